@@ -1,122 +1,289 @@
 #include "esp_log.h"
 #include "nvs_flash.h"
-#include "esp_event.h"
-#include "esp_netif.h"
-#include "esp_wifi.h"
-#include "esp_now.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_pm.h"
+#if CONFIG_PM_ENABLE
+#include "esp32/pm.h"
+#endif
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "bme280.h"
 #include "sensor.h"
+#include "espnow_comp.h"
 #include <string.h>
 
-#define ESPNOW_WIFI_MODE WIFI_MODE_STA
-#define ESPNOW_WIFI_IF   ESP_IF_WIFI_STA
+// 1: never deep sleep, else as pushed by the master (ESPNOW_CFG_LIGHT_SLEEP)
+#ifdef CONFIG_SENSOR_LIGHT_SLEEP
+#define SENSOR_LIGHT_SLEEP      CONFIG_SENSOR_LIGHT_SLEEP
+#else
+#define SENSOR_LIGHT_SLEEP      0
+#endif
 
-static uint8_t master_mac[ESP_NOW_ETH_ALEN] = {0x24, 0x6f, 0x28, 0xa8, 0xb2, 0x1c};
+// in light sleep, a lost master is looked for again this often
+#define SENSOR_JOIN_RETRY_MS    10000
 
 static RTC_DATA_ATTR uint32_t measureId = 1;
 
 static const char* TAG = "bme280_sensor";
 
 bme280_t        bme;
-uint8_t     measureSent;
-
-static void example_wifi_init(void)
-{
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
-    ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
-    ESP_ERROR_CHECK( esp_wifi_set_mode(ESPNOW_WIFI_MODE) );
-    ESP_ERROR_CHECK( esp_wifi_start());
 
-}
-
-static void example_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status) {
-    ESP_LOGI(TAG, "measure sent with status = %d", status);
-    measureSent = 1;
-}
+static TaskHandle_t sensor_task;
+static uint16_t     params_version;     // node settings the bme280 runs
 
-static esp_err_t example_espnow_init(void) {
+// radio init before the join starts
+#define SENSOR_RADIO_INIT_MS    500
 
+// oversampling and filter as pushed by the master
+static esp_err_t sensor_app_params(void) {
+    const espnow_config_t* cfg = espnow_node_config();
+    bme280_params_t params;
 
-    /* Initialize ESPNOW and register sending and receiving callback function. */
-    ESP_ERROR_CHECK( esp_now_init() );
-    ESP_ERROR_CHECK( esp_now_register_send_cb(example_espnow_send_cb) );
-
-    /* Add broadcast peer information to peer list. */
-    esp_now_peer_info_t *peer = malloc(sizeof(esp_now_peer_info_t));
-    if (peer == NULL) {
-        ESP_LOGE(TAG, "Malloc peer information fail");
-        return ESP_FAIL;
+    bme280_params_default(&bme, &params);
+    params.over_samp_temp = (bme280_oversampling_t)cfg->value[ESPNOW_CFG_OSRS_T];
+    params.over_samp_humi = (bme280_oversampling_t)cfg->value[ESPNOW_CFG_OSRS_H];
+    params.over_samp_pres = (bme280_oversampling_t)cfg->value[ESPNOW_CFG_OSRS_P];
+    params.filter = (bme280_filter_t)cfg->value[ESPNOW_CFG_FILTER];
+    esp_err_t ret = bme280_init_params(&bme, &params);
+    if ( ret == ESP_OK ) {
+        params_version = cfg->version;
     }
-    memset(peer, 0, sizeof(esp_now_peer_info_t));
-    peer->channel = 1; // config
-    peer->ifidx = ESPNOW_WIFI_IF;
-    peer->encrypt = false;
-    memcpy(peer->peer_addr, master_mac, ESP_NOW_ETH_ALEN);
-    ESP_ERROR_CHECK( esp_now_add_peer(peer) );
-    free(peer);
-
-    return ESP_OK;
+    return ret;
 }
 
+// init the sensor and start its conversion, the radio comes up meanwhile
 esp_err_t sensor_app_init(void) {
     ESP_LOGV(TAG, "bme280_sensor_app_init()");
-    
-    esp_err_t ret = ESP_OK;
-    //uint32_t  cnt = 0;
+
     sensor_info_t info;
-    char tmp[128];
 
     info.type = BME280_SENSOR;
     sensor_print_info(&info);
 
-    ret = bme280_init_default(&bme);
+    esp_err_t ret = bme280_init(&bme, BME280_I2C_PORT, BME280_I2C_ADDR, BME280_I2C_SDA, BME280_I2C_SCL);
+    if ( ret == ESP_OK ) {
+        ret = sensor_app_params();
+    }
     if ( ret  != ESP_OK ) {
         ESP_LOGE(TAG, "bme280 device init failed");
         bme280_done(&bme);
         return ret;
     }
+    return bme280_start_forced(&bme);
+}
+
+// wait for the conversion started by bme280_start_forced()
+static esp_err_t sensor_app_read(bme280_measure_t* m, espnow_measure_t* measure) {
+    esp_err_t ret = bme280_collect_forced(&bme, m);
+
+    if ( ret != ESP_OK ) {
+        ESP_LOGE(TAG, "failed to read data");
+        return ret;
+    }
+    espnow_proto_measure_from_float(measure, m->temp, m->humi, m->pres);
+    return ESP_OK;
+}
+
+// into the backlog unless within the deadbands pushed by the master, returns 1 if kept
+static uint8_t sensor_app_keep(const espnow_measure_t* measure) {
+    if ( !espnow_node_report(measure) ) {
+        return 0;
+    }
+    espnow_node_store(measure, 1);
+    return 1;
+}
 
+// collect the conversion into the backlog, returns 1 if kept
+static uint8_t sensor_app_measure(void) {
+    char tmp[128];
     bme280_measure_t m;
+    espnow_measure_t measure;
+
+    if ( sensor_app_read(&m, &measure) != ESP_OK ) {
+        return 0;
+    }
+    espnow_node_mark(ESPNOW_PHASE_CONVERT);
+    printf("-------------------------\n");
+    printf("measure id  : %07d\n", measureId++);
+    printf("temperature : %7.2f C\n", m.temp);
+    printf("humidity    : %7.2f\n", m.humi);
+    printf("pressure    : %7.2f hPa\n", m.pres);
+    printf("-------------------------\n");
+    sprintf(tmp, "/%d/temperature/%.2f", measureId, m.temp);
+    printf("%s\n", tmp);
+    sprintf(tmp, "/%d/humidity/%.2f", measureId, m.humi);
+    printf("%s\n", tmp);
+    sprintf(tmp, "/%d/pressure/%.2f", measureId, m.pres);
+    printf("%s\n", tmp);
+
+    return sensor_app_keep(&measure);
+}
+
+// send the backlog when the master was joined, keep it for the next wake otherwise
+static esp_err_t sensor_app_send(uint8_t joined) {
+    if ( !joined ) {
+        ESP_LOGI(TAG, "%u measures kept for the next wake", espnow_node_backlog_count());
+        return ESP_ERR_TIMEOUT;
+    }
+    esp_err_t ret = espnow_node_drain();
+    if ( ret != ESP_OK ) {
+        ESP_LOGW(TAG, "no ack from master, %u measures kept", espnow_node_backlog_count());
+    }
+
+    espnow_node_stats_t stats;
+    espnow_node_stats_get(&stats);
+    ESP_LOGI(TAG, "boot to radio ready %u us, to first frame %u us, send %u us",
+        stats.ready_us, stats.first_frame_us, stats.send_us);
+    return ret;
+}
+
+static uint8_t sensor_light_sleep() {
+    return SENSOR_LIGHT_SLEEP || espnow_node_config()->value[ESPNOW_CFG_LIGHT_SLEEP];
+}
+
+static void sensor_tick_cb(void* arg) {
+    xTaskNotifyGive(sensor_task);
+}
 
-    //while(1) {
+/* Cpu clock scaled down and light sleep whenever the idle task runs. The
+ * modem sleep below only saves power while associated to an AP (idf 4.x):
+ * a node without relay turns the rf off between reports instead
+ * (espnow_radio_off()), a relay keeps its receiver on for its children. */
+static void sensor_pm_init() {
+#if CONFIG_PM_ENABLE
+    esp_pm_config_esp32_t pm = {
+        .max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = 40,
+        .light_sleep_enable = true,
+    };
+    esp_err_t ret = esp_pm_configure(&pm);
+    if ( ret != ESP_OK ) {
+        ESP_LOGW(TAG, "no automatic light sleep: %s", esp_err_to_name(ret));
+    }
+#else
+    ESP_LOGW(TAG, "built without CONFIG_PM_ENABLE, the chip stays awake between samples");
+#endif
+    esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+}
 
-        ret = bme280_read_forced(&bme, &m);
-        if ( ret != ESP_OK ) {
-            ESP_LOGE(TAG, "failed to read data");
-            return ret;
+/* Joins if the link dropped the master, then drains the backlog. Without
+ * relay nothing comes unasked, the rf is only on for the exchange. */
+static void sensor_light_report(int64_t* join_ms) {
+    uint8_t join = !espnow_link_is_valid(espnow_node_link());
+
+    // the link drops a master that stopped acking
+    if ( join ) {
+        int64_t now_ms = esp_timer_get_time() / 1000;
+        if ( now_ms - *join_ms < SENSOR_JOIN_RETRY_MS ) {
+            return;
         }
-        //m.id = measureId++;
-        printf("-------------------------\n");
-        printf("measure id  : %07d\n", measureId++);
-        printf("temperature : %7.2f C\n", m.temp);
-        printf("humidity    : %7.2f\n", m.humi);
-        printf("pressure    : %7.2f hPa\n", m.pres);
-        printf("-------------------------\n");
-        sprintf(tmp, "/%d/temperature/%.2f", measureId, m.temp);
-        printf("%s\n", tmp);
-        sprintf(tmp, "/%d/humidity/%.2f", measureId, m.humi);
-        printf("%s\n", tmp);
-        sprintf(tmp, "/%d/pressure/%.2f", measureId, m.pres);
-        printf("%s\n", tmp);
-
-        measureSent = 0;
-        esp_now_send(master_mac, (void*)&m, sizeof(bme280_measure_t));
-        while(measureSent==0) {
-            vTaskDelay(1/portTICK_RATE_MS); 
+        *join_ms = now_ms;
+    }
+#if !CONFIG_SENSOR_RELAY
+    esp_err_t ret = espnow_radio_on();
+    if ( ret != ESP_OK ) {
+        ESP_LOGW(TAG, "radio not back on: %s", esp_err_to_name(ret));
+        return;
+    }
+#endif
+    if ( join && espnow_node_join() != ESP_OK ) {
+        ESP_LOGD(TAG, "no master yet");
+    }
+    else if ( espnow_node_drain() != ESP_OK ) {
+        ESP_LOGW(TAG, "no ack from master, %u measures kept", espnow_node_backlog_count());
+    }
+#if !CONFIG_SENSOR_RELAY
+    espnow_radio_off();
+#endif
+}
+
+/* Mains powered node: no deep sleep, no reboot between samples. Esp-now
+ * stays initialized (the rf only on for reports, all the time on a relay)
+ * and a periodic timer paces the conversions, the chip light sleeps in
+ * between. Measures go the same way as on deep sleep wakes:
+ * deadbands, backlog, batches of ESPNOW_CFG_BATCH, heartbeat. Returns when
+ * the master turns the mode off. */
+static void sensor_light_loop() {
+    const esp_timer_create_args_t args = { .callback = sensor_tick_cb, .name = "sensor_tick" };
+    const espnow_config_t* cfg = espnow_node_config();
+    esp_timer_handle_t timer;
+    uint32_t period_ms = 0;
+    int64_t join_ms = -SENSOR_JOIN_RETRY_MS;
+
+    sensor_task = xTaskGetCurrentTaskHandle();
+    ESP_ERROR_CHECK( esp_timer_create(&args, &timer) );
+    sensor_pm_init();
+#if CONFIG_SENSOR_RELAY
+    // the node never sleeps for good with it, the mode stays on
+    ESP_ERROR_CHECK( espnow_node_relay_start() );
+#else
+    espnow_radio_off();
+#endif
+
+    while ( sensor_light_sleep() ) {
+        // settings come with the acks, a new period starts on the next tick
+        if ( period_ms != cfg->value[ESPNOW_CFG_LIGHT_PERIOD_MS] ) {
+            period_ms = cfg->value[ESPNOW_CFG_LIGHT_PERIOD_MS];
+            esp_timer_stop(timer);
+            ESP_ERROR_CHECK( esp_timer_start_periodic(timer, (uint64_t)period_ms * 1000) );
+            ESP_LOGI(TAG, "light sleep, a measure every %u ms", period_ms);
         }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-    //    vTaskDelay(5000/portTICK_RATE_MS);
-    //}
-    return ret;
+        // oversampling and filter of an ack since the last measure
+        if ( params_version != cfg->version && sensor_app_params() != ESP_OK ) {
+            ESP_LOGW(TAG, "failed to apply the sensor settings %04x", cfg->version);
+        }
+        bme280_measure_t m;
+        espnow_measure_t measure;
+        if ( bme280_start_forced(&bme) != ESP_OK || sensor_app_read(&m, &measure) != ESP_OK ) {
+            continue;
+        }
+        ESP_LOGD(TAG, "temp %.2f C, humi %.2f %%, pres %.2f hPa", m.temp, m.humi, m.pres);
+        sensor_app_keep(&measure);
+        if ( espnow_node_backlog_count() < cfg->value[ESPNOW_CFG_BATCH] && !espnow_node_report_due() ) {
+            continue;
+        }
+        sensor_light_report(&join_ms);
+#if CONFIG_SENSOR_RELAY
+        espnow_relay_stats_t relayed;
+        espnow_node_relay_stats_get(&relayed);
+        ESP_LOGI(TAG, "relay: %u frames in %u bundles, %u down, %u retries dropped, %u answered, %u looped, %u children",
+            relayed.forwarded, relayed.bundles, relayed.down, relayed.dup_dropped, relayed.dup_acked, relayed.looped,
+            relayed.children);
+#endif
+    }
+    esp_timer_stop(timer);
+    esp_timer_delete(timer);
+    ESP_LOGI(TAG, "light sleep turned off, back to deep sleep");
 }
 
+// the bring up task is done by then, whether a master answered or not
+static uint32_t sensor_radio_wait_ms(void) {
+    return SENSOR_RADIO_INIT_MS + espnow_link_join_max_ms();
+}
 
-void app_main(void) {
+/* The radio comes up at boot, overlapped with the conversion, when it is
+ * sure to be needed: the node was powered on, the heartbeat is due, it
+ * stays up in light sleep or this measure fills the batch. With deadbands
+ * set it waits for the measure. */
+static uint8_t sensor_radio_wake(void) {
+    const espnow_config_t* cfg = espnow_node_config();
 
+    if ( esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED || espnow_node_report_due() ||
+         sensor_light_sleep() ) {
+        return 1;
+    }
+    if ( espnow_report_enabled(cfg) ) {
+        return 0;
+    }
+    return espnow_node_backlog_count() + 1 >= cfg->value[ESPNOW_CFG_BATCH];
+}
+
+void app_main(void) {
+    espnow_node_profile_start();
 
     // Initialize NVS
     esp_err_t ret = nvs_flash_init();
@@ -125,14 +292,50 @@ void app_main(void) {
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK( ret );
+    espnow_node_mark(ESPNOW_PHASE_NVS);
+    // link and settings from rtc memory, or nvs on power on, before the measure goes to the backlog
+    espnow_node_prepare();
 
-    example_wifi_init();
-    ESP_ERROR_CHECK(example_espnow_init());
-    ESP_ERROR_CHECK(sensor_app_init());
-    esp_now_deinit();
+    // radio init and join on the other core when sure to be needed, the conversion runs meanwhile
+    uint8_t radio = sensor_radio_wake();
+    if ( radio ) {
+        ESP_ERROR_CHECK( espnow_node_start() );
+    }
+    esp_err_t sensor_ret = sensor_app_init();
+    uint8_t kept = sensor_ret == ESP_OK && sensor_app_measure();
+
+    // a measure past the deadbands, or the one that fills the batch, brings it up now
+    if ( !radio && kept && espnow_node_backlog_count() >= espnow_node_config()->value[ESPNOW_CFG_BATCH] ) {
+        ESP_ERROR_CHECK( espnow_node_start() );
+        radio = 1;
+    }
+    if ( radio ) {
+        ret = espnow_node_wait_ready(sensor_radio_wait_ms());
+        sensor_app_send(ret == ESP_OK);
+    }
+    else if ( sensor_ret == ESP_OK ) {
+        ESP_LOGI(TAG, "%u measures kept, %s", espnow_node_backlog_count(), kept ? "radio off" : "within the deadbands");
+    }
+    // the loop needs a master, without one the node backs off in deep sleep
+    if ( ret == ESP_OK && radio && sensor_ret == ESP_OK && sensor_light_sleep() ) {
+        sensor_light_loop();
+    }
+    // period from the build, nvs or the last ack received
+    uint32_t sleep_ms = espnow_node_config()->value[ESPNOW_CFG_PERIOD_S] * 1000;
+    if ( ret != ESP_OK ) {
+        ESP_LOGW(TAG, "no master found (%s), back to sleep", esp_err_to_name(ret));
+        sleep_ms *= espnow_link_sleep_factor(espnow_node_link());
+    }
+    // land in the slot given by the master
+    sleep_ms = espnow_node_sleep_ms(sleep_ms);
+    // still in use by a bring up task stuck past the longest join
+    if ( radio && ret != ESP_ERR_TIMEOUT ) {
+        esp_now_deinit();
+    }
+    espnow_node_profile_end();
     //esp_wifi_stop();
-    printf("Enabling timer wakeup, %ds\n", 120);
-    esp_sleep_enable_timer_wakeup(120 * 1000000);
+    printf("Enabling timer wakeup, %dms\n", sleep_ms);
+    esp_sleep_enable_timer_wakeup((uint64_t)sleep_ms * 1000);
 
     esp_deep_sleep_start();
 }
\ No newline at end of file
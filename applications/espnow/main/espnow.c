@@ -27,16 +27,81 @@
 #include "esp_system.h"
 #include "esp_now.h"
 #include "esp_crc.h"
+#include "esp_timer.h"
 
 #include "espnow_comp.h"
+#include "sensor_store.h"
+#include "uplink.h"
+#include "master.h"
+#include "metrics.h"
+#if CONFIG_MASTER_CONSOLE
+#include "esp_console.h"
+#include "metrics_console.h"
+#endif
+#if CONFIG_MASTER_SEGLOG
+#include "nvs.h"
+#include "seglog.h"
+#endif
 
 
 /* ESPNOW can work in both station and softap mode. It is configured in menuconfig. */
 
 #define ESPNOW_QUEUE_SIZE           20
+#define MASTER_WORKER_STACK         4096    // frame scratch lives in the shards
+
+#ifdef CONFIG_MASTER_STATS_INTERVAL_S
+#define MASTER_STATS_INTERVAL_S     CONFIG_MASTER_STATS_INTERVAL_S
+#else
+#define MASTER_STATS_INTERVAL_S     60
+#endif
+
+#ifdef CONFIG_MASTER_LINK_DUMP_S
+#define MASTER_LINK_DUMP_S          CONFIG_MASTER_LINK_DUMP_S
+#else
+#define MASTER_LINK_DUMP_S          0
+#endif
+#define MASTER_LINK_DUMP_BATCH      8       // records per loop of a worker
+#define MASTER_PUBLISH_MS           1000    // shard totals for the report
+
+#if CONFIG_MASTER_SEGLOG
+#define MASTER_UPLINK_STACK         3072
+#define MASTER_UPLINK_POLL_MS       10
+#define MASTER_SEGLOG_WINDOW        256     // records sent ahead of the host ack
+#define MASTER_SEGLOG_PROBE_MS      2000    // while the host is silent
+#define MASTER_SEGLOG_SAVE_MS       30000   // acked id to nvs, at most this often
+#define MASTER_SEGLOG_NVS_NS        "seglog"
+#define MASTER_SEGLOG_NVS_KEY       "acked"
+
+#ifdef CONFIG_SEGLOG_PARTITION
+#define SEGLOG_PARTITION            CONFIG_SEGLOG_PARTITION
+#else
+#define SEGLOG_PARTITION            "seglog"
+#endif
+
+#ifdef CONFIG_SEGLOG_FLUSH_MS
+#define SEGLOG_FLUSH_MS             CONFIG_SEGLOG_FLUSH_MS
+#else
+#define SEGLOG_FLUSH_MS             1000
+#endif
+
+#ifdef CONFIG_MASTER_SEGLOG_ACK_TIMEOUT_S
+#define MASTER_SEGLOG_ACK_TIMEOUT_S CONFIG_MASTER_SEGLOG_ACK_TIMEOUT_S
+#else
+#define MASTER_SEGLOG_ACK_TIMEOUT_S 10
+#endif
+#endif
+
+/* In binary uplink mode the console only gets warnings and errors,
+ * measures go to the host as uplink records. */
+#if CONFIG_MASTER_UPLINK_BINARY
+#define master_trace(...)
+#else
+#define master_trace(...) printf(__VA_ARGS__)
+#endif
 
 typedef enum {
     MASTER_EVENT_SEND_CB = 0x00,
+    MASTER_EVENT_CONFIG  = 0x40,    // data: espnow_config_t for the nodes of the shard
     MASTER_EVENT_RECV_CB = 0x80
 } master_event_type_t;
 
@@ -45,23 +110,50 @@ typedef struct {
     uint8_t             addr[ESP_NOW_ETH_ALEN];
     uint8_t             status;
     uint8_t             len;
+    int8_t              rssi;
+    uint8_t             relayed;    // out of a relay bundle, via is the relay
+    uint8_t             via[ESP_NOW_ETH_ALEN];
+    uint32_t            ts;         // ms, reception time
     uint8_t*            data;
 } master_event_t;
 
+/* One per shard of the master pipeline, each with its own queue. */
 typedef struct {
-    float   temp;
-    float   humi;
-    float   pres;
-} meteo_event_t;
+    xQueueHandle    queue;
+    TaskHandle_t    task;
+    uint32_t        frames;
+    uint32_t        queue_max;  // deepest queue seen
+    uint32_t        busy_us;    // time spent processing events, wraps
+    int64_t         publish_us; // last master_shard_publish
+    int64_t         dump_us;    // last link dump start
+    uint32_t        dump_pos;   // next node of the shard to dump
+    uint8_t         dumping;
+} master_worker_t;
 
 static const char *TAG = "espnow_master";
 
-static xQueueHandle master_queue;
-
-static char tmp_mac_addr[20];
-
-static inline void format_mac_addr(uint8_t* mac_addr) {
-    sprintf(tmp_mac_addr,
+static master_worker_t  workers[MASTER_WORKERS];
+static uint32_t         node_period_ms;     // pushed to the nodes, for the fleet energy
+
+// receive callback, WiFi task
+METRICS_COUNTER(master_rx, "master.rx");
+METRICS_COUNTER(master_rx_dropped, "master.rx_dropped");
+METRICS_HISTOGRAM(master_rx_rssi, "master.rx_rssi", -90, -80, -70, -60, -50);
+METRICS_GAUGE(master_queue_max, "master.queue_max");
+// workers
+METRICS_HISTOGRAM(master_event_us, "master.event_us", 100, 250, 500, 1000, 2500, 10000);
+
+#if CONFIG_MASTER_SEGLOG
+/* Samples and profiles go to the flash log first, the uplink task sends
+ * them from there and keeps the id of the first one the host did not ack. */
+static seglog_t             seglog;
+static seglog_flash_t       seglog_flash;
+static SemaphoreHandle_t    seglog_lock = NULL;
+static uint32_t             seglog_acked = 0;
+#endif
+
+static inline void format_mac_addr(char* out, const uint8_t* mac_addr) {
+    sprintf(out,
         "%02x:%02x:%02x:%02x:%02x:%02x",
         mac_addr[0],
         mac_addr[1],
@@ -72,7 +164,233 @@ static inline void format_mac_addr(uint8_t* mac_addr) {
     );
 }
 
-uint8_t my_broadcast_macaddr[ESP_NOW_ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static inline uint32_t master_now_ms() {
+    return (uint32_t)( esp_timer_get_time() / 1000 );
+}
+
+// called in WiFi task, frames of one sensor always go to the same worker
+static BaseType_t master_post(const master_event_t* evt) {
+    master_worker_t* w = &workers[master_shard(evt->addr)];
+
+    BaseType_t ret = xQueueSend(w->queue, evt, portMAX_DELAY);
+    UBaseType_t depth = uxQueueMessagesWaiting(w->queue);
+    if ( depth > w->queue_max ) {
+        w->queue_max = depth;
+    }
+    metrics_max(&master_queue_max, (int32_t)depth);
+    return ret;
+}
+
+static void log_profile(const char* what, const espnow_profile_info_t* info, uint32_t period_ms) {
+    char line[160];
+    int pos = 0;
+
+    for ( int i = 0; i < ESPNOW_PHASE_COUNT && pos < sizeof(line); i++ ) {
+        pos += snprintf(line + pos, sizeof(line) - pos, " %s %u.%u",
+            espnow_profile_phase_name(i), info->phase[i] / 10, info->phase[i] % 10);
+    }
+    ESP_LOGI(TAG, "%s wake (ms, %u wakes):%s, ~%u uJ per cycle",
+        what, info->wakes, line, espnow_profile_energy_uj(info, period_ms));
+}
+
+static void master_workers_report(int64_t elapsed_us) {
+    static uint32_t last_busy_us[MASTER_WORKERS];
+
+    for ( int i = 0; i < MASTER_WORKERS; i++ ) {
+        master_worker_t* w = &workers[i];
+        uint32_t busy_us = w->busy_us;
+        ESP_LOGI(TAG, "worker %d: %u frames, queue %u (max %u / %d), %d%% busy, %u bytes of stack left",
+            i, w->frames, uxQueueMessagesWaiting(w->queue), w->queue_max, ESPNOW_QUEUE_SIZE,
+            (int)( (int64_t)( busy_us - last_busy_us[i] ) * 100 / elapsed_us ), uxTaskGetStackHighWaterMark(w->task));
+        last_busy_us[i] = busy_us;
+    }
+
+    master_stats_t stats;
+    master_stats_get(&stats);
+    if ( stats.backlog ) {
+        ESP_LOGI(TAG, "backlog: %u frames, %u held back", stats.backlog, stats.backlog_held);
+    }
+    if ( stats.configs ) {
+        ESP_LOGI(TAG, "node settings pushed in %u acks", stats.configs);
+    }
+    if ( stats.relayed ) {
+        ESP_LOGI(TAG, "relays: %u frames", stats.relayed);
+    }
+
+    espnow_peer_stats_t peers;
+    espnow_peer_stats_get(&peers);
+    if ( peers.base_airtime_us ) {
+        ESP_LOGI(TAG, "rates: 24M %u, 12M %u, 6M %u, 1M %u, LR %u frames, %u up, %u down, airtime %u%% of 1M",
+            peers.rate_frames[ESPNOW_RATE_24M], peers.rate_frames[ESPNOW_RATE_12M], peers.rate_frames[ESPNOW_RATE_6M],
+            peers.rate_frames[ESPNOW_RATE_1M], peers.rate_frames[ESPNOW_RATE_LR_500K] + peers.rate_frames[ESPNOW_RATE_LR_250K],
+            peers.rate_up, peers.rate_down, (uint32_t)( peers.airtime_us * 100 / peers.base_airtime_us ));
+    }
+    if ( stats.sampled ) {
+        ESP_LOGI(TAG, "reporting: %u of %u samples within the deadbands, %u%% of the reports skipped",
+            stats.skipped, stats.sampled, (uint32_t)( (uint64_t)stats.skipped * 100 / stats.sampled ));
+    }
+
+    master_link_summary_t links;
+    master_link_summary(&links);
+    if ( links.nodes ) {
+        ESP_LOGI(TAG, "links: %u nodes, %u weak, %u silent, rssi %d dBm, %u.%u%% of the data frames lost",
+            links.nodes, links.weak, links.silent, links.rssi, links.loss / 10, links.loss % 10);
+    }
+
+    espnow_profile_info_t fleet;
+    uint32_t nodes = master_profile_fleet(&fleet);
+    if ( nodes ) {
+        char what[24];
+        snprintf(what, sizeof(what), "fleet (%u nodes)", nodes);
+        log_profile(what, &fleet, node_period_ms);
+    }
+
+#if CONFIG_MASTER_SEGLOG
+    seglog_stats_t ls;
+    xSemaphoreTake(seglog_lock, portMAX_DELAY);
+    seglog_stats_get(&seglog, &ls);
+    uint32_t first = seglog_first_id(&seglog);
+    uint32_t next = seglog_next_id(&seglog);
+    xSemaphoreGive(seglog_lock);
+    ESP_LOGI(TAG, "flash log: records %u to %u, host %u behind, %u expired, %u to %u erases per segment",
+        first, next, next - seglog_acked, ls.expired, ls.min_erases, ls.max_erases);
+#endif
+}
+
+#if CONFIG_MASTER_UPLINK_BINARY
+// to the flash log when there is one, to the host otherwise
+static void master_record(uint8_t type, const void* data, uint16_t len) {
+#if CONFIG_MASTER_SEGLOG
+    xSemaphoreTake(seglog_lock, portMAX_DELAY);
+    esp_err_t ret = seglog_append(&seglog, type, data, len);
+    xSemaphoreGive(seglog_lock);
+#else
+    esp_err_t ret = uplink_write(type, data, len);
+#endif
+    if ( ret != ESP_OK ) {
+        ESP_LOGW(TAG, "failed to write uplink record");
+    }
+}
+#endif
+
+#if CONFIG_MASTER_UPLINK_BINARY
+static void uplink_meteo_sample(const uint8_t* addr, const sensor_store_sample_t* sample) {
+    uplink_sample_t rec;
+
+    memcpy(rec.addr, addr, ESP_NOW_ETH_ALEN);
+    rec.ts = sample->ts;
+    rec.temp = sample->value[SENSOR_STORE_TEMP];
+    rec.humi = sample->value[SENSOR_STORE_HUMI];
+    rec.pres = sample->value[SENSOR_STORE_PRES];
+    master_record(UPLINK_REC_SAMPLE, &rec, sizeof(uplink_sample_t));
+}
+#endif
+
+#if CONFIG_MASTER_CAPTURE
+/* Received frame as is, for an exact replay of the pipeline on the host. */
+static void uplink_capture_frame(const master_event_t* evt) {
+    uint8_t buf[sizeof(uplink_capture_t) + ESPNOW_PROTO_MAX_LEN];
+    uplink_capture_t rec;
+
+    rec.ts = evt->ts;
+    memcpy(rec.addr, evt->addr, ESP_NOW_ETH_ALEN);
+    rec.rssi = evt->rssi;
+    rec.len = evt->len;
+    memcpy(buf, &rec, sizeof(uplink_capture_t));
+    memcpy(buf + sizeof(uplink_capture_t), evt->data, evt->len);
+    if ( uplink_write(UPLINK_REC_FRAME, buf, sizeof(uplink_capture_t) + evt->len) != ESP_OK ) {
+        ESP_LOGW(TAG, "failed to write capture record");
+    }
+}
+#endif
+
+#if CONFIG_MASTER_UPLINK_BINARY
+static void uplink_profile(const uint8_t* addr, const espnow_profile_info_t* info, uint32_t period_ms, uint32_t now_ms) {
+    uplink_profile_t rec;
+
+    _Static_assert(UPLINK_PROFILE_PHASES == ESPNOW_PHASE_COUNT, "uplink profile phases");
+    memcpy(rec.addr, addr, ESP_NOW_ETH_ALEN);
+    rec.ts = now_ms;
+    rec.wakes = info->wakes;
+    memcpy(rec.phase, info->phase, sizeof(rec.phase));
+    rec.energy_uj = espnow_profile_energy_uj(info, period_ms);
+    master_record(UPLINK_REC_PROFILE, &rec, sizeof(uplink_profile_t));
+}
+#endif
+
+#if CONFIG_MASTER_UPLINK_BINARY
+// every metric of the registry, with the stats report
+static void uplink_metrics() {
+    uint8_t rec[METRICS_RECORD_MAX];
+
+    for ( metrics_t* m = metrics_next(NULL); m != NULL; m = metrics_next(m) ) {
+        size_t len = metrics_encode(m, rec, sizeof(rec));
+        if ( len == 0 || uplink_write(UPLINK_REC_METRIC, rec, len) != ESP_OK ) {
+            ESP_LOGW(TAG, "failed to write metric %s", m->name);
+        }
+    }
+}
+
+static void uplink_link(const uint8_t* addr, const espnow_linkstat_t* link, void* ctx) {
+    uint32_t now_ms = *(const uint32_t*)ctx;
+    uplink_link_t rec;
+
+    _Static_assert(UPLINK_LINK_METRICS == ESPNOW_LINKSTAT_COUNT && UPLINK_LINK_BUCKETS == ESPNOW_LINKSTAT_BUCKETS,
+        "uplink link metrics");
+    memcpy(rec.addr, addr, ESP_NOW_ETH_ALEN);
+    rec.ts = now_ms;
+    rec.age_ms = now_ms - link->last_ms;
+    rec.frames = link->frames;
+    rec.data = link->data;
+    rec.lost = link->lost;
+    rec.duplicates = link->duplicates;
+    for ( int i = 0; i < ESPNOW_LINKSTAT_COUNT; i++ ) {
+        rec.value[i].ewma = link->value[i].ewma;
+        memcpy(rec.value[i].hist, link->value[i].hist, sizeof(rec.value[i].hist));
+    }
+    // a snapshot, the next one replaces it: not worth the flash log
+    if ( uplink_write(UPLINK_REC_LINK, &rec, sizeof(uplink_link_t)) != ESP_OK ) {
+        ESP_LOGW(TAG, "failed to write link record");
+    }
+}
+
+/* Every sensor heard every MASTER_LINK_DUMP_S, each worker its own shard
+ * MASTER_LINK_DUMP_BATCH at a time: a large fleet does not hold its frames
+ * back. */
+static void uplink_link_dump(int index, int64_t now_us) {
+    master_worker_t* w = &workers[index];
+    uint32_t now_ms = (uint32_t)( now_us / 1000 );
+
+    if ( !w->dumping ) {
+        if ( now_us - w->dump_us < (int64_t)MASTER_LINK_DUMP_S * 1000000 ) {
+            return;
+        }
+        w->dump_us = now_us;
+        w->dump_pos = 0;
+        w->dumping = 1;
+    }
+    w->dumping = master_link_walk(index, &w->dump_pos, MASTER_LINK_DUMP_BATCH, uplink_link, &now_ms) > 0;
+}
+#endif
+
+static void master_profile(const uint8_t* addr, const espnow_profile_info_t* info, uint32_t period_ms, uint32_t now_ms) {
+    char mac_str[20];
+
+    format_mac_addr(mac_str, addr);
+    log_profile(mac_str, info, period_ms);
+#if CONFIG_MASTER_UPLINK_BINARY
+    uplink_profile(addr, info, period_ms, now_ms);
+#endif
+}
+
+static void master_sample(const uint8_t* addr, const sensor_store_sample_t* sample) {
+    master_trace("temperature: %.2f\n", sample->value[SENSOR_STORE_TEMP] / 100.0f);
+    master_trace("humidity   : %.2f\n", sample->value[SENSOR_STORE_HUMI] / 100.0f);
+    master_trace("pressure   : %.2f\n", sample->value[SENSOR_STORE_PRES] / 100.0f);
+#if CONFIG_MASTER_UPLINK_BINARY
+    uplink_meteo_sample(addr, sample);
+#endif
+}
 
 /* ESPNOW sending or receiving callback function is called in WiFi task.
  * Users should not do lengthy operations from this task. Instead, post
@@ -89,29 +407,70 @@ static void app_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t st
     evt.status = status;
     memcpy(&evt.addr, mac_addr,ESP_NOW_ETH_ALEN);
 
-    if (xQueueSend(master_queue, &evt, portMAX_DELAY) != pdTRUE) {
+    if (master_post(&evt) != pdTRUE) {
         ESP_LOGW(TAG, "send cb error: send queue fail");
     }
 }
 
+/* A relay bundle holds frames of sensors of any shard, each one goes to the
+ * worker of its sensor like a frame heard directly. */
+static void app_espnow_recv_relay(master_event_t* evt, const uint8_t* data, size_t len) {
+    size_t         pos = 0;
+    const uint8_t* addr;
+    const uint8_t* frame;
+    uint8_t        flen;
+
+    memcpy(evt->via, evt->addr, ESP_NOW_ETH_ALEN);
+    evt->relayed = 1;
+    while ( ( frame = espnow_proto_relay_next(data, len, &pos, &addr, &flen) ) != NULL ) {
+        memcpy(evt->addr, addr, ESP_NOW_ETH_ALEN);
+        evt->data = malloc(flen);
+        if ( evt->data == NULL ) {
+            metrics_inc(&master_rx_dropped);
+            ESP_LOGE(TAG, "receive cb error: malloc relayed data fail");
+            return;
+        }
+        memcpy(evt->data, frame, flen);
+        evt->len = flen;
+        if ( master_post(evt) != pdTRUE ) {
+            metrics_inc(&master_rx_dropped);
+            ESP_LOGW(TAG, "receive cb error: send queue fail");
+            free(evt->data);
+        }
+    }
+}
+
 static void app_espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int len) {
 
-    if (mac_addr == NULL || data == NULL || len <= 0) {
+    if (mac_addr == NULL || data == NULL || len <= 0 || len > ESPNOW_PROTO_MAX_LEN) {
         ESP_LOGE(TAG, "receive cb error: bad arguments");
         return;
     }
 
     master_event_t evt;
     evt.type = MASTER_EVENT_RECV_CB;
+    evt.ts = master_now_ms();
+    evt.rssi = espnow_rx_rssi(data, len);
+    evt.relayed = 0;
+    metrics_inc(&master_rx);
+    if ( evt.rssi < 0 ) {
+        metrics_observe(&master_rx_rssi, evt.rssi);
+    }
     memcpy(&evt.addr, mac_addr, ESP_NOW_ETH_ALEN);
+    if ( espnow_proto_parse(data, len, NULL) == ESPNOW_MSG_RELAY ) {
+        app_espnow_recv_relay(&evt, data, len);
+        return;
+    }
     evt.data = malloc(len);
     if (evt.data == NULL) {
+        metrics_inc(&master_rx_dropped);
         ESP_LOGE(TAG, "receive cb error: malloc receive data fail");
         return;
     }
     memcpy(evt.data, data, len);
     evt.len = len;
-    if (xQueueSend(master_queue, &evt, portMAX_DELAY) != pdTRUE) {
+    if (master_post(&evt) != pdTRUE) {
+        metrics_inc(&master_rx_dropped);
         ESP_LOGW(TAG, "receive cb error: send queue fail");
         free(evt.data);
     }
@@ -121,42 +480,273 @@ static void app_espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int
 
 static void app_espnow_task(void *pvParameter) {
 
-    master_event_t evt;
-
-    while (xQueueReceive(master_queue, &evt, portMAX_DELAY) == pdTRUE) {
-        printf("------------- <NEW EVENT> ---------------\n");
+    int                 index = (int)(intptr_t)pvParameter;
+    master_worker_t*    w = &workers[index];
+    master_event_t      evt;
+    char                mac_str[20];
+    int64_t             report_us = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "worker %d on core %d", index, xPortGetCoreID());
+    while (1) {
+        if ( index == 0 && MASTER_STATS_INTERVAL_S > 0 &&
+             esp_timer_get_time() - report_us >= (int64_t)MASTER_STATS_INTERVAL_S * 1000000 ) {
+            int64_t now_us = esp_timer_get_time();
+            master_workers_report(now_us - report_us);
+#if CONFIG_MASTER_UPLINK_BINARY
+            uplink_metrics();
+#endif
+            report_us = now_us;
+        }
+#if CONFIG_MASTER_UPLINK_BINARY
+        if ( MASTER_LINK_DUMP_S > 0 ) {
+            uplink_link_dump(index, esp_timer_get_time());
+        }
+#endif
+        // the report runs on worker 0, it only reads what the shards publish
+        if ( esp_timer_get_time() - w->publish_us >= MASTER_PUBLISH_MS * 1000 ) {
+            w->publish_us = esp_timer_get_time();
+            master_shard_publish(index, (uint32_t)( w->publish_us / 1000 ));
+        }
+        if ( xQueueReceive(w->queue, &evt, pdMS_TO_TICKS(UPLINK_FLUSH_MS)) != pdTRUE ) {
+#if CONFIG_MASTER_UPLINK_BINARY
+            // queue idle, push the pending records to the host
+            uplink_flush();
+#endif
+            continue;
+        }
+        int64_t start_us = esp_timer_get_time();
+        master_trace("------------- <NEW EVENT> ---------------\n");
         if ( evt.type == MASTER_EVENT_SEND_CB ) {
-            format_mac_addr(evt.addr);
-            printf("event sent to [%s] with status = %d\n", tmp_mac_addr, evt.status);
+            format_mac_addr(mac_str, evt.addr);
+            master_trace("event sent to [%s] with status = %d\n", mac_str, evt.status);
+            espnow_peer_rate_sent(evt.addr, evt.status == ESP_NOW_SEND_SUCCESS);
         }
         else if ( evt.type == MASTER_EVENT_RECV_CB ) {
-            format_mac_addr(evt.addr);
-            printf("event received from [%s] with %d byte(s)\n", tmp_mac_addr, evt.len);
+            format_mac_addr(mac_str, evt.addr);
+            master_trace("event received from [%s] with %d byte(s)\n", mac_str, evt.len);
+#if !CONFIG_MASTER_UPLINK_BINARY
             ESP_LOG_BUFFER_HEXDUMP(TAG, evt.data, evt.len, ESP_LOG_WARN);
-            if ( evt.len == sizeof(meteo_event_t)) {
-                meteo_event_t* m_evt = (meteo_event_t*)evt.data;
-                printf("temperature: %.2f\n", m_evt->temp);
-                printf("humidity   : %.2f\n", m_evt->humi);
-                printf("pressure   : %.2f\n", m_evt->pres);                
-            } 
-            else if ( evt.len == 2 ) {
-                uint16_t code = (uint16_t)(*evt.data | (*(evt.data+1) << 8));
-                ESP_LOGI(TAG, "ping event from %s with code %d", tmp_mac_addr, code);
-                if ( code == 1973 ) {
-                    //ESP_LOGI(TAG, "ping event from %s", tmp_mac_addr);
-                    // ping
-                    code = 1389;
-                    // renvoyer le ping
-                    //esp_now_send ( evt.addr, (void*)&code, 2);
-                    espnow_add_peer ( evt.addr );
-                    esp_now_send ( my_broadcast_macaddr, (void*)&code, 2);
-                }
+#endif
+#if CONFIG_MASTER_CAPTURE
+            uplink_capture_frame(&evt);
+#endif
+            // heard from the relay for a relayed frame, the ack goes back through it
+            espnow_peer_rate_heard(evt.relayed ? evt.via : evt.addr, evt.rssi);
+            // reception time, not processing time: a replay gives the same result
+            if ( evt.relayed ) {
+                master_handle_frame_via(evt.via, evt.addr, evt.data, evt.len, evt.ts);
+            }
+            else {
+                master_handle_frame(evt.addr, evt.data, evt.len, evt.rssi, evt.ts);
             }
             free(evt.data);
+            w->frames++;
         }
+        else if ( evt.type == MASTER_EVENT_CONFIG ) {
+            master_node_config_set(index, (const espnow_config_t*)evt.data);
+            free(evt.data);
+        }
+        int64_t busy_us = esp_timer_get_time() - start_us;
+        metrics_observe(&master_event_us, (int32_t)busy_us);
+        w->busy_us += busy_us;
+    }
+}
+
+#if CONFIG_MASTER_SEGLOG
+static esp_err_t master_seglog_init() {
+    seglog_config_t config;
+    nvs_handle_t nvs;
+
+    esp_err_t ret = seglog_partition_open(SEGLOG_PARTITION, &seglog_flash);
+    if ( ret != ESP_OK ) {
+        ESP_LOGE(TAG, "no \"%s\" partition for the flash log", SEGLOG_PARTITION);
+        return ret;
+    }
+    seglog_config_default(&config);
+    ret = seglog_open(&seglog, &seglog_flash, &config);
+    if ( ret != ESP_OK ) {
+        return ret;
+    }
+    seglog_lock = xSemaphoreCreateMutex();
+    if ( seglog_lock == NULL ) {
+        return ESP_ERR_NO_MEM;
+    }
+    // the host goes on where it was before the reboot
+    seglog_acked = seglog_first_id(&seglog);
+    if ( nvs_open(MASTER_SEGLOG_NVS_NS, NVS_READONLY, &nvs) == ESP_OK ) {
+        nvs_get_u32(nvs, MASTER_SEGLOG_NVS_KEY, &seglog_acked);
+        nvs_close(nvs);
+    }
+    ESP_LOGI(TAG, "flash log: records %u to %u, host acked %u",
+        seglog_first_id(&seglog), seglog_next_id(&seglog), seglog_acked);
+    return ESP_OK;
+}
+
+static void master_seglog_save(uint32_t acked) {
+    nvs_handle_t nvs;
+
+    if ( nvs_open(MASTER_SEGLOG_NVS_NS, NVS_READWRITE, &nvs) != ESP_OK ) {
+        return;
     }
+    if ( nvs_set_u32(nvs, MASTER_SEGLOG_NVS_KEY, acked) == ESP_OK ) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+static void master_send_cursor(uint32_t id) {
+    uplink_cursor_t rec = { .id = id };
+
+    uplink_write(UPLINK_REC_CURSOR, &rec, sizeof(uplink_cursor_t));
+    uplink_flush();
 }
 
+/* Streams the flash log to the host, at most MASTER_SEGLOG_WINDOW records
+ * past its last ack, each batch followed by a cursor record the host sends
+ * back. A host without ack for MASTER_SEGLOG_ACK_TIMEOUT_S is down: the
+ * cursor goes back to the first record not acked and is sent as a probe
+ * until the host answers, the log is then replayed from there at uart
+ * speed. Records are sent at least once, a master reboot may send again
+ * the ones acked after the last save to nvs. */
+static void app_uplink_task(void *pvParameter) {
+    seglog_cursor_t cursor;
+    seglog_entry_t  e;
+    uint8_t         host_up = 1;
+    uint32_t        saved = seglog_acked;
+    int64_t         now_us = esp_timer_get_time();
+    int64_t         flush_us = now_us;
+    int64_t         ack_us = now_us;
+    int64_t         probe_us = now_us;
+    int64_t         save_us = now_us;
+
+    xSemaphoreTake(seglog_lock, portMAX_DELAY);
+    seglog_seek(&seglog, &cursor, seglog_acked);
+    xSemaphoreGive(seglog_lock);
+    seglog_acked = cursor.id;
+    while (1) {
+        uint32_t id;
+        now_us = esp_timer_get_time();
+        if ( uplink_read_cursor(&id) == ESP_OK &&
+             (int32_t)( id - seglog_acked ) >= 0 && (int32_t)( id - cursor.id ) <= 0 ) {
+            seglog_acked = id;
+            ack_us = now_us;
+            if ( !host_up ) {
+                ESP_LOGW(TAG, "host back, replaying from record %u", id);
+                host_up = 1;
+            }
+        }
+        if ( host_up && cursor.id != seglog_acked &&
+             now_us - ack_us >= (int64_t)MASTER_SEGLOG_ACK_TIMEOUT_S * 1000000 ) {
+            ESP_LOGW(TAG, "host silent, %u records not acked", cursor.id - seglog_acked);
+            host_up = 0;
+        }
+
+        uint32_t sent = 0;
+        uint32_t from = cursor.id;
+        xSemaphoreTake(seglog_lock, portMAX_DELAY);
+        if ( now_us - flush_us >= (int64_t)SEGLOG_FLUSH_MS * 1000 ) {
+            seglog_flush(&seglog);
+            flush_us = now_us;
+        }
+        uint32_t first = seglog_first_id(&seglog);
+        if ( (int32_t)( first - seglog_acked ) > 0 ) {
+            ESP_LOGW(TAG, "%u records expired before the host got them", first - seglog_acked);
+            seglog_acked = first;
+        }
+        if ( !host_up && cursor.id != seglog_acked ) {
+            seglog_seek(&seglog, &cursor, seglog_acked);
+        }
+        while ( host_up && (int32_t)( cursor.id - seglog_acked ) < MASTER_SEGLOG_WINDOW &&
+                seglog_next(&seglog, &cursor, &e) == ESP_OK ) {
+            uplink_write(e.type, e.data, e.len);
+            sent++;
+        }
+        if ( !sent ) {
+            // idle, the next rotation does not wait for an erase
+            seglog_maintain(&seglog);
+        }
+        xSemaphoreGive(seglog_lock);
+
+        if ( sent ) {
+            if ( from == seglog_acked ) {
+                ack_us = now_us;
+            }
+            master_send_cursor(cursor.id);
+        }
+        else if ( !host_up && now_us - probe_us >= (int64_t)MASTER_SEGLOG_PROBE_MS * 1000 ) {
+            master_send_cursor(cursor.id);
+            probe_us = now_us;
+        }
+        if ( seglog_acked != saved && now_us - save_us >= (int64_t)MASTER_SEGLOG_SAVE_MS * 1000 ) {
+            master_seglog_save(seglog_acked);
+            saved = seglog_acked;
+            save_us = now_us;
+        }
+        if ( !sent ) {
+            vTaskDelay(pdMS_TO_TICKS(MASTER_UPLINK_POLL_MS));
+        }
+    }
+}
+#endif
+
+#if CONFIG_MASTER_CONSOLE
+static espnow_config_t console_node_config;    // console task
+
+static void node_config_print(const espnow_config_t* cfg) {
+    printf("version %04x\n", cfg->version);
+    for ( uint8_t key = 1; key < ESPNOW_CFG_COUNT; key++ ) {
+        printf("  %-16s %u\n", espnow_config_key_name(key), cfg->value[key]);
+    }
+}
+
+/* Every worker takes the new settings from its queue, its shard is its
+ * own: each node gets them with its next ack. */
+static int node_config_cmd(int argc, char** argv) {
+    espnow_config_t cfg = console_node_config;
+
+    if ( argc % 2 == 0 ) {
+        printf("usage: node_config [key value]...\n");
+        return 1;
+    }
+    for ( int i = 1; i + 1 < argc; i += 2 ) {
+        uint8_t key = 1;
+        while ( key < ESPNOW_CFG_COUNT && strcmp(espnow_config_key_name(key), argv[i]) != 0 ) {
+            key++;
+        }
+        if ( key == ESPNOW_CFG_COUNT || espnow_config_set(&cfg, key, strtoul(argv[i + 1], NULL, 0)) != ESP_OK ) {
+            printf("bad setting %s %s\n", argv[i], argv[i + 1]);
+            return 1;
+        }
+    }
+    for ( int i = 0; argc > 1 && i < MASTER_WORKERS; i++ ) {
+        master_event_t evt = { .type = MASTER_EVENT_CONFIG };
+        evt.data = malloc(sizeof(espnow_config_t));
+        if ( evt.data == NULL ) {
+            printf("out of memory, worker %d keeps its settings\n", i);
+            return 1;
+        }
+        memcpy(evt.data, &cfg, sizeof(espnow_config_t));
+        if ( xQueueSend(workers[i].queue, &evt, portMAX_DELAY) != pdTRUE ) {
+            free(evt.data);
+        }
+    }
+    console_node_config = cfg;
+    node_period_ms = cfg.value[ESPNOW_CFG_PERIOD_S] * 1000;
+    node_config_print(&cfg);
+    return 0;
+}
+
+static esp_err_t node_config_register(const espnow_config_t* node) {
+    const esp_console_cmd_t cmd = {
+        .command = "node_config",
+        .help = "Print the settings pushed to the nodes, change the given ones first (key as printed)",
+        .hint = "[key value]...",
+        .func = node_config_cmd,
+    };
+    console_node_config = *node;
+    return esp_console_cmd_register(&cmd);
+}
+#endif
 
 void app_main(void)  {
     // Initialize NVS
@@ -167,16 +757,72 @@ void app_main(void)  {
     }
     ESP_ERROR_CHECK( ret );
 
-    master_queue = xQueueCreate(ESPNOW_QUEUE_SIZE, sizeof(master_event_t));
-    if (master_queue == NULL) {
-        ESP_LOGE(TAG, "Create mutex fail");
-        return;
+#if CONFIG_MASTER_UPLINK_BINARY
+    ESP_ERROR_CHECK( uplink_init() );
+    if ( UPLINK_UART_PORT == 0 ) {
+        // console shares the uplink uart
+        esp_log_level_set("*", ESP_LOG_WARN);
+    }
+#endif
+#if CONFIG_MASTER_SEGLOG
+    ESP_ERROR_CHECK( master_seglog_init() );
+#endif
+
+    for ( int i = 0; i < MASTER_WORKERS; i++ ) {
+        workers[i].queue = xQueueCreate(ESPNOW_QUEUE_SIZE, sizeof(master_event_t));
+        if ( workers[i].queue == NULL ) {
+            ESP_LOGE(TAG, "Create queue fail");
+            return;
+        }
     }
 
     espnow_init(app_espnow_send_cb, app_espnow_recv_cb, NULL);
 
-
-    xTaskCreate(app_espnow_task, "app_espnow_task", 2048, NULL, 4, NULL);
-
-    set_sensor_state(SENSOR_NOT_CONFIGURED);
+    master_config_t config;
+    master_config_default(&config);
+    config.transport = &espnow_transport_esp;
+    config.on_sample = master_sample;
+    config.on_profile = master_profile;
+    // the token changes on every boot, nodes use it to detect a master reboot
+    ESP_ERROR_CHECK( esp_wifi_get_mac(WIFI_IF_STA, config.mac) );
+    config.channel = espnow_get_channel();
+    do {
+        config.token = esp_random();
+    } while ( config.token == 0 );
+    config.shards = MASTER_WORKERS;
+    ESP_ERROR_CHECK( master_init(&config) );
+    node_period_ms = (uint32_t)config.node.value[ESPNOW_CFG_PERIOD_S] * 1000;
+    for ( int i = 0; i < config.peer_count; i++ ) {
+        char mac_str[20];
+        format_mac_addr(mac_str, config.peers[i].addr);
+        ESP_LOGI(TAG, "redundant master %s on channel %d", mac_str,
+            config.peers[i].channel ? config.peers[i].channel : config.channel);
+    }
+    ESP_LOGI(TAG, "node settings %04x: period %u s, batch %u, deadbands %u %u %u, heartbeat %u s, light sleep %s %u ms",
+        config.node.version, config.node.value[ESPNOW_CFG_PERIOD_S], config.node.value[ESPNOW_CFG_BATCH],
+        config.node.value[ESPNOW_CFG_DEADBAND_T], config.node.value[ESPNOW_CFG_DEADBAND_H],
+        config.node.value[ESPNOW_CFG_DEADBAND_P], config.node.value[ESPNOW_CFG_HEARTBEAT_S],
+        config.node.value[ESPNOW_CFG_LIGHT_SLEEP] ? "on" : "off", config.node.value[ESPNOW_CFG_LIGHT_PERIOD_MS]);
+
+    // the WiFi task runs on core 0, the first worker gets the other core
+    for ( int i = 0; i < MASTER_WORKERS; i++ ) {
+        char name[16];
+        snprintf(name, sizeof(name), "app_espnow_w%d", i);
+        xTaskCreatePinnedToCore(app_espnow_task, name, MASTER_WORKER_STACK, (void*)(intptr_t)i, 4, &workers[i].task,
+            ( i + 1 ) % portNUM_PROCESSORS);
+    }
+#if CONFIG_MASTER_SEGLOG
+    xTaskCreate(app_uplink_task, "app_uplink", MASTER_UPLINK_STACK, NULL, 3, NULL);
+#endif
+#if CONFIG_MASTER_CONSOLE
+    esp_console_repl_t* repl = NULL;
+    esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    esp_console_dev_uart_config_t uart_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    repl_config.prompt = "master>";
+    ESP_ERROR_CHECK( esp_console_register_help_command() );
+    ESP_ERROR_CHECK( metrics_console_register() );
+    ESP_ERROR_CHECK( node_config_register(&config.node) );
+    ESP_ERROR_CHECK( esp_console_new_repl_uart(&uart_config, &repl_config, &repl) );
+    ESP_ERROR_CHECK( esp_console_start_repl(repl) );
+#endif
 }
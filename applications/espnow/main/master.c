@@ -0,0 +1,771 @@
+#include "master.h"
+#include "espnow_sync.h"
+#include "espnow_delta.h"
+#include "espnow_window.h"
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    float   temp;
+    float   humi;
+    float   pres;
+} master_legacy_measure_t;
+
+typedef struct {
+    uint32_t            last_discover_ms;
+    uint8_t             discovered;
+    espnow_delta_rx_t   delta;
+    espnow_window_t     window;         // data frame sequences
+    uint8_t             last_status;    // ack of the newest data frame
+    espnow_profile_info_t profile;      // wakes 0 until the first report
+    uint16_t            config_version; // settings the node runs
+    uint8_t             config_known;   // 0 until the node tells its version
+    espnow_report_info_t report;        // last skip totals of the node
+    uint8_t             peers_sent;     // other masters told since the master booted
+    espnow_linkstat_t   link;
+} master_node_t;
+
+// totals over the nodes of a shard, see master_shard_publish
+typedef struct {
+    uint64_t        phase[ESPNOW_PHASE_COUNT];  // wake phases x wakes
+    uint64_t        wakes;
+    uint32_t        profiled;
+    uint32_t        nodes;
+    uint32_t        weak;
+    uint32_t        silent;
+    uint32_t        heard;      // nodes with an rssi
+    int64_t         rssi;       // sum of their rssi EWMAs
+    uint64_t        lost;
+    uint64_t        data;
+} master_totals_t;
+
+/* Everything a frame touches lives in the shard of its sender, so shards
+ * fed by different tasks share nothing but the read only config and the
+ * totals they publish. */
+typedef struct {
+    sensor_store_t  store;
+    master_node_t*  nodes;      // per sensor state, indexed like the store
+    master_stats_t  stats;
+    uint32_t        credit_milli;   // backlog frames allowed now, x1000
+    uint32_t        credit_ms;      // last refill
+    espnow_config_t node_config;
+    const uint8_t*  via;        // relay of the frame being handled, NULL when heard directly
+    // scratch of the frame being handled, off the stack of the worker
+    espnow_measure_t measure[ESPNOW_DATA_DELTA_MAX_MEASURES];
+    uint32_t        ts[ESPNOW_DATA_DELTA_MAX_MEASURES];
+    uint32_t        age_s[ESPNOW_DATA_DELTA_MAX_MEASURES];
+    uint8_t         reply[ESPNOW_PROTO_MAX_LEN];    // ack, discover reply
+    uint8_t         bundle[ESPNOW_PROTO_MAX_LEN];   // reply wrapped for a relay
+    // written by the task of the shard only, odd while it writes
+    uint32_t        published_seq;
+    master_totals_t published;
+} master_shard_t;
+
+_Static_assert(ESPNOW_DATA_MAX_MEASURES <= ESPNOW_DATA_DELTA_MAX_MEASURES, "master scratch");
+
+static const char *TAG = "master";
+
+static master_config_t  config;
+static master_shard_t*  shards = NULL;
+
+void master_config_default(master_config_t* cfg) {
+    memset(cfg, 0, sizeof(master_config_t));
+    cfg->shards = MASTER_WORKERS;
+    cfg->discover_min_interval_ms = MASTER_DISCOVER_MIN_INTERVAL_MS;
+    cfg->slot_period_ms = MASTER_SLOT_PERIOD_MS;
+    cfg->slot_width_ms = MASTER_SLOT_WIDTH_MS;
+    cfg->backlog_credit = MASTER_BACKLOG_CREDIT;
+    cfg->backlog_rate = MASTER_BACKLOG_RATE;
+    espnow_config_default(&cfg->node);
+#ifdef CONFIG_MASTER_NODE_PERIOD_S
+    espnow_config_set(&cfg->node, ESPNOW_CFG_PERIOD_S, CONFIG_MASTER_NODE_PERIOD_S);
+    espnow_config_set(&cfg->node, ESPNOW_CFG_OSRS_T, CONFIG_MASTER_NODE_OSRS_T);
+    espnow_config_set(&cfg->node, ESPNOW_CFG_OSRS_H, CONFIG_MASTER_NODE_OSRS_H);
+    espnow_config_set(&cfg->node, ESPNOW_CFG_OSRS_P, CONFIG_MASTER_NODE_OSRS_P);
+    espnow_config_set(&cfg->node, ESPNOW_CFG_FILTER, CONFIG_MASTER_NODE_FILTER);
+    espnow_config_set(&cfg->node, ESPNOW_CFG_BATCH, CONFIG_MASTER_NODE_BATCH);
+    espnow_config_set(&cfg->node, ESPNOW_CFG_DEADBAND_T, CONFIG_MASTER_NODE_DEADBAND_T);
+    espnow_config_set(&cfg->node, ESPNOW_CFG_DEADBAND_H, CONFIG_MASTER_NODE_DEADBAND_H);
+    espnow_config_set(&cfg->node, ESPNOW_CFG_DEADBAND_P, CONFIG_MASTER_NODE_DEADBAND_P);
+    espnow_config_set(&cfg->node, ESPNOW_CFG_HEARTBEAT_S, CONFIG_MASTER_NODE_HEARTBEAT_S);
+#if CONFIG_MASTER_NODE_LIGHT_SLEEP
+    espnow_config_set(&cfg->node, ESPNOW_CFG_LIGHT_SLEEP, 1);
+#endif
+    espnow_config_set(&cfg->node, ESPNOW_CFG_LIGHT_PERIOD_MS, CONFIG_MASTER_NODE_LIGHT_PERIOD_MS);
+#endif
+#ifdef CONFIG_MASTER_PEERS
+    if ( master_config_peers(cfg, CONFIG_MASTER_PEERS) != ESP_OK ) {
+        ESP_LOGE(TAG, "malformed MASTER_PEERS \"%s\"", CONFIG_MASTER_PEERS);
+    }
+#endif
+    sensor_store_config_default(&cfg->store);
+}
+
+esp_err_t master_config_peers(master_config_t* cfg, const char* list) {
+    const char* p = list;
+
+    cfg->peer_count = 0;
+    while ( *p ) {
+        unsigned int a[ESPNOW_PROTO_ADDR_LEN];
+        unsigned int channel = 0;
+        int used = 0;
+
+        if ( *p == ',' || *p == ' ' ) {
+            p++;
+            continue;
+        }
+        if ( sscanf(p, "%2x:%2x:%2x:%2x:%2x:%2x%n", &a[0], &a[1], &a[2], &a[3], &a[4], &a[5], &used) != 6 ) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        p += used;
+        if ( *p == '@' ) {
+            if ( sscanf(p + 1, "%u%n", &channel, &used) != 1 || channel > 14 ) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            p += 1 + used;
+        }
+        if ( cfg->peer_count == MASTER_MAX_PEERS ) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        espnow_master_info_t* peer = &cfg->peers[cfg->peer_count++];
+        for ( int i = 0; i < ESPNOW_PROTO_ADDR_LEN; i++ ) {
+            peer->addr[i] = (uint8_t)a[i];
+        }
+        peer->channel = (uint8_t)channel;
+    }
+    return ESP_OK;
+}
+
+esp_err_t master_init(const master_config_t* cfg) {
+    ESP_LOGV(TAG, "master_init");
+
+    if ( cfg == NULL || cfg->transport == NULL || cfg->shards == 0 ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(&config, cfg, sizeof(master_config_t));
+
+    // the hash does not split the sensors evenly, leave each shard some room
+    if ( config.shards > 1 ) {
+        uint32_t max_nodes = ( cfg->store.max_nodes + config.shards - 1 ) / config.shards;
+        max_nodes += max_nodes / 4 + 1;
+        config.store.max_nodes = max_nodes < cfg->store.max_nodes ? max_nodes : cfg->store.max_nodes;
+    }
+
+    shards = calloc(config.shards, sizeof(master_shard_t));
+    if ( shards == NULL ) {
+        return ESP_ERR_NO_MEM;
+    }
+    for ( uint8_t i = 0; i < config.shards; i++ ) {
+        master_shard_t* sh = &shards[i];
+        memcpy(&sh->node_config, &config.node, sizeof(espnow_config_t));
+        sh->nodes = calloc(config.store.max_nodes, sizeof(master_node_t));
+        esp_err_t ret = sh->nodes ? sensor_store_init(&sh->store, &config.store, NULL, 0) : ESP_ERR_NO_MEM;
+        if ( ret != ESP_OK ) {
+            free(sh->nodes);
+            sh->nodes = NULL;
+            master_done();
+            return ret;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t master_done() {
+    ESP_LOGV(TAG, "master_done");
+
+    if ( shards == NULL ) {
+        return ESP_OK;
+    }
+    for ( uint8_t i = 0; i < config.shards; i++ ) {
+        if ( shards[i].nodes != NULL ) {
+            free(shards[i].nodes);
+            sensor_store_done(&shards[i].store);
+        }
+    }
+    free(shards);
+    shards = NULL;
+    return ESP_OK;
+}
+
+uint8_t master_shards() {
+    return config.shards;
+}
+
+uint8_t master_shard(const uint8_t* addr) {
+    return config.shards > 1 ? espnow_proto_addr_hash(addr) % config.shards : 0;
+}
+
+sensor_store_t* master_store(uint8_t shard) {
+    return shard < config.shards ? &shards[shard].store : NULL;
+}
+
+void master_shard_stats_get(uint8_t shard, master_stats_t* out) {
+    memcpy(out, &shards[shard].stats, sizeof(master_stats_t));
+}
+
+void master_stats_get(master_stats_t* out) {
+    memset(out, 0, sizeof(master_stats_t));
+    for ( uint8_t i = 0; i < config.shards; i++ ) {
+        const master_stats_t* s = &shards[i].stats;
+        out->frames += s->frames;
+        out->discovers += s->discovers;
+        out->discover_limited += s->discover_limited;
+        out->data += s->data;
+        out->resyncs += s->resyncs;
+        out->duplicates += s->duplicates;
+        out->stale += s->stale;
+        out->measures += s->measures;
+        out->backlog += s->backlog;
+        out->backlog_held += s->backlog_held;
+        out->profiles += s->profiles;
+        out->configs += s->configs;
+        out->peer_lists += s->peer_lists;
+        out->sampled += s->sampled;
+        out->skipped += s->skipped;
+        out->relayed += s->relayed;
+        out->legacy += s->legacy;
+        out->store_errors += s->store_errors;
+        out->send_errors += s->send_errors;
+    }
+}
+
+void master_node_config_set(uint8_t shard, const espnow_config_t* node) {
+    if ( shard < config.shards ) {
+        memcpy(&shards[shard].node_config, node, sizeof(espnow_config_t));
+    }
+}
+
+void master_shard_publish(uint8_t shard, uint32_t now_ms) {
+    master_shard_t* sh = &shards[shard];
+    master_totals_t t;
+
+    memset(&t, 0, sizeof(master_totals_t));
+    for ( uint32_t k = 0; k < config.store.max_nodes; k++ ) {
+        const master_node_t* n = &sh->nodes[k];
+        if ( n->profile.wakes ) {
+            for ( int ph = 0; ph < ESPNOW_PHASE_COUNT; ph++ ) {
+                t.phase[ph] += (uint64_t)n->profile.phase[ph] * n->profile.wakes;
+            }
+            t.wakes += n->profile.wakes;
+            t.profiled++;
+        }
+        if ( n->link.frames ) {
+            t.nodes++;
+            t.weak += espnow_linkstat_weak(&n->link);
+            t.silent += espnow_linkstat_silent(&n->link, now_ms);
+            if ( n->link.value[ESPNOW_LINKSTAT_RSSI].ewma ) {
+                t.rssi += n->link.value[ESPNOW_LINKSTAT_RSSI].ewma;
+                t.heard++;
+            }
+            t.lost += n->link.lost;
+            t.data += n->link.data;
+        }
+    }
+    // seqlock: readers on other tasks copy again while the seq is odd or moved
+    uint32_t seq = sh->published_seq;
+    __atomic_store_n(&sh->published_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&sh->published, &t, sizeof(master_totals_t));
+    __atomic_store_n(&sh->published_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// last totals published by a shard, from any task
+static void master_shard_totals(const master_shard_t* sh, master_totals_t* t) {
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&sh->published_seq, __ATOMIC_ACQUIRE);
+        memcpy(t, &sh->published, sizeof(master_totals_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ( ( seq & 1 ) || seq != __atomic_load_n(&sh->published_seq, __ATOMIC_RELAXED) );
+}
+
+esp_err_t master_profile_get(const uint8_t* addr, espnow_profile_info_t* info) {
+    master_shard_t* sh = &shards[master_shard(addr)];
+    uint16_t node = sensor_store_node_index(&sh->store, addr, 0);
+
+    if ( node == SENSOR_STORE_NONE || sh->nodes[node].profile.wakes == 0 ) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    memcpy(info, &sh->nodes[node].profile, sizeof(espnow_profile_info_t));
+    return ESP_OK;
+}
+
+uint32_t master_profile_fleet(espnow_profile_info_t* info) {
+    uint64_t sum[ESPNOW_PHASE_COUNT] = { 0 };
+    uint64_t wakes = 0;
+    uint32_t count = 0;
+    master_totals_t t;
+
+    for ( uint8_t i = 0; i < config.shards; i++ ) {
+        master_shard_totals(&shards[i], &t);
+        for ( int ph = 0; ph < ESPNOW_PHASE_COUNT; ph++ ) {
+            sum[ph] += t.phase[ph];
+        }
+        wakes += t.wakes;
+        count += t.profiled;
+    }
+    memset(info, 0, sizeof(espnow_profile_info_t));
+    if ( count ) {
+        for ( int ph = 0; ph < ESPNOW_PHASE_COUNT; ph++ ) {
+            info->phase[ph] = sum[ph] / wakes;
+        }
+        info->wakes = wakes > UINT16_MAX ? UINT16_MAX : wakes;
+    }
+    return count;
+}
+
+esp_err_t master_link_get(const uint8_t* addr, espnow_linkstat_t* link) {
+    master_shard_t* sh = &shards[master_shard(addr)];
+    uint16_t node = sensor_store_node_index(&sh->store, addr, 0);
+
+    if ( node == SENSOR_STORE_NONE || sh->nodes[node].link.frames == 0 ) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    memcpy(link, &sh->nodes[node].link, sizeof(espnow_linkstat_t));
+    return ESP_OK;
+}
+
+uint32_t master_link_walk(uint8_t shard, uint32_t* pos, uint32_t max, master_link_cb_t fn, void* ctx) {
+    master_shard_t* sh = &shards[shard];
+    uint32_t count = 0;
+
+    while ( *pos < config.store.max_nodes && count < max ) {
+        uint16_t node = (uint16_t)( *pos )++;
+        const espnow_linkstat_t* link = &sh->nodes[node].link;
+        const uint8_t* addr = link->frames ? sensor_store_node_addr(&sh->store, node) : NULL;
+
+        if ( addr != NULL ) {
+            fn(addr, link, ctx);
+            count++;
+        }
+    }
+    return count;
+}
+
+void master_link_summary(master_link_summary_t* out) {
+    int64_t rssi = 0;
+    uint32_t heard = 0;
+    uint64_t lost = 0;
+    uint64_t data = 0;
+    master_totals_t t;
+
+    memset(out, 0, sizeof(master_link_summary_t));
+    for ( uint8_t i = 0; i < config.shards; i++ ) {
+        master_shard_totals(&shards[i], &t);
+        out->nodes += t.nodes;
+        out->weak += t.weak;
+        out->silent += t.silent;
+        rssi += t.rssi;
+        heard += t.heard;
+        lost += t.lost;
+        data += t.data;
+    }
+    out->rssi = heard ? (int32_t)( rssi / heard / ESPNOW_LINKSTAT_SCALE ) : 0;
+    out->loss = lost + data ? (uint32_t)( lost * 1000 / ( lost + data ) ) : 0;
+}
+
+static void master_send(master_shard_t* sh, const uint8_t* addr, const uint8_t* data, size_t len) {
+    uint8_t* buf = sh->bundle;
+
+    if ( sh->via != NULL ) {
+        size_t down = espnow_proto_relay(buf, ESPNOW_MSG_RELAY_DOWN, 0, 0);
+
+        down = espnow_proto_relay_add(buf, down, addr, data, (uint8_t)len);
+        if ( down == 0 ) {
+            sh->stats.send_errors++;
+            ESP_LOGW(TAG, "frame type %d too long for a relay", data[1]);
+            return;
+        }
+        addr = sh->via;
+        data = buf;
+        len = down;
+    }
+    if ( espnow_transport_send(config.transport, addr, data, len) != ESP_OK ) {
+        sh->stats.send_errors++;
+        ESP_LOGW(TAG, "failed to send frame type %d", data[1]);
+    }
+}
+
+static void store_measure(master_shard_t* sh, const uint8_t* addr, const espnow_measure_t* m, uint32_t ts) {
+    sensor_store_sample_t sample;
+    sensor_store_agg_t agg;
+
+    sample.ts = ts;
+    sample.value[SENSOR_STORE_TEMP] = m->temp;
+    sample.value[SENSOR_STORE_HUMI] = m->humi;
+    sample.value[SENSOR_STORE_PRES] = m->pres;
+    sh->stats.measures++;
+    if ( config.on_sample != NULL ) {
+        config.on_sample(addr, &sample);
+    }
+
+    uint16_t node = sensor_store_node_index(&sh->store, addr, 1);
+    if ( node == SENSOR_STORE_NONE || sensor_store_add_node(&sh->store, node, &sample) != ESP_OK ) {
+        sh->stats.store_errors++;
+        ESP_LOGW(TAG, "failed to store measure");
+        return;
+    }
+    if ( sensor_store_window(&sh->store, node, 0, sample.ts, &agg) == ESP_OK ) {
+        ESP_LOGD(TAG, "window 0: %d sample(s), temp min %d max %d mean %d",
+            agg.count, agg.min[SENSOR_STORE_TEMP], agg.max[SENSOR_STORE_TEMP], agg.mean[SENSOR_STORE_TEMP]);
+    }
+}
+
+/* Discovery replies are rate limited per requester so a node stuck in
+ * discovery cannot keep the master busy. */
+static uint8_t discover_allowed(master_shard_t* sh, const uint8_t* addr, uint32_t now_ms) {
+    uint16_t node = sensor_store_node_index(&sh->store, addr, 1);
+    if ( node == SENSOR_STORE_NONE ) {
+        return 0;
+    }
+
+    master_node_t* n = &sh->nodes[node];
+    if ( n->discovered && now_ms - n->last_discover_ms < config.discover_min_interval_ms ) {
+        sh->stats.discover_limited++;
+        return 0;
+    }
+    n->discovered = 1;
+    n->last_discover_ms = now_ms;
+    return 1;
+}
+
+/* Master clock and wake slot for a node, appended to replies and acks so
+ * nodes spread their wakes over the cycle instead of drifting together. */
+static size_t add_sync(master_shard_t* sh, uint8_t* buf, size_t len, const uint8_t* addr, uint32_t now_ms) {
+    if ( config.slot_period_ms == 0 ) {
+        return len;
+    }
+    uint16_t node = sensor_store_node_index(&sh->store, addr, 1);
+    if ( node == SENSOR_STORE_NONE ) {
+        return len;
+    }
+
+    // shards interleave their node indexes, so slots stay unique across shards
+    espnow_sync_info_t sync;
+    sync.period_ms = config.slot_period_ms;
+    sync.slot_ms = espnow_sync_slot_ms((uint32_t)node * config.shards + ( sh - shards ), config.slot_period_ms, config.slot_width_ms);
+    sync.time_ms = now_ms;
+    size_t ret = espnow_proto_opt_add(buf, len, ESPNOW_OPT_SYNC, &sync, sizeof(espnow_sync_info_t));
+    return ret ? ret : len;
+}
+
+/* The other masters, in discover replies and in the first ack of a node
+ * after a master boot. Not to nodes behind a relay, they cannot reach
+ * them. */
+static size_t add_peers(master_shard_t* sh, master_node_t* n, uint8_t* buf, size_t len) {
+    if ( config.peer_count == 0 || sh->via != NULL || ( n != NULL && n->peers_sent ) ) {
+        return len;
+    }
+    size_t ret = espnow_proto_opt_add(buf, len, ESPNOW_OPT_MASTERS, config.peers,
+                                      config.peer_count * sizeof(espnow_master_info_t));
+    if ( ret == 0 ) {
+        return len;
+    }
+    if ( n != NULL ) {
+        n->peers_sent = 1;
+    }
+    sh->stats.peer_lists++;
+    return ret;
+}
+
+static void handle_discover(master_shard_t* sh, const uint8_t* addr, const espnow_hdr_t* hdr, uint32_t now_ms) {
+    sh->stats.discovers++;
+    if ( !discover_allowed(sh, addr, now_ms) ) {
+        ESP_LOGD(TAG, "discover rate limited (%d so far)", sh->stats.discover_limited);
+        return;
+    }
+    uint8_t* buf = sh->reply;
+    size_t len = espnow_proto_discover_reply(buf, hdr->seq, config.mac, config.channel, config.token);
+    len = add_sync(sh, buf, len, addr, now_ms);
+    len = add_peers(sh, NULL, buf, len);
+    master_send(sh, addr, buf, len);
+}
+
+/* Nodes back from an outage drain their backlog in bursts of credit
+ * frames. A token bucket per shard (one second of backlog_rate at most)
+ * bounds them all together, a node without credit goes on next wake. */
+static uint8_t backlog_credit(master_shard_t* sh, uint32_t now_ms) {
+    if ( config.backlog_rate == 0 ) {
+        return config.backlog_credit;
+    }
+    uint32_t max = (uint32_t)config.backlog_rate * 1000;
+    uint32_t elapsed = now_ms - sh->credit_ms;
+
+    sh->credit_ms = now_ms;
+    sh->credit_milli = elapsed >= 1000 ? max : sh->credit_milli + elapsed * config.backlog_rate;
+    if ( sh->credit_milli > max ) {
+        sh->credit_milli = max;
+    }
+    // this frame takes its share
+    sh->credit_milli = sh->credit_milli >= 1000 ? sh->credit_milli - 1000 : 0;
+    uint32_t credit = sh->credit_milli / 1000;
+    return credit < config.backlog_credit ? credit : config.backlog_credit;
+}
+
+/* Settings of the shard for a node that runs another version, or did not
+ * tell which one since the master booted. */
+static size_t add_config(master_shard_t* sh, const master_node_t* n, uint8_t* buf, size_t len) {
+    uint8_t value[ESPNOW_CONFIG_MAX_LEN];
+
+    if ( n == NULL || ( n->config_known && n->config_version == sh->node_config.version ) ) {
+        return len;
+    }
+    size_t vlen = espnow_config_put(&sh->node_config, value, sizeof(value));
+    size_t ret = vlen ? espnow_proto_opt_add(buf, len, ESPNOW_OPT_CONFIG, value, (uint8_t)vlen) : 0;
+    if ( ret == 0 ) {
+        return len;
+    }
+    sh->stats.configs++;
+    return ret;
+}
+
+static void master_ack(master_shard_t* sh, master_node_t* n, const uint8_t* addr, uint16_t seq, uint8_t status,
+                       int credit, uint32_t now_ms) {
+    uint8_t* buf = sh->reply;
+    size_t len = espnow_proto_ack(buf, seq, config.token, status);
+
+    len = add_sync(sh, buf, len, addr, now_ms);
+    if ( credit >= 0 ) {
+        espnow_flow_info_t flow = { .credit = (uint8_t)credit };
+        size_t with = espnow_proto_opt_add(buf, len, ESPNOW_OPT_FLOW, &flow, sizeof(espnow_flow_info_t));
+        len = with ? with : len;
+    }
+    len = add_config(sh, n, buf, len);
+    len = add_peers(sh, n, buf, len);
+    master_send(sh, addr, buf, len);
+}
+
+// version of the settings a node runs, sent until it got an ack without config
+static void config_seen(master_node_t* n, const uint8_t* data, size_t len) {
+    uint8_t vlen = 0;
+    const uint8_t* opt = espnow_proto_opt_find(data, len, ESPNOW_OPT_CONFIG_VER, &vlen);
+
+    if ( opt != NULL && vlen >= sizeof(uint16_t) ) {
+        n->config_version = (uint16_t)( opt[0] | ( opt[1] << 8 ) );
+        n->config_known = 1;
+    }
+}
+
+// time each measure was taken, on the master clock, from their ages; 0 without ages
+static int measure_times(master_shard_t* sh, const uint8_t* data, size_t len, uint8_t count, uint32_t now_ms) {
+    uint32_t* age_s = sh->age_s;
+    uint32_t* ts = sh->ts;
+    uint8_t vlen = 0;
+    const uint8_t* opt = espnow_proto_opt_find(data, len, ESPNOW_OPT_AGES, &vlen);
+    int n = opt ? espnow_proto_ages_get(opt, vlen, age_s, ESPNOW_DATA_DELTA_MAX_MEASURES) : -1;
+
+    for ( uint8_t i = 0; i < count; i++ ) {
+        // measures older than the master boot stay at its start
+        uint32_t age_ms = i < n && age_s[i] < UINT32_MAX / 1000 ? age_s[i] * 1000 : 0;
+        ts[i] = age_ms < now_ms ? now_ms - age_ms : 0;
+    }
+    return n > 0;
+}
+
+static uint8_t handle_data(master_shard_t* sh, const uint8_t* addr, const uint8_t* frame, size_t len, uint32_t now_ms) {
+    const espnow_data_t* data = (const espnow_data_t*)frame;
+
+    measure_times(sh, frame, len, data->count, now_ms);
+    for ( int i = 0; i < data->count; i++ ) {
+        store_measure(sh, addr, &data->measure[i], sh->ts[i]);
+    }
+    return ESPNOW_ACK_OK;
+}
+
+static uint8_t handle_data_delta(master_shard_t* sh, master_node_t* n, const uint8_t* addr, const espnow_hdr_t* hdr,
+                                 const uint8_t* data, size_t len, uint32_t now_ms) {
+    const espnow_data_delta_t* f = (const espnow_data_delta_t*)data;
+    espnow_measure_t* measure = sh->measure;
+
+    if ( n == NULL ) {
+        sh->stats.store_errors++;
+        return ESPNOW_ACK_ERROR;
+    }
+    const espnow_measure_t* ref = espnow_delta_rx_ref(&n->delta, f->ref_seq);
+    if ( ( f->flags & ESPNOW_DATA_KEY ) == 0 && ref == NULL ) {
+        // master rebooted or too many frames lost, the node sends a keyframe
+        sh->stats.resyncs++;
+        return ESPNOW_ACK_RESYNC;
+    }
+    int count = espnow_proto_data_delta_decode(data, len, ref, measure, ESPNOW_DATA_DELTA_MAX_MEASURES);
+    if ( count > 0 ) {
+        measure_times(sh, data, len, count, now_ms);
+    }
+    for ( int i = 0; i < count; i++ ) {
+        store_measure(sh, addr, &measure[i], sh->ts[i]);
+    }
+    if ( count > 0 ) {
+        espnow_delta_rx_push(&n->delta, hdr->seq, &measure[count - 1]);
+    }
+    return count < 0 ? ESPNOW_ACK_ERROR : ESPNOW_ACK_OK;
+}
+
+static void handle_profile(master_shard_t* sh, master_node_t* n, const uint8_t* addr, const uint8_t* data, size_t len, uint32_t now_ms) {
+    espnow_profile_info_t info;
+    uint8_t vlen = 0;
+    const uint8_t* opt = espnow_proto_opt_find(data, len, ESPNOW_OPT_PROFILE, &vlen);
+
+    if ( opt == NULL || vlen < sizeof(espnow_profile_info_t) ) {
+        return;
+    }
+    memcpy(&info, opt, sizeof(espnow_profile_info_t));
+    sh->stats.profiles++;
+    espnow_profile_merge(&n->profile, &info);
+    if ( config.on_profile != NULL ) {
+        config.on_profile(addr, &info, (uint32_t)sh->node_config.value[ESPNOW_CFG_PERIOD_S] * 1000, now_ms);
+    }
+}
+
+/* Skip totals of a node with deadbands, since its power on: the stats take
+ * what it sampled since its last report, all of it after a reset. */
+static void handle_report(master_shard_t* sh, master_node_t* n, const uint8_t* data, size_t len) {
+    espnow_report_info_t info;
+    uint8_t vlen = 0;
+    const uint8_t* opt = espnow_proto_opt_find(data, len, ESPNOW_OPT_REPORT, &vlen);
+
+    if ( opt == NULL || vlen < sizeof(espnow_report_info_t) ) {
+        return;
+    }
+    memcpy(&info, opt, sizeof(espnow_report_info_t));
+    uint8_t reset = info.samples < n->report.samples || info.skipped < n->report.skipped;
+    sh->stats.sampled += reset ? info.samples : info.samples - n->report.samples;
+    sh->stats.skipped += reset ? info.skipped : info.skipped - n->report.skipped;
+    n->report = info;
+}
+
+/* Retransmissions (lost acks) and replays stop here, before decode and
+ * storage: a duplicate is acked again with the status it got the first
+ * time, a stale frame is dropped. Returns 1 when the frame is done with.
+ *
+ * A node powered on again restarts from a random seq and flags its frames
+ * FIRST until one is acked. The window only restarts on a FIRST frame it
+ * cannot judge: within it, a replayed FIRST frame is a duplicate as any
+ * other. One 64 frames or more behind is taken as a power on, the
+ * protocol has nothing to tell it from a replay that old. */
+static uint8_t master_dedup(master_shard_t* sh, master_node_t* n, const uint8_t* addr, const espnow_hdr_t* hdr,
+                            uint8_t flags, uint32_t now_ms) {
+    uint8_t status;
+
+    if ( flags & ESPNOW_DATA_FIRST ) {
+        espnow_window_restart(&n->window, hdr->seq);
+    }
+    switch ( espnow_window_check(&n->window, hdr->seq) ) {
+        case ESPNOW_WINDOW_DUP:
+            sh->stats.duplicates++;
+            espnow_linkstat_data(&n->link, hdr->seq, ESPNOW_LINKSTAT_COPY, now_ms);
+            // a node only sends its newest frame again: a FIRST frame behind it is a
+            // node restarted on a seq already seen, it tries again with the next one
+            status = hdr->seq == n->window.top ? n->last_status :
+                     ( flags & ESPNOW_DATA_FIRST ) ? ESPNOW_ACK_RESYNC : ESPNOW_ACK_OK;
+            master_ack(sh, n, addr, hdr->seq, status, -1, now_ms);
+            return 1;
+        case ESPNOW_WINDOW_STALE:
+            sh->stats.stale++;
+            ESP_LOGD(TAG, "stale frame seq %d, newest %d", hdr->seq, n->window.top);
+            return 1;
+        default:
+            espnow_linkstat_data(&n->link, hdr->seq, ( flags & ESPNOW_DATA_FIRST ) ? ESPNOW_LINKSTAT_RESTART : ESPNOW_LINKSTAT_NEW, now_ms);
+            return 0;
+    }
+}
+
+static void handle_data_frame(master_shard_t* sh, const uint8_t* addr, const espnow_hdr_t* hdr, const uint8_t* data, size_t len, uint32_t now_ms) {
+    // flags sit at the same place in both data frames
+    uint8_t flags = ((const espnow_data_t*)data)->flags;
+    uint16_t node = sensor_store_node_index(&sh->store, addr, 1);
+    master_node_t* n = node == SENSOR_STORE_NONE ? NULL : &sh->nodes[node];
+
+    if ( n != NULL && master_dedup(sh, n, addr, hdr, flags, now_ms) ) {
+        return;
+    }
+    sh->stats.data++;
+    uint8_t status = hdr->type == ESPNOW_MSG_DATA ?
+        handle_data(sh, addr, data, len, now_ms) :
+        handle_data_delta(sh, n, addr, hdr, data, len, now_ms);
+    // a node draining its backlog is told how far it may go
+    int credit = -1;
+    if ( espnow_proto_opt_find(data, len, ESPNOW_OPT_AGES, NULL) != NULL ) {
+        sh->stats.backlog++;
+        if ( status == ESPNOW_ACK_OK ) {
+            credit = backlog_credit(sh, now_ms);
+            if ( credit == 0 ) {
+                sh->stats.backlog_held++;
+            }
+        }
+    }
+    if ( n != NULL ) {
+        n->last_status = status;
+        if ( status == ESPNOW_ACK_OK ) {
+            handle_profile(sh, n, addr, data, len, now_ms);
+            handle_report(sh, n, data, len);
+        }
+        config_seen(n, data, len);
+    }
+    master_ack(sh, n, addr, hdr->seq, status, credit, now_ms);
+}
+
+/* Frames from nodes that predate espnow_proto. */
+static void handle_legacy(master_shard_t* sh, const uint8_t* addr, const uint8_t* data, size_t len, uint32_t now_ms) {
+    sh->stats.legacy++;
+    if ( len == sizeof(master_legacy_measure_t) ) {
+        master_legacy_measure_t legacy;
+        espnow_measure_t m;
+
+        memcpy(&legacy, data, sizeof(master_legacy_measure_t));
+        espnow_proto_measure_from_float(&m, legacy.temp, legacy.humi, legacy.pres);
+        store_measure(sh, addr, &m, now_ms);
+    }
+    else if ( len == 2 ) {
+        uint16_t code = (uint16_t)( data[0] | ( data[1] << 8 ) );
+        ESP_LOGD(TAG, "ping with code %d", code);
+        if ( code == ESPNOW_PING_REQUEST && discover_allowed(sh, addr, now_ms) ) {
+            // legacy nodes take the sender of any frame as master, unicast is enough
+            code = ESPNOW_PING_REPLY;
+            master_send(sh, addr, (uint8_t*)&code, 2);
+        }
+    }
+}
+
+void master_handle_frame(const uint8_t* addr, const uint8_t* data, size_t len, int8_t rssi, uint32_t now_ms) {
+    master_shard_t* sh = &shards[master_shard(addr)];
+    espnow_hdr_t hdr;
+
+    sh->stats.frames++;
+    int type = espnow_proto_parse(data, len, &hdr);
+    switch ( type ) {
+        case ESPNOW_MSG_DISCOVER:
+            handle_discover(sh, addr, &hdr, now_ms);
+            break;
+        case ESPNOW_MSG_DATA:
+        case ESPNOW_MSG_DATA_DELTA:
+            handle_data_frame(sh, addr, &hdr, data, len, now_ms);
+            break;
+        default:
+            handle_legacy(sh, addr, data, len, now_ms);
+    }
+    // after the handling, nodes get known on their first discover or data frame
+    uint16_t node = sensor_store_node_index(&sh->store, addr, 0);
+    if ( node != SENSOR_STORE_NONE ) {
+        if ( type == ESPNOW_MSG_DISCOVER ) {
+            espnow_linkstat_rejoin(&sh->nodes[node].link, hdr.seq);
+        }
+        espnow_linkstat_frame(&sh->nodes[node].link, rssi, now_ms);
+    }
+}
+
+void master_handle_frame_via(const uint8_t* via, const uint8_t* addr, const uint8_t* data, size_t len, uint32_t now_ms) {
+    master_shard_t* sh = &shards[master_shard(addr)];
+
+    // relays only forward protocol frames
+    if ( espnow_proto_parse(data, len, NULL) < 0 ) {
+        return;
+    }
+    sh->stats.relayed++;
+    sh->via = via;
+    master_handle_frame(addr, data, len, 0, now_ms);
+    sh->via = NULL;
+}
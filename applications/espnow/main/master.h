@@ -0,0 +1,160 @@
+#ifndef _MASTER_H_
+#define _MASTER_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "espnow_proto.h"
+#include "espnow_transport.h"
+#include "espnow_profile.h"
+#include "espnow_config.h"
+#include "espnow_linkstat.h"
+#include "sensor_store.h"
+
+/*
+ * Master frame pipeline: decode, discovery replies, store, acks.
+ *
+ * No radio nor RTOS in here, frames come from the caller and replies leave
+ * through an espnow_transport_t, so the same code runs on target and in
+ * the host simulator.
+ *
+ * Sensors are split in shards by a hash of their MAC, each shard with its
+ * own store, per sensor state and counters. Frames from one sensor always
+ * land in the same shard, so one task per shard can feed the pipeline
+ * without any lock: route each frame with master_shard() first.
+ */
+
+#ifdef CONFIG_ESPNOW_DISCOVER_MIN_INTERVAL_MS
+#define MASTER_DISCOVER_MIN_INTERVAL_MS CONFIG_ESPNOW_DISCOVER_MIN_INTERVAL_MS
+#else
+#define MASTER_DISCOVER_MIN_INTERVAL_MS 2000
+#endif
+
+#ifdef CONFIG_MASTER_WORKERS
+#define MASTER_WORKERS                  CONFIG_MASTER_WORKERS
+#else
+#define MASTER_WORKERS                  1
+#endif
+
+#ifdef CONFIG_ESPNOW_SLOT_PERIOD_MS
+#define MASTER_SLOT_PERIOD_MS           CONFIG_ESPNOW_SLOT_PERIOD_MS
+#define MASTER_SLOT_WIDTH_MS            CONFIG_ESPNOW_SLOT_WIDTH_MS
+#else
+#define MASTER_SLOT_PERIOD_MS           30000
+#define MASTER_SLOT_WIDTH_MS            50
+#endif
+
+#ifdef CONFIG_MASTER_BACKLOG_CREDIT
+#define MASTER_BACKLOG_CREDIT           CONFIG_MASTER_BACKLOG_CREDIT
+#define MASTER_BACKLOG_RATE             CONFIG_MASTER_BACKLOG_RATE
+#else
+#define MASTER_BACKLOG_CREDIT           8
+#define MASTER_BACKLOG_RATE             50
+#endif
+
+// redundant masters advertised to the nodes
+#define MASTER_MAX_PEERS                4
+
+typedef void (*master_sample_cb_t)(const uint8_t* addr, const sensor_store_sample_t* sample);
+// period_ms: sample period the shard pushes to its nodes
+typedef void (*master_profile_cb_t)(const uint8_t* addr, const espnow_profile_info_t* info, uint32_t period_ms,
+                                    uint32_t now_ms);
+
+typedef struct {
+    const espnow_transport_t*   transport;
+    master_sample_cb_t          on_sample;      // optional, every decoded sample
+    master_profile_cb_t         on_profile;     // optional, every wake profile report
+    uint8_t                     mac[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t                     channel;
+    uint32_t                    token;          // changes on every boot
+    uint8_t                     shards;         // one per worker task
+    uint32_t                    discover_min_interval_ms;
+    uint32_t                    slot_period_ms; // 0: no wake slots
+    uint32_t                    slot_width_ms;
+    uint8_t                     backlog_credit; // frames a draining node may send after an ack
+    uint16_t                    backlog_rate;   // backlog frames / s per shard, 0: no limit
+    espnow_config_t             node;           // settings pushed to the nodes in acks
+    espnow_master_info_t        peers[MASTER_MAX_PEERS];   // other masters the nodes fail over to
+    uint8_t                     peer_count;
+    sensor_store_config_t       store;          // max_nodes over all shards
+} master_config_t;
+
+typedef struct {
+    uint32_t    frames;
+    uint32_t    discovers;
+    uint32_t    discover_limited;
+    uint32_t    data;
+    uint32_t    resyncs;        // delta frames without a known reference
+    uint32_t    duplicates;     // data frames seen before, acked again
+    uint32_t    stale;          // data frames behind the sequence window, dropped
+    uint32_t    measures;
+    uint32_t    backlog;        // data frames with measures taken before, stamped with their age
+    uint32_t    backlog_held;   // backlog acks without credit, the node goes on next wake
+    uint32_t    profiles;       // wake profile reports
+    uint32_t    configs;        // acks with the node settings
+    uint32_t    peer_lists;     // discover replies and acks with the other masters
+    uint32_t    sampled;        // samples taken by nodes with deadbands, from their reports
+    uint32_t    skipped;        // of which within the deadbands, never sent
+    uint32_t    relayed;        // frames that came through a relay
+    uint32_t    legacy;
+    uint32_t    store_errors;
+    uint32_t    send_errors;
+} master_stats_t;
+
+void            master_config_default(master_config_t* cfg);
+// "aa:bb:cc:dd:ee:ff[@channel], ..." into cfg->peers, ESP_ERR_INVALID_ARG on a malformed entry
+esp_err_t       master_config_peers(master_config_t* cfg, const char* list);
+
+esp_err_t       master_init(const master_config_t* cfg);
+esp_err_t       master_done();
+
+uint8_t         master_shards();
+// shard of a sensor, all its frames must be handled by the same task
+uint8_t         master_shard(const uint8_t* addr);
+// rssi of the frame, 0 when not known
+void            master_handle_frame(const uint8_t* addr, const uint8_t* data, size_t len, int8_t rssi, uint32_t now_ms);
+/* Frame of addr out of an ESPNOW_MSG_RELAY bundle from relay via, handled
+ * by the task of the shard of addr: bundles mix shards, split them before
+ * routing. The answers go back through via, its rssi is not the one of
+ * addr. */
+void            master_handle_frame_via(const uint8_t* via, const uint8_t* addr, const uint8_t* data, size_t len, uint32_t now_ms);
+
+sensor_store_t* master_store(uint8_t shard);
+void            master_shard_stats_get(uint8_t shard, master_stats_t* stats);
+// sum over the shards
+void            master_stats_get(master_stats_t* stats);
+
+/* New settings for the nodes of a shard, from the task of that shard (or
+ * with its task stopped): pushed with the next ack of every node. */
+void            master_node_config_set(uint8_t shard, const espnow_config_t* node);
+
+/* Totals over the sensors of a shard, from the task of that shard: the
+ * fleet profile and the link summary add up the last ones of every shard,
+ * from any task. */
+void            master_shard_publish(uint8_t shard, uint32_t now_ms);
+
+// wake profile of a sensor, averaged over all its reports, ESP_ERR_NOT_FOUND if none, from the task of its shard
+esp_err_t       master_profile_get(const uint8_t* addr, espnow_profile_info_t* info);
+// average over the sensors that reported one, weighted by wakes, returns their count, as last published
+uint32_t        master_profile_fleet(espnow_profile_info_t* info);
+
+// link quality of each sensor (espnow_linkstat.h)
+typedef void (*master_link_cb_t)(const uint8_t* addr, const espnow_linkstat_t* link, void* ctx);
+
+typedef struct {
+    uint32_t    nodes;          // heard since the master booted
+    uint32_t    weak;           // espnow_linkstat_weak
+    uint32_t    silent;         // espnow_linkstat_silent
+    int32_t     rssi;           // mean of the rssi EWMAs, dBm
+    uint32_t    loss;           // per mille of the data frames lost, all nodes
+} master_link_summary_t;
+
+// ESP_ERR_NOT_FOUND if never heard, from the task of the shard of addr
+esp_err_t       master_link_get(const uint8_t* addr, espnow_linkstat_t* link);
+/* Sensors of a shard heard so far, from *pos on (0 to start), max at most:
+ * fn for each, *pos past them. Returns how many, 0 once at the end. From
+ * the task of the shard. */
+uint32_t        master_link_walk(uint8_t shard, uint32_t* pos, uint32_t max, master_link_cb_t fn, void* ctx);
+// as last published, silent as of then
+void            master_link_summary(master_link_summary_t* summary);
+
+#endif // _MASTER_H_
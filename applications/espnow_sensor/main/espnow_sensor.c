@@ -28,28 +28,43 @@
 #include "esp_now.h"
 #include "esp_crc.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
 
+#include "espnow_comp.h"
+#include "bme280.h"
 
-/* ESPNOW can work in both station and softap mode. It is configured in menuconfig. */
-#if CONFIG_ESPNOW_WIFI_MODE_STATION
-#define ESPNOW_WIFI_MODE WIFI_MODE_STA
-#define ESPNOW_WIFI_IF   ESP_IF_WIFI_STA
+#define ESPNOW_QUEUE_SIZE           20
+
+#ifdef CONFIG_SENSOR_MAX_AWAKE_MS
+#define SENSOR_MAX_AWAKE_MS         CONFIG_SENSOR_MAX_AWAKE_MS
 #else
-#define ESPNOW_WIFI_MODE WIFI_MODE_AP
-#define ESPNOW_WIFI_IF   ESP_IF_WIFI_AP
+#define SENSOR_MAX_AWAKE_MS         10000
 #endif
 
-#define ESPNOW_QUEUE_SIZE           20
+/* Per state deadlines. The join waits for the radio init then for the
+ * longest join of the link (espnow_link_join_max_ms(), ~6.2 s with the
+ * defaults), its deadline comes a margin later so the wait gives up first. */
+#define SENSOR_RADIO_INIT_MS        500
+#define SENSOR_DEADLINE_MARGIN_MS   200
+#define SENSOR_CAPTURE_TIMEOUT_MS   500
+#define SENSOR_SEND_TIMEOUT_MS      1500
+
+// the handler drains and spills the backlog, the link logs on top
+#define SENSOR_HANDLER_STACK        4096
 
 typedef enum {
     SENSOR_UNDEFINED_STATE = 0,
-    SENSOR_NOT_CONFIGURED ,
-    SENSOR_CONFIGURED,
-    SENSOR_CAPTURING_DATA,
-    SENSOR_CAPTURE_DONE,
-    SENSOR_SENDING_DATA,
-    SENSOR_SEND_DATA_DONE
-
+    SENSOR_NOT_CONFIGURED,          // joining the master
+    SENSOR_CONFIGURED,              // capturing data
+    SENSOR_CAPTURE_DONE,            // sending data
+    SENSOR_SEND_DATA_DONE,
+    SENSOR_LINK_FAILED,             // capturing data for the backlog
+    SENSOR_DATA_KEPT,               // in the backlog, sent on the next contact
+    SENSOR_CAPTURE_FAILED,
+    SENSOR_SAMPLING,                // capturing data, the radio stays off unless it has to report
+    SENSOR_DATA_BATCHED,
+    SENSOR_DATA_SKIPPED,            // within the deadbands
+    SENSOR_STATE_COUNT
 } sensor_state_t;
 
 typedef struct {
@@ -57,22 +72,39 @@ typedef struct {
     sensor_state_t  state;
 } sensor_event_t;
 
+/* One row per state: the action run on entry, how long it may take, how
+ * many times it is run again when it fails and where each outcome leads.
+ * Terminal states have no action, they go to deep sleep. */
 typedef struct {
-    float   temp;
-    float   humi;
-    float   pres;
-} sensor_info_t;
+    const char*     name;
+    esp_err_t       (*action)();
+    uint32_t        timeout_ms;     // 0: the join wait and a margin
+    uint8_t         retries;
+    sensor_state_t  on_ok;
+    sensor_state_t  on_fail;
+} sensor_transition_t;
 
 static const char *TAG = "espnow_sensor";
 
 static xQueueHandle sensor_queue;
 
-static RTC_DATA_ATTR uint8_t master_addr[ESP_NOW_ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
-static uint8_t broadcast_addr[ESP_NOW_ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-static uint8_t null_addr[ESP_NOW_ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
+static sensor_state_t   state = SENSOR_UNDEFINED_STATE;
+static bme280_t         bme;
+static uint8_t          bme_ready;
+static uint8_t          converting;     // forced conversion started, not collected yet
+static bme280_measure_t info;
+static uint8_t          captured;       // info is this wake's measure
+static uint8_t          stored;         // info went through the reporting policy
+static uint8_t          kept;           // and is in the backlog
+static sensor_state_t   next_state;     // set by an action to leave elsewhere than on_ok
+static uint8_t          radio;          // brought up this wake, the node looked for its master
 
-static sensor_state_t state = SENSOR_UNDEFINED_STATE;
-static sensor_info_t  info;
+static esp_timer_handle_t state_timer;  // deadline of the current state
+static esp_timer_handle_t awake_timer;  // hard bound of the whole wake
+static TaskHandle_t handler_task;
+
+// wakes in a row that did not get data acked, stretches the deep sleep
+static RTC_DATA_ATTR uint8_t failed_wakes;
 
 static char tmp_mac_addr[20];
 static inline void format_mac_addr(uint8_t* mac_addr) {
@@ -87,14 +119,6 @@ static inline void format_mac_addr(uint8_t* mac_addr) {
     );
 }
 
-static inline uint8_t IS_NULL_ADDR(uint8_t* addr) {
-    return (memcmp(addr, null_addr, ESP_NOW_ETH_ALEN) == 0);
-}
-
-static inline uint8_t IS_BROADCAST_ADDR(uint8_t* addr) {
-    return (memcmp(addr, broadcast_addr, ESP_NOW_ETH_ALEN) == 0);
-}
-
 static void set_sensor_state(sensor_state_t new_state) {
     sensor_event_t evt;
 
@@ -106,182 +130,296 @@ static void set_sensor_state(sensor_state_t new_state) {
     }
 }
 
-/* ESPNOW sending or receiving callback function is called in WiFi task.
- * Users should not do lengthy operations from this task. Instead, post
- * necessary data to a queue and handle it from a lower priority task. */
-static void app_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status) {
+static uint32_t sensor_join_wait_ms() {
+    return SENSOR_RADIO_INIT_MS + espnow_link_join_max_ms();
+}
 
-    if ( mac_addr == NULL ) {
-        ESP_LOGE(TAG, "send cb error: mac_addr is null");
-        return;
-    }
-    /*
-    master_event_t evt;
-    evt.type = MASTER_EVENT_SEND_CB;
-    evt.status = status;
-    memcpy(&evt.addr, mac_addr,ESP_NOW_ETH_ALEN);
-
-    if (xQueueSend(sensor_queue, &evt, portMAX_DELAY) != pdTRUE) {
-        ESP_LOGW(TAG, "send cb error: send queue fail");
+static esp_err_t do_sensor_configuration() {
+    // started at boot on the other core: cached master as is, else probe
+    // the cached channel then scan them all
+    return espnow_node_wait_ready(sensor_join_wait_ms());
+}
+
+// oversampling and filter as pushed by the master
+static esp_err_t sensor_init() {
+    const espnow_config_t* cfg = espnow_node_config();
+    bme280_params_t params;
+
+    esp_err_t ret = bme280_init(&bme, BME280_I2C_PORT, BME280_I2C_ADDR, BME280_I2C_SDA, BME280_I2C_SCL);
+    if ( ret != ESP_OK ) {
+        return ret;
     }
-    */
-    ESP_LOGI(TAG, "app_espnow_send_cb(status=%d)", status);
-    ESP_LOGI(TAG, "current sensor state %d", state);
-    if ( state > SENSOR_NOT_CONFIGURED ) {
-        set_sensor_state(SENSOR_SEND_DATA_DONE);
+    bme280_params_default(&bme, &params);
+    params.over_samp_temp = (bme280_oversampling_t)cfg->value[ESPNOW_CFG_OSRS_T];
+    params.over_samp_humi = (bme280_oversampling_t)cfg->value[ESPNOW_CFG_OSRS_H];
+    params.over_samp_pres = (bme280_oversampling_t)cfg->value[ESPNOW_CFG_OSRS_P];
+    params.filter = (bme280_filter_t)cfg->value[ESPNOW_CFG_FILTER];
+    return bme280_init_params(&bme, &params);
+}
+
+static esp_err_t sensor_start() {
+    esp_err_t ret = ESP_OK;
+
+    if ( !bme_ready ) {
+        ret = sensor_init();
+        if ( ret != ESP_OK ) {
+            ESP_LOGE(TAG, "bme280 device init failed");
+            bme280_done(&bme);
+            return ret;
+        }
+        bme_ready = 1;
     }
+    ret = bme280_start_forced(&bme);
+    converting = ret == ESP_OK;
+    return ret;
 }
 
-static void app_espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int len) {
+static esp_err_t app_espnow_init(uint8_t start) {
 
-    if (mac_addr == NULL || data == NULL || len <= 0) {
-        ESP_LOGE(TAG, "receive cb error: bad arguments");
-        return;
+    sensor_queue = xQueueCreate(ESPNOW_QUEUE_SIZE, sizeof(sensor_event_t));
+    if (sensor_queue == NULL) {
+        ESP_LOGE(TAG, "Create mutex fail");
+        return ESP_FAIL;
     }
-    /*
-    master_event_t evt;
-    evt.type = MASTER_EVENT_RECV_CB;
-    memcpy(&evt.addr, mac_addr, ESP_NOW_ETH_ALEN);
-    evt.data = malloc(len);
-    if (evt.data == NULL) {
-        ESP_LOGE(TAG, "receive cb error: malloc receive data fail");
-        return;
+
+    // radio init and join on the other core, do_sensor_configuration waits for them
+    return start ? espnow_node_start() : ESP_OK;
+}
+
+static esp_err_t do_capture_data() {
+    if ( captured ) {
+        return ESP_OK;
+    }
+    // started at boot, again on retries
+    esp_err_t ret = converting ? ESP_OK : sensor_start();
+    if ( ret == ESP_OK ) {
+        converting = 0;
+        ret = bme280_collect_forced(&bme, &info);
     }
-    memcpy(evt.data, data, len);
-    evt.len = len;
-    if (xQueueSend(sensor_queue, &evt, portMAX_DELAY) != pdTRUE) {
-        ESP_LOGW(TAG, "receive cb error: send queue fail");
-        free(evt.data);
+    if ( ret != ESP_OK ) {
+        return ret;
     }
-    */
-    ESP_LOGI(TAG, "app_espnow_recv_cb(len=%d)", len);
-    memcpy(master_addr, mac_addr, ESP_NOW_ETH_ALEN);
-    set_sensor_state(SENSOR_CONFIGURED);
+    captured = 1;
+    espnow_node_mark(ESPNOW_PHASE_CONVERT);
+    ESP_LOGI(TAG, "temp %.2f C, humi %.2f %%, pres %.2f hPa", info.temp, info.humi, info.pres);
+    return ESP_OK;
 }
 
+// the measure of this wake into the backlog, once, unless within the deadbands
+static void sensor_keep() {
+    espnow_measure_t measure;
 
-
-static void do_sensor_configuration() {
-    if ( IS_NULL_ADDR(master_addr) ) {
-        uint16_t ping = 1973;
-        esp_now_send(broadcast_addr, (void*)&ping, 2);
+    if ( stored ) {
+        return;
     }
-    else {
-        set_sensor_state(SENSOR_CONFIGURED);
+    stored = 1;
+    espnow_proto_measure_from_float(&measure, info.temp, info.humi, info.pres);
+    kept = espnow_node_report(&measure);
+    if ( kept ) {
+        espnow_node_store(&measure, 1);
     }
 }
 
+// no master this time, the measure waits in the backlog
+static esp_err_t do_keep_data() {
+    esp_err_t ret = do_capture_data();
 
-static esp_err_t app_add_peer(uint8_t* addr) {
-    /* Add broadcast peer information to peer list. */
-     esp_err_t ret = ESP_OK;
-    if ( esp_now_is_peer_exist(addr)  == false ) {
-        esp_now_peer_info_t *peer = malloc(sizeof(esp_now_peer_info_t));
-        if (peer == NULL) {
-            ESP_LOGE(TAG, "Malloc peer information fail");
-            vSemaphoreDelete(sensor_queue);
-            esp_now_deinit();
-            return ESP_FAIL;
-        }
-        memset(peer, 0, sizeof(esp_now_peer_info_t));
-        peer->channel = CONFIG_ESPNOW_CHANNEL;
-        peer->ifidx = ESPNOW_WIFI_IF;
-        peer->encrypt = false;
-        memcpy(peer->peer_addr, addr, ESP_NOW_ETH_ALEN);
-        ret =  esp_now_add_peer(peer);
-        free(peer);
-        ESP_LOGI(TAG, "peer added");
+    if ( ret != ESP_OK ) {
+        return ret;
     }
-    else {
-        ESP_LOGI(TAG, "peer already exists");
-    }
-    return ret;
+    sensor_keep();
+    ESP_LOGI(TAG, "%u measures kept for the next wake", espnow_node_backlog_count());
+    return ESP_OK;
 }
 
+/* Radio off: the measure is kept for a later wake or dropped within the
+ * deadbands. The radio comes up right away once a kept measure fills the
+ * batch, with deadbands set that is what tells whether to report. */
+static esp_err_t do_sample_data() {
+    esp_err_t ret = do_capture_data();
 
-/* WiFi should start before using ESPNOW */
-static void app_wifi_init(void)
-{
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
-    ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
-    ESP_ERROR_CHECK( esp_wifi_set_mode(ESPNOW_WIFI_MODE) );
-    ESP_ERROR_CHECK( esp_wifi_start());
+    if ( ret != ESP_OK ) {
+        return ret;
+    }
+    sensor_keep();
+    if ( !kept ) {
+        next_state = SENSOR_DATA_SKIPPED;
+        return ESP_OK;
+    }
+    if ( espnow_node_backlog_count() < espnow_node_config()->value[ESPNOW_CFG_BATCH] ) {
+        ESP_LOGI(TAG, "%u measures kept for the next wake", espnow_node_backlog_count());
+        return ESP_OK;
+    }
+    ret = espnow_node_start();
+    if ( ret != ESP_OK ) {
+        return ret;
+    }
+    radio = 1;
+    next_state = SENSOR_NOT_CONFIGURED;
+    return ESP_OK;
 }
 
-static esp_err_t app_espnow_init(void) {
+static esp_err_t do_send_data() {
+    ESP_LOGI(TAG, "do_send_data()");
 
-    sensor_queue = xQueueCreate(ESPNOW_QUEUE_SIZE, sizeof(sensor_event_t));
-    if (sensor_queue == NULL) {
-        ESP_LOGE(TAG, "Create mutex fail");
-        return ESP_FAIL;
+    format_mac_addr((uint8_t*)espnow_link_master(espnow_node_link()));
+    ESP_LOGI(TAG, "master addr [%s]", tmp_mac_addr);
+
+    // once, retries only drain the backlog again, oldest measure first
+    sensor_keep();
+    esp_err_t ret = espnow_node_drain();
+    if ( ret != ESP_OK ) {
+        ESP_LOGW(TAG, "no ack from master, %u measures kept", espnow_node_backlog_count());
     }
 
-    /* Initialize ESPNOW and register sending and receiving callback function. */
-    ESP_ERROR_CHECK( esp_now_init() );
-    ESP_ERROR_CHECK( esp_now_register_send_cb(app_espnow_send_cb) );
-    ESP_ERROR_CHECK( esp_now_register_recv_cb(app_espnow_recv_cb) );
+    espnow_node_stats_t stats;
+    espnow_node_stats_get(&stats);
+    ESP_LOGI(TAG, "wake cost: ready %u us, first frame %u us, join %u us (%d probes), send %u us (%d frames, %d failovers, %s)",
+        stats.ready_us, stats.first_frame_us, stats.join_us, stats.join_probes, stats.send_us, stats.send_probes,
+        stats.send_failovers, espnow_rate_name(stats.send_rate));
+    return ret;
+}
 
-    ESP_ERROR_CHECK( app_add_peer(broadcast_addr) );
+static const sensor_transition_t transitions[SENSOR_STATE_COUNT] = {
+    [SENSOR_NOT_CONFIGURED] = { "joining", do_sensor_configuration, 0, 0,
+                                SENSOR_CONFIGURED, SENSOR_LINK_FAILED },
+    [SENSOR_CONFIGURED]     = { "capturing", do_capture_data, SENSOR_CAPTURE_TIMEOUT_MS, 2,
+                                SENSOR_CAPTURE_DONE, SENSOR_CAPTURE_FAILED },
+    [SENSOR_CAPTURE_DONE]   = { "sending", do_send_data, SENSOR_SEND_TIMEOUT_MS, 1,
+                                SENSOR_SEND_DATA_DONE, SENSOR_DATA_KEPT },
+    [SENSOR_SEND_DATA_DONE] = { "data sent" },
+    [SENSOR_LINK_FAILED]    = { "no master", do_keep_data, SENSOR_CAPTURE_TIMEOUT_MS, 2,
+                                SENSOR_DATA_KEPT, SENSOR_CAPTURE_FAILED },
+    [SENSOR_DATA_KEPT]      = { "data kept" },
+    [SENSOR_CAPTURE_FAILED] = { "no data" },
+    [SENSOR_SAMPLING]       = { "sampling", do_sample_data, SENSOR_CAPTURE_TIMEOUT_MS, 2,
+                                SENSOR_DATA_BATCHED, SENSOR_CAPTURE_FAILED },
+    [SENSOR_DATA_BATCHED]   = { "data batched" },
+    [SENSOR_DATA_SKIPPED]   = { "data skipped" },
+};
+
+/* The master may ask for several measures per radio wake, or only for the
+ * ones past the deadbands: the wakes in between only sample. The radio
+ * comes up at boot, overlapped with the conversion, when it is sure to be
+ * needed: the node was powered on, the heartbeat is due or this measure
+ * fills the batch. With deadbands set it waits for the measure. */
+static uint8_t sensor_radio_wake() {
+    const espnow_config_t* cfg = espnow_node_config();
+
+    if ( esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED || espnow_node_report_due() ) {
+        return 1;
+    }
+    if ( espnow_report_enabled(cfg) ) {
+        return 0;
+    }
+    return espnow_node_backlog_count() + 1 >= cfg->value[ESPNOW_CFG_BATCH];
+}
 
-    format_mac_addr(master_addr);
-    ESP_LOGI(TAG, "master mac addr: %s", tmp_mac_addr);
+/* Wakes that fail in a row sleep 2, then 4 times longer (or more when the
+ * link stretches it), a working wake lands in the slot of the master.
+ * Wakes without radio (batched, skipped) sleep the period: the stretch
+ * spares joins, they made none. */
+static void do_deep_sleep(uint8_t ok) {
+    esp_timer_stop(state_timer);
+    esp_timer_stop(awake_timer);
 
-    return ESP_OK;
+    if ( ok ) {
+        failed_wakes = 0;
+    }
+    else if ( failed_wakes < UINT8_MAX ) {
+        failed_wakes++;
+    }
+    uint32_t factor = radio ? espnow_link_sleep_factor(espnow_node_link()) : 1;
+    uint32_t backoff = failed_wakes < 2 ? 1 << failed_wakes : ESPNOW_LINK_SLEEP_FACTOR_MAX;
+    if ( backoff > factor ) {
+        factor = backoff;
+    }
+    uint32_t sleep_ms = espnow_node_config()->value[ESPNOW_CFG_PERIOD_S] * 1000 * factor;
+    // land in the slot given by the master
+    sleep_ms = espnow_node_sleep_ms(sleep_ms);
+    espnow_node_profile_end();
+    ESP_LOGI(TAG, "awake %u ms, %u failed wakes, %u bytes of handler stack left, enabling timer wakeup, %dms\n",
+        (uint32_t)( esp_timer_get_time() / 1000 ), failed_wakes,
+        handler_task ? uxTaskGetStackHighWaterMark(handler_task) : 0, sleep_ms);
+    esp_sleep_enable_timer_wakeup((uint64_t)sleep_ms * 1000);
+    esp_deep_sleep_start();
 }
 
-static void do_capture_data() {
-    info.temp = 19.73;
-    info.humi = 13.89;
-    info.pres = 1013.25;
-    set_sensor_state(SENSOR_CAPTURE_DONE);
+static uint32_t sensor_deadline_ms(const sensor_transition_t* t) {
+    return t->timeout_ms ? t->timeout_ms : sensor_join_wait_ms() + SENSOR_DEADLINE_MARGIN_MS;
 }
 
-static void do_send_data() {
-    ESP_LOGI(TAG, "do_send_data()");
-    esp_now_send(master_addr, (void*)&info, sizeof(sensor_info_t));
+/* Called in the esp_timer task: the action of the current state is stuck
+ * (a callback that never came), the handler task cannot get out of it. */
+static void state_timeout_cb(void* arg) {
+    ESP_LOGE(TAG, "state %s over its %u ms deadline", transitions[state].name, sensor_deadline_ms(&transitions[state]));
+    do_deep_sleep(0);
 }
 
-static void do_deep_sleep() {
-    ESP_LOGI(TAG, "Enabling timer wakeup, %ds\n", 30);
-    esp_sleep_enable_timer_wakeup(30 * 1000000);
-    esp_deep_sleep_start();
+static void awake_timeout_cb(void* arg) {
+    ESP_LOGE(TAG, "awake for %u ms, forcing deep sleep", SENSOR_MAX_AWAKE_MS);
+    do_deep_sleep(0);
+}
+
+static esp_err_t sensor_timers_init() {
+    const esp_timer_create_args_t state_args = { .callback = state_timeout_cb, .name = "sensor_state" };
+    const esp_timer_create_args_t awake_args = { .callback = awake_timeout_cb, .name = "sensor_awake" };
+    esp_err_t ret;
+
+    if ( ( ret = esp_timer_create(&state_args, &state_timer) ) != ESP_OK ||
+         ( ret = esp_timer_create(&awake_args, &awake_timer) ) != ESP_OK ) {
+        return ret;
+    }
+    if ( sensor_join_wait_ms() + SENSOR_CAPTURE_TIMEOUT_MS + SENSOR_SEND_TIMEOUT_MS > SENSOR_MAX_AWAKE_MS ) {
+        ESP_LOGW(TAG, "joins of up to %u ms leave no time to send within %u ms awake",
+            sensor_join_wait_ms(), SENSOR_MAX_AWAKE_MS);
+    }
+    // counted from boot, init time included
+    int64_t left_us = (int64_t)SENSOR_MAX_AWAKE_MS * 1000 - esp_timer_get_time();
+    return esp_timer_start_once(awake_timer, left_us > 0 ? left_us : 1);
 }
 
 static void sensor_event_handler(void *pvParameter) {
 
     sensor_event_t evt;
+    uint8_t        attempt = 0;
 
     while (xQueueReceive(sensor_queue, &evt, portMAX_DELAY) == pdTRUE) {
-        printf("------------- <NEW SENSOR EVENT> ---------------\n");
-        printf("sensor state changed %d -> %d\n", evt.prev_state, evt.state);
-        switch (evt.state) {
-            case SENSOR_NOT_CONFIGURED:
-                do_sensor_configuration();
-                break;
-            case SENSOR_CONFIGURED:
-                format_mac_addr(master_addr);
-                ESP_LOGI(TAG, "master addr [%s]", tmp_mac_addr);
-                app_add_peer(master_addr);
-                do_capture_data();
-                break;
-            case SENSOR_CAPTURE_DONE:
-                ESP_LOGI(TAG, "capture data done");
-                do_send_data();
-                break;
-            case SENSOR_SEND_DATA_DONE:
-                ESP_LOGI(TAG, "data send done");
-                do_deep_sleep();
-                break;
-            default:
-                ESP_LOGI(TAG, "state %d not processed yet", evt.state);
+        const sensor_transition_t* t = &transitions[evt.state];
+
+        ESP_LOGI(TAG, "sensor state changed %d -> %d (%s)", evt.prev_state, evt.state, t->name ? t->name : "?");
+        if ( t->action == NULL ) {
+            do_deep_sleep(evt.state == SENSOR_SEND_DATA_DONE || evt.state == SENSOR_DATA_BATCHED ||
+                          evt.state == SENSOR_DATA_SKIPPED);
+            continue;
+        }
+        if ( evt.state != evt.prev_state ) {
+            attempt = 0;
+        }
+
+        esp_timer_stop(state_timer);
+        esp_timer_start_once(state_timer, (uint64_t)sensor_deadline_ms(t) * 1000);
+        esp_err_t ret = t->action();
+        esp_timer_stop(state_timer);
+
+        if ( ret == ESP_OK ) {
+            set_sensor_state(next_state != SENSOR_UNDEFINED_STATE ? next_state : t->on_ok);
+            next_state = SENSOR_UNDEFINED_STATE;
+        }
+        else if ( attempt++ < t->retries ) {
+            ESP_LOGW(TAG, "%s failed (%s), retry %d / %d", t->name, esp_err_to_name(ret), attempt, t->retries);
+            set_sensor_state(evt.state);
+        }
+        else {
+            set_sensor_state(t->on_fail);
         }
     }
 }
 
 void app_main(void)  {
+    espnow_node_profile_start();
+    ESP_ERROR_CHECK( sensor_timers_init() );
+
     // Initialize NVS
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -289,11 +427,16 @@ void app_main(void)  {
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK( ret );
+    espnow_node_mark(ESPNOW_PHASE_NVS);
 
-    app_wifi_init();
-    app_espnow_init();
+    // link and settings from rtc memory, or nvs on power on: wakes without radio sleep through them too
+    espnow_node_prepare();
+    radio = sensor_radio_wake();
+    ESP_ERROR_CHECK( app_espnow_init(radio) );
+    // converts while the radio comes up, a failure is retried by the capture state
+    sensor_start();
 
-    xTaskCreate(sensor_event_handler, "sensor_event_handler", 2048, NULL, 4, NULL);
+    xTaskCreate(sensor_event_handler, "sensor_event_handler", SENSOR_HANDLER_STACK, NULL, 4, &handler_task);
 
-    set_sensor_state(SENSOR_NOT_CONFIGURED);
+    set_sensor_state(radio ? SENSOR_NOT_CONFIGURED : SENSOR_SAMPLING);
 }
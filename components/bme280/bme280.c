@@ -1,9 +1,15 @@
 #include "esp_log.h"
 #include "bme280.h"
+#include "metrics.h"
 #include <string.h>
 
 static const char *TAG = "bme280";
 
+METRICS_COUNTER(bme280_measures, "bme280.measures");
+METRICS_COUNTER(bme280_errors, "bme280.errors");
+// status reads before a forced measure is done
+METRICS_HISTOGRAM(bme280_polls, "bme280.status_polls", 2, 4, 8, 16, 64);
+
 static inline esp_err_t bme280_wait_measure_done(bme280_t* bme) {
     ESP_LOGD(TAG, "waiting for measure done");
 
@@ -13,10 +19,12 @@ static inline esp_err_t bme280_wait_measure_done(bme280_t* bme) {
     bme280_ctrl_temp_t  ctrl;
     uint8_t data[2];
     uint8_t reg = BME280_REG_STATUS;
+    int32_t polls = 0;
 
     while ( !measure_done ) {
 
         ret = i2c_device_read (&bme->device, &reg, 1, data, 2);
+        polls++;
         if ( ret != ESP_OK ) {
             ESP_LOGE(TAG, "failed to read status & ctrl_temp registers");
             return ret;
@@ -32,6 +40,7 @@ static inline esp_err_t bme280_wait_measure_done(bme280_t* bme) {
         }
     }
     ESP_LOGD(TAG, "measure done");
+    metrics_observe(&bme280_polls, polls);
     return ESP_OK;
 }
 
@@ -362,41 +371,38 @@ static inline int32_t bme280_compensate_temperature(bme280_t *bme, int32_t temp,
     return comp_temp;
 }
 
-esp_err_t bme280_read_forced(bme280_t *bme, bme280_measure_t *measure)
+static inline void bme280_compensate(bme280_t* bme, const bme280_raw_data_t* raw_data, bme280_measure_t* measure)
 {
-    ESP_LOGV(TAG, "bme280_read_forced");
-
-    esp_err_t ret = ESP_OK;
-    bme280_raw_data_t raw_data;
-    bme280_measure_t m;
     int32_t fine_temp;
     int32_t comp_temp;
     uint32_t comp_humi;
     uint32_t comp_pres;
 
-    ret = bme280_read_raw_forced(bme, &raw_data);
+    comp_temp = bme280_compensate_temperature(bme, raw_data->temp, &fine_temp);
+    comp_humi = bme280_compensate_humidity(bme, raw_data->humi, fine_temp);
+    comp_pres = bme280_compensate_pressure(bme, raw_data->pres, fine_temp);
+
+    memset(measure, 0, sizeof(bme280_measure_t));
+    measure->temp = (float)comp_temp / 100.0f;
+    measure->humi = (float)comp_humi / 1024.0f;
+    measure->pres = (float)comp_pres / 256.0f / 100.0f;
+}
+
+esp_err_t bme280_read_forced(bme280_t *bme, bme280_measure_t *measure)
+{
+    ESP_LOGV(TAG, "bme280_read_forced");
+
+    esp_err_t ret = bme280_start_forced(bme);
     if (ret != ESP_OK)
     {
-        ESP_LOGE(TAG, "failed to read raw data");
         return ret;
     }
-
-    comp_temp = bme280_compensate_temperature(bme, raw_data.temp, &fine_temp);
-    comp_humi = bme280_compensate_humidity(bme, raw_data.humi, fine_temp);
-    comp_pres = bme280_compensate_pressure(bme, raw_data.pres, fine_temp);
-    m.temp = (float)comp_temp / 100.0f;
-    m.humi = (float)comp_humi / 1024.0f;
-    m.pres = (float)comp_pres / 256.0f / 100.0f;
-
-    memset(measure, 0, sizeof(bme280_measure_t));
-    memcpy(measure, &m, sizeof(bme280_measure_t));
-
-    return ret;
+    return bme280_collect_forced(bme, measure);
 }
 
-esp_err_t bme280_read_raw_forced(bme280_t *bme, bme280_raw_data_t *raw_data)
+esp_err_t bme280_start_forced(bme280_t *bme)
 {
-    ESP_LOGV(TAG, "bme280_read_raw_forced");
+    ESP_LOGV(TAG, "bme280_start_forced");
 
     bme280_ctrl_temp_t ctrl;
     uint8_t reg;
@@ -414,6 +420,37 @@ esp_err_t bme280_read_raw_forced(bme280_t *bme, bme280_raw_data_t *raw_data)
     if (ret != ESP_OK)
     {
         ESP_LOGE(TAG, "failed to write (%d) to ctrl temp reg", ctrl.data);
+    }
+    return ret;
+}
+
+esp_err_t bme280_collect_forced(bme280_t *bme, bme280_measure_t *measure)
+{
+    ESP_LOGV(TAG, "bme280_collect_forced");
+
+    bme280_raw_data_t raw_data;
+    esp_err_t ret = bme280_wait_measure_done(bme);
+
+    if (ret == ESP_OK)
+    {
+        ret = bme280_read_raw(bme, &raw_data);
+    }
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "failed to read raw data");
+        return ret;
+    }
+    bme280_compensate(bme, &raw_data, measure);
+    return ret;
+}
+
+esp_err_t bme280_read_raw_forced(bme280_t *bme, bme280_raw_data_t *raw_data)
+{
+    ESP_LOGV(TAG, "bme280_read_raw_forced");
+
+    esp_err_t ret = bme280_start_forced(bme);
+    if (ret != ESP_OK)
+    {
         return ret;
     }
 
@@ -432,6 +469,7 @@ esp_err_t bme280_read_raw(bme280_t *bme, bme280_raw_data_t *raw_data)
     uint8_t val[8];
 
     ret = i2c_device_read(&bme->device, &reg, 1, val, 8);
+    metrics_inc(ret == ESP_OK ? &bme280_measures : &bme280_errors);
     if (ret == ESP_OK)
     {
         memset(raw_data, 0, sizeof(bme280_raw_data_t));
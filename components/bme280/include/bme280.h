@@ -170,6 +170,12 @@ esp_err_t bme280_read_raw(bme280_t* bme, bme280_raw_data_t* raw_data);
 esp_err_t bme280_read_raw_forced(bme280_t* bme, bme280_raw_data_t* raw_data);
 esp_err_t bme280_read_forced(bme280_t* bme, bme280_measure_t* measure);
 
+// forced conversion in two steps, the chip converts (about 10 ms at x1
+// oversampling) while the caller does something else
+esp_err_t bme280_start_forced(bme280_t* bme);
+// waits for the end of the conversion started by bme280_start_forced()
+esp_err_t bme280_collect_forced(bme280_t* bme, bme280_measure_t* measure);
+
 //int32_t bme280_compensate_temperature(bme280_t *bme, int32_t temp, int32_t *fine_temp);
 
 #endif // _BME280_DEVICE_H_
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "espnow_backlog.h"
+#include <string.h>
+
+void espnow_backlog_reset(espnow_backlog_t* b) {
+    memset(b, 0, sizeof(espnow_backlog_t));
+}
+
+uint8_t espnow_backlog_push(espnow_backlog_t* b, const espnow_measure_t* measure, uint32_t ts) {
+    uint8_t dropped = 0;
+
+    if ( b->count == ESPNOW_BACKLOG_SIZE ) {
+        espnow_backlog_pop(b, 1);
+        b->dropped++;
+        b->pending = 0;
+        dropped = 1;
+    }
+    espnow_backlog_sample_t* s = &b->sample[( b->head + b->count ) % ESPNOW_BACKLOG_SIZE];
+    s->measure = *measure;
+    s->ts = ts;
+    b->count++;
+    return dropped;
+}
+
+uint16_t espnow_backlog_peek(const espnow_backlog_t* b, espnow_backlog_sample_t* out, uint16_t max) {
+    uint16_t count = max < b->count ? max : b->count;
+
+    for ( uint16_t i = 0; i < count; i++ ) {
+        out[i] = b->sample[( b->head + i ) % ESPNOW_BACKLOG_SIZE];
+    }
+    return count;
+}
+
+void espnow_backlog_pop(espnow_backlog_t* b, uint16_t count) {
+    if ( count > b->count ) {
+        count = b->count;
+    }
+    b->head = ( b->head + count ) % ESPNOW_BACKLOG_SIZE;
+    b->count -= count;
+}
+
+void espnow_backlog_sent(espnow_backlog_t* b, uint16_t seq, uint8_t used, uint8_t answered) {
+    b->pending_seq = seq;
+    b->pending = answered ? 0 : used;
+}
+
+size_t espnow_backlog_encode(const espnow_backlog_t* b, espnow_delta_tx_t* tx, uint8_t* buf, const espnow_backlog_sample_t* sample,
+                             uint16_t count, uint32_t now_ms, uint8_t* used) {
+    espnow_measure_t measure[ESPNOW_BACKLOG_BATCH];
+    uint32_t age[ESPNOW_BACKLOG_BATCH];
+    uint8_t ages[ESPNOW_PROTO_MAX_LEN];
+    uint8_t n = count < ESPNOW_BACKLOG_BATCH ? count : ESPNOW_BACKLOG_BATCH;
+
+    if ( b->pending && n > b->pending ) {
+        n = b->pending;
+    }
+
+    for ( uint8_t i = 0; i < n; i++ ) {
+        measure[i] = sample[i].measure;
+        // rounded to the second, wraps are fine up to 24 days
+        int32_t age_ms = (int32_t)( now_ms - sample[i].ts );
+        age[i] = age_ms > 0 ? ( (uint32_t)age_ms + 500 ) / 1000 : 0;
+    }
+    // the first batch that fits, a quarter less each time
+    while ( n ) {
+        size_t len = tx != NULL ? espnow_delta_tx_encode(tx, buf, measure, n) :
+                     n <= ESPNOW_DATA_MAX_MEASURES ? espnow_proto_data(buf, 0, measure, n) : 0;
+        if ( len && age[0] == 0 ) {
+            *used = n;
+            return len;
+        }
+        size_t alen = len ? espnow_proto_ages_put(ages, sizeof(ages), age, n) : 0;
+        size_t with = alen ? espnow_proto_opt_add(buf, len, ESPNOW_OPT_AGES, ages, (uint8_t)alen) : 0;
+        if ( with ) {
+            *used = n;
+            return with;
+        }
+        n = n > 4 ? n - n / 4 : n - 1;
+    }
+    *used = 0;
+    return 0;
+}
@@ -1,10 +1,32 @@
 #include "espnow_comp.h"
+#include "esp_idf_version.h"
+#include "metrics.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 uint8_t NULL_MAC_ADDR[ESP_NOW_ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
 uint8_t BROADCAST_MAC_ADDR[ESP_NOW_ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
 static const char *TAG = "espnow_comp";
 
+static const wifi_phy_rate_t phy_rate[ESPNOW_RATE_MAX] = {
+    [ESPNOW_RATE_24M]       = WIFI_PHY_RATE_24M,
+    [ESPNOW_RATE_12M]       = WIFI_PHY_RATE_12M,
+    [ESPNOW_RATE_6M]        = WIFI_PHY_RATE_6M,
+    [ESPNOW_RATE_1M]        = WIFI_PHY_RATE_1M_L,
+    [ESPNOW_RATE_LR_500K]   = WIFI_PHY_RATE_LORA_500K,
+    [ESPNOW_RATE_LR_250K]   = WIFI_PHY_RATE_LORA_250K,
+};
+
+// the esp-now rate is one for the interface, set then send go together
+static SemaphoreHandle_t    send_lock = NULL;
+static uint8_t              send_rate = ESPNOW_RATE_BASE;
+
+METRICS_COUNTER(espnow_tx, "espnow.tx");
+METRICS_COUNTER(espnow_tx_errors, "espnow.tx_errors");
+METRICS_COUNTER(espnow_rate_errors, "espnow.rate_errors");
+METRICS_HISTOGRAM(espnow_tx_len, "espnow.tx_len", 16, 32, 64, 128, 200);
+
 
 inline uint8_t espnow_is_null_addr(uint8_t* addr) {
     return (memcmp(addr, NULL_MAC_ADDR, ESP_NOW_ETH_ALEN) == 0);
@@ -14,6 +36,38 @@ inline uint8_t espnow_is_broadcast_addr(uint8_t* addr) {
     return (memcmp(addr, BROADCAST_MAC_ADDR, ESP_NOW_ETH_ALEN) == 0);   
 }
 
+static esp_err_t espnow_start(const wifi_init_config_t* cfg, esp_now_send_cb_t send_cb, esp_now_recv_cb_t recv_cb, uint8_t* addr) {
+    ESP_ERROR_CHECK( esp_wifi_init(cfg) );
+    ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
+    ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
+    ESP_ERROR_CHECK( esp_wifi_start());
+#if ESPNOW_RATE_LONG_RANGE
+    // long range on top of b/g/n, peers at the other rates are still heard
+    ESP_ERROR_CHECK( esp_wifi_set_protocol(ESP_IF_WIFI_STA,
+        WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | WIFI_PROTOCOL_LR) );
+#endif
+    ESP_ERROR_CHECK( espnow_set_channel(ESPNOW_CHANNEL) );
+    espnow_node_mark(ESPNOW_PHASE_WIFI);
+
+    /* Initialize ESPNOW and register sending and receiving callback function. */
+    if ( send_lock == NULL ) {
+        send_lock = xSemaphoreCreateMutex();
+        if ( send_lock == NULL ) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    send_rate = ESPNOW_RATE_BASE;
+    ESP_ERROR_CHECK( esp_now_init() );
+    if ( send_cb != NULL ) ESP_ERROR_CHECK( esp_now_register_send_cb(send_cb) );
+    if ( recv_cb != NULL ) ESP_ERROR_CHECK( esp_now_register_recv_cb(recv_cb) );
+
+    ESP_ERROR_CHECK( espnow_peer_init() );
+    ESP_ERROR_CHECK( espnow_add_peer(BROADCAST_MAC_ADDR) );
+    if ( addr != NULL ) ESP_ERROR_CHECK( espnow_add_peer(addr));
+    espnow_node_mark(ESPNOW_PHASE_ESPNOW);
+    return ESP_OK;
+}
+
 esp_err_t espnow_init(esp_now_send_cb_t send_cb, esp_now_recv_cb_t recv_cb, uint8_t* addr) {
     ESP_LOGV(TAG, "espnow_init");
 
@@ -25,24 +79,81 @@ esp_err_t espnow_init(esp_now_send_cb_t send_cb, esp_now_recv_cb_t recv_cb, uint
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
-    ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
-    ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK( esp_wifi_start());
+    return espnow_start(&cfg, send_cb, recv_cb, addr);
+}
 
-    /* Initialize ESPNOW and register sending and receiving callback function. */
-    ESP_ERROR_CHECK( esp_now_init() );
-    if ( send_cb != NULL ) ESP_ERROR_CHECK( esp_now_register_send_cb(send_cb) );
-    if ( recv_cb != NULL ) ESP_ERROR_CHECK( esp_now_register_recv_cb(recv_cb) );
+/* Nothing on a node listens to wifi events nor uses ip, so no netif and no
+ * default event loop (the driver events are dropped), no wifi config in
+ * nvs and no ampdu. The phy takes its calibration from nvs
+ * (CONFIG_ESP32_PHY_CALIBRATION_AND_DATA_STORAGE) and skips it entirely
+ * after a deep sleep: the nvs partition must be initialized first. */
+esp_err_t espnow_init_fast(esp_now_send_cb_t send_cb, esp_now_recv_cb_t recv_cb) {
+    ESP_LOGV(TAG, "espnow_init_fast");
 
-    ESP_ERROR_CHECK( espnow_add_peer(BROADCAST_MAC_ADDR) );
-    if ( addr != NULL ) ESP_ERROR_CHECK( espnow_add_peer(addr));
-    return ESP_OK;
+    if ( send_cb == NULL && recv_cb == NULL ) {
+        ESP_LOGE(TAG, "both cb function are nulls");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    cfg.nvs_enable = 0;
+    cfg.ampdu_rx_enable = 0;
+    cfg.ampdu_tx_enable = 0;
+    return espnow_start(&cfg, send_cb, recv_cb, NULL);
 }
 
 esp_err_t espnow_done() {
     ESP_LOGV(TAG, "espnow_done");
-    return ESP_OK;
+    return espnow_peer_done();
+}
+
+esp_err_t espnow_set_channel(uint8_t channel) {
+    if ( channel == espnow_get_channel() ) {
+        return ESP_OK;
+    }
+    ESP_LOGD(TAG, "channel %d", channel);
+    return esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+}
+
+/* esp_wifi_set_ps() only lets the modem sleep while associated to an AP
+ * (idf 4.x, the esp-now wake window came with 5.0): an esp-now station
+ * keeps its receiver on, some 95 mA on the esp32 against under 1 mA in
+ * light sleep by the datasheet. esp_wifi_stop() turns the rf off, esp-now
+ * and its peers stay, esp_wifi_start() comes back on the default channel
+ * and rate. */
+static uint8_t radio_channel = 0;
+
+esp_err_t espnow_radio_off() {
+    radio_channel = espnow_get_channel();
+    return esp_wifi_stop();
+}
+
+esp_err_t espnow_radio_on() {
+    esp_err_t ret = esp_wifi_start();
+
+    if ( ret != ESP_OK ) {
+        return ret;
+    }
+    if ( send_lock != NULL ) {
+        xSemaphoreTake(send_lock, portMAX_DELAY);
+    }
+    ret = esp_wifi_config_espnow_rate(ESP_IF_WIFI_STA, phy_rate[ESPNOW_RATE_BASE]);
+    send_rate = ESPNOW_RATE_BASE;
+    if ( send_lock != NULL ) {
+        xSemaphoreGive(send_lock);
+    }
+    if ( ret != ESP_OK ) {
+        return ret;
+    }
+    return espnow_set_channel(radio_channel ? radio_channel : ESPNOW_CHANNEL);
+}
+
+uint8_t espnow_get_channel() {
+    uint8_t            channel = 0;
+    wifi_second_chan_t second;
+
+    esp_wifi_get_channel(&channel, &second);
+    return channel;
 }
 
 esp_err_t espnow_add_peer(uint8_t* addr) {
@@ -50,18 +161,14 @@ esp_err_t espnow_add_peer(uint8_t* addr) {
 
     esp_err_t ret = ESP_OK;
     if ( esp_now_is_peer_exist(addr)  == false ) {
-        esp_now_peer_info_t *peer = malloc(sizeof(esp_now_peer_info_t));
-        if (peer == NULL) {
-            ESP_LOGE(TAG, "malloc peer information fail");
-            return ESP_FAIL;
-        }
-        memset(peer, 0, sizeof(esp_now_peer_info_t));
-        peer->channel = CONFIG_ESPNOW_CHANNEL;
-        peer->ifidx = ESP_IF_WIFI_STA;
-        peer->encrypt = false;
-        memcpy(peer->peer_addr, addr, ESP_NOW_ETH_ALEN);
-        ret =  esp_now_add_peer(peer);
-        free(peer);
+        esp_now_peer_info_t peer;
+        memset(&peer, 0, sizeof(esp_now_peer_info_t));
+        // 0: current channel, peers move with the node during a scan
+        peer.channel = 0;
+        peer.ifidx = ESP_IF_WIFI_STA;
+        peer.encrypt = false;
+        memcpy(peer.peer_addr, addr, ESP_NOW_ETH_ALEN);
+        ret =  esp_now_add_peer(&peer);
         ESP_LOGD(TAG, "peer added");
     }
     else {
@@ -70,3 +177,82 @@ esp_err_t espnow_add_peer(uint8_t* addr) {
     return ret;
 }
 
+/* The receive callback of idf 4.x gets no rx info, but its data points
+ * into the rx buffer of the driver, laid out as a promiscuous packet:
+ *
+ *   wifi_pkt_rx_ctrl_t | 802.11 header (24) | category (1) oui (3)
+ *   random (4) | element id (1) len (1) oui (3) type (1) version (1) | data
+ *
+ * Nothing documents it: the length the rx_ctrl header gives must match
+ * the frame (with or without its 4 bytes fcs), else the rssi is unknown.
+ * idf 5 gives esp_now_recv_info_t to the callback, and a new signature to
+ * every receive callback of the tree. */
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#error "esp-now receive callbacks and espnow_rx_rssi() need porting to esp_now_recv_info_t"
+#endif
+
+#define ESPNOW_RX_HDR_LEN   39
+#define ESPNOW_RX_FCS_LEN   4
+
+int8_t espnow_rx_rssi(const uint8_t* data, int len) {
+    const wifi_promiscuous_pkt_t* pkt = (const wifi_promiscuous_pkt_t*)( data - ESPNOW_RX_HDR_LEN - sizeof(wifi_pkt_rx_ctrl_t) );
+    int extra = (int)pkt->rx_ctrl.sig_len - ESPNOW_RX_HDR_LEN - len;
+
+    if ( ( extra != 0 && extra != ESPNOW_RX_FCS_LEN ) || pkt->rx_ctrl.rssi >= 0 ) {
+        return 0;
+    }
+    return (int8_t)pkt->rx_ctrl.rssi;
+}
+
+
+/* The driver takes the rate in force when the frame goes on air: frames
+ * still queued may leave at the rate set for the next one, their status
+ * then counts for the wrong rate once in a while. */
+esp_err_t espnow_send_at(const uint8_t* addr, const uint8_t* data, size_t len, uint8_t rate) {
+    esp_err_t ret = ESP_OK;
+
+    metrics_inc(&espnow_tx);
+    metrics_observe(&espnow_tx_len, (int32_t)len);
+    if ( send_lock == NULL ) {
+        ret = esp_now_send(addr, data, len);
+    }
+    else {
+        xSemaphoreTake(send_lock, portMAX_DELAY);
+        if ( rate != send_rate && rate < ESPNOW_RATE_MAX ) {
+            ret = esp_wifi_config_espnow_rate(ESP_IF_WIFI_STA, phy_rate[rate]);
+            if ( ret == ESP_OK ) {
+                send_rate = rate;
+            }
+            else {
+                metrics_inc(&espnow_rate_errors);
+                ESP_LOGW(TAG, "rate %s not set (%d)", espnow_rate_name(rate), ret);
+            }
+        }
+        ret = esp_now_send(addr, data, len);
+        xSemaphoreGive(send_lock);
+    }
+    if ( ret != ESP_OK ) {
+        metrics_inc(&espnow_tx_errors);
+    }
+    return ret;
+}
+
+/* Unicast to a sensor, the peer cache swaps it into the driver if needed
+ * and keeps its rate. */
+static esp_err_t espnow_transport_esp_send(void* ctx, const uint8_t* addr, const uint8_t* data, size_t len) {
+    uint8_t rate = ESPNOW_RATE_BASE;
+
+    if ( !espnow_is_broadcast_addr((uint8_t*)addr) ) {
+        esp_err_t ret = espnow_peer_touch(addr);
+        if ( ret != ESP_OK ) {
+            return ret;
+        }
+        rate = espnow_peer_rate(addr, len);
+    }
+    return espnow_send_at(addr, data, len, rate);
+}
+
+const espnow_transport_t espnow_transport_esp = {
+    .send = espnow_transport_esp_send,
+    .ctx = NULL
+};
@@ -0,0 +1,113 @@
+#include "espnow_config.h"
+#include <string.h>
+
+typedef struct {
+    const char* name;
+    uint32_t    def;
+    uint32_t    min;
+    uint32_t    max;
+} espnow_config_range_t;
+
+static const espnow_config_range_t ranges[ESPNOW_CFG_COUNT] = {
+    [ESPNOW_CFG_PERIOD_S]   = { "period_s", 30, 1, 86400 },
+    [ESPNOW_CFG_OSRS_T]     = { "osrs_t", 1, 0, 4 },
+    [ESPNOW_CFG_OSRS_H]     = { "osrs_h", 1, 0, 4 },
+    [ESPNOW_CFG_OSRS_P]     = { "osrs_p", 1, 0, 4 },
+    [ESPNOW_CFG_FILTER]     = { "filter", 0, 0, 4 },
+    [ESPNOW_CFG_BATCH]      = { "batch", 1, 1, 32 },
+    [ESPNOW_CFG_DEADBAND_T] = { "deadband_t", 0, 0, 10000 },
+    [ESPNOW_CFG_DEADBAND_H] = { "deadband_h", 0, 0, 10000 },
+    [ESPNOW_CFG_DEADBAND_P] = { "deadband_p", 0, 0, 10000 },
+    [ESPNOW_CFG_HEARTBEAT_S] = { "heartbeat_s", 3600, 1, 604800 },
+    [ESPNOW_CFG_LIGHT_SLEEP] = { "light_sleep", 0, 0, 1 },
+    [ESPNOW_CFG_LIGHT_PERIOD_MS] = { "light_period_ms", 1000, 20, 60000 },
+};
+
+// the keys that differ from the defaults
+static size_t espnow_config_keys(const espnow_config_t* cfg, uint8_t* buf, size_t room) {
+    size_t len = 0;
+
+    for ( uint8_t key = 1; key < ESPNOW_CFG_COUNT; key++ ) {
+        if ( cfg->value[key] == ranges[key].def ) {
+            continue;
+        }
+        if ( len == room ) {
+            return 0;
+        }
+        buf[len++] = key;
+        // values stay under 2^31, the zigzag only costs a bit
+        size_t used = espnow_proto_varint_put(buf + len, room - len, (int32_t)cfg->value[key]);
+        if ( used == 0 ) {
+            return 0;
+        }
+        len += used;
+    }
+    return len;
+}
+
+static void espnow_config_seal(espnow_config_t* cfg) {
+    uint8_t buf[ESPNOW_CONFIG_MAX_LEN];
+    size_t len = espnow_config_keys(cfg, buf, sizeof(buf));
+
+    cfg->version = len ? espnow_proto_crc16(buf, len) : 0;
+    if ( len && cfg->version == 0 ) {
+        cfg->version = 1;
+    }
+}
+
+void espnow_config_default(espnow_config_t* cfg) {
+    memset(cfg, 0, sizeof(espnow_config_t));
+    for ( uint8_t key = 1; key < ESPNOW_CFG_COUNT; key++ ) {
+        cfg->value[key] = ranges[key].def;
+    }
+}
+
+esp_err_t espnow_config_set(espnow_config_t* cfg, uint8_t key, uint32_t value) {
+    if ( key == 0 || key >= ESPNOW_CFG_COUNT || value < ranges[key].min || value > ranges[key].max ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    cfg->value[key] = value;
+    espnow_config_seal(cfg);
+    return ESP_OK;
+}
+
+const char* espnow_config_key_name(uint8_t key) {
+    return key && key < ESPNOW_CFG_COUNT ? ranges[key].name : "?";
+}
+
+size_t espnow_config_put(const espnow_config_t* cfg, uint8_t* buf, size_t room) {
+    if ( room < 2 ) {
+        return 0;
+    }
+    buf[0] = (uint8_t)( cfg->version & 0xff );
+    buf[1] = (uint8_t)( cfg->version >> 8 );
+    size_t len = espnow_config_keys(cfg, buf + 2, room - 2);
+    return len || cfg->version == 0 ? len + 2 : 0;
+}
+
+esp_err_t espnow_config_get(espnow_config_t* cfg, const uint8_t* value, size_t len) {
+    espnow_config_t c;
+    size_t pos = 2;
+
+    if ( len < 2 ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    espnow_config_default(&c);
+    c.version = (uint16_t)( value[0] | ( value[1] << 8 ) );
+    while ( pos < len ) {
+        uint8_t key = value[pos++];
+        int32_t v;
+        size_t used = espnow_proto_varint_get(value + pos, len - pos, &v);
+        if ( used == 0 ) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        pos += used;
+        if ( key == 0 || key >= ESPNOW_CFG_COUNT ) {
+            continue;
+        }
+        uint32_t u = v < 0 ? 0 : (uint32_t)v;
+        c.value[key] = u < ranges[key].min ? ranges[key].min : u > ranges[key].max ? ranges[key].max : u;
+    }
+    memcpy(cfg, &c, sizeof(espnow_config_t));
+    return ESP_OK;
+}
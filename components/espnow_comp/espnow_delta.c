@@ -0,0 +1,56 @@
+#include "espnow_delta.h"
+#include <string.h>
+
+void espnow_delta_tx_reset(espnow_delta_tx_t* tx) {
+    memset(tx, 0, sizeof(espnow_delta_tx_t));
+}
+
+size_t espnow_delta_tx_encode(espnow_delta_tx_t* tx, uint8_t* buf, const espnow_measure_t* measure, uint8_t count) {
+    if ( count == 0 ) {
+        return 0;
+    }
+    uint8_t key = !tx->valid || tx->since_key + 1 >= ESPNOW_DELTA_KEYFRAME_INTERVAL;
+
+    // seq is set by the link
+    size_t len = espnow_proto_data_delta(buf, 0, key ? NULL : &tx->ref, tx->ref_seq, measure, count);
+    if ( len ) {
+        tx->pending = measure[count - 1];
+        tx->pending_key = key;
+    }
+    return len;
+}
+
+void espnow_delta_tx_done(espnow_delta_tx_t* tx, uint16_t seq, int status) {
+    if ( status == ESPNOW_ACK_OK ) {
+        tx->ref = tx->pending;
+        tx->ref_seq = seq;
+        tx->valid = 1;
+        tx->since_key = tx->pending_key ? 0 : tx->since_key + 1;
+    }
+    else if ( status == ESPNOW_ACK_RESYNC ) {
+        tx->valid = 0;
+    }
+    // no ack: the master may or may not have the frame, it keeps both references
+}
+
+const espnow_measure_t* espnow_delta_rx_ref(const espnow_delta_rx_t* rx, uint16_t ref_seq) {
+    for ( uint8_t i = 0; i < rx->count; i++ ) {
+        if ( rx->seq[i] == ref_seq ) {
+            return &rx->ref[i];
+        }
+    }
+    return NULL;
+}
+
+void espnow_delta_rx_push(espnow_delta_rx_t* rx, uint16_t seq, const espnow_measure_t* last) {
+    // a retransmission replaces the newest entry instead of pushing the older one out
+    if ( rx->count == 0 || rx->seq[0] != seq ) {
+        rx->ref[1] = rx->ref[0];
+        rx->seq[1] = rx->seq[0];
+        if ( rx->count < 2 ) {
+            rx->count++;
+        }
+    }
+    rx->ref[0] = *last;
+    rx->seq[0] = seq;
+}
@@ -0,0 +1,458 @@
+#include "espnow_link.h"
+#include "espnow_proto.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include <string.h>
+
+// scan_channel values besides real channels
+#define ESPNOW_LINK_SCAN_HINT       0
+#define ESPNOW_LINK_SCAN_BACKOFF    0xff
+
+static const char *TAG = "espnow_link";
+
+static const uint8_t broadcast_addr[ESPNOW_PROTO_ADDR_LEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static inline uint16_t espnow_link_crc(const espnow_link_cache_t* cache) {
+    return espnow_proto_crc16((const uint8_t*)cache, offsetof(espnow_link_cache_t, crc));
+}
+
+void espnow_link_cache_seal(espnow_link_cache_t* cache) {
+    cache->crc = espnow_link_crc(cache);
+}
+
+uint8_t espnow_link_cache_is_valid(const espnow_link_cache_t* cache) {
+    return cache->valid && cache->crc == espnow_link_crc(cache);
+}
+
+void espnow_link_init(espnow_link_t* link, espnow_link_cache_t* cache) {
+    memset(link, 0, sizeof(espnow_link_t));
+    link->cache = cache;
+
+    // power on: rtc memory holds garbage, start from an empty cache
+    if ( cache->crc != espnow_link_crc(cache) ) {
+        memset(cache, 0, sizeof(espnow_link_cache_t));
+        espnow_link_cache_seal(cache);
+    }
+}
+
+uint8_t espnow_link_is_valid(const espnow_link_t* link) {
+    return espnow_link_cache_is_valid(link->cache);
+}
+
+const uint8_t* espnow_link_master(const espnow_link_t* link) {
+    return link->cache->master;
+}
+
+uint8_t espnow_link_channel(const espnow_link_t* link) {
+    return link->cache->channel;
+}
+
+uint32_t espnow_link_token(const espnow_link_t* link) {
+    return espnow_link_is_valid(link) ? link->cache->token : 0;
+}
+
+uint16_t espnow_link_next_seq(espnow_link_t* link) {
+    uint16_t seq = ++link->cache->seq;
+
+    espnow_link_cache_seal(link->cache);
+    return seq;
+}
+
+esp_err_t espnow_link_set_master(espnow_link_t* link, const uint8_t* master, uint8_t channel, uint32_t token) {
+    ESP_LOGV(TAG, "espnow_link_set_master");
+
+    if ( master == NULL || channel < ESPNOW_LINK_MIN_CHANNEL || channel > ESPNOW_LINK_MAX_CHANNEL ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    espnow_link_cache_t* cache = link->cache;
+    memcpy(cache->master, master, ESPNOW_PROTO_ADDR_LEN);
+    cache->channel = channel;
+    cache->token = token;
+    cache->ack_failures = 0;
+    cache->discover_failures = 0;
+    cache->delivery = UINT8_MAX;
+    cache->rssi = 0;
+    // alternates come with the answers of the new master
+    cache->alt_count = 0;
+    cache->valid = 1;
+    espnow_link_cache_seal(cache);
+    return ESP_OK;
+}
+
+uint8_t espnow_link_score(uint8_t delivery, int8_t rssi) {
+    int32_t score = delivery;
+
+    if ( rssi && rssi < ESPNOW_LINK_GOOD_RSSI ) {
+        score -= ( ESPNOW_LINK_GOOD_RSSI - rssi ) * 4;
+    }
+    return score < 0 ? 0 : (uint8_t)score;
+}
+
+static inline uint8_t espnow_link_delivery(uint8_t delivery, uint8_t ok) {
+    int32_t sample = ok ? UINT8_MAX : 0;
+
+    return (uint8_t)( delivery + ( ( sample - (int32_t)delivery ) >> ESPNOW_LINK_DELIVERY_SHIFT ) );
+}
+
+void espnow_link_rssi(espnow_link_t* link, int8_t rssi) {
+    if ( espnow_link_is_valid(link) ) {
+        link->cache->rssi = rssi;
+        espnow_link_cache_seal(link->cache);
+    }
+}
+
+/* The master tells which other masters serve its nodes, the alternates
+ * follow that list and keep the score of the ones already known. */
+static void espnow_link_learn_masters(espnow_link_t* link, const uint8_t* data, size_t len) {
+    espnow_link_cache_t* cache = link->cache;
+    espnow_link_peer_t   alt[ESPNOW_LINK_ALTERNATES];
+    uint8_t              count = 0;
+    uint8_t              vlen = 0;
+    const uint8_t*       opt = espnow_proto_opt_find(data, len, ESPNOW_OPT_MASTERS, &vlen);
+
+    if ( opt == NULL ) {
+        return;
+    }
+    for ( size_t pos = 0; pos + sizeof(espnow_master_info_t) <= vlen && count < ESPNOW_LINK_ALTERNATES; pos += sizeof(espnow_master_info_t) ) {
+        espnow_master_info_t info;
+        memcpy(&info, opt + pos, sizeof(espnow_master_info_t));
+        if ( memcmp(info.addr, cache->master, ESPNOW_PROTO_ADDR_LEN) == 0 ) {
+            continue;
+        }
+
+        espnow_link_peer_t* p = &alt[count++];
+        memset(p, 0, sizeof(espnow_link_peer_t));
+        memcpy(p->addr, info.addr, ESPNOW_PROTO_ADDR_LEN);
+        p->delivery = ESPNOW_LINK_DELIVERY_NEW;
+        for ( uint8_t i = 0; i < cache->alt_count; i++ ) {
+            if ( memcmp(cache->alt[i].addr, info.addr, ESPNOW_PROTO_ADDR_LEN) == 0 ) {
+                *p = cache->alt[i];
+            }
+        }
+        p->channel = info.channel ? info.channel : cache->channel;
+    }
+    memcpy(cache->alt, alt, count * sizeof(espnow_link_peer_t));
+    cache->alt_count = count;
+    espnow_link_cache_seal(cache);
+}
+
+// after a missed ack, the best scored alternate becomes the master, 0 without any
+static uint8_t espnow_link_failover(espnow_link_t* link) {
+    espnow_link_cache_t* cache = link->cache;
+    uint8_t              best = 0;
+
+    if ( !espnow_link_is_valid(link) || cache->alt_count == 0 ) {
+        return 0;
+    }
+    // the miss counts against the master left behind
+    cache->delivery = espnow_link_delivery(cache->delivery, 0);
+    for ( uint8_t i = 1; i < cache->alt_count; i++ ) {
+        if ( espnow_link_score(cache->alt[i].delivery, cache->alt[i].rssi) >
+             espnow_link_score(cache->alt[best].delivery, cache->alt[best].rssi) ) {
+            best = i;
+        }
+    }
+
+    espnow_link_peer_t next = cache->alt[best];
+    espnow_link_peer_t* prev = &cache->alt[best];
+
+    memcpy(prev->addr, cache->master, ESPNOW_PROTO_ADDR_LEN);
+    prev->channel = cache->channel;
+    prev->delivery = cache->delivery;
+    prev->rssi = cache->rssi;
+    prev->token = cache->token;
+    memcpy(cache->master, next.addr, ESPNOW_PROTO_ADDR_LEN);
+    cache->channel = next.channel;
+    cache->delivery = next.delivery;
+    cache->rssi = next.rssi;
+    cache->token = next.token;
+    espnow_link_cache_seal(cache);
+    link->failovers++;
+    ESP_LOGW(TAG, "failover to master %02x:%02x:%02x:%02x:%02x:%02x on channel %d",
+        next.addr[0], next.addr[1], next.addr[2], next.addr[3], next.addr[4], next.addr[5], next.channel);
+    return 1;
+}
+
+void espnow_link_invalidate(espnow_link_t* link) {
+    ESP_LOGV(TAG, "espnow_link_invalidate");
+
+    espnow_link_cache_t* cache = link->cache;
+    uint8_t  channel = cache->channel;
+    uint16_t seq = cache->seq;
+    uint8_t  discover_failures = espnow_link_is_valid(link) ? 0 : cache->discover_failures;
+
+    memset(cache, 0, sizeof(espnow_link_cache_t));
+    cache->channel = channel;
+    cache->seq = seq;
+    cache->discover_failures = discover_failures;
+    espnow_link_cache_seal(cache);
+}
+
+void espnow_link_ack(espnow_link_t* link, uint8_t ok, uint32_t token) {
+    espnow_link_cache_t* cache = link->cache;
+
+    if ( !espnow_link_is_valid(link) ) {
+        return;
+    }
+    cache->delivery = espnow_link_delivery(cache->delivery, ok);
+    if ( ok ) {
+        // first ack of a master taken over from the alternates
+        if ( token != cache->token && cache->token ) {
+            ESP_LOGI(TAG, "master token changed (%08x -> %08x), master rebooted", cache->token, token);
+        }
+        cache->token = token;
+        cache->ack_failures = 0;
+        espnow_link_cache_seal(cache);
+        return;
+    }
+
+    cache->ack_failures++;
+    ESP_LOGW(TAG, "no ack from master (%d / %d)", cache->ack_failures, ESPNOW_LINK_ACK_FAILURES);
+    if ( cache->ack_failures >= ESPNOW_LINK_ACK_FAILURES ) {
+        espnow_link_invalidate(link);
+    }
+    else {
+        espnow_link_cache_seal(cache);
+    }
+}
+
+static uint32_t espnow_link_backoff_ms(uint8_t attempt) {
+    uint32_t delay = ESPNOW_LINK_BACKOFF_BASE_MS << ( attempt < 8 ? attempt : 8 );
+
+    return delay > ESPNOW_LINK_BACKOFF_MAX_MS ? ESPNOW_LINK_BACKOFF_MAX_MS : delay;
+}
+
+uint32_t espnow_link_discover_delay_ms(uint8_t attempt) {
+    uint32_t delay = espnow_link_backoff_ms(attempt);
+
+    // +/- 25% jitter so nodes woken together do not retry together
+    return delay - delay / 4 + esp_random() % ( delay / 2 + 1 );
+}
+
+uint32_t espnow_link_join_max_ms() {
+    uint32_t max_ms = 0;
+
+    for ( uint8_t attempt = 0; attempt < ESPNOW_LINK_DISCOVER_ATTEMPTS; attempt++ ) {
+        uint32_t delay = espnow_link_backoff_ms(attempt);
+        uint32_t jittered = delay - delay / 4 + delay / 2;
+        uint32_t channels = ESPNOW_LINK_MAX_CHANNEL - ESPNOW_LINK_MIN_CHANNEL + 1;
+        // a sweep probes the cached channel for the delay then dwells on the
+        // others, or dwells on them all without one
+        uint32_t sweep_ms = jittered + ( channels - 1 ) * ESPNOW_LINK_SCAN_DWELL_MS;
+        if ( sweep_ms < channels * ESPNOW_LINK_SCAN_DWELL_MS ) {
+            sweep_ms = channels * ESPNOW_LINK_SCAN_DWELL_MS;
+        }
+        // the sweeps after the first start with a backoff of the same delay
+        max_ms += sweep_ms + ( attempt ? jittered : 0 );
+    }
+    return max_ms;
+}
+
+uint32_t espnow_link_sleep_factor(const espnow_link_t* link) {
+    uint32_t factor = 1;
+
+    // not initialized, no join this wake
+    if ( link->cache == NULL ) {
+        return factor;
+    }
+    for ( uint8_t i = 0; i < link->cache->discover_failures && factor < ESPNOW_LINK_SLEEP_FACTOR_MAX; i++ ) {
+        factor <<= 1;
+    }
+    return factor;
+}
+
+static inline uint8_t espnow_link_hint(const espnow_link_t* link) {
+    uint8_t channel = link->cache->channel;
+
+    return ( channel >= ESPNOW_LINK_MIN_CHANNEL && channel <= ESPNOW_LINK_MAX_CHANNEL ) ? channel : 0;
+}
+
+static inline uint8_t espnow_link_probe_channel(const espnow_link_t* link) {
+    return link->scan_channel == ESPNOW_LINK_SCAN_HINT ? espnow_link_hint(link) : link->scan_channel;
+}
+
+static inline void espnow_link_wait(espnow_link_action_t* act, uint32_t wait_ms) {
+    memset(act, 0, sizeof(espnow_link_action_t));
+    act->wait_ms = wait_ms;
+}
+
+static inline void espnow_link_emit(espnow_link_t* link, const uint8_t* dest, uint8_t channel, uint32_t wait_ms, espnow_link_action_t* act) {
+    memcpy(act->dest, dest, ESPNOW_PROTO_ADDR_LEN);
+    act->channel = channel;
+    act->frame = link->frame;
+    act->len = link->frame_len;
+    act->wait_ms = wait_ms;
+    link->probes++;
+}
+
+static espnow_link_state_t espnow_link_probe(espnow_link_t* link, espnow_link_action_t* act) {
+    uint8_t  channel = espnow_link_probe_channel(link);
+    // the cached channel gets the full backoff delay, scanned ones a short dwell
+    uint32_t wait_ms = link->scan_channel == ESPNOW_LINK_SCAN_HINT ?
+        espnow_link_discover_delay_ms(link->attempt) : ESPNOW_LINK_SCAN_DWELL_MS;
+
+    link->seq = espnow_link_next_seq(link);
+    link->frame_len = espnow_proto_discover(link->frame, link->seq, espnow_link_token(link));
+    espnow_link_emit(link, broadcast_addr, channel, wait_ms, act);
+    return link->state;
+}
+
+static espnow_link_state_t espnow_link_fail(espnow_link_t* link, espnow_link_action_t* act) {
+    espnow_link_wait(act, 0);
+    link->state = ESPNOW_LINK_FAILED;
+    return link->state;
+}
+
+espnow_link_state_t espnow_link_join_start(espnow_link_t* link, espnow_link_action_t* act) {
+    ESP_LOGV(TAG, "espnow_link_join_start");
+
+    link->probes = 0;
+    link->attempt = 0;
+    link->ack_len = 0;
+    if ( espnow_link_is_valid(link) ) {
+        espnow_link_wait(act, 0);
+        act->channel = link->cache->channel;
+        link->state = ESPNOW_LINK_DONE;
+        return link->state;
+    }
+    link->state = ESPNOW_LINK_JOINING;
+    link->scan_channel = espnow_link_hint(link) ? ESPNOW_LINK_SCAN_HINT : ESPNOW_LINK_MIN_CHANNEL;
+    return espnow_link_probe(link, act);
+}
+
+static espnow_link_state_t espnow_link_send(espnow_link_t* link, const uint8_t* frame, size_t len, int32_t seq, espnow_link_action_t* act) {
+    // taken even if nothing goes out, the caller keeps it for the resend
+    link->seq = seq < 0 ? espnow_link_next_seq(link) : (uint16_t)seq;
+    if ( !espnow_link_is_valid(link) || frame == NULL || len < sizeof(espnow_hdr_t) || len > ESPNOW_PROTO_MAX_LEN ) {
+        return espnow_link_fail(link, act);
+    }
+    link->probes = 0;
+    link->retries = 0;
+    link->failovers = 0;
+    link->ack_len = 0;
+    memcpy(link->frame, frame, len);
+    ((espnow_hdr_t*)link->frame)->seq = link->seq;
+    link->frame_len = len;
+    link->state = ESPNOW_LINK_SENDING;
+    espnow_link_emit(link, link->cache->master, link->cache->channel, ESPNOW_LINK_ACK_TIMEOUT_MS, act);
+    return link->state;
+}
+
+espnow_link_state_t espnow_link_send_start(espnow_link_t* link, const uint8_t* frame, size_t len, espnow_link_action_t* act) {
+    ESP_LOGV(TAG, "espnow_link_send_start");
+
+    return espnow_link_send(link, frame, len, -1, act);
+}
+
+espnow_link_state_t espnow_link_resend_start(espnow_link_t* link, const uint8_t* frame, size_t len, uint16_t seq, espnow_link_action_t* act) {
+    ESP_LOGV(TAG, "espnow_link_resend_start");
+
+    return espnow_link_send(link, frame, len, seq, act);
+}
+
+static espnow_link_state_t espnow_link_resend(espnow_link_t* link, espnow_link_action_t* act) {
+    if ( link->retries < ESPNOW_LINK_SEND_RETRIES ) {
+        link->retries++;
+        // one missed ack is enough, the retry goes to the best alternate
+        espnow_link_failover(link);
+        espnow_link_emit(link, link->cache->master, link->cache->channel, ESPNOW_LINK_ACK_TIMEOUT_MS, act);
+        return link->state;
+    }
+    espnow_link_ack(link, 0, 0);
+    return espnow_link_fail(link, act);
+}
+
+espnow_link_state_t espnow_link_on_frame(espnow_link_t* link, const uint8_t* mac, const uint8_t* data, size_t len, espnow_link_action_t* act) {
+    espnow_hdr_t hdr;
+    int type = espnow_proto_parse(data, len, &hdr);
+
+    espnow_link_wait(act, 0);
+    if ( link->state == ESPNOW_LINK_JOINING && type == ESPNOW_MSG_DISCOVER_REPLY ) {
+        const espnow_discover_reply_t* reply = (const espnow_discover_reply_t*)data;
+        uint8_t channel = reply->channel ? reply->channel : espnow_link_probe_channel(link);
+
+        uint8_t        vlen = 0;
+        const uint8_t* hops = espnow_proto_opt_find(data, len, ESPNOW_OPT_HOPS, &vlen);
+
+        // a relay no closer to the master than the caller was, maybe behind it
+        if ( link->max_hops && hops != NULL && vlen >= 1 && hops[0] >= link->max_hops ) {
+            return link->state;
+        }
+        // a reply for somebody else, or relayed for a master we cannot reach
+        if ( memcmp(reply->master, mac, ESPNOW_PROTO_ADDR_LEN) != 0 ||
+             espnow_link_set_master(link, mac, channel, reply->token) != ESP_OK ) {
+            return link->state;
+        }
+        link->ack_len = len < ESPNOW_PROTO_MAX_LEN ? len : ESPNOW_PROTO_MAX_LEN;
+        memcpy(link->ack, data, link->ack_len);
+        espnow_link_learn_masters(link, data, len);
+        ESP_LOGI(TAG, "master found on channel %d after %d probes", channel, link->probes);
+        act->channel = channel;
+        link->state = ESPNOW_LINK_DONE;
+        return link->state;
+    }
+    if ( link->state == ESPNOW_LINK_SENDING && type == ESPNOW_MSG_ACK && hdr.seq == link->seq &&
+         memcmp(mac, link->cache->master, ESPNOW_PROTO_ADDR_LEN) == 0 ) {
+        const espnow_ack_t* ack = (const espnow_ack_t*)data;
+
+        link->ack_len = len < ESPNOW_PROTO_MAX_LEN ? len : ESPNOW_PROTO_MAX_LEN;
+        memcpy(link->ack, data, link->ack_len);
+        // a resync request still proves the master is there
+        espnow_link_ack(link, ack->status != ESPNOW_ACK_ERROR, ack->token);
+        espnow_link_learn_masters(link, data, len);
+        act->channel = link->cache->channel;
+        link->state = ESPNOW_LINK_DONE;
+        return link->state;
+    }
+    // not for this exchange, keep the current deadline
+    return link->state;
+}
+
+espnow_link_state_t espnow_link_on_send_status(espnow_link_t* link, uint8_t ok, espnow_link_action_t* act) {
+    espnow_link_wait(act, 0);
+    // broadcast probes are never acknowledged by the mac layer
+    if ( link->state == ESPNOW_LINK_SENDING && !ok ) {
+        return espnow_link_resend(link, act);
+    }
+    return link->state;
+}
+
+espnow_link_state_t espnow_link_on_timeout(espnow_link_t* link, espnow_link_action_t* act) {
+    espnow_link_wait(act, 0);
+    if ( link->state == ESPNOW_LINK_SENDING ) {
+        return espnow_link_resend(link, act);
+    }
+    if ( link->state != ESPNOW_LINK_JOINING ) {
+        return link->state;
+    }
+
+    uint8_t hint = espnow_link_hint(link);
+
+    if ( link->scan_channel == ESPNOW_LINK_SCAN_BACKOFF ) {
+        link->scan_channel = hint ? ESPNOW_LINK_SCAN_HINT : ESPNOW_LINK_MIN_CHANNEL;
+        return espnow_link_probe(link, act);
+    }
+
+    // next channel of the sweep, the hint was already probed
+    uint8_t channel = link->scan_channel == ESPNOW_LINK_SCAN_HINT ? ESPNOW_LINK_MIN_CHANNEL : link->scan_channel + 1;
+    if ( channel == hint ) {
+        channel++;
+    }
+    if ( channel <= ESPNOW_LINK_MAX_CHANNEL ) {
+        link->scan_channel = channel;
+        return espnow_link_probe(link, act);
+    }
+
+    // full sweep without answer
+    if ( ++link->attempt >= ESPNOW_LINK_DISCOVER_ATTEMPTS ) {
+        ESP_LOGW(TAG, "no master on any channel after %d sweeps", link->attempt);
+        if ( link->cache->discover_failures < 0xff ) {
+            link->cache->discover_failures++;
+        }
+        espnow_link_cache_seal(link->cache);
+        return espnow_link_fail(link, act);
+    }
+    link->scan_channel = ESPNOW_LINK_SCAN_BACKOFF;
+    espnow_link_wait(act, espnow_link_discover_delay_ms(link->attempt));
+    return link->state;
+}
@@ -0,0 +1,136 @@
+#include "espnow_linkstat.h"
+#include <string.h>
+
+static const char* const names[ESPNOW_LINKSTAT_COUNT] = { "rssi", "gap", "dup", "interval", "jitter" };
+
+// upper bounds of the buckets but the last one
+static const int32_t bounds[ESPNOW_LINKSTAT_COUNT][ESPNOW_LINKSTAT_BUCKETS - 1] = {
+    [ESPNOW_LINKSTAT_RSSI]      = { -90, -80, -70, -60, -50 },
+    [ESPNOW_LINKSTAT_GAP]       = { 1, 2, 4, 8, 16 },
+    [ESPNOW_LINKSTAT_DUP]       = { 1, 2, 3, 4, 8 },
+    [ESPNOW_LINKSTAT_INTERVAL]  = { 1000, 10000, 30000, 60000, 300000 },
+    [ESPNOW_LINKSTAT_JITTER]    = { 10, 100, 1000, 5000, 30000 },
+};
+
+// a node needs that many data frames before its loss says anything
+#define ESPNOW_LINKSTAT_MIN_DATA    8
+
+static void espnow_linkstat_add(espnow_linkstat_t* s, espnow_linkstat_metric_t metric, int32_t sample) {
+    espnow_linkstat_value_t* v = &s->value[metric];
+    uint8_t first = 1;
+    uint8_t b = 0;
+
+    if ( sample > INT32_MAX / ESPNOW_LINKSTAT_SCALE ) {
+        sample = INT32_MAX / ESPNOW_LINKSTAT_SCALE;
+    }
+    while ( b < ESPNOW_LINKSTAT_BUCKETS - 1 && sample >= bounds[metric][b] ) {
+        b++;
+    }
+    for ( int i = 0; i < ESPNOW_LINKSTAT_BUCKETS; i++ ) {
+        if ( v->hist[i] ) {
+            first = 0;
+            break;
+        }
+    }
+    if ( v->hist[b] < UINT16_MAX ) {
+        v->hist[b]++;
+    }
+    sample *= ESPNOW_LINKSTAT_SCALE;
+    v->ewma = first ? sample : v->ewma + ( sample - v->ewma ) / ( 1 << ESPNOW_LINKSTAT_SHIFT );
+}
+
+void espnow_linkstat_reset(espnow_linkstat_t* s) {
+    memset(s, 0, sizeof(espnow_linkstat_t));
+}
+
+void espnow_linkstat_frame(espnow_linkstat_t* s, int8_t rssi, uint32_t now_ms) {
+    s->frames++;
+    s->last_ms = now_ms;
+    if ( rssi < 0 ) {
+        espnow_linkstat_add(s, ESPNOW_LINKSTAT_RSSI, rssi);
+    }
+}
+
+void espnow_linkstat_data(espnow_linkstat_t* s, uint16_t seq, espnow_linkstat_kind_t kind, uint32_t now_ms) {
+    if ( kind == ESPNOW_LINKSTAT_NEW && s->data && seq == s->seq ) {
+        kind = ESPNOW_LINKSTAT_COPY;
+    }
+    if ( kind == ESPNOW_LINKSTAT_COPY ) {
+        s->duplicates++;
+        if ( s->copies < UINT8_MAX ) {
+            s->copies++;
+        }
+        return;
+    }
+    uint8_t late = 0;
+    if ( kind == ESPNOW_LINKSTAT_NEW && ( s->data || s->rejoined ) ) {
+        uint16_t ahead = (uint16_t)( seq - s->seq );
+
+        if ( ahead >= 0x8000 ) {
+            // fills a gap counted already, or held by the node over its rejoin
+            late = 1;
+            if ( !s->rejoined && s->lost ) {
+                s->lost--;
+            }
+        }
+        else {
+            s->lost += ahead - 1;
+            espnow_linkstat_add(s, ESPNOW_LINKSTAT_GAP, ahead - 1);
+            s->rejoined = 0;
+        }
+    }
+    else {
+        s->rejoined = 0;
+    }
+    if ( s->data ) {
+        uint32_t interval = now_ms - s->data_ms;
+
+        espnow_linkstat_add(s, ESPNOW_LINKSTAT_DUP, s->copies);
+        espnow_linkstat_add(s, ESPNOW_LINKSTAT_INTERVAL, (int32_t)( interval > INT32_MAX ? INT32_MAX : interval ));
+        if ( s->interval_ms ) {
+            uint32_t change = interval > s->interval_ms ? interval - s->interval_ms : s->interval_ms - interval;
+            espnow_linkstat_add(s, ESPNOW_LINKSTAT_JITTER, (int32_t)( change > INT32_MAX ? INT32_MAX : change ));
+        }
+        s->interval_ms = interval ? interval : 1;
+    }
+    if ( !late ) {
+        s->seq = seq;
+    }
+    s->copies = 0;
+    s->data_ms = now_ms;
+    s->data++;
+}
+
+void espnow_linkstat_rejoin(espnow_linkstat_t* s, uint16_t seq) {
+    s->seq = seq;
+    s->rejoined = 1;
+}
+
+int32_t espnow_linkstat_bound(espnow_linkstat_metric_t metric, uint8_t bucket) {
+    return bucket < ESPNOW_LINKSTAT_BUCKETS - 1 ? bounds[metric][bucket] : INT32_MAX;
+}
+
+const char* espnow_linkstat_name(espnow_linkstat_metric_t metric) {
+    return metric < ESPNOW_LINKSTAT_COUNT ? names[metric] : "?";
+}
+
+uint32_t espnow_linkstat_loss(const espnow_linkstat_t* s) {
+    uint64_t total = (uint64_t)s->lost + s->data;
+
+    return total ? (uint32_t)( (uint64_t)s->lost * 1000 / total ) : 0;
+}
+
+uint8_t espnow_linkstat_weak(const espnow_linkstat_t* s) {
+    const espnow_linkstat_value_t* rssi = &s->value[ESPNOW_LINKSTAT_RSSI];
+
+    if ( rssi->ewma && rssi->ewma < ESPNOW_LINKSTAT_WEAK_RSSI * ESPNOW_LINKSTAT_SCALE ) {
+        return 1;
+    }
+    return s->data >= ESPNOW_LINKSTAT_MIN_DATA && espnow_linkstat_loss(s) > ESPNOW_LINKSTAT_WEAK_LOSS;
+}
+
+uint8_t espnow_linkstat_silent(const espnow_linkstat_t* s, uint32_t now_ms) {
+    int32_t interval = s->value[ESPNOW_LINKSTAT_INTERVAL].ewma / ESPNOW_LINKSTAT_SCALE;
+
+    return s->interval_ms && interval > 0 && now_ms - s->last_ms > (uint32_t)interval * ESPNOW_LINKSTAT_SILENT;
+}
@@ -0,0 +1,991 @@
+#include "espnow_comp.h"
+#include "espnow_node.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include <stdio.h>
+#include <sys/time.h>
+
+#define ESPNOW_NODE_QUEUE_SIZE  4
+#define ESPNOW_NODE_NVS_NS      "espnow"
+#define ESPNOW_NODE_NVS_KEY     "link"
+#define ESPNOW_NODE_NVS_SPILL   "espnow_bl"     // backlog chunks, "%u" keys
+#define ESPNOW_NODE_NVS_CONFIG  "config"
+#define ESPNOW_NODE_CHUNK_SIZE  ( ESPNOW_BACKLOG_SIZE / 2 )
+#define ESPNOW_NODE_START_STACK 4096
+#define ESPNOW_NODE_START_PRIO  5
+#define ESPNOW_NODE_RELAY_QUEUE 8
+#define ESPNOW_NODE_RELAY_STACK 4096
+#define ESPNOW_NODE_RELAY_PRIO  6
+#define ESPNOW_NODE_RELAY_SENT_MS   20      // send status of a relay frame
+#define ESPNOW_NODE_RELAY_JOIN_MS   10000   // between joins while no master answers
+#define ESPNOW_NODE_RATE_PEER       ESPNOW_RATE_MAX
+#define ESPNOW_NODE_TX_MAX      32          // frames in flight, bits of tx_owner
+
+typedef enum {
+    ESPNOW_NODE_EVENT_FRAME = 0,
+    ESPNOW_NODE_EVENT_SEND,
+} espnow_node_event_type_t;
+
+// who sent a frame in flight, its send status goes back there
+typedef enum {
+    ESPNOW_NODE_TX_LINK = 0,
+    ESPNOW_NODE_TX_RELAY,
+} espnow_node_tx_t;
+
+// backlog chunks spilled to nvs, all older than the ring
+typedef struct {
+    uint16_t    first;          // key of the oldest one
+    uint16_t    count;
+    uint16_t    sent;           // samples of the oldest one already acked
+} espnow_node_spill_t;
+
+typedef struct {
+    espnow_node_event_type_t    type;
+    uint8_t                     ok;
+    uint8_t                     addr[ESP_NOW_ETH_ALEN];
+    uint8_t                     len;
+    int8_t                      rssi;
+    int64_t                     local_ms;
+    uint8_t                     data[ESPNOW_PROTO_MAX_LEN];
+} espnow_node_event_t;
+
+static const char *TAG = "espnow_node";
+
+static RTC_DATA_ATTR espnow_link_cache_t cache;
+static RTC_DATA_ATTR espnow_sync_t       sync;
+static RTC_DATA_ATTR espnow_delta_tx_t   delta;
+static RTC_DATA_ATTR uint8_t             first;     // no data frame acked since power on
+static RTC_DATA_ATTR espnow_profile_t    profile;
+static RTC_DATA_ATTR espnow_backlog_t    backlog;
+static RTC_DATA_ATTR espnow_node_spill_t spill;
+static RTC_DATA_ATTR espnow_config_t     config;
+static RTC_DATA_ATTR uint8_t             config_report;  // version not seen by the master yet
+static RTC_DATA_ATTR espnow_report_t     reporting;
+static RTC_DATA_ATTR espnow_rate_t       rate;      // towards rate_addr, the peer the link talks to
+static RTC_DATA_ATTR uint8_t             rate_addr[ESP_NOW_ETH_ALEN];
+
+static espnow_link_t        link;
+static xQueueHandle         node_queue = NULL;
+static xQueueHandle         ready_queue = NULL;     // result of the bring up task
+static espnow_node_stats_t  stats;
+static int64_t              answer_ms;  // local clock of the last master answer
+static uint16_t             chunk_len;  // samples in the oldest spilled chunk, once read
+/* Scratch of the backlog: store and drain run on the task of the app, one
+ * at a time, their buffers stay off its stack. */
+static espnow_backlog_sample_t  chunk[ESPNOW_NODE_CHUNK_SIZE];
+static espnow_backlog_sample_t  drain_sample[ESPNOW_BACKLOG_BATCH];
+static uint8_t                  drain_buf[ESPNOW_PROTO_MAX_LEN];
+static uint8_t              config_loaded;
+static uint8_t              report_loaded;
+static uint8_t              link_hops;  // relays to the master, from the last discover reply
+
+/* Relay role. Two tasks send then, send statuses come back in the order of
+ * the frames: tx_owner keeps who sent each frame in flight, oldest in bit
+ * 0. node_lock keeps the exchanges of the link (join, send) one at a time. */
+static espnow_relay_t*      relay = NULL;
+static xQueueHandle         relay_queue = NULL;
+static xQueueHandle         relay_sent = NULL;
+static SemaphoreHandle_t    tx_lock = NULL;
+static SemaphoreHandle_t    node_lock = NULL;
+static portMUX_TYPE         tx_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t             tx_owner;
+static uint8_t              tx_count;
+
+// rtc backed, keeps running in deep sleep
+static int64_t espnow_node_clock_ms() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void espnow_node_save() {
+    nvs_handle_t nvs;
+
+    if ( nvs_open(ESPNOW_NODE_NVS_NS, NVS_READWRITE, &nvs) != ESP_OK ) {
+        ESP_LOGW(TAG, "nvs not available, link not saved");
+        return;
+    }
+    if ( nvs_set_blob(nvs, ESPNOW_NODE_NVS_KEY, &cache, sizeof(espnow_link_cache_t)) == ESP_OK ) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+static void espnow_node_load() {
+    nvs_handle_t        nvs;
+    espnow_link_cache_t saved;
+    size_t              len = sizeof(espnow_link_cache_t);
+
+    if ( nvs_open(ESPNOW_NODE_NVS_NS, NVS_READONLY, &nvs) != ESP_OK ) {
+        return;
+    }
+    if ( nvs_get_blob(nvs, ESPNOW_NODE_NVS_KEY, &saved, &len) == ESP_OK &&
+         len == sizeof(espnow_link_cache_t) && espnow_link_cache_is_valid(&saved) ) {
+        memcpy(&cache, &saved, sizeof(espnow_link_cache_t));
+        ESP_LOGI(TAG, "link restored from nvs, channel %d", cache.channel);
+    }
+    nvs_close(nvs);
+}
+
+static void espnow_node_config_save() {
+    nvs_handle_t nvs;
+
+    if ( nvs_open(ESPNOW_NODE_NVS_NS, NVS_READWRITE, &nvs) != ESP_OK ) {
+        ESP_LOGW(TAG, "nvs not available, config not saved");
+        return;
+    }
+    if ( nvs_set_blob(nvs, ESPNOW_NODE_NVS_CONFIG, &config, sizeof(espnow_config_t)) == ESP_OK ) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+const espnow_config_t* espnow_node_config() {
+    nvs_handle_t    nvs;
+    espnow_config_t saved;
+    size_t          len = sizeof(espnow_config_t);
+
+    if ( config_loaded ) {
+        return &config;
+    }
+    config_loaded = 1;
+    // rtc memory only survives deep sleep
+    if ( esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED ) {
+        return &config;
+    }
+    espnow_config_default(&config);
+    // the master learns the version on the first data frame
+    config_report = 1;
+    if ( nvs_open(ESPNOW_NODE_NVS_NS, NVS_READONLY, &nvs) != ESP_OK ) {
+        return &config;
+    }
+    if ( nvs_get_blob(nvs, ESPNOW_NODE_NVS_CONFIG, &saved, &len) == ESP_OK && len == sizeof(espnow_config_t) ) {
+        memcpy(&config, &saved, sizeof(espnow_config_t));
+        ESP_LOGI(TAG, "config %04x restored from nvs", config.version);
+    }
+    nvs_close(nvs);
+    return &config;
+}
+
+// settings in the ack, if any
+static void espnow_node_config_update() {
+    espnow_config_t pushed;
+    uint8_t         len = 0;
+    const uint8_t*  opt = espnow_proto_opt_find(link.ack, link.ack_len, ESPNOW_OPT_CONFIG, &len);
+
+    if ( opt == NULL || espnow_config_get(&pushed, opt, len) != ESP_OK ) {
+        return;
+    }
+    config_report = 1;
+    if ( pushed.version == config.version ) {
+        return;
+    }
+    for ( uint8_t key = 1; key < ESPNOW_CFG_COUNT; key++ ) {
+        if ( pushed.value[key] != config.value[key] ) {
+            ESP_LOGI(TAG, "config %s: %u -> %u", espnow_config_key_name(key), config.value[key], pushed.value[key]);
+        }
+    }
+    memcpy(&config, &pushed, sizeof(espnow_config_t));
+    espnow_node_config_save();
+}
+
+static espnow_report_t* espnow_node_report_state() {
+    if ( !report_loaded ) {
+        report_loaded = 1;
+        if ( esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED ) {
+            espnow_report_reset(&reporting);
+        }
+    }
+    return &reporting;
+}
+
+uint8_t espnow_node_report(const espnow_measure_t* measure) {
+    espnow_report_t* r = espnow_node_report_state();
+
+    if ( espnow_report_sample(r, espnow_node_config(), measure, (uint32_t)espnow_node_clock_ms()) ) {
+        return 1;
+    }
+    ESP_LOGD(TAG, "sample within the deadbands, %u of %u skipped", r->skipped, r->samples);
+    return 0;
+}
+
+uint8_t espnow_node_report_due() {
+    return espnow_report_due(espnow_node_report_state(), espnow_node_config(), (uint32_t)espnow_node_clock_ms());
+}
+
+static void espnow_node_spill_key(char* key, uint16_t chunk) {
+    sprintf(key, "%u", chunk);
+}
+
+static void espnow_node_spill_clear() {
+    nvs_handle_t nvs;
+
+    memset(&spill, 0, sizeof(espnow_node_spill_t));
+    if ( ESPNOW_NODE_BACKLOG_CHUNKS && nvs_open(ESPNOW_NODE_NVS_SPILL, NVS_READWRITE, &nvs) == ESP_OK ) {
+        nvs_erase_all(nvs);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+static void espnow_node_spill_drop(nvs_handle_t nvs) {
+    char key[8];
+
+    espnow_node_spill_key(key, spill.first);
+    nvs_erase_key(nvs, key);
+    nvs_commit(nvs);
+    spill.first++;
+    spill.count--;
+    spill.sent = 0;
+    chunk_len = 0;
+    // whatever went without answer is gone
+    backlog.pending = 0;
+}
+
+/* The ring is full: its oldest half goes to nvs, as one blob, instead of
+ * being dropped. With every chunk in use the oldest chunk goes. */
+static void espnow_node_spill() {
+    nvs_handle_t nvs;
+    char key[8];
+
+    if ( nvs_open(ESPNOW_NODE_NVS_SPILL, NVS_READWRITE, &nvs) != ESP_OK ) {
+        return;
+    }
+    if ( spill.count == ESPNOW_NODE_BACKLOG_CHUNKS ) {
+        ESP_LOGW(TAG, "backlog full, oldest chunk dropped");
+        backlog.dropped += ESPNOW_NODE_CHUNK_SIZE - spill.sent;
+        espnow_node_spill_drop(nvs);
+    }
+    uint16_t count = espnow_backlog_peek(&backlog, chunk, ESPNOW_NODE_CHUNK_SIZE);
+    espnow_node_spill_key(key, spill.first + spill.count);
+    if ( nvs_set_blob(nvs, key, chunk, count * sizeof(espnow_backlog_sample_t)) == ESP_OK && nvs_commit(nvs) == ESP_OK ) {
+        espnow_backlog_pop(&backlog, count);
+        spill.count++;
+    }
+    nvs_close(nvs);
+}
+
+// the oldest samples waiting: from the oldest spilled chunk, else from the ring
+static uint16_t espnow_node_backlog_peek(espnow_backlog_sample_t* out, uint16_t max) {
+    nvs_handle_t nvs;
+    char key[8];
+
+    while ( spill.count && nvs_open(ESPNOW_NODE_NVS_SPILL, NVS_READWRITE, &nvs) == ESP_OK ) {
+        size_t len = sizeof(chunk);
+        espnow_node_spill_key(key, spill.first);
+        esp_err_t ret = nvs_get_blob(nvs, key, chunk, &len);
+        if ( ret != ESP_OK || len % sizeof(espnow_backlog_sample_t) || len / sizeof(espnow_backlog_sample_t) <= spill.sent ) {
+            ESP_LOGW(TAG, "spilled backlog chunk %u unreadable, dropped", spill.first);
+            espnow_node_spill_drop(nvs);
+            nvs_close(nvs);
+            continue;
+        }
+        nvs_close(nvs);
+        chunk_len = len / sizeof(espnow_backlog_sample_t);
+        uint16_t count = chunk_len - spill.sent < max ? chunk_len - spill.sent : max;
+        memcpy(out, &chunk[spill.sent], count * sizeof(espnow_backlog_sample_t));
+        return count;
+    }
+    return espnow_backlog_peek(&backlog, out, max);
+}
+
+static void espnow_node_backlog_pop(uint16_t count) {
+    nvs_handle_t nvs;
+
+    if ( spill.count == 0 ) {
+        espnow_backlog_pop(&backlog, count);
+        return;
+    }
+    spill.sent += count;
+    if ( spill.sent >= chunk_len && nvs_open(ESPNOW_NODE_NVS_SPILL, NVS_READWRITE, &nvs) == ESP_OK ) {
+        espnow_node_spill_drop(nvs);
+        nvs_close(nvs);
+    }
+}
+
+uint32_t espnow_node_backlog_count() {
+    uint32_t count = backlog.count;
+
+    if ( spill.count ) {
+        count += ( spill.count - 1 ) * ESPNOW_NODE_CHUNK_SIZE + ESPNOW_NODE_CHUNK_SIZE - spill.sent;
+    }
+    return count;
+}
+
+void espnow_node_prepare() {
+    if ( link.cache != NULL ) {
+        return;
+    }
+    espnow_link_init(&link, &cache);
+    espnow_node_config();
+    // rtc memory only survives deep sleep, fall back to the copy in nvs
+    if ( esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED ) {
+        espnow_node_load();
+        // frames sent before the reset may still be in the master dedup window
+        cache.seq = (uint16_t)esp_random();
+        espnow_link_cache_seal(&cache);
+        memset(&sync, 0, sizeof(espnow_sync_t));
+        espnow_delta_tx_reset(&delta);
+        first = 1;
+        // the node clock restarted, the age of spilled samples is lost
+        espnow_backlog_reset(&backlog);
+        espnow_node_spill_clear();
+    }
+    espnow_node_report_state();
+}
+
+esp_err_t espnow_node_init() {
+    ESP_LOGV(TAG, "espnow_node_init");
+
+    if ( node_queue == NULL ) {
+        node_queue = xQueueCreate(ESPNOW_NODE_QUEUE_SIZE, sizeof(espnow_node_event_t));
+        if ( node_queue == NULL ) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    espnow_node_prepare();
+    memset(&stats, 0, sizeof(espnow_node_stats_t));
+    if ( espnow_link_channel(&link) ) {
+        ESP_ERROR_CHECK( espnow_set_channel(espnow_link_channel(&link)) );
+    }
+    stats.channel = espnow_get_channel();
+    stats.ready_us = (uint32_t)esp_timer_get_time();
+    espnow_node_mark(ESPNOW_PHASE_ESPNOW);
+    ESP_LOGI(TAG, "radio ready on channel %d, %u us after boot", stats.channel, stats.ready_us);
+    return ESP_OK;
+}
+
+esp_err_t espnow_node_radio_init() {
+    esp_err_t ret;
+
+#if CONFIG_ESPNOW_FAST_WAKE
+    ret = espnow_init_fast(espnow_node_send_cb, espnow_node_recv_cb);
+#else
+    ret = espnow_init(espnow_node_send_cb, espnow_node_recv_cb, NULL);
+#endif
+    return ret == ESP_OK ? espnow_node_init() : ret;
+}
+
+static void espnow_node_start_task(void* arg) {
+    esp_err_t ret = espnow_node_radio_init();
+
+    if ( ret == ESP_OK ) {
+        ret = espnow_node_join();
+    }
+    xQueueSend(ready_queue, &ret, 0);
+    vTaskDelete(NULL);
+}
+
+esp_err_t espnow_node_start() {
+    ESP_LOGV(TAG, "espnow_node_start");
+
+    if ( ready_queue == NULL ) {
+        ready_queue = xQueueCreate(1, sizeof(esp_err_t));
+        if ( ready_queue == NULL ) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    // the calling core is left to the sensor, single core chips share it
+    BaseType_t core = portNUM_PROCESSORS > 1 ? !xPortGetCoreID() : 0;
+    if ( xTaskCreatePinnedToCore(espnow_node_start_task, "espnow_node_start", ESPNOW_NODE_START_STACK,
+                                 NULL, ESPNOW_NODE_START_PRIO, NULL, core) != pdPASS ) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t espnow_node_wait_ready(uint32_t timeout_ms) {
+    esp_err_t ret;
+
+    if ( ready_queue == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ( xQueueReceive(ready_queue, &ret, pdMS_TO_TICKS(timeout_ms)) != pdTRUE ) {
+        return ESP_ERR_TIMEOUT;
+    }
+    return ret;
+}
+
+espnow_link_t* espnow_node_link() {
+    return &link;
+}
+
+static void espnow_node_post_sent(const uint8_t* mac_addr, uint8_t ok) {
+    espnow_node_event_t evt;
+
+    evt.type = ESPNOW_NODE_EVENT_SEND;
+    evt.ok = ok;
+    memcpy(evt.addr, mac_addr, ESP_NOW_ETH_ALEN);
+    evt.len = 0;
+    xQueueSend(node_queue, &evt, 0);
+}
+
+/* rate of the link, or ESPNOW_NODE_RATE_PEER: the one the peer cache
+ * keeps for addr (espnow_transport_esp), relay frames to the parent and
+ * the children. */
+static esp_err_t espnow_node_tx(espnow_node_tx_t owner, const uint8_t* addr, const uint8_t* data, size_t len, uint8_t rate) {
+    if ( relay == NULL ) {
+        return espnow_send_at(addr, data, len, rate);
+    }
+
+    xSemaphoreTake(tx_lock, portMAX_DELAY);
+    portENTER_CRITICAL(&tx_mux);
+    if ( tx_count < ESPNOW_NODE_TX_MAX ) {
+        tx_owner |= (uint32_t)owner << tx_count;
+        tx_count++;
+    }
+    portEXIT_CRITICAL(&tx_mux);
+    esp_err_t ret = rate == ESPNOW_NODE_RATE_PEER ? espnow_transport_send(&espnow_transport_esp, addr, data, len)
+                                                  : espnow_send_at(addr, data, len, rate);
+    if ( ret != ESP_OK ) {
+        // no status comes for it, the frame pushed last is this one
+        portENTER_CRITICAL(&tx_mux);
+        if ( tx_count ) {
+            tx_count--;
+            tx_owner &= ~( (uint32_t)1 << tx_count );
+        }
+        portEXIT_CRITICAL(&tx_mux);
+    }
+    xSemaphoreGive(tx_lock);
+    return ret;
+}
+
+static espnow_node_tx_t espnow_node_tx_done() {
+    espnow_node_tx_t owner = ESPNOW_NODE_TX_LINK;
+
+    portENTER_CRITICAL(&tx_mux);
+    if ( tx_count ) {
+        owner = tx_owner & 1;
+        tx_owner >>= 1;
+        tx_count--;
+    }
+    portEXIT_CRITICAL(&tx_mux);
+    return owner;
+}
+
+// rate state follows the peer of the link, a new one starts over
+static espnow_rate_t* espnow_node_rate(const uint8_t* addr) {
+    if ( memcmp(rate_addr, addr, ESP_NOW_ETH_ALEN) != 0 ) {
+        memcpy(rate_addr, addr, ESP_NOW_ETH_ALEN);
+        espnow_rate_init(&rate, ESPNOW_RATE_LONG_RANGE);
+    }
+    return &rate;
+}
+
+static void espnow_node_apply(const espnow_link_action_t* act) {
+    uint8_t tx_rate = ESPNOW_RATE_BASE;
+
+    if ( act->channel ) {
+        espnow_set_channel(act->channel);
+    }
+    if ( act->len == 0 ) {
+        return;
+    }
+    if ( stats.first_frame_us == 0 ) {
+        stats.first_frame_us = (uint32_t)esp_timer_get_time();
+    }
+    if ( !espnow_is_broadcast_addr((uint8_t*)act->dest) ) {
+        espnow_add_peer((uint8_t*)act->dest);
+        tx_rate = espnow_rate_pick(espnow_node_rate(act->dest));
+    }
+    esp_err_t ret = espnow_node_tx(ESPNOW_NODE_TX_LINK, act->dest, act->frame, act->len, tx_rate);
+    if ( ret != ESP_OK ) {
+        // reported like a mac layer failure, the link decides about retries
+        ESP_LOGW(TAG, "esp_now_send failed: %s", esp_err_to_name(ret));
+        espnow_node_post_sent(act->dest, 0);
+    }
+}
+
+static void espnow_node_sync_update() {
+    espnow_sync_info_t info;
+    uint8_t            len = 0;
+    const uint8_t*     opt = espnow_proto_opt_find(link.ack, link.ack_len, ESPNOW_OPT_SYNC, &len);
+
+    if ( opt == NULL || len < sizeof(espnow_sync_info_t) ) {
+        return;
+    }
+    memcpy(&info, opt, sizeof(espnow_sync_info_t));
+    espnow_sync_update(&sync, &info, answer_ms);
+    ESP_LOGD(TAG, "slot %u / %u ms, drift %d ppm", sync.slot_ms, sync.period_ms, sync.drift_ppm);
+}
+
+static uint8_t espnow_node_ack_status() {
+    if ( link.ack_len < sizeof(espnow_ack_t) || link.ack[1] != ESPNOW_MSG_ACK ) {
+        return ESPNOW_ACK_ERROR;
+    }
+    return ((const espnow_ack_t*)link.ack)->status;
+}
+
+// drives the link until the exchange is over, returns its final state
+static espnow_link_state_t espnow_node_run(espnow_link_state_t state, espnow_link_action_t* act) {
+    espnow_node_event_t evt;
+    int64_t             deadline = esp_timer_get_time();
+    uint8_t             on_air = 0;
+
+    while ( state == ESPNOW_LINK_JOINING || state == ESPNOW_LINK_SENDING ) {
+        if ( act->wait_ms ) {
+            deadline = esp_timer_get_time() + (int64_t)act->wait_ms * 1000;
+        }
+        espnow_node_apply(act);
+
+        int64_t left_us = deadline - esp_timer_get_time();
+        TickType_t ticks = left_us > 0 ? pdMS_TO_TICKS(( left_us + 999 ) / 1000) : 0;
+
+        if ( xQueueReceive(node_queue, &evt, ticks) != pdTRUE ) {
+            state = espnow_link_on_timeout(&link, act);
+        }
+        else if ( evt.type == ESPNOW_NODE_EVENT_FRAME ) {
+            state = espnow_link_on_frame(&link, evt.addr, evt.data, evt.len, act);
+            answer_ms = evt.local_ms;
+            if ( state == ESPNOW_LINK_DONE ) {
+                espnow_link_rssi(&link, evt.rssi);
+                espnow_rate_heard(espnow_node_rate(evt.addr), evt.rssi);
+            }
+        }
+        else {
+            if ( state == ESPNOW_LINK_SENDING && !on_air ) {
+                espnow_node_mark(ESPNOW_PHASE_SEND);
+                on_air = 1;
+            }
+            if ( memcmp(evt.addr, rate_addr, ESP_NOW_ETH_ALEN) == 0 ) {
+                espnow_rate_sent(&rate, evt.ok);
+            }
+            state = espnow_link_on_send_status(&link, evt.ok, act);
+        }
+    }
+    if ( act->channel ) {
+        espnow_set_channel(act->channel);
+    }
+    if ( state == ESPNOW_LINK_DONE && link.ack_len ) {
+        espnow_node_sync_update();
+        espnow_node_config_update();
+    }
+    return state;
+}
+
+// exchanges of the link one at a time once the relay task runs its own joins
+static void espnow_node_lock() {
+    if ( node_lock != NULL ) {
+        xSemaphoreTake(node_lock, portMAX_DELAY);
+    }
+}
+
+static void espnow_node_unlock() {
+    if ( node_lock != NULL ) {
+        xSemaphoreGive(node_lock);
+    }
+}
+
+static esp_err_t espnow_node_join_locked() {
+    espnow_link_action_t act;
+    int64_t start = esp_timer_get_time();
+
+    xQueueReset(node_queue);
+    // a relay that lost its way cannot take one of its children as parent
+    if ( relay != NULL && relay->hops ) {
+        link.max_hops = relay->hops;
+    }
+    espnow_link_state_t state = espnow_link_join_start(&link, &act);
+    if ( state == ESPNOW_LINK_DONE ) {
+        espnow_node_run(state, &act);
+        espnow_node_mark(ESPNOW_PHASE_JOIN);
+        stats.join_us = 0;
+        stats.join_probes = 0;
+        stats.channel = espnow_link_channel(&link);
+        return ESP_OK;
+    }
+
+    state = espnow_node_run(state, &act);
+    // for one join, the next one takes any relay once the children gave up
+    link.max_hops = 0;
+    espnow_node_mark(ESPNOW_PHASE_JOIN);
+    stats.join_us = (uint32_t)( esp_timer_get_time() - start );
+    stats.join_probes = link.probes;
+    stats.channel = espnow_get_channel();
+    ESP_LOGI(TAG, "join %s in %u us, %d probes, channel %d",
+        state == ESPNOW_LINK_DONE ? "done" : "failed", stats.join_us, stats.join_probes, stats.channel);
+
+    if ( state != ESPNOW_LINK_DONE ) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint8_t        vlen = 0;
+    const uint8_t* hops = espnow_proto_opt_find(link.ack, link.ack_len, ESPNOW_OPT_HOPS, &vlen);
+
+    link_hops = hops != NULL && vlen >= 1 ? hops[0] : 0;
+    espnow_node_save();
+    return ESP_OK;
+}
+
+esp_err_t espnow_node_join() {
+    ESP_LOGV(TAG, "espnow_node_join");
+
+    espnow_node_lock();
+    esp_err_t ret = espnow_node_join_locked();
+    espnow_node_unlock();
+    return ret;
+}
+
+static esp_err_t espnow_node_send_locked(const uint8_t* frame, size_t len, int32_t seq) {
+    espnow_link_action_t act;
+    int64_t start = esp_timer_get_time();
+
+    // the node wakes this early to be on air at the start of its slot
+    sync.lead_ms = (uint32_t)( start / 1000 ) + ESPNOW_NODE_SLOT_GUARD_MS;
+
+    xQueueReset(node_queue);
+    espnow_link_state_t state = seq < 0 ? espnow_link_send_start(&link, frame, len, &act)
+                                        : espnow_link_resend_start(&link, frame, len, (uint16_t)seq, &act);
+    state = espnow_node_run(state, &act);
+    espnow_node_mark(ESPNOW_PHASE_ACK);
+    stats.send_us = (uint32_t)( esp_timer_get_time() - start );
+    stats.send_probes = link.probes;
+    stats.send_failovers = link.failovers;
+    stats.send_rate = rate.rate;
+    // a node powered on goes to the master it failed over to
+    if ( link.failovers && espnow_link_is_valid(&link) ) {
+        espnow_node_save();
+    }
+    if ( state != ESPNOW_LINK_DONE ) {
+        return ESP_ERR_TIMEOUT;
+    }
+    return espnow_node_ack_status() == ESPNOW_ACK_OK ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
+
+// seq -1 takes the next one
+static esp_err_t espnow_node_send_seq(const uint8_t* frame, size_t len, int32_t seq) {
+    espnow_node_lock();
+    esp_err_t ret = espnow_node_send_locked(frame, len, seq);
+    espnow_node_unlock();
+    return ret;
+}
+
+esp_err_t espnow_node_send(const uint8_t* frame, size_t len) {
+    ESP_LOGV(TAG, "espnow_node_send");
+
+    return espnow_node_send_seq(frame, len, -1);
+}
+
+static uint8_t espnow_node_flow_credit() {
+    espnow_flow_info_t info;
+    uint8_t            len = 0;
+    const uint8_t*     opt = espnow_proto_opt_find(link.ack, link.ack_len, ESPNOW_OPT_FLOW, &len);
+
+    if ( opt == NULL || len < sizeof(espnow_flow_info_t) ) {
+        return 0;
+    }
+    memcpy(&info, opt, sizeof(espnow_flow_info_t));
+    return info.credit;
+}
+
+// one data frame with the oldest samples of the backlog, popped once acked
+static esp_err_t espnow_node_send_backlog(uint8_t* credit) {
+    uint8_t* buf = drain_buf;
+    espnow_backlog_sample_t* sample = drain_sample;
+    esp_err_t ret = ESP_ERR_INVALID_SIZE;
+    espnow_profile_info_t info;
+    espnow_report_info_t skips;
+    uint8_t report = ESPNOW_PROFILE_INTERVAL && profile.wakes >= ESPNOW_PROFILE_INTERVAL &&
+                     espnow_profile_info(&profile, &info);
+    uint16_t count = espnow_node_backlog_peek(sample, ESPNOW_BACKLOG_BATCH);
+    uint32_t now_ms = (uint32_t)espnow_node_clock_ms();
+
+    *credit = 0;
+    // a master that lost the reference asks for a keyframe, sent right away
+    for ( int attempt = 0; attempt < 2; attempt++ ) {
+        uint8_t used = 0;
+        size_t len = espnow_backlog_encode(&backlog, &delta, buf, sample, count, now_ms, &used);
+        if ( len == 0 ) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        // the master restarts its sequence window for this node
+        if ( first ) {
+            ((espnow_data_delta_t*)buf)->flags |= ESPNOW_DATA_FIRST;
+        }
+        // the wake profile rides along when there is room for it
+        size_t with = report ? espnow_proto_opt_add(buf, len, ESPNOW_OPT_PROFILE, &info, sizeof(info)) : 0;
+        if ( with ) {
+            len = with;
+        }
+        // until the master has seen it, it may push its config again
+        size_t with_config = config_report ?
+            espnow_proto_opt_add(buf, len, ESPNOW_OPT_CONFIG_VER, &config.version, sizeof(uint16_t)) : 0;
+        if ( with_config ) {
+            len = with_config;
+        }
+        // skip ratio of a node with deadbands, totals since power on
+        if ( espnow_report_enabled(&config) ) {
+            espnow_report_info(&reporting, &skips);
+            size_t with_skips = espnow_proto_opt_add(buf, len, ESPNOW_OPT_REPORT, &skips, sizeof(skips));
+            len = with_skips ? with_skips : len;
+        }
+        ret = espnow_node_send_seq(buf, len, backlog.pending ? backlog.pending_seq : -1);
+        int status = ret == ESP_ERR_TIMEOUT ? -1 : espnow_node_ack_status();
+        espnow_backlog_sent(&backlog, link.seq, used, status >= 0);
+        espnow_delta_tx_done(&delta, link.seq, status);
+        if ( status == ESPNOW_ACK_OK ) {
+            first = 0;
+            espnow_report_contact(&reporting, now_ms);
+            if ( with ) {
+                espnow_profile_reported(&profile);
+            }
+            espnow_node_backlog_pop(used);
+            *credit = espnow_node_flow_credit();
+            // a config in this ack asks for the version again
+            if ( with_config && espnow_proto_opt_find(link.ack, link.ack_len, ESPNOW_OPT_CONFIG, NULL) == NULL ) {
+                config_report = 0;
+            }
+        }
+        if ( status != ESPNOW_ACK_RESYNC ) {
+            break;
+        }
+        ESP_LOGI(TAG, "master has no delta reference, sending a keyframe");
+    }
+    return ret;
+}
+
+void espnow_node_store(const espnow_measure_t* measure, uint8_t count) {
+    uint32_t now_ms = (uint32_t)espnow_node_clock_ms();
+
+    for ( uint8_t i = 0; i < count; i++ ) {
+        if ( ESPNOW_NODE_BACKLOG_CHUNKS && backlog.count == ESPNOW_BACKLOG_SIZE ) {
+            espnow_node_spill();
+        }
+        if ( espnow_backlog_push(&backlog, &measure[i], now_ms) ) {
+            ESP_LOGW(TAG, "backlog full, oldest sample dropped (%u so far)", backlog.dropped);
+        }
+    }
+}
+
+esp_err_t espnow_node_drain() {
+    ESP_LOGV(TAG, "espnow_node_drain");
+
+    uint8_t credit = 0;
+    esp_err_t ret = ESP_OK;
+    uint32_t frames = 0;
+
+    while ( espnow_node_backlog_count() ) {
+        ret = espnow_node_send_backlog(&credit);
+        frames++;
+        if ( ret != ESP_OK || credit == 0 ) {
+            break;
+        }
+    }
+    if ( espnow_node_backlog_count() ) {
+        ESP_LOGI(TAG, "%u samples left in the backlog after %u frames", espnow_node_backlog_count(), frames);
+    }
+    return ret;
+}
+
+esp_err_t espnow_node_send_measures(const espnow_measure_t* measure, uint8_t count) {
+    ESP_LOGV(TAG, "espnow_node_send_measures");
+
+    espnow_node_store(measure, count);
+    return espnow_node_drain();
+}
+
+/* Called in WiFi task, only hand the event over to the waiting task. */
+void espnow_node_send_cb(const uint8_t* mac_addr, esp_now_send_status_t status) {
+    uint8_t ok = status == ESP_NOW_SEND_SUCCESS;
+
+    if ( mac_addr == NULL || node_queue == NULL ) {
+        return;
+    }
+    if ( relay != NULL && espnow_node_tx_done() == ESPNOW_NODE_TX_RELAY ) {
+        xQueueSend(relay_sent, &ok, 0);
+        return;
+    }
+    espnow_node_post_sent(mac_addr, ok);
+}
+
+void espnow_node_recv_cb(const uint8_t* mac_addr, const uint8_t* data, int len) {
+    espnow_node_event_t evt;
+
+    if ( mac_addr == NULL || data == NULL || len <= 0 || len > ESPNOW_PROTO_MAX_LEN || node_queue == NULL ) {
+        return;
+    }
+    evt.type = ESPNOW_NODE_EVENT_FRAME;
+    evt.ok = 1;
+    memcpy(evt.addr, mac_addr, ESP_NOW_ETH_ALEN);
+    evt.len = len;
+    evt.rssi = espnow_rx_rssi(data, len);
+    evt.local_ms = espnow_node_clock_ms();
+    memcpy(evt.data, data, len);
+    if ( relay != NULL && espnow_relay_wants(data, len) ) {
+        if ( xQueueSend(relay_queue, &evt, 0) != pdTRUE ) {
+            ESP_LOGW(TAG, "receive cb error: relay queue full, frame dropped");
+        }
+        return;
+    }
+    if ( xQueueSend(node_queue, &evt, 0) != pdTRUE ) {
+        ESP_LOGW(TAG, "receive cb error: queue full, frame dropped");
+    }
+}
+
+uint32_t espnow_node_sleep_ms(uint32_t nominal_ms) {
+    uint32_t sleep_ms = espnow_sync_sleep_ms(&sync, espnow_node_clock_ms(), nominal_ms);
+
+    ESP_LOGI(TAG, "sleep %u ms (nominal %u ms)", sleep_ms, nominal_ms);
+    return sleep_ms;
+}
+
+void espnow_node_profile_start() {
+    if ( esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED ) {
+        espnow_profile_reset(&profile);
+    }
+    espnow_profile_start(&profile, esp_timer_get_time());
+}
+
+void espnow_node_mark(espnow_phase_t phase) {
+    espnow_profile_mark(&profile, phase, esp_timer_get_time());
+}
+
+void espnow_node_profile_end() {
+    espnow_node_mark(ESPNOW_PHASE_SLEEP);
+    espnow_profile_end(&profile);
+
+    ESP_LOGI(TAG, "wake: boot %u, nvs %u, wifi %u, espnow %u, sensor %u, convert %u, join %u, send %u, ack %u, sleep %u us",
+        profile.cur_us[ESPNOW_PHASE_BOOT], profile.cur_us[ESPNOW_PHASE_NVS], profile.cur_us[ESPNOW_PHASE_WIFI],
+        profile.cur_us[ESPNOW_PHASE_ESPNOW], profile.cur_us[ESPNOW_PHASE_SENSOR], profile.cur_us[ESPNOW_PHASE_CONVERT],
+        profile.cur_us[ESPNOW_PHASE_JOIN], profile.cur_us[ESPNOW_PHASE_SEND], profile.cur_us[ESPNOW_PHASE_ACK],
+        profile.cur_us[ESPNOW_PHASE_SLEEP]);
+}
+
+const espnow_profile_t* espnow_node_profile() {
+    return &profile;
+}
+
+const espnow_sync_t* espnow_node_sync() {
+    return &sync;
+}
+
+void espnow_node_stats_get(espnow_node_stats_t* stats_out) {
+    memcpy(stats_out, &stats, sizeof(espnow_node_stats_t));
+}
+
+/* Relay frames go at the rate the peer cache keeps for their peer, their
+ * send status moves it and tells the relay whether its parent (or child)
+ * got the frame. */
+static esp_err_t espnow_node_relay_send(void* ctx, const uint8_t* addr, const uint8_t* data, size_t len) {
+    uint8_t ok = 0;
+
+    xQueueReset(relay_sent);
+    esp_err_t ret = espnow_node_tx(ESPNOW_NODE_TX_RELAY, addr, data, len, ESPNOW_NODE_RATE_PEER);
+    if ( ret != ESP_OK ) {
+        return ret;
+    }
+    if ( xQueueReceive(relay_sent, &ok, pdMS_TO_TICKS(ESPNOW_NODE_RELAY_SENT_MS)) != pdTRUE ) {
+        return ESP_FAIL;
+    }
+    espnow_peer_rate_sent(addr, ok);
+    return ok ? ESP_OK : ESP_FAIL;
+}
+
+static const espnow_transport_t relay_transport = {
+    .send = espnow_node_relay_send,
+    .ctx = NULL
+};
+
+static uint32_t espnow_node_relay_ms() {
+    return (uint32_t)( esp_timer_get_time() / 1000 );
+}
+
+// follows the master of the link, joins again when the parent is lost
+static void espnow_node_relay_parent(int64_t* join_us) {
+    if ( espnow_relay_parent_lost(relay) ) {
+        ESP_LOGW(TAG, "relay: parent lost, joining again");
+        espnow_node_lock();
+        espnow_link_invalidate(&link);
+        espnow_node_unlock();
+    }
+    if ( !espnow_link_is_valid(&link) ) {
+        // kept for the next join, the relay forgets its hops with the parent
+        if ( relay->hops ) {
+            espnow_node_lock();
+            link.max_hops = relay->hops;
+            espnow_node_unlock();
+        }
+        espnow_relay_set_parent(relay, NULL, 0, 0, 0);
+        if ( esp_timer_get_time() < *join_us ) {
+            return;
+        }
+        *join_us = esp_timer_get_time() + (int64_t)ESPNOW_NODE_RELAY_JOIN_MS * 1000;
+        if ( espnow_node_join() != ESP_OK ) {
+            return;
+        }
+    }
+    if ( relay->hops == 0 || memcmp(relay->parent, espnow_link_master(&link), ESPNOW_PROTO_ADDR_LEN) != 0 ||
+         relay->token != espnow_link_token(&link) ) {
+        espnow_relay_set_parent(relay, espnow_link_master(&link), espnow_link_channel(&link),
+                                espnow_link_token(&link), link_hops);
+    }
+}
+
+static void espnow_node_relay_task(void* arg) {
+    espnow_node_event_t evt;
+    uint32_t            wait_ms = 0;
+    int64_t             join_us = 0;
+
+    while ( 1 ) {
+        TickType_t ticks = wait_ms == UINT32_MAX ? pdMS_TO_TICKS(ESPNOW_NODE_RELAY_JOIN_MS) : pdMS_TO_TICKS(wait_ms);
+
+        if ( xQueueReceive(relay_queue, &evt, ticks ? ticks : 1) == pdTRUE ) {
+            espnow_peer_rate_heard(evt.addr, evt.rssi);
+            espnow_relay_on_frame(relay, evt.addr, evt.rssi, evt.data, evt.len, espnow_node_relay_ms());
+        }
+        espnow_node_relay_parent(&join_us);
+        wait_ms = espnow_relay_poll(relay, espnow_node_relay_ms());
+    }
+}
+
+esp_err_t espnow_node_relay_start() {
+    ESP_LOGV(TAG, "espnow_node_relay_start");
+
+    uint8_t self[ESP_NOW_ETH_ALEN];
+
+    if ( relay != NULL ) {
+        return ESP_OK;
+    }
+    relay_queue = xQueueCreate(ESPNOW_NODE_RELAY_QUEUE, sizeof(espnow_node_event_t));
+    relay_sent = xQueueCreate(1, sizeof(uint8_t));
+    tx_lock = xSemaphoreCreateMutex();
+    node_lock = xSemaphoreCreateMutex();
+    espnow_relay_t* r = calloc(1, sizeof(espnow_relay_t));
+    if ( relay_queue == NULL || relay_sent == NULL || tx_lock == NULL || node_lock == NULL || r == NULL ) {
+        free(r);
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_ERROR_CHECK( esp_wifi_get_mac(WIFI_IF_STA, self) );
+    espnow_relay_init(r, &relay_transport, self);
+    // children are heard at any time, no modem sleep
+    esp_wifi_set_ps(WIFI_PS_NONE);
+    // a cached master says nothing of its hops
+    espnow_node_lock();
+    espnow_link_invalidate(&link);
+    espnow_node_unlock();
+    relay = r;
+
+    if ( xTaskCreate(espnow_node_relay_task, "espnow_relay", ESPNOW_NODE_RELAY_STACK, NULL,
+                     ESPNOW_NODE_RELAY_PRIO, NULL) != pdPASS ) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "relay role started");
+    return ESP_OK;
+}
+
+void espnow_node_relay_stats_get(espnow_relay_stats_t* stats_out) {
+    if ( relay == NULL ) {
+        memset(stats_out, 0, sizeof(espnow_relay_stats_t));
+        return;
+    }
+    espnow_relay_stats_get(relay, stats_out);
+}
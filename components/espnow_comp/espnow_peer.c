@@ -0,0 +1,363 @@
+#include "espnow_peer.h"
+#include "espnow_comp.h"
+#include "espnow_proto.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+/*
+ * Peer cache
+ *
+ * The esp-now driver can only hold ESP_NOW_MAX_TOTAL_PEER_NUM peers. All the
+ * known nodes are kept in a preallocated pool indexed by a chained hash
+ * table, and only the ESPNOW_PEER_DRIVER_MAX most recently used ones are
+ * registered in the driver. Each entry is either on the resident list (in
+ * the driver) or on the idle list (RAM only), both ordered by last use, so
+ * swapping a node in or out is O(1).
+ */
+
+_Static_assert(ESPNOW_PEER_CACHE_SIZE > ESPNOW_PEER_DRIVER_MAX, "peer cache smaller than driver table");
+_Static_assert(ESPNOW_PEER_CACHE_SIZE < ESPNOW_PEER_NONE, "peer cache too large");
+_Static_assert(ESPNOW_PEER_DRIVER_MAX < ESP_NOW_MAX_TOTAL_PEER_NUM, "no room left for the broadcast peer");
+_Static_assert((ESPNOW_PEER_BUCKETS & (ESPNOW_PEER_BUCKETS - 1)) == 0, "bucket count must be a power of 2");
+
+typedef struct {
+    uint8_t     addr[ESP_NOW_ETH_ALEN];
+    uint8_t     resident;
+    espnow_rate_t rate;
+    uint16_t    hash_next;
+    uint16_t    prev;
+    uint16_t    next;
+} espnow_peer_entry_t;
+
+typedef struct {
+    uint16_t    head;
+    uint16_t    tail;
+    uint16_t    count;
+} espnow_peer_list_t;
+
+static const char *TAG = "espnow_peer";
+
+static espnow_peer_entry_t  entries[ESPNOW_PEER_CACHE_SIZE];
+static uint16_t             buckets[ESPNOW_PEER_BUCKETS];
+static espnow_peer_list_t   resident_list;
+static espnow_peer_list_t   idle_list;
+static uint16_t             free_head;
+static espnow_peer_stats_t  stats;
+static SemaphoreHandle_t    peer_lock = NULL;
+
+static inline uint16_t espnow_peer_hash(const uint8_t* addr) {
+    return (uint16_t)( espnow_proto_addr_hash(addr) & ( ESPNOW_PEER_BUCKETS - 1 ) );
+}
+
+static inline void espnow_peer_list_init(espnow_peer_list_t* list) {
+    list->head = ESPNOW_PEER_NONE;
+    list->tail = ESPNOW_PEER_NONE;
+    list->count = 0;
+}
+
+static void espnow_peer_list_unlink(espnow_peer_list_t* list, uint16_t idx) {
+    espnow_peer_entry_t* e = &entries[idx];
+
+    if ( e->prev != ESPNOW_PEER_NONE ) entries[e->prev].next = e->next;
+    else list->head = e->next;
+    if ( e->next != ESPNOW_PEER_NONE ) entries[e->next].prev = e->prev;
+    else list->tail = e->prev;
+    e->prev = e->next = ESPNOW_PEER_NONE;
+    list->count--;
+}
+
+static void espnow_peer_list_push(espnow_peer_list_t* list, uint16_t idx) {
+    espnow_peer_entry_t* e = &entries[idx];
+
+    e->prev = ESPNOW_PEER_NONE;
+    e->next = list->head;
+    if ( list->head != ESPNOW_PEER_NONE ) entries[list->head].prev = idx;
+    else list->tail = idx;
+    list->head = idx;
+    list->count++;
+}
+
+static uint16_t espnow_peer_lookup(const uint8_t* addr) {
+    uint16_t idx = buckets[espnow_peer_hash(addr)];
+
+    while ( idx != ESPNOW_PEER_NONE ) {
+        if ( memcmp(entries[idx].addr, addr, ESP_NOW_ETH_ALEN) == 0 ) {
+            return idx;
+        }
+        idx = entries[idx].hash_next;
+    }
+    return ESPNOW_PEER_NONE;
+}
+
+static void espnow_peer_hash_remove(uint16_t idx) {
+    uint16_t* link = &buckets[espnow_peer_hash(entries[idx].addr)];
+
+    while ( *link != ESPNOW_PEER_NONE ) {
+        if ( *link == idx ) {
+            *link = entries[idx].hash_next;
+            break;
+        }
+        link = &entries[*link].hash_next;
+    }
+    entries[idx].hash_next = ESPNOW_PEER_NONE;
+}
+
+static void espnow_peer_release(uint16_t idx) {
+    espnow_peer_hash_remove(idx);
+    memset(&entries[idx], 0, sizeof(espnow_peer_entry_t));
+    entries[idx].prev = entries[idx].next = ESPNOW_PEER_NONE;
+    entries[idx].hash_next = free_head;
+    free_head = idx;
+    stats.known--;
+}
+
+static uint16_t espnow_peer_alloc(const uint8_t* addr) {
+    uint16_t idx = free_head;
+
+    if ( idx != ESPNOW_PEER_NONE ) {
+        free_head = entries[idx].hash_next;
+    }
+    else {
+        // cache full, recycle the least recently used idle node
+        idx = idle_list.tail;
+        if ( idx == ESPNOW_PEER_NONE ) {
+            return ESPNOW_PEER_NONE;
+        }
+        espnow_peer_list_unlink(&idle_list, idx);
+        espnow_peer_hash_remove(idx);
+        stats.recycled++;
+        stats.known--;
+    }
+
+    uint16_t bucket = espnow_peer_hash(addr);
+    espnow_peer_entry_t* e = &entries[idx];
+    memcpy(e->addr, addr, ESP_NOW_ETH_ALEN);
+    e->resident = 0;
+    espnow_rate_init(&e->rate, ESPNOW_RATE_LONG_RANGE);
+    e->prev = e->next = ESPNOW_PEER_NONE;
+    e->hash_next = buckets[bucket];
+    buckets[bucket] = idx;
+    stats.known++;
+    return idx;
+}
+
+static esp_err_t espnow_peer_evict() {
+    uint16_t victim = resident_list.tail;
+    espnow_peer_entry_t* e = &entries[victim];
+
+    esp_err_t ret = esp_now_del_peer(e->addr);
+    if ( ret != ESP_OK && ret != ESP_ERR_ESPNOW_NOT_FOUND ) {
+        ESP_LOGE(TAG, "failed to remove peer from driver (%d)", ret);
+        return ret;
+    }
+    espnow_peer_list_unlink(&resident_list, victim);
+    e->resident = 0;
+    espnow_peer_list_push(&idle_list, victim);
+    stats.evictions++;
+    return ESP_OK;
+}
+
+esp_err_t espnow_peer_init() {
+    ESP_LOGV(TAG, "espnow_peer_init");
+
+    if ( peer_lock == NULL ) {
+        peer_lock = xSemaphoreCreateMutex();
+        if ( peer_lock == NULL ) {
+            ESP_LOGE(TAG, "create mutex fail");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    memset(entries, 0, sizeof(entries));
+    memset(&stats, 0, sizeof(stats));
+    for ( int i = 0; i < ESPNOW_PEER_BUCKETS; i++ ) {
+        buckets[i] = ESPNOW_PEER_NONE;
+    }
+    for ( int i = 0; i < ESPNOW_PEER_CACHE_SIZE; i++ ) {
+        entries[i].prev = entries[i].next = ESPNOW_PEER_NONE;
+        entries[i].hash_next = ( i + 1 < ESPNOW_PEER_CACHE_SIZE ) ? i + 1 : ESPNOW_PEER_NONE;
+    }
+    free_head = 0;
+    espnow_peer_list_init(&resident_list);
+    espnow_peer_list_init(&idle_list);
+
+    ESP_LOGD(TAG, "peer cache: %d known, %d in driver", ESPNOW_PEER_CACHE_SIZE, ESPNOW_PEER_DRIVER_MAX);
+    return ESP_OK;
+}
+
+esp_err_t espnow_peer_done() {
+    ESP_LOGV(TAG, "espnow_peer_done");
+
+    if ( peer_lock == NULL ) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(peer_lock, portMAX_DELAY);
+    while ( resident_list.tail != ESPNOW_PEER_NONE ) {
+        uint16_t idx = resident_list.tail;
+        esp_now_del_peer(entries[idx].addr);
+        espnow_peer_list_unlink(&resident_list, idx);
+    }
+    xSemaphoreGive(peer_lock);
+    vSemaphoreDelete(peer_lock);
+    peer_lock = NULL;
+    return ESP_OK;
+}
+
+esp_err_t espnow_peer_touch(const uint8_t* addr) {
+    ESP_LOGV(TAG, "espnow_peer_touch");
+
+    if ( addr == NULL || peer_lock == NULL ) {
+        ESP_LOGE(TAG, "peer cache not initialized or null addr");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(peer_lock, portMAX_DELAY);
+
+    uint16_t idx = espnow_peer_lookup(addr);
+    if ( idx != ESPNOW_PEER_NONE && entries[idx].resident ) {
+        espnow_peer_list_unlink(&resident_list, idx);
+        espnow_peer_list_push(&resident_list, idx);
+        stats.hits++;
+        xSemaphoreGive(peer_lock);
+        return ESP_OK;
+    }
+
+    if ( idx == ESPNOW_PEER_NONE ) {
+        idx = espnow_peer_alloc(addr);
+        if ( idx == ESPNOW_PEER_NONE ) {
+            ESP_LOGE(TAG, "no peer entry available");
+            xSemaphoreGive(peer_lock);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    else {
+        espnow_peer_list_unlink(&idle_list, idx);
+    }
+    stats.misses++;
+
+    if ( resident_list.count >= ESPNOW_PEER_DRIVER_MAX ) {
+        ret = espnow_peer_evict();
+    }
+    if ( ret == ESP_OK ) {
+        ret = espnow_add_peer(entries[idx].addr);
+    }
+    if ( ret == ESP_OK ) {
+        entries[idx].resident = 1;
+        espnow_peer_list_push(&resident_list, idx);
+    }
+    else {
+        ESP_LOGE(TAG, "failed to register peer (%d)", ret);
+        espnow_peer_list_push(&idle_list, idx);
+    }
+    stats.resident = resident_list.count;
+
+    xSemaphoreGive(peer_lock);
+    return ret;
+}
+
+esp_err_t espnow_peer_forget(const uint8_t* addr) {
+    ESP_LOGV(TAG, "espnow_peer_forget");
+
+    if ( addr == NULL || peer_lock == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(peer_lock, portMAX_DELAY);
+    uint16_t idx = espnow_peer_lookup(addr);
+    if ( idx == ESPNOW_PEER_NONE ) {
+        ret = ESP_ERR_NOT_FOUND;
+    }
+    else {
+        if ( entries[idx].resident ) {
+            esp_now_del_peer(entries[idx].addr);
+            espnow_peer_list_unlink(&resident_list, idx);
+        }
+        else {
+            espnow_peer_list_unlink(&idle_list, idx);
+        }
+        espnow_peer_release(idx);
+        stats.resident = resident_list.count;
+    }
+    xSemaphoreGive(peer_lock);
+    return ret;
+}
+
+uint8_t espnow_peer_rate(const uint8_t* addr, size_t len) {
+    uint8_t rate = ESPNOW_RATE_BASE;
+
+    if ( peer_lock == NULL ) return rate;
+
+    xSemaphoreTake(peer_lock, portMAX_DELAY);
+    uint16_t idx = espnow_peer_lookup(addr);
+    if ( idx != ESPNOW_PEER_NONE ) {
+        rate = espnow_rate_pick(&entries[idx].rate);
+    }
+    stats.rate_frames[rate]++;
+    stats.airtime_us += espnow_rate_airtime_us(rate, len);
+    stats.base_airtime_us += espnow_rate_airtime_us(ESPNOW_RATE_BASE, len);
+    xSemaphoreGive(peer_lock);
+    return rate;
+}
+
+static void espnow_peer_rate_count(int8_t moved) {
+    if ( moved > 0 ) stats.rate_up++;
+    else if ( moved < 0 ) stats.rate_down++;
+}
+
+void espnow_peer_rate_sent(const uint8_t* addr, uint8_t ok) {
+    if ( peer_lock == NULL ) return;
+
+    xSemaphoreTake(peer_lock, portMAX_DELAY);
+    uint16_t idx = espnow_peer_lookup(addr);
+    if ( idx != ESPNOW_PEER_NONE ) {
+        espnow_peer_rate_count(espnow_rate_sent(&entries[idx].rate, ok));
+    }
+    xSemaphoreGive(peer_lock);
+}
+
+void espnow_peer_rate_heard(const uint8_t* addr, int8_t rssi) {
+    if ( peer_lock == NULL || espnow_is_broadcast_addr((uint8_t*)addr) ) return;
+
+    xSemaphoreTake(peer_lock, portMAX_DELAY);
+    uint16_t idx = espnow_peer_lookup(addr);
+    if ( idx == ESPNOW_PEER_NONE ) {
+        // known from now on, registered in the driver on its first unicast
+        idx = espnow_peer_alloc(addr);
+        if ( idx != ESPNOW_PEER_NONE ) {
+            espnow_peer_list_push(&idle_list, idx);
+        }
+    }
+    if ( idx != ESPNOW_PEER_NONE ) {
+        espnow_peer_rate_count(espnow_rate_heard(&entries[idx].rate, rssi));
+    }
+    xSemaphoreGive(peer_lock);
+}
+
+uint8_t espnow_peer_is_known(const uint8_t* addr) {
+    if ( peer_lock == NULL ) return 0;
+
+    xSemaphoreTake(peer_lock, portMAX_DELAY);
+    uint8_t known = ( espnow_peer_lookup(addr) != ESPNOW_PEER_NONE );
+    xSemaphoreGive(peer_lock);
+    return known;
+}
+
+uint8_t espnow_peer_is_resident(const uint8_t* addr) {
+    if ( peer_lock == NULL ) return 0;
+
+    xSemaphoreTake(peer_lock, portMAX_DELAY);
+    uint16_t idx = espnow_peer_lookup(addr);
+    uint8_t resident = ( idx != ESPNOW_PEER_NONE && entries[idx].resident );
+    xSemaphoreGive(peer_lock);
+    return resident;
+}
+
+void espnow_peer_stats_get(espnow_peer_stats_t* stats_out) {
+    if ( stats_out == NULL || peer_lock == NULL ) return;
+
+    xSemaphoreTake(peer_lock, portMAX_DELAY);
+    memcpy(stats_out, &stats, sizeof(espnow_peer_stats_t));
+    xSemaphoreGive(peer_lock);
+}
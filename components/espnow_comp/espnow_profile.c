@@ -0,0 +1,104 @@
+#include "espnow_profile.h"
+#include <string.h>
+
+#define ESPNOW_PROFILE_UNIT_US      100
+#define ESPNOW_PROFILE_SUPPLY_MV    3300
+#define ESPNOW_PROFILE_SLEEP_UA     10
+
+static const char* const phase_names[ESPNOW_PHASE_COUNT] = {
+    "boot", "nvs", "wifi", "espnow", "sensor", "convert", "join", "send", "ack", "sleep"
+};
+
+// typical esp32 current draw in each phase, mA
+static const uint16_t phase_ma[ESPNOW_PHASE_COUNT] = {
+    40,     // boot, cpu and flash
+    40,     // nvs
+    100,    // wifi, rf calibration
+    100,    // espnow, radio on
+    30,     // sensor
+    30,     // convert, cpu mostly waiting
+    110,    // join, mostly listening
+    170,    // send, tx
+    110,    // ack, rx
+    30,     // sleep
+};
+
+void espnow_profile_reset(espnow_profile_t* p) {
+    memset(p, 0, sizeof(espnow_profile_t));
+}
+
+void espnow_profile_start(espnow_profile_t* p, int64_t now_us) {
+    memset(p->cur_us, 0, sizeof(p->cur_us));
+    p->last_us = 0;
+    espnow_profile_mark(p, ESPNOW_PHASE_BOOT, now_us);
+}
+
+void espnow_profile_mark(espnow_profile_t* p, espnow_phase_t phase, int64_t now_us) {
+    if ( phase >= ESPNOW_PHASE_COUNT || now_us < p->last_us ) {
+        return;
+    }
+    p->cur_us[phase] += (uint32_t)( now_us - p->last_us );
+    p->last_us = now_us;
+}
+
+void espnow_profile_end(espnow_profile_t* p) {
+    // past that the average is good enough, keep it
+    if ( p->wakes == UINT16_MAX ) {
+        return;
+    }
+    for ( int i = 0; i < ESPNOW_PHASE_COUNT; i++ ) {
+        uint32_t sum = p->sum_us[i] + p->cur_us[i];
+        p->sum_us[i] = sum < p->sum_us[i] ? UINT32_MAX : sum;
+    }
+    p->wakes++;
+}
+
+uint8_t espnow_profile_info(const espnow_profile_t* p, espnow_profile_info_t* info) {
+    if ( p->wakes == 0 ) {
+        return 0;
+    }
+    info->wakes = p->wakes;
+    for ( int i = 0; i < ESPNOW_PHASE_COUNT; i++ ) {
+        uint32_t avg = p->sum_us[i] / p->wakes / ESPNOW_PROFILE_UNIT_US;
+        info->phase[i] = avg > UINT16_MAX ? UINT16_MAX : avg;
+    }
+    return 1;
+}
+
+void espnow_profile_reported(espnow_profile_t* p) {
+    memset(p->sum_us, 0, sizeof(p->sum_us));
+    p->wakes = 0;
+}
+
+void espnow_profile_merge(espnow_profile_info_t* agg, const espnow_profile_info_t* info) {
+    uint32_t total = (uint32_t)agg->wakes + info->wakes;
+
+    if ( total == 0 ) {
+        return;
+    }
+    for ( int i = 0; i < ESPNOW_PHASE_COUNT; i++ ) {
+        agg->phase[i] = ( (uint64_t)agg->phase[i] * agg->wakes + (uint64_t)info->phase[i] * info->wakes ) / total;
+    }
+    // the weight of the past stops growing there
+    agg->wakes = total > UINT16_MAX ? UINT16_MAX : total;
+}
+
+const char* espnow_profile_phase_name(espnow_phase_t phase) {
+    return phase < ESPNOW_PHASE_COUNT ? phase_names[phase] : "?";
+}
+
+uint32_t espnow_profile_energy_uj(const espnow_profile_info_t* info, uint32_t cycle_ms) {
+    uint64_t nj = 0;        // mA * 0.1 ms * mV / 10 = nJ
+    uint32_t awake = 0;     // 0.1 ms
+
+    for ( int i = 0; i < ESPNOW_PHASE_COUNT; i++ ) {
+        nj += (uint64_t)phase_ma[i] * info->phase[i] * ESPNOW_PROFILE_SUPPLY_MV / 10;
+        awake += info->phase[i];
+    }
+    uint64_t cycle = (uint64_t)cycle_ms * 1000 / ESPNOW_PROFILE_UNIT_US;
+    if ( cycle > awake ) {
+        // uA * 0.1 ms * mV / 10000 = nJ
+        nj += ( cycle - awake ) * ESPNOW_PROFILE_SLEEP_UA * ESPNOW_PROFILE_SUPPLY_MV / 10000;
+    }
+    return (uint32_t)( nj / 1000 );
+}
@@ -0,0 +1,341 @@
+#include "espnow_proto.h"
+#include <string.h>
+
+static inline void espnow_proto_hdr(uint8_t* buf, uint8_t type, uint16_t seq) {
+    espnow_hdr_t hdr = { .magic = ESPNOW_PROTO_MAGIC, .type = type, .seq = seq };
+    memcpy(buf, &hdr, sizeof(espnow_hdr_t));
+}
+
+static inline int32_t espnow_proto_round(float v) {
+    return (int32_t)( v < 0 ? v - 0.5f : v + 0.5f );
+}
+
+#define ESPNOW_PROTO_DELTA_VALUES(count) ( (size_t)(count) * 3 )
+
+// bytes taken by n varints, 0 if truncated
+static size_t espnow_proto_varints_len(const uint8_t* data, size_t len, size_t n) {
+    size_t pos = 0;
+    int32_t v;
+
+    while ( n-- ) {
+        size_t used = espnow_proto_varint_get(data + pos, len - pos, &v);
+        if ( used == 0 ) {
+            return 0;
+        }
+        pos += used;
+    }
+    return pos;
+}
+
+size_t espnow_proto_base_len(const uint8_t* data, size_t len) {
+    if ( data == NULL || len < sizeof(espnow_hdr_t) || data[0] != ESPNOW_PROTO_MAGIC ) {
+        return 0;
+    }
+
+    // frames may grow, only check the minimum length
+    size_t min_len;
+    switch ( ((const espnow_hdr_t*)data)->type ) {
+        case ESPNOW_MSG_DISCOVER:       min_len = sizeof(espnow_discover_t); break;
+        case ESPNOW_MSG_DISCOVER_REPLY: min_len = sizeof(espnow_discover_reply_t); break;
+        case ESPNOW_MSG_ACK:            min_len = sizeof(espnow_ack_t); break;
+        case ESPNOW_MSG_DATA:
+            min_len = sizeof(espnow_data_t);
+            if ( len >= min_len ) {
+                min_len += ((const espnow_data_t*)data)->count * sizeof(espnow_measure_t);
+            }
+            break;
+        case ESPNOW_MSG_DATA_DELTA:
+            min_len = sizeof(espnow_data_delta_t);
+            if ( len >= min_len ) {
+                const espnow_data_delta_t* f = (const espnow_data_delta_t*)data;
+                size_t values = espnow_proto_varints_len(f->values, len - min_len, ESPNOW_PROTO_DELTA_VALUES(f->count));
+                if ( values == 0 && f->count ) {
+                    return 0;
+                }
+                min_len += values;
+            }
+            break;
+        case ESPNOW_MSG_RELAY:
+        case ESPNOW_MSG_RELAY_DOWN:
+            min_len = sizeof(espnow_relay_frame_t);
+            for ( uint8_t i = 0; len >= min_len && i < ((const espnow_relay_frame_t*)data)->count; i++ ) {
+                if ( len < min_len + ESPNOW_RELAY_ENTRY_HDR ) {
+                    return 0;
+                }
+                min_len += ESPNOW_RELAY_ENTRY_HDR + data[min_len + ESPNOW_PROTO_ADDR_LEN];
+            }
+            break;
+        default:
+            return 0;
+    }
+    return len < min_len ? 0 : min_len;
+}
+
+int espnow_proto_parse(const uint8_t* data, size_t len, espnow_hdr_t* hdr) {
+    if ( espnow_proto_base_len(data, len) == 0 ) {
+        return -1;
+    }
+
+    espnow_hdr_t h;
+    memcpy(&h, data, sizeof(espnow_hdr_t));
+    if ( hdr != NULL ) {
+        memcpy(hdr, &h, sizeof(espnow_hdr_t));
+    }
+    return h.type;
+}
+
+size_t espnow_proto_opt_add(uint8_t* buf, size_t len, uint8_t type, const void* value, uint8_t vlen) {
+    if ( len + 2 + vlen > ESPNOW_PROTO_MAX_LEN ) {
+        return 0;
+    }
+    buf[len] = type;
+    buf[len + 1] = vlen;
+    memcpy(buf + len + 2, value, vlen);
+    return len + 2 + vlen;
+}
+
+const uint8_t* espnow_proto_opt_find(const uint8_t* data, size_t len, uint8_t type, uint8_t* vlen) {
+    size_t pos = espnow_proto_base_len(data, len);
+
+    if ( pos == 0 ) {
+        return NULL;
+    }
+    while ( pos + 2 <= len && pos + 2 + data[pos + 1] <= len ) {
+        if ( data[pos] == type ) {
+            if ( vlen != NULL ) {
+                *vlen = data[pos + 1];
+            }
+            return data + pos + 2;
+        }
+        pos += 2 + data[pos + 1];
+    }
+    return NULL;
+}
+
+size_t espnow_proto_discover(uint8_t* buf, uint16_t seq, uint32_t token) {
+    espnow_discover_t* f = (espnow_discover_t*)buf;
+
+    espnow_proto_hdr(buf, ESPNOW_MSG_DISCOVER, seq);
+    f->token = token;
+    return sizeof(espnow_discover_t);
+}
+
+size_t espnow_proto_discover_reply(uint8_t* buf, uint16_t seq, const uint8_t* master, uint8_t channel, uint32_t token) {
+    espnow_discover_reply_t* f = (espnow_discover_reply_t*)buf;
+
+    espnow_proto_hdr(buf, ESPNOW_MSG_DISCOVER_REPLY, seq);
+    memcpy(f->master, master, ESPNOW_PROTO_ADDR_LEN);
+    f->channel = channel;
+    f->flags = 0;
+    f->token = token;
+    return sizeof(espnow_discover_reply_t);
+}
+
+size_t espnow_proto_relay(uint8_t* buf, uint8_t type, uint16_t seq, uint8_t hops) {
+    espnow_relay_frame_t* f = (espnow_relay_frame_t*)buf;
+
+    espnow_proto_hdr(buf, type, seq);
+    f->hops = hops;
+    f->count = 0;
+    return sizeof(espnow_relay_frame_t);
+}
+
+size_t espnow_proto_relay_add(uint8_t* buf, size_t len, const uint8_t* addr, const uint8_t* frame, uint8_t flen) {
+    espnow_relay_frame_t* f = (espnow_relay_frame_t*)buf;
+
+    if ( len + ESPNOW_RELAY_ENTRY_HDR + flen > ESPNOW_PROTO_MAX_LEN || f->count == 0xff ) {
+        return 0;
+    }
+    memcpy(buf + len, addr, ESPNOW_PROTO_ADDR_LEN);
+    buf[len + ESPNOW_PROTO_ADDR_LEN] = flen;
+    memcpy(buf + len + ESPNOW_RELAY_ENTRY_HDR, frame, flen);
+    f->count++;
+    return len + ESPNOW_RELAY_ENTRY_HDR + flen;
+}
+
+const uint8_t* espnow_proto_relay_next(const uint8_t* data, size_t len, size_t* pos, const uint8_t** addr, uint8_t* flen) {
+    size_t end = espnow_proto_base_len(data, len);
+
+    if ( *pos == 0 ) {
+        *pos = sizeof(espnow_relay_frame_t);
+    }
+    // base_len checked every entry
+    if ( end == 0 || *pos + ESPNOW_RELAY_ENTRY_HDR > end ) {
+        return NULL;
+    }
+    *addr = data + *pos;
+    *flen = data[*pos + ESPNOW_PROTO_ADDR_LEN];
+    *pos += ESPNOW_RELAY_ENTRY_HDR + *flen;
+    return *addr + ESPNOW_RELAY_ENTRY_HDR;
+}
+
+size_t espnow_proto_data(uint8_t* buf, uint16_t seq, const espnow_measure_t* measure, uint8_t count) {
+    espnow_data_t* f = (espnow_data_t*)buf;
+
+    if ( count > ESPNOW_DATA_MAX_MEASURES ) {
+        return 0;
+    }
+    espnow_proto_hdr(buf, ESPNOW_MSG_DATA, seq);
+    f->flags = 0;
+    f->count = count;
+    memcpy(f->measure, measure, count * sizeof(espnow_measure_t));
+    return sizeof(espnow_data_t) + count * sizeof(espnow_measure_t);
+}
+
+size_t espnow_proto_ack(uint8_t* buf, uint16_t seq, uint32_t token, uint8_t status) {
+    espnow_ack_t* f = (espnow_ack_t*)buf;
+
+    espnow_proto_hdr(buf, ESPNOW_MSG_ACK, seq);
+    f->token = token;
+    f->status = status;
+    return sizeof(espnow_ack_t);
+}
+
+size_t espnow_proto_varint_put(uint8_t* buf, size_t room, int32_t value) {
+    uint32_t v = ( (uint32_t)value << 1 ) ^ (uint32_t)( value >> 31 );
+    size_t n = 0;
+
+    do {
+        if ( n == room ) {
+            return 0;
+        }
+        buf[n++] = (uint8_t)( ( v & 0x7f ) | ( v > 0x7f ? 0x80 : 0 ) );
+        v >>= 7;
+    } while ( v );
+    return n;
+}
+
+size_t espnow_proto_varint_get(const uint8_t* buf, size_t len, int32_t* value) {
+    uint32_t v = 0;
+
+    for ( size_t n = 0; n < len && n < 5; n++ ) {
+        v |= (uint32_t)( buf[n] & 0x7f ) << ( 7 * n );
+        if ( ( buf[n] & 0x80 ) == 0 ) {
+            *value = (int32_t)( ( v >> 1 ) ^ -( v & 1 ) );
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+size_t espnow_proto_data_delta(uint8_t* buf, uint16_t seq, const espnow_measure_t* ref, uint16_t ref_seq,
+                               const espnow_measure_t* measure, uint8_t count) {
+    espnow_data_delta_t* f = (espnow_data_delta_t*)buf;
+    espnow_measure_t prev = { 0 };
+    size_t len = sizeof(espnow_data_delta_t);
+
+    espnow_proto_hdr(buf, ESPNOW_MSG_DATA_DELTA, seq);
+    f->flags = ref == NULL ? ESPNOW_DATA_KEY : 0;
+    f->count = count;
+    f->ref_seq = ref == NULL ? 0 : ref_seq;
+    if ( ref != NULL ) {
+        prev = *ref;
+    }
+    for ( uint8_t i = 0; i < count; i++ ) {
+        // wrapping deltas, decoded back with the same wrap
+        int32_t delta[3] = {
+            (int32_t)( (uint32_t)measure[i].temp - (uint32_t)prev.temp ),
+            (int32_t)( (uint32_t)measure[i].humi - (uint32_t)prev.humi ),
+            (int32_t)( (uint32_t)measure[i].pres - (uint32_t)prev.pres ),
+        };
+        for ( int k = 0; k < 3; k++ ) {
+            size_t used = espnow_proto_varint_put(buf + len, ESPNOW_PROTO_MAX_LEN - len, delta[k]);
+            if ( used == 0 ) {
+                return 0;
+            }
+            len += used;
+        }
+        prev = measure[i];
+    }
+    return len;
+}
+
+int espnow_proto_data_delta_decode(const uint8_t* data, size_t len, const espnow_measure_t* ref,
+                                   espnow_measure_t* measure, uint8_t max) {
+    const espnow_data_delta_t* f = (const espnow_data_delta_t*)data;
+    espnow_measure_t prev = { 0 };
+    size_t pos = sizeof(espnow_data_delta_t);
+
+    if ( espnow_proto_parse(data, len, NULL) != ESPNOW_MSG_DATA_DELTA || f->count > max ) {
+        return -1;
+    }
+    if ( ( f->flags & ESPNOW_DATA_KEY ) == 0 ) {
+        if ( ref == NULL ) {
+            return -1;
+        }
+        prev = *ref;
+    }
+    for ( uint8_t i = 0; i < f->count; i++ ) {
+        int32_t delta[3];
+        for ( int k = 0; k < 3; k++ ) {
+            // lengths already checked by the parse
+            pos += espnow_proto_varint_get(data + pos, len - pos, &delta[k]);
+        }
+        measure[i].temp = (int32_t)( (uint32_t)prev.temp + (uint32_t)delta[0] );
+        measure[i].humi = (int32_t)( (uint32_t)prev.humi + (uint32_t)delta[1] );
+        measure[i].pres = (int32_t)( (uint32_t)prev.pres + (uint32_t)delta[2] );
+        prev = measure[i];
+    }
+    return f->count;
+}
+
+size_t espnow_proto_ages_put(uint8_t* buf, size_t room, const uint32_t* age_s, uint8_t count) {
+    size_t len = 0;
+
+    for ( uint8_t i = 0; i < count; i++ ) {
+        // oldest first, the differences stay small and positive
+        int32_t v = (int32_t)( i ? age_s[i - 1] - age_s[i] : age_s[0] );
+        size_t used = espnow_proto_varint_put(buf + len, room - len, v);
+        if ( used == 0 ) {
+            return 0;
+        }
+        len += used;
+    }
+    return len;
+}
+
+int espnow_proto_ages_get(const uint8_t* value, size_t len, uint32_t* age_s, uint8_t max) {
+    size_t pos = 0;
+    int count = 0;
+
+    while ( pos < len ) {
+        int32_t v;
+        size_t used = espnow_proto_varint_get(value + pos, len - pos, &v);
+        if ( used == 0 || count == max ) {
+            return -1;
+        }
+        age_s[count] = count ? age_s[count - 1] - (uint32_t)v : (uint32_t)v;
+        pos += used;
+        count++;
+    }
+    return count;
+}
+
+void espnow_proto_measure_from_float(espnow_measure_t* m, float temp, float humi, float pres) {
+    m->temp = espnow_proto_round(temp * 100.0f);
+    m->humi = espnow_proto_round(humi * 100.0f);
+    m->pres = espnow_proto_round(pres * 100.0f);
+}
+
+// crc-16/ccitt-false
+uint16_t espnow_proto_crc16(const uint8_t* data, size_t len) {
+    uint16_t crc = 0xffff;
+
+    while ( len-- ) {
+        crc ^= (uint16_t)( *data++ ) << 8;
+        for ( int i = 0; i < 8; i++ ) {
+            crc = ( crc & 0x8000 ) ? (uint16_t)( ( crc << 1 ) ^ 0x1021 ) : (uint16_t)( crc << 1 );
+        }
+    }
+    return crc;
+}
+
+uint32_t espnow_proto_addr_hash(const uint8_t* addr) {
+    // fnv-1a, the 3 first bytes (oui) are often the same for all nodes
+    uint32_t h = 2166136261u;
+
+    for ( int i = 0; i < ESPNOW_PROTO_ADDR_LEN; i++ ) {
+        h = ( h ^ addr[i] ) * 16777619u;
+    }
+    return h ^ ( h >> 16 );
+}
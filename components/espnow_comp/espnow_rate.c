@@ -0,0 +1,133 @@
+#include "espnow_rate.h"
+
+typedef struct {
+    const char* name;
+    int8_t      floor;          // rssi under which the rate is not tried
+    uint16_t    symbol_bits;    // ofdm data bits per 4 us symbol, 0: dsss or long range
+    uint8_t     us_per_bit;
+} espnow_rate_info_t;
+
+/* Floors are the esp32 sensitivity at the rate plus about 10 dB of margin.
+ * The long range preamble is taken as the 802.11b long one. */
+static const espnow_rate_info_t rate_info[ESPNOW_RATE_MAX] = {
+    [ESPNOW_RATE_24M]       = { "24M",      -74,    96, 0 },
+    [ESPNOW_RATE_12M]       = { "12M",      -79,    48, 0 },
+    [ESPNOW_RATE_6M]        = { "6M",       -84,    24, 0 },
+    [ESPNOW_RATE_1M]        = { "1M",       -90,    0,  1 },
+    [ESPNOW_RATE_LR_500K]   = { "LR500K",   -96,    0,  2 },
+    [ESPNOW_RATE_LR_250K]   = { "LR250K",   -128,   0,  4 },
+};
+
+#define ESPNOW_RATE_TARGET_DELIVERY     ( ESPNOW_RATE_TARGET * ESPNOW_RATE_DELIVERY_ALL / 100 )
+
+static uint8_t espnow_rate_fastest(const espnow_rate_t* r, int8_t rssi) {
+    uint8_t rate = 0;
+
+    while ( rate < r->slowest && rssi < rate_info[rate].floor ) {
+        rate++;
+    }
+    return rate;
+}
+
+// rounded, the EWMA is negative
+static inline int8_t espnow_rate_rssi(const espnow_rate_t* r) {
+    return (int8_t)( ( r->rssi - ESPNOW_RATE_RSSI_SCALE / 2 ) / ESPNOW_RATE_RSSI_SCALE );
+}
+
+static void espnow_rate_move(espnow_rate_t* r, uint8_t rate) {
+    r->rate = rate;
+    r->delivery = ESPNOW_RATE_DELIVERY_ALL;
+    r->streak = 0;
+    r->probing = 0;
+}
+
+void espnow_rate_init(espnow_rate_t* r, uint8_t long_range) {
+    r->slowest = long_range ? ESPNOW_RATE_LR_250K : ESPNOW_RATE_1M;
+    r->rssi = 0;
+    r->backoff = 0;
+    espnow_rate_move(r, ESPNOW_RATE_BASE);
+}
+
+uint8_t espnow_rate_pick(espnow_rate_t* r) {
+    if ( !ESPNOW_RATE_ADAPT ) {
+        return ESPNOW_RATE_BASE;
+    }
+    if ( r->rate > 0 && r->delivery >= ESPNOW_RATE_TARGET_DELIVERY &&
+         r->streak >= ( ESPNOW_RATE_PROBE_AFTER << r->backoff ) &&
+         ( r->rssi == 0 || espnow_rate_rssi(r) >= rate_info[r->rate - 1].floor ) ) {
+        r->probing = 1;
+        r->streak = 0;
+        return r->rate - 1;
+    }
+    r->probing = 0;
+    return r->rate;
+}
+
+int8_t espnow_rate_sent(espnow_rate_t* r, uint8_t ok) {
+    if ( r->probing ) {
+        r->probing = 0;
+        if ( ok ) {
+            espnow_rate_move(r, r->rate - 1);
+            if ( r->backoff ) r->backoff--;
+            return 1;
+        }
+        if ( r->backoff < ESPNOW_RATE_BACKOFF_MAX ) r->backoff++;
+        return 0;
+    }
+    if ( ok ) {
+        r->delivery += ( ESPNOW_RATE_DELIVERY_ALL - r->delivery + ( 1 << ESPNOW_RATE_DELIVERY_SHIFT ) - 1 ) >>
+                       ESPNOW_RATE_DELIVERY_SHIFT;
+        if ( r->streak < UINT16_MAX ) r->streak++;
+        return 0;
+    }
+    r->delivery -= r->delivery >> ESPNOW_RATE_DELIVERY_SHIFT;
+    r->streak = 0;
+    if ( r->delivery < ESPNOW_RATE_TARGET_DELIVERY && r->rate < r->slowest ) {
+        // the rate just left is not probed again soon
+        espnow_rate_move(r, r->rate + 1);
+        if ( r->backoff < ESPNOW_RATE_BACKOFF_MAX ) r->backoff++;
+        return -1;
+    }
+    return 0;
+}
+
+int8_t espnow_rate_heard(espnow_rate_t* r, int8_t rssi) {
+    // unknown, see the header
+    if ( rssi >= 0 ) {
+        return 0;
+    }
+    if ( r->rssi == 0 ) {
+        r->rssi = (int16_t)( rssi * ESPNOW_RATE_RSSI_SCALE );
+        // nothing sent at the rate yet, start where the rssi says
+        if ( r->streak == 0 && r->delivery == ESPNOW_RATE_DELIVERY_ALL ) {
+            espnow_rate_move(r, espnow_rate_fastest(r, rssi));
+        }
+        return 0;
+    }
+    // a quarter of the way from one negative value to another, never back to 0
+    r->rssi += ( rssi * ESPNOW_RATE_RSSI_SCALE - r->rssi ) / ( 1 << ESPNOW_RATE_RSSI_SHIFT );
+    if ( r->rate < r->slowest && espnow_rate_rssi(r) < rate_info[r->rate].floor - ESPNOW_RATE_RSSI_HYST ) {
+        espnow_rate_move(r, espnow_rate_fastest(r, espnow_rate_rssi(r)));
+        return -1;
+    }
+    return 0;
+}
+
+uint8_t espnow_rate_is_long_range(uint8_t rate) {
+    return rate == ESPNOW_RATE_LR_500K || rate == ESPNOW_RATE_LR_250K;
+}
+
+uint32_t espnow_rate_airtime_us(uint8_t rate, size_t len) {
+    const espnow_rate_info_t* info = &rate_info[rate < ESPNOW_RATE_MAX ? rate : ESPNOW_RATE_BASE];
+    uint32_t bits = ( len + ESPNOW_RATE_OVERHEAD ) * 8;
+
+    if ( info->symbol_bits ) {
+        // preamble and signal field, then symbols with the service and tail bits
+        return 20 + ( ( bits + 22 + info->symbol_bits - 1 ) / info->symbol_bits ) * 4;
+    }
+    return 192 + bits * info->us_per_bit;
+}
+
+const char* espnow_rate_name(uint8_t rate) {
+    return rate < ESPNOW_RATE_MAX ? rate_info[rate].name : "?";
+}
@@ -0,0 +1,325 @@
+#include "espnow_relay.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include <string.h>
+
+static const char *TAG = "espnow_relay";
+
+void espnow_relay_init(espnow_relay_t* r, const espnow_transport_t* transport, const uint8_t* self) {
+    memset(r, 0, sizeof(espnow_relay_t));
+    r->transport = transport;
+    memcpy(r->self, self, ESPNOW_PROTO_ADDR_LEN);
+}
+
+void espnow_relay_set_parent(espnow_relay_t* r, const uint8_t* parent, uint8_t channel, uint32_t token, uint8_t parent_hops) {
+    // whatever waits went to the old parent or would lead nowhere
+    memset(r->reply, 0, sizeof(r->reply));
+    r->bundle_len = 0;
+    r->loss = 0;
+    r->sent = 0;
+    if ( parent == NULL ) {
+        // the children time out and look for another way, none of them through this relay
+        memset(r->child, 0, sizeof(r->child));
+        r->stats.children = 0;
+        r->hops = 0;
+        return;
+    }
+    memcpy(r->parent, parent, ESPNOW_PROTO_ADDR_LEN);
+    r->channel = channel;
+    r->token = token;
+    r->hops = parent_hops + 1;
+    ESP_LOGI(TAG, "parent %02x:%02x:%02x:%02x:%02x:%02x, %d hops to the master",
+        parent[0], parent[1], parent[2], parent[3], parent[4], parent[5], r->hops);
+}
+
+uint8_t espnow_relay_parent_lost(const espnow_relay_t* r) {
+    return r->hops && r->sent >= ESPNOW_RELAY_MIN_SENT && r->loss > ESPNOW_RELAY_MAX_LOSS;
+}
+
+uint8_t espnow_relay_wants(const uint8_t* data, size_t len) {
+    switch ( espnow_proto_parse(data, len, NULL) ) {
+        case ESPNOW_MSG_DISCOVER:
+        case ESPNOW_MSG_DATA:
+        case ESPNOW_MSG_DATA_DELTA:
+        case ESPNOW_MSG_RELAY:
+        case ESPNOW_MSG_RELAY_DOWN:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static espnow_relay_child_t* espnow_relay_child_find(espnow_relay_t* r, const uint8_t* addr) {
+    for ( int i = 0; i < ESPNOW_RELAY_MAX_CHILDREN; i++ ) {
+        if ( r->child[i].state != ESPNOW_RELAY_CHILD_FREE && memcmp(r->child[i].addr, addr, ESPNOW_PROTO_ADDR_LEN) == 0 ) {
+            return &r->child[i];
+        }
+    }
+    return NULL;
+}
+
+// known child, else a free entry, else the least recently heard one
+static espnow_relay_child_t* espnow_relay_child_get(espnow_relay_t* r, const uint8_t* addr, uint32_t now_ms) {
+    espnow_relay_child_t* c = espnow_relay_child_find(r, addr);
+
+    if ( c != NULL ) {
+        return c;
+    }
+    c = &r->child[0];
+    for ( int i = 0; i < ESPNOW_RELAY_MAX_CHILDREN && c->state != ESPNOW_RELAY_CHILD_FREE; i++ ) {
+        espnow_relay_child_t* e = &r->child[i];
+        if ( e->state == ESPNOW_RELAY_CHILD_FREE || (int32_t)( now_ms - e->seen_ms ) > (int32_t)( now_ms - c->seen_ms ) ) {
+            c = e;
+        }
+    }
+    if ( c->state == ESPNOW_RELAY_CHILD_FREE ) {
+        r->stats.children++;
+    }
+    memset(c, 0, sizeof(espnow_relay_child_t));
+    memcpy(c->addr, addr, ESPNOW_PROTO_ADDR_LEN);
+    return c;
+}
+
+static void espnow_relay_loss(espnow_relay_t* r, uint8_t ok) {
+    int32_t sample = ok ? 0 : 1000;
+
+    r->loss = (uint16_t)( r->loss + ( ( sample - (int32_t)r->loss ) >> ESPNOW_RELAY_LOSS_SHIFT ) );
+    if ( r->sent < 0xffff ) {
+        r->sent++;
+    }
+}
+
+static esp_err_t espnow_relay_send_parent(espnow_relay_t* r, const uint8_t* data, size_t len) {
+    esp_err_t ret = espnow_transport_send(r->transport, r->parent, data, len);
+
+    espnow_relay_loss(r, ret == ESP_OK);
+    if ( ret != ESP_OK ) {
+        r->stats.send_failed++;
+    }
+    return ret;
+}
+
+static void espnow_relay_flush(espnow_relay_t* r) {
+    if ( r->bundle_len == 0 ) {
+        return;
+    }
+    if ( espnow_relay_send_parent(r, r->bundle, r->bundle_len) != ESP_OK ) {
+        // let the retries of the children go up again
+        size_t         pos = 0;
+        const uint8_t* addr;
+        uint8_t        flen;
+        while ( espnow_proto_relay_next(r->bundle, r->bundle_len, &pos, &addr, &flen) != NULL ) {
+            espnow_relay_child_t* c = espnow_relay_child_find(r, addr);
+            if ( c != NULL && c->state == ESPNOW_RELAY_CHILD_FORWARDED ) {
+                c->sent_ms -= ESPNOW_RELAY_RETRY_MS;
+            }
+        }
+    }
+    r->stats.bundles++;
+    r->bundle_len = 0;
+}
+
+static void espnow_relay_bundle_add(espnow_relay_t* r, const uint8_t* addr, const uint8_t* frame, uint8_t flen,
+                                    uint8_t hops, uint32_t now_ms) {
+    for ( int attempt = 0; attempt < 2; attempt++ ) {
+        if ( r->bundle_len == 0 ) {
+            r->bundle_len = espnow_proto_relay(r->bundle, ESPNOW_MSG_RELAY, r->seq++, hops);
+            r->bundle_ms = now_ms;
+        }
+        size_t len = espnow_proto_relay_add(r->bundle, r->bundle_len, addr, frame, flen);
+        if ( len ) {
+            espnow_relay_frame_t* f = (espnow_relay_frame_t*)r->bundle;
+            if ( hops > f->hops ) {
+                f->hops = hops;
+            }
+            r->bundle_len = len;
+            r->stats.forwarded++;
+            return;
+        }
+        // full, the frame opens the next one
+        espnow_relay_flush(r);
+    }
+}
+
+static void espnow_relay_down(espnow_relay_t* r, const uint8_t* dest, const uint8_t* frame, uint8_t flen) {
+    espnow_relay_child_t* c = espnow_relay_child_find(r, dest);
+    espnow_hdr_t          hdr;
+
+    if ( c == NULL ) {
+        r->stats.unroutable++;
+        return;
+    }
+    if ( espnow_proto_parse(frame, flen, &hdr) == ESPNOW_MSG_ACK && hdr.seq == c->seq &&
+         c->state == ESPNOW_RELAY_CHILD_FORWARDED && flen <= ESPNOW_RELAY_ACK_MAX ) {
+        memcpy(c->ack, frame, flen);
+        c->ack_len = flen;
+        c->state = ESPNOW_RELAY_CHILD_ACKED;
+    }
+    r->stats.down++;
+    if ( memcmp(c->via, c->addr, ESPNOW_PROTO_ADDR_LEN) == 0 ) {
+        espnow_transport_send(r->transport, c->addr, frame, flen);
+        return;
+    }
+    // behind another relay
+    uint8_t buf[ESPNOW_PROTO_MAX_LEN];
+    size_t  len = espnow_proto_relay(buf, ESPNOW_MSG_RELAY_DOWN, r->seq++, 0);
+
+    len = espnow_proto_relay_add(buf, len, c->addr, frame, flen);
+    if ( len ) {
+        espnow_transport_send(r->transport, c->via, buf, len);
+    }
+}
+
+// frame of a child in range (via == addr) or behind a relay
+static void espnow_relay_up(espnow_relay_t* r, const uint8_t* via, const uint8_t* addr, const uint8_t* frame, uint8_t flen,
+                            uint8_t hops, uint32_t now_ms) {
+    espnow_hdr_t hdr;
+
+    if ( memcmp(addr, r->self, ESPNOW_PROTO_ADDR_LEN) == 0 || espnow_proto_parse(frame, flen, &hdr) < 0 ) {
+        r->stats.unroutable++;
+        return;
+    }
+
+    espnow_relay_child_t* c = espnow_relay_child_get(r, addr, now_ms);
+
+    memcpy(c->via, via, ESPNOW_PROTO_ADDR_LEN);
+    c->seen_ms = now_ms;
+    if ( c->state == ESPNOW_RELAY_CHILD_ACKED && hdr.seq == c->seq ) {
+        r->stats.dup_acked++;
+        espnow_relay_down(r, addr, c->ack, c->ack_len);
+        return;
+    }
+    if ( c->state == ESPNOW_RELAY_CHILD_FORWARDED && hdr.seq == c->seq &&
+         (int32_t)( now_ms - c->sent_ms ) < ESPNOW_RELAY_RETRY_MS ) {
+        r->stats.dup_dropped++;
+        return;
+    }
+    c->state = ESPNOW_RELAY_CHILD_FORWARDED;
+    c->seq = hdr.seq;
+    c->sent_ms = now_ms;
+    espnow_relay_bundle_add(r, addr, frame, flen, hops, now_ms);
+}
+
+static void espnow_relay_discover(espnow_relay_t* r, const uint8_t* src, int8_t rssi, uint16_t seq, uint32_t now_ms) {
+    // no way to the master, or our own parent looking for one
+    if ( r->hops == 0 || r->hops >= ESPNOW_RELAY_MAX_HOPS || rssi < ESPNOW_RELAY_MIN_RSSI ||
+         memcmp(src, r->parent, ESPNOW_PROTO_ADDR_LEN) == 0 ) {
+        return;
+    }
+
+    uint32_t delay_ms = r->hops * ESPNOW_RELAY_HOP_DELAY_MS + r->loss / 50;
+    if ( rssi < ESPNOW_RELAY_GOOD_RSSI ) {
+        delay_ms += ( ESPNOW_RELAY_GOOD_RSSI - rssi ) / 4;
+    }
+    // relays alike would all answer at once and collide at the node
+    delay_ms += esp_random() % ESPNOW_RELAY_HOP_DELAY_MS;
+    if ( delay_ms > ESPNOW_RELAY_REPLY_MAX_MS ) {
+        delay_ms = ESPNOW_RELAY_REPLY_MAX_MS;
+    }
+
+    espnow_relay_reply_t* slot = NULL;
+    for ( int i = 0; i < ESPNOW_RELAY_PENDING; i++ ) {
+        if ( r->reply[i].used && memcmp(r->reply[i].addr, src, ESPNOW_PROTO_ADDR_LEN) == 0 ) {
+            slot = &r->reply[i];
+            break;
+        }
+        if ( !r->reply[i].used && slot == NULL ) {
+            slot = &r->reply[i];
+        }
+    }
+    if ( slot == NULL ) {
+        return;
+    }
+    memcpy(slot->addr, src, ESPNOW_PROTO_ADDR_LEN);
+    slot->seq = seq;
+    slot->used = 1;
+    slot->due_ms = now_ms + delay_ms;
+}
+
+void espnow_relay_on_frame(espnow_relay_t* r, const uint8_t* src, int8_t rssi, const uint8_t* data, size_t len, uint32_t now_ms) {
+    espnow_hdr_t   hdr;
+    size_t         pos = 0;
+    const uint8_t* addr;
+    const uint8_t* frame;
+    uint8_t        flen;
+
+    switch ( espnow_proto_parse(data, len, &hdr) ) {
+        case ESPNOW_MSG_DISCOVER:
+            espnow_relay_discover(r, src, rssi, hdr.seq, now_ms);
+            break;
+        case ESPNOW_MSG_DATA:
+        case ESPNOW_MSG_DATA_DELTA:
+            // without a parent the child times out and looks for another one
+            if ( r->hops && len <= ESPNOW_PROTO_MAX_LEN - sizeof(espnow_relay_frame_t) - ESPNOW_RELAY_ENTRY_HDR ) {
+                espnow_relay_up(r, src, src, data, (uint8_t)len, 1, now_ms);
+            }
+            break;
+        case ESPNOW_MSG_RELAY:
+            if ( r->hops == 0 ) {
+                r->stats.unroutable += ((const espnow_relay_frame_t*)data)->count;
+                break;
+            }
+            /* No relay answers a discover past the max hops, a bundle that
+             * went through that many is in a loop: every mac ack in it
+             * succeeds, its frames count as lost towards the parent. */
+            if ( ((const espnow_relay_frame_t*)data)->hops >= ESPNOW_RELAY_MAX_HOPS ) {
+                r->stats.unroutable += ((const espnow_relay_frame_t*)data)->count;
+                r->stats.looped++;
+                espnow_relay_loss(r, 0);
+                break;
+            }
+            while ( ( frame = espnow_proto_relay_next(data, len, &pos, &addr, &flen) ) != NULL ) {
+                espnow_relay_up(r, src, addr, frame, flen, ((const espnow_relay_frame_t*)data)->hops + 1, now_ms);
+            }
+            break;
+        case ESPNOW_MSG_RELAY_DOWN:
+            if ( r->hops == 0 || memcmp(src, r->parent, ESPNOW_PROTO_ADDR_LEN) != 0 ) {
+                break;
+            }
+            while ( ( frame = espnow_proto_relay_next(data, len, &pos, &addr, &flen) ) != NULL ) {
+                espnow_relay_down(r, addr, frame, flen);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+uint32_t espnow_relay_poll(espnow_relay_t* r, uint32_t now_ms) {
+    uint32_t next_ms = UINT32_MAX;
+
+    for ( int i = 0; i < ESPNOW_RELAY_PENDING; i++ ) {
+        espnow_relay_reply_t* slot = &r->reply[i];
+        int32_t               left = (int32_t)( slot->due_ms - now_ms );
+
+        if ( !slot->used ) {
+            continue;
+        }
+        if ( left > 0 ) {
+            next_ms = (uint32_t)left < next_ms ? (uint32_t)left : next_ms;
+            continue;
+        }
+
+        uint8_t buf[ESPNOW_PROTO_MAX_LEN];
+        size_t  len = espnow_proto_discover_reply(buf, slot->seq, r->self, r->channel, r->token);
+
+        len = espnow_proto_opt_add(buf, len, ESPNOW_OPT_HOPS, &r->hops, sizeof(r->hops));
+        espnow_transport_send(r->transport, slot->addr, buf, len);
+        slot->used = 0;
+    }
+
+    if ( r->bundle_len ) {
+        int32_t left = (int32_t)( r->bundle_ms + ESPNOW_RELAY_WINDOW_MS - now_ms );
+        if ( left <= 0 ) {
+            espnow_relay_flush(r);
+        }
+        else if ( (uint32_t)left < next_ms ) {
+            next_ms = (uint32_t)left;
+        }
+    }
+    return next_ms;
+}
+
+void espnow_relay_stats_get(const espnow_relay_t* r, espnow_relay_stats_t* stats) {
+    memcpy(stats, &r->stats, sizeof(espnow_relay_stats_t));
+}
@@ -0,0 +1,50 @@
+#include "espnow_report.h"
+#include <string.h>
+
+void espnow_report_reset(espnow_report_t* r) {
+    memset(r, 0, sizeof(espnow_report_t));
+}
+
+uint8_t espnow_report_enabled(const espnow_config_t* cfg) {
+    return cfg->value[ESPNOW_CFG_DEADBAND_T] || cfg->value[ESPNOW_CFG_DEADBAND_H] || cfg->value[ESPNOW_CFG_DEADBAND_P];
+}
+
+uint8_t espnow_report_due(const espnow_report_t* r, const espnow_config_t* cfg, uint32_t now_ms) {
+    if ( !r->contact ) {
+        return 1;
+    }
+    // up to a week, the node clock wraps after 49 days
+    return (int32_t)( now_ms - r->contact_ms ) >= (int32_t)( cfg->value[ESPNOW_CFG_HEARTBEAT_S] * 1000 );
+}
+
+static uint8_t espnow_report_past(int32_t value, int32_t last, uint32_t deadband) {
+    int64_t diff = (int64_t)value - last;
+
+    return deadband && ( diff >= (int64_t)deadband || -diff >= (int64_t)deadband );
+}
+
+uint8_t espnow_report_sample(espnow_report_t* r, const espnow_config_t* cfg, const espnow_measure_t* m, uint32_t now_ms) {
+    uint8_t keep = !espnow_report_enabled(cfg) || !r->valid || espnow_report_due(r, cfg, now_ms) ||
+                   espnow_report_past(m->temp, r->last.temp, cfg->value[ESPNOW_CFG_DEADBAND_T]) ||
+                   espnow_report_past(m->humi, r->last.humi, cfg->value[ESPNOW_CFG_DEADBAND_H]) ||
+                   espnow_report_past(m->pres, r->last.pres, cfg->value[ESPNOW_CFG_DEADBAND_P]);
+
+    r->samples++;
+    if ( !keep ) {
+        r->skipped++;
+        return 0;
+    }
+    r->last = *m;
+    r->valid = 1;
+    return 1;
+}
+
+void espnow_report_contact(espnow_report_t* r, uint32_t now_ms) {
+    r->contact = 1;
+    r->contact_ms = now_ms;
+}
+
+void espnow_report_info(const espnow_report_t* r, espnow_report_info_t* info) {
+    info->samples = r->samples;
+    info->skipped = r->skipped;
+}
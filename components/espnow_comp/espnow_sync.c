@@ -0,0 +1,56 @@
+#include "espnow_sync.h"
+#include "esp_log.h"
+
+static const char *TAG = "espnow_sync";
+
+void espnow_sync_update(espnow_sync_t* sync, const espnow_sync_info_t* info, int64_t local_ms) {
+    int64_t  offset = (int64_t)info->time_ms - local_ms;
+    uint32_t elapsed = info->time_ms - sync->synced_ms;
+
+    // the clock error since the last sync gives the drift of the local clock
+    if ( sync->valid && sync->period_ms == info->period_ms && elapsed >= 1000 && elapsed < 0x80000000 ) {
+        int64_t error = offset - sync->offset_ms;
+        int64_t ppm = error * 1000000 / elapsed;
+
+        if ( ppm > -ESPNOW_SYNC_MAX_DRIFT_PPM && ppm < ESPNOW_SYNC_MAX_DRIFT_PPM ) {
+            sync->drift_ppm = sync->drift_ppm ? (int32_t)( ( 3 * (int64_t)sync->drift_ppm + ppm ) / 4 ) : (int32_t)ppm;
+        }
+        ESP_LOGD(TAG, "clock error %d ms over %u ms, drift %d ppm", (int)error, elapsed, sync->drift_ppm);
+    }
+    sync->offset_ms = offset;
+    sync->period_ms = info->period_ms;
+    sync->slot_ms = info->period_ms ? info->slot_ms % info->period_ms : 0;
+    sync->synced_ms = info->time_ms;
+    sync->valid = info->period_ms != 0;
+}
+
+uint32_t espnow_sync_sleep_ms(const espnow_sync_t* sync, int64_t local_ms, uint32_t nominal_ms) {
+    if ( !sync->valid || sync->period_ms == 0 ) {
+        return nominal_ms;
+    }
+
+    int64_t period = sync->period_ms;
+    int64_t now = local_ms + sync->offset_ms;
+    // the slot occurrence closest to the nominal wake
+    int64_t half = ( nominal_ms < period ? nominal_ms : period ) / 2;
+    int64_t earliest = now + nominal_ms - half;
+    int64_t pos = ( earliest + sync->lead_ms - sync->slot_ms ) % period;
+
+    if ( pos < 0 ) {
+        pos += period;
+    }
+    int64_t sleep = earliest - now + ( pos ? period - pos : 0 );
+
+    // the sleep timer runs on the local clock
+    sleep -= sleep * sync->drift_ppm / 1000000;
+    return sleep > 0 ? (uint32_t)sleep : nominal_ms;
+}
+
+uint32_t espnow_sync_slot_ms(uint32_t index, uint32_t period_ms, uint32_t width_ms) {
+    if ( period_ms == 0 || width_ms == 0 ) {
+        return 0;
+    }
+    uint32_t slots = period_ms / width_ms;
+
+    return slots ? ( index % slots ) * width_ms : 0;
+}
@@ -0,0 +1,45 @@
+#include "espnow_window.h"
+
+void espnow_window_reset(espnow_window_t* w) {
+    w->bits = 0;
+    w->top = 0;
+    w->valid = 0;
+}
+
+uint8_t espnow_window_restart(espnow_window_t* w, uint16_t seq) {
+    int16_t ahead = (int16_t)( seq - w->top );
+
+    if ( w->valid && ahead > -ESPNOW_WINDOW_SIZE ) {
+        return 0;
+    }
+    espnow_window_reset(w);
+    return 1;
+}
+
+espnow_window_result_t espnow_window_check(espnow_window_t* w, uint16_t seq) {
+    if ( !w->valid ) {
+        w->bits = 1;
+        w->top = seq;
+        w->valid = 1;
+        return ESPNOW_WINDOW_NEW;
+    }
+
+    int16_t ahead = (int16_t)( seq - w->top );
+    if ( ahead > 0 ) {
+        w->bits = ahead >= ESPNOW_WINDOW_SIZE ? 0 : w->bits << ahead;
+        w->bits |= 1;
+        w->top = seq;
+        return ESPNOW_WINDOW_NEW;
+    }
+
+    uint16_t behind = (uint16_t)( -ahead );
+    if ( behind >= ESPNOW_WINDOW_SIZE ) {
+        return ESPNOW_WINDOW_STALE;
+    }
+    uint64_t bit = (uint64_t)1 << behind;
+    if ( w->bits & bit ) {
+        return ESPNOW_WINDOW_DUP;
+    }
+    w->bits |= bit;
+    return ESPNOW_WINDOW_NEW;
+}
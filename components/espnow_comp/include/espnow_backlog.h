@@ -0,0 +1,66 @@
+#ifndef _ESPNOW_BACKLOG_H_
+#define _ESPNOW_BACKLOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "espnow_proto.h"
+#include "espnow_delta.h"
+
+/*
+ * Measures a node could not get acked, kept for its next contact with the
+ * master.
+ *
+ * A ring of fixed point samples with their time on the node clock (which
+ * keeps running in deep sleep), sized to fit in RTC memory. Every measure
+ * goes through it: a wake pushes its own and sends the oldest ones first,
+ * as many per data frame as fit, each with its age so the master stamps
+ * it with the time it was taken. When the ring is full the oldest sample
+ * is dropped, or spilled to NVS by the node.
+ *
+ * A data frame left without answer may still have reached the master: the
+ * same oldest samples go again with the same seq, so that the master takes
+ * it as a duplicate, before anything else is sent.
+ */
+
+#ifdef CONFIG_ESPNOW_BACKLOG_SIZE
+#define ESPNOW_BACKLOG_SIZE     CONFIG_ESPNOW_BACKLOG_SIZE
+#else
+#define ESPNOW_BACKLOG_SIZE     64
+#endif
+
+// measures per data frame, fewer when their deltas do not fit
+#define ESPNOW_BACKLOG_BATCH    32
+
+typedef struct {
+    espnow_measure_t    measure;
+    uint32_t            ts;         // node clock, ms, wraps
+} espnow_backlog_sample_t;
+
+typedef struct {
+    espnow_backlog_sample_t sample[ESPNOW_BACKLOG_SIZE];
+    uint16_t            head;       // oldest
+    uint16_t            count;
+    uint32_t            dropped;    // pushed out of a full ring
+    uint16_t            pending_seq;
+    uint8_t             pending;    // oldest samples sent with pending_seq, not answered
+} espnow_backlog_t;
+
+void     espnow_backlog_reset(espnow_backlog_t* b);
+// returns 1 when the oldest sample was dropped to make room
+uint8_t  espnow_backlog_push(espnow_backlog_t* b, const espnow_measure_t* measure, uint32_t ts);
+// copy the max oldest samples, returns their number
+uint16_t espnow_backlog_peek(const espnow_backlog_t* b, espnow_backlog_sample_t* out, uint16_t max);
+// forget the count oldest samples, once acked
+void     espnow_backlog_pop(espnow_backlog_t* b, uint16_t count);
+// a data frame with the used oldest samples went out, answered or not
+void     espnow_backlog_sent(espnow_backlog_t* b, uint16_t seq, uint8_t used, uint8_t answered);
+
+/* Data frame with as many of the count samples as fit, from the first one,
+ * only the pending ones when a frame is left without answer:
+ * delta coded against tx, raw data frame when tx is NULL, with their ages
+ * at now_ms unless they are all fresh. Returns the frame length, 0 if even
+ * one does not fit, and the samples taken in used. */
+size_t   espnow_backlog_encode(const espnow_backlog_t* b, espnow_delta_tx_t* tx, uint8_t* buf, const espnow_backlog_sample_t* sample,
+                               uint16_t count, uint32_t now_ms, uint8_t* used);
+
+#endif // _ESPNOW_BACKLOG_H_
@@ -9,6 +9,25 @@
 #include "esp_netif.h"
 #include "esp_wifi.h"
 
+#include "espnow_peer.h"
+#include "espnow_proto.h"
+#include "espnow_link.h"
+#include "espnow_sync.h"
+#include "espnow_delta.h"
+#include "espnow_window.h"
+#include "espnow_profile.h"
+#include "espnow_backlog.h"
+#include "espnow_node.h"
+#include "espnow_transport.h"
+#include "espnow_rate.h"
+
+// channel the master listens on, nodes find it by themselves
+#ifdef CONFIG_ESPNOW_CHANNEL
+#define ESPNOW_CHANNEL  CONFIG_ESPNOW_CHANNEL
+#else
+#define ESPNOW_CHANNEL  1
+#endif
+
 
 
 
@@ -16,7 +35,19 @@ uint8_t espnow_is_null_addr(uint8_t* addr);
 uint8_t espnow_is_broadcast_addr(uint8_t* addr);
 
 esp_err_t espnow_init(esp_now_send_cb_t send_sb, esp_now_recv_cb_t recv_cb, uint8_t* addr);
+// minimal radio bring up for esp-now only sensor nodes, after nvs_flash_init()
+esp_err_t espnow_init_fast(esp_now_send_cb_t send_cb, esp_now_recv_cb_t recv_cb);
 esp_err_t espnow_done();
+esp_err_t espnow_set_channel(uint8_t channel);
+uint8_t   espnow_get_channel();
+// rf off between exchanges and back on the same channel, esp-now stays initialized
+esp_err_t espnow_radio_off();
+esp_err_t espnow_radio_on();
+// permanent peer, never swapped out (broadcast, master), follows the radio channel
 esp_err_t espnow_add_peer(uint8_t* addr);
+// rssi of a frame, only valid on the data and len given to the receive callback, 0 unknown
+int8_t    espnow_rx_rssi(const uint8_t* data, int len);
+// esp_now_send at an espnow_rate_id_t, ESPNOW_RATE_BASE for broadcasts
+esp_err_t espnow_send_at(const uint8_t* addr, const uint8_t* data, size_t len, uint8_t rate);
 
 #endif // _ESPNOW_COMP_H
\ No newline at end of file
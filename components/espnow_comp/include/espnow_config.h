@@ -0,0 +1,58 @@
+#ifndef _ESPNOW_CONFIG_H_
+#define _ESPNOW_CONFIG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "espnow_proto.h"
+
+/*
+ * Node settings pushed by the master, as an option of its acks.
+ *
+ * Every node is built with the same defaults (below, part of the protocol
+ * so both sides agree on them). The master sends only the settings that
+ * differ, [key][varint] each, after a 16 bit version that is a hash of
+ * them. A node applies the whole set over the defaults (a key the master
+ * drops goes back to its default), keeps it in RTC memory and NVS and
+ * tells its version to the master once, so the config only rides along
+ * with the acks of nodes that run another one.
+ */
+
+typedef enum {
+    ESPNOW_CFG_PERIOD_S = 1,    // sample period, s
+    ESPNOW_CFG_OSRS_T,          // bme280 oversampling codes, 0 skips the channel
+    ESPNOW_CFG_OSRS_H,
+    ESPNOW_CFG_OSRS_P,
+    ESPNOW_CFG_FILTER,          // bme280 iir filter code
+    ESPNOW_CFG_BATCH,           // measures kept before the radio goes up
+    ESPNOW_CFG_DEADBAND_T,      // report threshold, 0.01 C
+    ESPNOW_CFG_DEADBAND_H,      // 0.01 %
+    ESPNOW_CFG_DEADBAND_P,      // 0.01 hPa
+    ESPNOW_CFG_HEARTBEAT_S,     // longest silence of a node that skips its reports, s
+    ESPNOW_CFG_LIGHT_SLEEP,     // 1: mains powered nodes stay up in light sleep between samples
+    ESPNOW_CFG_LIGHT_PERIOD_MS, // their sample period, ms
+    ESPNOW_CFG_COUNT
+} espnow_config_key_t;
+
+// longest option value: version, then every key with a 5 byte varint
+#define ESPNOW_CONFIG_MAX_LEN   ( 2 + ( ESPNOW_CFG_COUNT - 1 ) * 6 )
+
+typedef struct {
+    uint16_t    version;                    // 0: the defaults
+    uint32_t    value[ESPNOW_CFG_COUNT];    // by key, [0] unused
+} espnow_config_t;
+
+void      espnow_config_default(espnow_config_t* cfg);
+// ESP_ERR_INVALID_ARG for an unknown key or a value out of its range
+esp_err_t espnow_config_set(espnow_config_t* cfg, uint8_t key, uint32_t value);
+const char* espnow_config_key_name(uint8_t key);
+
+// ESPNOW_OPT_CONFIG value, returns its length, 0 if no room
+size_t    espnow_config_put(const espnow_config_t* cfg, uint8_t* buf, size_t room);
+/* Whole set over the defaults, values out of range are clamped, keys not
+ * known by this build are skipped (the node still takes the version, or
+ * the master would send it again and again). ESP_ERR_INVALID_ARG if
+ * malformed, cfg is left as is then. */
+esp_err_t espnow_config_get(espnow_config_t* cfg, const uint8_t* value, size_t len);
+
+#endif // _ESPNOW_CONFIG_H_
@@ -0,0 +1,53 @@
+#ifndef _ESPNOW_DELTA_H_
+#define _ESPNOW_DELTA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "espnow_proto.h"
+
+/*
+ * Reference tracking for ESPNOW_MSG_DATA_DELTA frames.
+ *
+ * The node codes its measures against the last one the master acked and
+ * keeps it across deep sleep. The master keeps the references of the last
+ * two data frames of each node: when an ack is lost the node sends again
+ * a frame coded against the older one. A node without a reference, or
+ * told to resync, sends a keyframe, and one every ESPNOW_DELTA_KEYFRAME_INTERVAL
+ * frames anyway.
+ */
+
+#ifdef CONFIG_ESPNOW_DELTA_KEYFRAME_INTERVAL
+#define ESPNOW_DELTA_KEYFRAME_INTERVAL  CONFIG_ESPNOW_DELTA_KEYFRAME_INTERVAL
+#else
+#define ESPNOW_DELTA_KEYFRAME_INTERVAL  32
+#endif
+
+// node side, fits in RTC memory
+typedef struct {
+    espnow_measure_t    ref;        // last measure acked by the master
+    uint16_t            ref_seq;    // data frame it came with
+    uint8_t             valid;
+    uint8_t             since_key;  // frames acked since the last keyframe
+    espnow_measure_t    pending;    // last measure of the frame in flight
+    uint8_t             pending_key;
+} espnow_delta_tx_t;
+
+// master side, per node
+typedef struct {
+    espnow_measure_t    ref[2];     // newest first
+    uint16_t            seq[2];
+    uint8_t             count;
+} espnow_delta_rx_t;
+
+void   espnow_delta_tx_reset(espnow_delta_tx_t* tx);
+// keyframe or delta frame for count measures, 0 if they do not fit
+size_t espnow_delta_tx_encode(espnow_delta_tx_t* tx, uint8_t* buf, const espnow_measure_t* measure, uint8_t count);
+// outcome of the frame built by the last encode: seq as sent, ack status or -1 without ack
+void   espnow_delta_tx_done(espnow_delta_tx_t* tx, uint16_t seq, int status);
+
+// reference a delta frame was coded against, NULL if forgotten
+const espnow_measure_t* espnow_delta_rx_ref(const espnow_delta_rx_t* rx, uint16_t ref_seq);
+// a data frame was decoded, last is its last measure
+void   espnow_delta_rx_push(espnow_delta_rx_t* rx, uint16_t seq, const espnow_measure_t* last);
+
+#endif // _ESPNOW_DELTA_H_
@@ -0,0 +1,169 @@
+#ifndef _ESPNOW_LINK_H_
+#define _ESPNOW_LINK_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "espnow_proto.h"
+
+/*
+ * Node side link to the master.
+ *
+ * Besides its master the cache keeps up to ESPNOW_LINK_ALTERNATES other
+ * masters, as advertised by the master (ESPNOW_OPT_MASTERS), each with a
+ * score: the delivery ratio of its exchanges (EWMA) less a penalty for a
+ * weak signal of its acks. One missed ack of the master sends the retry
+ * to the best scored alternate, which becomes the master: a failover
+ * costs a retry, not a discovery.
+ *
+ * espnow_link_cache_t is what a node remembers across deep sleep (RTC
+ * memory, NVS). espnow_link_t runs one exchange (join or data + ack) as a
+ * non blocking state machine: every call returns the next action, a frame
+ * to send on a channel and how long to wait for the next event. The radio
+ * and the waiting are left to the caller (espnow_node on target).
+ */
+
+#ifdef CONFIG_ESPNOW_LINK_ACK_FAILURES
+#define ESPNOW_LINK_ACK_FAILURES        CONFIG_ESPNOW_LINK_ACK_FAILURES
+#else
+#define ESPNOW_LINK_ACK_FAILURES        3
+#endif
+
+#ifdef CONFIG_ESPNOW_DISCOVER_ATTEMPTS
+#define ESPNOW_LINK_DISCOVER_ATTEMPTS   CONFIG_ESPNOW_DISCOVER_ATTEMPTS
+#else
+#define ESPNOW_LINK_DISCOVER_ATTEMPTS   5
+#endif
+
+#ifdef CONFIG_ESPNOW_ACK_TIMEOUT_MS
+#define ESPNOW_LINK_ACK_TIMEOUT_MS      CONFIG_ESPNOW_ACK_TIMEOUT_MS
+#else
+#define ESPNOW_LINK_ACK_TIMEOUT_MS      100
+#endif
+
+#ifdef CONFIG_ESPNOW_SEND_RETRIES
+#define ESPNOW_LINK_SEND_RETRIES        CONFIG_ESPNOW_SEND_RETRIES
+#else
+#define ESPNOW_LINK_SEND_RETRIES        2
+#endif
+
+#ifdef CONFIG_ESPNOW_SCAN_DWELL_MS
+#define ESPNOW_LINK_SCAN_DWELL_MS       CONFIG_ESPNOW_SCAN_DWELL_MS
+#else
+#define ESPNOW_LINK_SCAN_DWELL_MS       40
+#endif
+
+#ifdef CONFIG_ESPNOW_LINK_ALTERNATES
+#define ESPNOW_LINK_ALTERNATES          CONFIG_ESPNOW_LINK_ALTERNATES
+#else
+#define ESPNOW_LINK_ALTERNATES          2
+#endif
+
+#define ESPNOW_LINK_MIN_CHANNEL         1
+#define ESPNOW_LINK_MAX_CHANNEL         13
+#define ESPNOW_LINK_BACKOFF_BASE_MS     50
+#define ESPNOW_LINK_BACKOFF_MAX_MS      800
+// deep sleep is stretched up to this factor while no master answers
+#define ESPNOW_LINK_SLEEP_FACTOR_MAX    4
+// score: delivery EWMA weight 1/4, 4 points per dB under ESPNOW_LINK_GOOD_RSSI
+#define ESPNOW_LINK_DELIVERY_SHIFT      2
+#define ESPNOW_LINK_DELIVERY_NEW        192
+#define ESPNOW_LINK_GOOD_RSSI           -70
+
+typedef struct {
+    uint8_t     addr[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t     channel;
+    uint8_t     delivery;           // acked exchanges EWMA, 255: all of them
+    int8_t      rssi;               // of its last ack, 0: not heard yet
+    uint32_t    token;              // 0: not known yet
+} espnow_link_peer_t;
+
+typedef struct {
+    uint8_t     master[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t     channel;            // kept as a scan hint when the master is lost
+    uint8_t     ack_failures;
+    uint32_t    token;
+    uint16_t    seq;
+    uint8_t     discover_failures;
+    uint8_t     valid;
+    uint8_t     delivery;           // of the master, as for the alternates
+    int8_t      rssi;
+    uint8_t     alt_count;
+    espnow_link_peer_t alt[ESPNOW_LINK_ALTERNATES];
+    uint16_t    crc;
+} espnow_link_cache_t;
+
+typedef enum {
+    ESPNOW_LINK_IDLE = 0,
+    ESPNOW_LINK_JOINING,
+    ESPNOW_LINK_SENDING,
+    ESPNOW_LINK_DONE,
+    ESPNOW_LINK_FAILED,
+} espnow_link_state_t;
+
+typedef struct {
+    uint8_t         dest[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t         channel;
+    uint8_t         len;            // 0: nothing to send
+    const uint8_t*  frame;
+    uint32_t        wait_ms;        // new deadline, 0 keeps the current one
+} espnow_link_action_t;
+
+typedef struct {
+    espnow_link_cache_t*    cache;
+    espnow_link_state_t     state;
+    uint8_t                 attempt;
+    uint8_t                 retries;
+    uint8_t                 scan_channel;   // 0: probing the cached channel
+    uint8_t                 probes;         // frames sent during this exchange
+    uint8_t                 failovers;      // masters switched during this exchange
+    uint8_t                 max_hops;       // join: replies of relays this many hops away or more ignored, 0: any
+    uint16_t                seq;
+    uint8_t                 frame[ESPNOW_PROTO_MAX_LEN];
+    uint8_t                 frame_len;
+    uint8_t                 ack[ESPNOW_PROTO_MAX_LEN];  // last ack or discover reply, for its options
+    uint8_t                 ack_len;
+} espnow_link_t;
+
+void           espnow_link_init(espnow_link_t* link, espnow_link_cache_t* cache);
+
+uint8_t        espnow_link_cache_is_valid(const espnow_link_cache_t* cache);
+void           espnow_link_cache_seal(espnow_link_cache_t* cache);
+
+uint8_t        espnow_link_is_valid(const espnow_link_t* link);
+const uint8_t* espnow_link_master(const espnow_link_t* link);
+uint8_t        espnow_link_channel(const espnow_link_t* link);
+uint32_t       espnow_link_token(const espnow_link_t* link);
+uint16_t       espnow_link_next_seq(espnow_link_t* link);
+
+esp_err_t      espnow_link_set_master(espnow_link_t* link, const uint8_t* master, uint8_t channel, uint32_t token);
+void           espnow_link_invalidate(espnow_link_t* link);
+
+// signal of the frame that ended the exchange, part of the master score
+void           espnow_link_rssi(espnow_link_t* link, int8_t rssi);
+// 0 to 255, delivery ratio less the weak signal penalty
+uint8_t        espnow_link_score(uint8_t delivery, int8_t rssi);
+
+// result of a data frame, the cache is dropped after ESPNOW_LINK_ACK_FAILURES
+// failures in a row and the node goes back to broadcast discovery
+void           espnow_link_ack(espnow_link_t* link, uint8_t ok, uint32_t token);
+
+// wait before discovery attempt n, exponential with jitter
+uint32_t       espnow_link_discover_delay_ms(uint8_t attempt);
+// longest join: every sweep without answer, every delay at its jitter bound
+uint32_t       espnow_link_join_max_ms();
+// deep sleep stretch after joins without master, 1 before espnow_link_init
+uint32_t       espnow_link_sleep_factor(const espnow_link_t* link);
+
+// exchanges: the cached channel is probed first, then every channel
+espnow_link_state_t espnow_link_join_start(espnow_link_t* link, espnow_link_action_t* act);
+// frame must start with an espnow_hdr_t, its seq is set here
+espnow_link_state_t espnow_link_send_start(espnow_link_t* link, const uint8_t* frame, size_t len, espnow_link_action_t* act);
+// again with the seq of a frame left without answer in an earlier exchange,
+// a master that got it answers as a duplicate instead of storing it twice
+espnow_link_state_t espnow_link_resend_start(espnow_link_t* link, const uint8_t* frame, size_t len, uint16_t seq, espnow_link_action_t* act);
+
+espnow_link_state_t espnow_link_on_frame(espnow_link_t* link, const uint8_t* mac, const uint8_t* data, size_t len, espnow_link_action_t* act);
+espnow_link_state_t espnow_link_on_send_status(espnow_link_t* link, uint8_t ok, espnow_link_action_t* act);
+espnow_link_state_t espnow_link_on_timeout(espnow_link_t* link, espnow_link_action_t* act);
+
+#endif // _ESPNOW_LINK_H_
@@ -0,0 +1,82 @@
+#ifndef _ESPNOW_LINKSTAT_H_
+#define _ESPNOW_LINKSTAT_H_
+
+#include <stdint.h>
+
+/*
+ * Link quality of one sensor, master side, fixed size.
+ *
+ * Every frame counts with its rssi, data frames with their sequence: the
+ * sequences skipped before a new one are frames the master never got, the
+ * copies of one (lost acks) are duplicates, the time from one new frame
+ * to the next is the interval and its change from one frame to the next
+ * the jitter. Discovers take their sequence from the same counter: a node
+ * that rejoins goes on from the one of its discover, the probes the master
+ * missed before are not data frames lost. Each of these metrics keeps an EWMA (1/8 of each sample) and
+ * a histogram of ESPNOW_LINKSTAT_BUCKETS saturating counters.
+ *
+ * A weak node shows its rssi going down and its gaps up well before it
+ * goes silent.
+ */
+
+typedef enum {
+    ESPNOW_LINKSTAT_RSSI = 0,   // dBm, every frame
+    ESPNOW_LINKSTAT_GAP,        // frames missing before each new data frame
+    ESPNOW_LINKSTAT_DUP,        // copies of a data frame past the first, counted on the next one
+    ESPNOW_LINKSTAT_INTERVAL,   // ms between new data frames
+    ESPNOW_LINKSTAT_JITTER,     // ms, change of the interval
+    ESPNOW_LINKSTAT_COUNT,
+} espnow_linkstat_metric_t;
+
+#define ESPNOW_LINKSTAT_BUCKETS     6
+#define ESPNOW_LINKSTAT_SHIFT       3
+// EWMA fixed point
+#define ESPNOW_LINKSTAT_SCALE       16
+
+// weak: rssi EWMA under this, or more than ESPNOW_LINKSTAT_WEAK_LOSS per mille of the data frames lost
+#define ESPNOW_LINKSTAT_WEAK_RSSI   -85
+#define ESPNOW_LINKSTAT_WEAK_LOSS   50
+// silent: not heard for that many intervals
+#define ESPNOW_LINKSTAT_SILENT      3
+
+typedef enum {
+    ESPNOW_LINKSTAT_NEW = 0,    // data frame seen for the first time
+    ESPNOW_LINKSTAT_COPY,       // seen before, acked again
+    ESPNOW_LINKSTAT_RESTART,    // first frame after a node power on, the sequence starts over
+} espnow_linkstat_kind_t;
+
+typedef struct {
+    int32_t     ewma;           // x ESPNOW_LINKSTAT_SCALE
+    uint16_t    hist[ESPNOW_LINKSTAT_BUCKETS];
+} espnow_linkstat_value_t;
+
+typedef struct {
+    espnow_linkstat_value_t value[ESPNOW_LINKSTAT_COUNT];
+    uint32_t    frames;         // any frame
+    uint32_t    data;           // new data frames
+    uint32_t    lost;           // sum of the gaps, less the late frames
+    uint32_t    duplicates;
+    uint32_t    last_ms;        // master clock, last frame
+    uint32_t    data_ms;        // last new data frame
+    uint32_t    interval_ms;    // between the two last ones, 0 until then
+    uint16_t    seq;            // newest data frame
+    uint8_t     copies;         // of seq so far
+    uint8_t     rejoined;       // seq is the one of a discover
+} espnow_linkstat_t;
+
+void     espnow_linkstat_reset(espnow_linkstat_t* s);
+// any frame from the node, rssi 0 when not known
+void     espnow_linkstat_frame(espnow_linkstat_t* s, int8_t rssi, uint32_t now_ms);
+void     espnow_linkstat_data(espnow_linkstat_t* s, uint16_t seq, espnow_linkstat_kind_t kind, uint32_t now_ms);
+// discover from the node
+void     espnow_linkstat_rejoin(espnow_linkstat_t* s, uint16_t seq);
+
+// upper bound (excluded) of bucket i of a metric, INT32_MAX for the last one
+int32_t  espnow_linkstat_bound(espnow_linkstat_metric_t metric, uint8_t bucket);
+const char* espnow_linkstat_name(espnow_linkstat_metric_t metric);
+// per mille of the data frames lost since the master booted
+uint32_t espnow_linkstat_loss(const espnow_linkstat_t* s);
+uint8_t  espnow_linkstat_weak(const espnow_linkstat_t* s);
+uint8_t  espnow_linkstat_silent(const espnow_linkstat_t* s, uint32_t now_ms);
+
+#endif // _ESPNOW_LINKSTAT_H_
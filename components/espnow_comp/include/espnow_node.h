@@ -0,0 +1,124 @@
+#ifndef _ESPNOW_NODE_H_
+#define _ESPNOW_NODE_H_
+
+#include "esp_err.h"
+#include "esp_now.h"
+#include "espnow_link.h"
+#include "espnow_sync.h"
+#include "espnow_delta.h"
+#include "espnow_profile.h"
+#include "espnow_backlog.h"
+#include "espnow_config.h"
+#include "espnow_report.h"
+#include "espnow_relay.h"
+
+/*
+ * Sensor node side of espnow_comp: runs espnow_link exchanges on the radio.
+ *
+ * The link cache lives in RTC memory and is copied to NVS whenever a new
+ * master (or channel) is found, so a node woken from deep sleep goes
+ * straight to the right channel and a node powered on skips the scan when
+ * the master did not move. The wake slot given by the master, the
+ * delta coding reference, the wake profile and the backlog of measures
+ * not acked yet are kept in RTC memory as well. A full backlog spills its
+ * oldest half to NVS, up to ESPNOW_NODE_BACKLOG_CHUNKS times. The settings
+ * pushed by the master (espnow_config_t) are kept in RTC memory and NVS,
+ * the reporting state with its deadbands (espnow_report_t) in RTC memory.
+ * The link cache holds the alternate masters as well, a failover to one
+ * of them is saved like a new master.
+ *
+ * A node that never sleeps may take the relay role (espnow_relay_t): a
+ * task of its own forwards the frames of other sensors to the master of
+ * the node, next to the exchanges of the node itself.
+ */
+
+// margin for the boot time not seen by esp_timer
+#ifdef CONFIG_ESPNOW_SLOT_GUARD_MS
+#define ESPNOW_NODE_SLOT_GUARD_MS   CONFIG_ESPNOW_SLOT_GUARD_MS
+#else
+#define ESPNOW_NODE_SLOT_GUARD_MS   30
+#endif
+
+// 0: the oldest samples of a full backlog are dropped
+#ifdef CONFIG_ESPNOW_BACKLOG_NVS_CHUNKS
+#define ESPNOW_NODE_BACKLOG_CHUNKS  CONFIG_ESPNOW_BACKLOG_NVS_CHUNKS
+#else
+#define ESPNOW_NODE_BACKLOG_CHUNKS  8
+#endif
+
+typedef struct {
+    uint32_t    ready_us;       // boot to radio on the master channel
+    uint32_t    first_frame_us; // boot to the first frame handed to the radio
+    uint32_t    join_us;        // 0 when the cached master was used
+    uint8_t     join_probes;    // discover frames sent by the last join
+    uint8_t     channel;
+    uint32_t    send_us;        // last data frame to its ack
+    uint8_t     send_probes;    // frames sent including retries
+    uint8_t     send_failovers; // masters switched on missed acks
+    uint8_t     send_rate;      // espnow_rate_id_t to the master after the last exchange
+} espnow_node_stats_t;
+
+// link from the rtc cache, settings and power on resets, no radio: call
+// it once nvs is up, before the backlog or the link are used on a wake
+// that leaves the radio off. espnow_node_init runs it if not done yet
+void           espnow_node_prepare();
+// call after espnow_init(espnow_node_send_cb, espnow_node_recv_cb, NULL)
+esp_err_t      espnow_node_init();
+// espnow_init (espnow_init_fast with CONFIG_ESPNOW_FAST_WAKE) and espnow_node_init
+esp_err_t      espnow_node_radio_init();
+// espnow_node_radio_init and espnow_node_join in a task on the other core,
+// the caller starts its sensor meanwhile then waits for the radio, the
+// phases marked by the bring up stay on the critical path
+esp_err_t      espnow_node_start();
+// result of the bring up, ESP_ERR_NOT_FOUND when no master answered the
+// join, ESP_ERR_TIMEOUT when still running after timeout_ms
+esp_err_t      espnow_node_wait_ready(uint32_t timeout_ms);
+espnow_link_t* espnow_node_link();
+
+// find the master: cached one as is, else probe the cached channel then
+// scan, ESP_ERR_NOT_FOUND when none answered
+esp_err_t      espnow_node_join();
+// send a frame to the master and wait for its ack, retries included,
+// ESP_ERR_INVALID_RESPONSE when the master did not accept it
+esp_err_t      espnow_node_send(const uint8_t* frame, size_t len);
+// measures into the backlog, then drained: oldest first, as delta frames
+// against the last acked one (reference in rtc memory), more frames while
+// the master gives credit. ESP_OK when every frame sent was acked
+esp_err_t      espnow_node_send_measures(const espnow_measure_t* measure, uint8_t count);
+// keep measures for the next contact with the master
+void           espnow_node_store(const espnow_measure_t* measure, uint8_t count);
+esp_err_t      espnow_node_drain();
+uint32_t       espnow_node_backlog_count();
+
+void           espnow_node_send_cb(const uint8_t* mac_addr, esp_now_send_status_t status);
+void           espnow_node_recv_cb(const uint8_t* mac_addr, const uint8_t* data, int len);
+
+// deep sleep length landing on the node slot, nominal_ms without one
+uint32_t       espnow_node_sleep_ms(uint32_t nominal_ms);
+const espnow_sync_t* espnow_node_sync();
+
+// wake profile: start first thing in app_main, mark the end of each phase
+// (espnow_init and the node mark theirs), end right before deep sleep
+void           espnow_node_profile_start();
+void           espnow_node_mark(espnow_phase_t phase);
+void           espnow_node_profile_end();
+const espnow_profile_t* espnow_node_profile();
+
+// settings pushed by the master, defaults until then; call it once nvs
+// is up and before espnow_node_start(), it loads them on power on
+const espnow_config_t* espnow_node_config();
+
+// every sample of the node: 1 when it is to be stored for the master, 0
+// when within the deadbands of the last one kept
+uint8_t        espnow_node_report(const espnow_measure_t* measure);
+// the heartbeat is due, the radio comes up whatever the samples
+uint8_t        espnow_node_report_due();
+
+void           espnow_node_stats_get(espnow_node_stats_t* stats);
+
+// relay role, mains powered nodes only: the radio stays on, the node joins
+// again to learn its hops to the master, then answers other sensors
+esp_err_t      espnow_node_relay_start();
+void           espnow_node_relay_stats_get(espnow_relay_stats_t* stats);
+
+#endif // _ESPNOW_NODE_H_
@@ -0,0 +1,71 @@
+#ifndef _ESPNOW_PEER_H_
+#define _ESPNOW_PEER_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_now.h"
+#include "espnow_rate.h"
+
+// number of known nodes kept in RAM, per app: a sensor only needs a few
+#ifdef CONFIG_ESPNOW_PEER_CACHE_SIZE
+#define ESPNOW_PEER_CACHE_SIZE  CONFIG_ESPNOW_PEER_CACHE_SIZE
+#else
+#define ESPNOW_PEER_CACHE_SIZE  256
+#endif
+
+// number of nodes registered in the esp-now driver at the same time.
+// broadcast and pinned peers (espnow_add_peer) are not counted here.
+#ifdef CONFIG_ESPNOW_PEER_DRIVER_MAX
+#define ESPNOW_PEER_DRIVER_MAX  CONFIG_ESPNOW_PEER_DRIVER_MAX
+#else
+#define ESPNOW_PEER_DRIVER_MAX  16
+#endif
+
+// hash buckets, must be a power of 2
+#if ESPNOW_PEER_CACHE_SIZE <= 16
+#define ESPNOW_PEER_BUCKETS     16
+#elif ESPNOW_PEER_CACHE_SIZE <= 64
+#define ESPNOW_PEER_BUCKETS     64
+#else
+#define ESPNOW_PEER_BUCKETS     256
+#endif
+
+#define ESPNOW_PEER_NONE        0xffff
+
+typedef struct {
+    uint32_t    hits;           // peer already registered in the driver
+    uint32_t    misses;         // peer had to be registered
+    uint32_t    evictions;      // peer removed from the driver to make room
+    uint32_t    recycled;       // known node dropped from the cache (cache full)
+    uint16_t    known;          // nodes in the cache
+    uint16_t    resident;       // nodes registered in the driver
+    uint32_t    rate_up;        // probes acked
+    uint32_t    rate_down;      // on losses or rssi
+    uint32_t    rate_frames[ESPNOW_RATE_MAX];   // unicasts sent at each rate
+    uint64_t    airtime_us;     // of the unicasts sent
+    uint64_t    base_airtime_us;// the same unicasts at ESPNOW_RATE_BASE
+} espnow_peer_stats_t;
+
+esp_err_t espnow_peer_init();
+esp_err_t espnow_peer_done();
+
+// make sure addr is registered in the driver, swap out the least
+// recently used node if the driver is full
+esp_err_t espnow_peer_touch(const uint8_t* addr);
+// forget a node, remove it from the driver if needed
+esp_err_t espnow_peer_forget(const uint8_t* addr);
+
+/* Rate adaptation (espnow_rate.h), kept with the node in the cache. A
+ * node dropped from the cache starts over at ESPNOW_RATE_BASE. */
+// rate of the next unicast of len bytes to addr
+uint8_t   espnow_peer_rate(const uint8_t* addr, size_t len);
+// mac layer status of the last unicast to addr
+void      espnow_peer_rate_sent(const uint8_t* addr, uint8_t ok);
+// rssi of a frame heard from addr, the first one sets the rate of a new node
+void      espnow_peer_rate_heard(const uint8_t* addr, int8_t rssi);
+
+uint8_t   espnow_peer_is_known(const uint8_t* addr);
+uint8_t   espnow_peer_is_resident(const uint8_t* addr);
+void      espnow_peer_stats_get(espnow_peer_stats_t* stats);
+
+#endif // _ESPNOW_PEER_H_
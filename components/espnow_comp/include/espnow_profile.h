@@ -0,0 +1,51 @@
+#ifndef _ESPNOW_PROFILE_H_
+#define _ESPNOW_PROFILE_H_
+
+#include <stdint.h>
+#include "espnow_proto.h"
+
+/*
+ * Wake cycle profiler.
+ *
+ * The node marks the end of every phase of a wake, the time since the
+ * previous mark goes to that phase. Finished wakes are summed across deep
+ * sleep and their average is sent to the master every
+ * ESPNOW_PROFILE_INTERVAL wakes, as an option of a data frame. Boot time
+ * counts from esp_timer start, rom and bootloader time before it is not
+ * seen.
+ */
+
+#ifdef CONFIG_ESPNOW_PROFILE_INTERVAL
+#define ESPNOW_PROFILE_INTERVAL     CONFIG_ESPNOW_PROFILE_INTERVAL
+#else
+#define ESPNOW_PROFILE_INTERVAL     16
+#endif
+
+// node side, fits in RTC memory
+typedef struct {
+    uint32_t    sum_us[ESPNOW_PHASE_COUNT];     // wakes not reported yet
+    uint16_t    wakes;
+    uint32_t    cur_us[ESPNOW_PHASE_COUNT];     // wake in progress
+    int64_t     last_us;                        // last mark
+} espnow_profile_t;
+
+void     espnow_profile_reset(espnow_profile_t* p);
+// a new wake, now_us is the time since boot
+void     espnow_profile_start(espnow_profile_t* p, int64_t now_us);
+void     espnow_profile_mark(espnow_profile_t* p, espnow_phase_t phase, int64_t now_us);
+// the wake is over, add it to the sum
+void     espnow_profile_end(espnow_profile_t* p);
+// average of the summed wakes, 0 if none
+uint8_t  espnow_profile_info(const espnow_profile_t* p, espnow_profile_info_t* info);
+// the master got the average, start a new sum
+void     espnow_profile_reported(espnow_profile_t* p);
+
+// master side: fold a report into the wake weighted average of a node
+void     espnow_profile_merge(espnow_profile_info_t* agg, const espnow_profile_info_t* info);
+
+const char* espnow_profile_phase_name(espnow_phase_t phase);
+// rough energy of a wake from the typical current of each phase, plus deep
+// sleep for the rest of cycle_ms (0: wake only), in uJ at 3.3 V
+uint32_t espnow_profile_energy_uj(const espnow_profile_info_t* info, uint32_t cycle_ms);
+
+#endif // _ESPNOW_PROFILE_H_
@@ -0,0 +1,220 @@
+#ifndef _ESPNOW_PROTO_H_
+#define _ESPNOW_PROTO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Frames exchanged between sensor nodes and the master.
+ *
+ * Every frame starts with espnow_hdr_t. Frames without the magic byte are
+ * legacy ones (2 bytes ping, 12 bytes float measure).
+ *
+ * The fixed part of a frame may be followed by options, [type][len][value]
+ * each, receivers skip the ones they do not know.
+ */
+
+#define ESPNOW_PROTO_MAGIC      0xe5
+#define ESPNOW_PROTO_ADDR_LEN   6
+#define ESPNOW_PROTO_MAX_LEN    250
+
+// legacy ping codes
+#define ESPNOW_PING_REQUEST     1973
+#define ESPNOW_PING_REPLY       1389
+
+typedef enum {
+    ESPNOW_MSG_DISCOVER         = 0x01,     // node -> broadcast
+    ESPNOW_MSG_DISCOVER_REPLY   = 0x02,     // master -> node, unicast
+    ESPNOW_MSG_DATA             = 0x10,     // node -> master
+    ESPNOW_MSG_ACK              = 0x11,     // master -> node
+    ESPNOW_MSG_DATA_DELTA       = 0x12,     // node -> master, espnow_data_delta_t
+    ESPNOW_MSG_RELAY            = 0x20,     // relay -> its parent, espnow_relay_frame_t
+    ESPNOW_MSG_RELAY_DOWN       = 0x21,     // parent -> relay, espnow_relay_frame_t
+} espnow_msg_type_t;
+
+typedef enum {
+    ESPNOW_ACK_OK = 0,
+    ESPNOW_ACK_ERROR,
+    ESPNOW_ACK_RESYNC,          // delta frame without a known reference, send a keyframe
+} espnow_ack_status_t;
+
+// espnow_data_t and espnow_data_delta_t flags
+#define ESPNOW_DATA_KEY         0x01    // delta frame: first measure is absolute
+#define ESPNOW_DATA_FIRST       0x02    // first data frame since power on, seq restarted
+
+typedef struct __attribute__((packed)) {
+    uint8_t     magic;
+    uint8_t     type;
+    uint16_t    seq;
+} espnow_hdr_t;
+
+typedef enum {
+    ESPNOW_OPT_SYNC             = 0x01,     // master -> node, espnow_sync_info_t
+    ESPNOW_OPT_PROFILE          = 0x02,     // node -> master with data, espnow_profile_info_t
+    ESPNOW_OPT_AGES             = 0x03,     // node -> master with data, age of each measure, varints
+    ESPNOW_OPT_FLOW             = 0x04,     // master -> node in acks, espnow_flow_info_t
+    ESPNOW_OPT_CONFIG           = 0x05,     // master -> node in acks, see espnow_config.h
+    ESPNOW_OPT_CONFIG_VER       = 0x06,     // node -> master with data, uint16_t config version
+    ESPNOW_OPT_REPORT           = 0x07,     // node -> master with data, espnow_report_info_t
+    ESPNOW_OPT_HOPS             = 0x08,     // relay -> node in discover replies, uint8_t relays to the master
+    ESPNOW_OPT_MASTERS          = 0x09,     // master -> node in discover replies and acks, espnow_master_info_t each
+} espnow_opt_type_t;
+
+typedef struct __attribute__((packed)) {
+    espnow_hdr_t    hdr;
+    uint32_t        token;      // last master token known by the node, 0 if none
+} espnow_discover_t;
+
+typedef struct __attribute__((packed)) {
+    espnow_hdr_t    hdr;
+    uint8_t         master[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t         channel;
+    uint8_t         flags;
+    uint32_t        token;      // changes on every master boot
+} espnow_discover_reply_t;
+
+// fixed point measure
+typedef struct __attribute__((packed)) {
+    int32_t     temp;           // 0.01 C
+    int32_t     humi;           // 0.01 %
+    int32_t     pres;           // 0.01 hPa
+} espnow_measure_t;
+
+typedef struct __attribute__((packed)) {
+    espnow_hdr_t    hdr;
+    uint8_t         flags;
+    uint8_t         count;
+    espnow_measure_t measure[0];
+} espnow_data_t;
+
+/* Measures as zigzag varints, temp humi pres for each measure. The first
+ * measure is a delta against the reference (the last measure of data frame
+ * ref_seq, acked by the master) or absolute in a keyframe, the next ones
+ * are deltas against the previous measure. */
+typedef struct __attribute__((packed)) {
+    espnow_hdr_t    hdr;
+    uint8_t         flags;
+    uint8_t         count;
+    uint16_t        ref_seq;    // unused in keyframes
+    uint8_t         values[0];
+} espnow_data_delta_t;
+
+typedef struct __attribute__((packed)) {
+    espnow_hdr_t    hdr;        // seq of the acknowledged data frame
+    uint32_t        token;
+    uint8_t         status;
+} espnow_ack_t;
+
+/* Frames of sensors behind a relay, count entries [addr][len][frame]
+ * each: addr is the sensor a frame comes from (RELAY) or goes to
+ * (RELAY_DOWN), frames keep their own header. A relay behind another one
+ * gets its entries flattened into the bundle of its parent. */
+typedef struct __attribute__((packed)) {
+    espnow_hdr_t    hdr;
+    uint8_t         hops;       // most relays an entry went through, RELAY only
+    uint8_t         count;
+    uint8_t         entries[0];
+} espnow_relay_frame_t;
+
+#define ESPNOW_RELAY_ENTRY_HDR  ( ESPNOW_PROTO_ADDR_LEN + 1 )
+
+// another master serving the same nodes, a node fails over to it without a discovery
+typedef struct __attribute__((packed)) {
+    uint8_t         addr[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t         channel;    // 0: the one of the master sending it
+} espnow_master_info_t;
+
+// master clock and wake slot, sent with discover replies and acks
+typedef struct __attribute__((packed)) {
+    uint32_t        time_ms;    // master clock when the frame was built
+    uint32_t        period_ms;  // wake cycle shared by all nodes
+    uint32_t        slot_ms;    // start of the node slot in the cycle
+} espnow_sync_info_t;
+
+// phases of a node wake, each one ends where the next one it goes through starts
+typedef enum {
+    ESPNOW_PHASE_BOOT = 0,      // reset to app_main
+    ESPNOW_PHASE_NVS,
+    ESPNOW_PHASE_WIFI,
+    ESPNOW_PHASE_ESPNOW,
+    ESPNOW_PHASE_SENSOR,        // sensor init, 0 when overlapped with the radio
+    ESPNOW_PHASE_CONVERT,       // overlapped: what is left of it once the radio is up
+    ESPNOW_PHASE_JOIN,          // 0 when the cached master answers
+    ESPNOW_PHASE_SEND,          // data frame until it is on air
+    ESPNOW_PHASE_ACK,           // retries included
+    ESPNOW_PHASE_SLEEP,         // last phase to deep sleep
+    ESPNOW_PHASE_COUNT
+} espnow_phase_t;
+
+// average wake of a node since its last report
+typedef struct __attribute__((packed)) {
+    uint16_t        wakes;
+    uint16_t        phase[ESPNOW_PHASE_COUNT];  // 0.1 ms, saturated
+} espnow_profile_info_t;
+
+/* Samples taken by a node since power on and how many of them stayed
+ * within the deadbands, never sent. Totals, a lost report costs nothing. */
+typedef struct __attribute__((packed)) {
+    uint32_t        samples;
+    uint32_t        skipped;
+} espnow_report_info_t;
+
+/* Answer to a data frame with ESPNOW_OPT_AGES: the node drains its backlog
+ * while credit is not 0, and keeps the rest for its next wake otherwise.
+ * Acks without it stop the drain as well. */
+typedef struct __attribute__((packed)) {
+    uint8_t         credit;     // data frames the node may send right after this one
+} espnow_flow_info_t;
+
+#define ESPNOW_DATA_MAX_MEASURES ((ESPNOW_PROTO_MAX_LEN - sizeof(espnow_data_t)) / sizeof(espnow_measure_t))
+// at least one byte per value
+#define ESPNOW_DATA_DELTA_MAX_MEASURES ((ESPNOW_PROTO_MAX_LEN - sizeof(espnow_data_delta_t)) / 3)
+
+// returns the message type, -1 if not a protocol frame
+int    espnow_proto_parse(const uint8_t* data, size_t len, espnow_hdr_t* hdr);
+
+// length of the fixed part, options start there, 0 if not a protocol frame
+size_t espnow_proto_base_len(const uint8_t* data, size_t len);
+
+// append an option to a frame of len bytes, returns the new length, 0 if no room
+size_t espnow_proto_opt_add(uint8_t* buf, size_t len, uint8_t type, const void* value, uint8_t vlen);
+// value of the first option of that type, NULL if absent
+const uint8_t* espnow_proto_opt_find(const uint8_t* data, size_t len, uint8_t type, uint8_t* vlen);
+
+size_t espnow_proto_discover(uint8_t* buf, uint16_t seq, uint32_t token);
+size_t espnow_proto_discover_reply(uint8_t* buf, uint16_t seq, const uint8_t* master, uint8_t channel, uint32_t token);
+size_t espnow_proto_data(uint8_t* buf, uint16_t seq, const espnow_measure_t* measure, uint8_t count);
+size_t espnow_proto_ack(uint8_t* buf, uint16_t seq, uint32_t token, uint8_t status);
+
+// empty bundle, entries appended with espnow_proto_relay_add()
+size_t espnow_proto_relay(uint8_t* buf, uint8_t type, uint16_t seq, uint8_t hops);
+// returns the new length, 0 if no room
+size_t espnow_proto_relay_add(uint8_t* buf, size_t len, const uint8_t* addr, const uint8_t* frame, uint8_t flen);
+// entry at *pos (0 for the first one) and moves past it, NULL after the last one
+const uint8_t* espnow_proto_relay_next(const uint8_t* data, size_t len, size_t* pos, const uint8_t** addr, uint8_t* flen);
+
+// ref NULL builds a keyframe, returns 0 if the measures do not fit in a frame
+size_t espnow_proto_data_delta(uint8_t* buf, uint16_t seq, const espnow_measure_t* ref, uint16_t ref_seq,
+                               const espnow_measure_t* measure, uint8_t count);
+// ref is ignored for keyframes, returns the number of measures, -1 if malformed
+int    espnow_proto_data_delta_decode(const uint8_t* data, size_t len, const espnow_measure_t* ref,
+                                      espnow_measure_t* measure, uint8_t max);
+
+/* ESPNOW_OPT_AGES value: age in s at send time of the first measure, then
+ * for each next one how much younger it is. Returns the bytes used, 0 if
+ * no room; the number of ages, -1 if malformed. */
+size_t espnow_proto_ages_put(uint8_t* buf, size_t room, const uint32_t* age_s, uint8_t count);
+int    espnow_proto_ages_get(const uint8_t* value, size_t len, uint32_t* age_s, uint8_t max);
+
+// zigzag varint, 1 to 5 bytes, returns the bytes used, 0 if no room / truncated
+size_t espnow_proto_varint_put(uint8_t* buf, size_t room, int32_t value);
+size_t espnow_proto_varint_get(const uint8_t* buf, size_t len, int32_t* value);
+
+// float <-> fixed point
+void   espnow_proto_measure_from_float(espnow_measure_t* m, float temp, float humi, float pres);
+
+uint16_t espnow_proto_crc16(const uint8_t* data, size_t len);
+// fnv-1a of a mac, folded: peer cache buckets, master shards
+uint32_t espnow_proto_addr_hash(const uint8_t* addr);
+
+#endif // _ESPNOW_PROTO_H_
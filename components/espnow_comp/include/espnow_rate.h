@@ -0,0 +1,98 @@
+#ifndef _ESPNOW_RATE_H_
+#define _ESPNOW_RATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * PHY rate adaptation, per peer.
+ *
+ * esp-now sends at 1 Mbps by default: a node next to the master spends
+ * ten times the airtime it needs, a far one loses frames. Each peer gets
+ * its own rate on a ladder from 24 Mbps down to 1 Mbps, and on to the long
+ * range rates when CONFIG_ESPNOW_ENABLE_LONG_RANGE is set. Its first rate
+ * comes from the rssi of the peer, 1 Mbps until it is heard.
+ *
+ * The mac layer status of every unicast feeds a delivery EWMA at the
+ * current rate, under ESPNOW_RATE_TARGET the peer goes one rate down.
+ * After ESPNOW_RATE_PROBE_AFTER acks in a row one frame probes the rate
+ * above, when the rssi is over its floor: acked, the peer moves up, lost,
+ * the wait to the next probe doubles. A rssi falling under the floor of
+ * the rate steps down without waiting for losses. Long range is only
+ * reached that way, by peers 1 Mbps does not carry.
+ *
+ * Portable, the target maps the ladder on wifi_phy_rate_t (espnow_comp.c).
+ */
+
+// fastest first
+typedef enum {
+    ESPNOW_RATE_24M = 0,
+    ESPNOW_RATE_12M,
+    ESPNOW_RATE_6M,
+    ESPNOW_RATE_1M,         // esp-now default, broadcasts
+    ESPNOW_RATE_LR_500K,
+    ESPNOW_RATE_LR_250K,
+    ESPNOW_RATE_MAX,
+} espnow_rate_id_t;
+
+#define ESPNOW_RATE_BASE            ESPNOW_RATE_1M
+
+// fixed rate: every frame at ESPNOW_RATE_BASE, as before
+#if CONFIG_ESPNOW_RATE_FIXED
+#define ESPNOW_RATE_ADAPT           0
+#else
+#define ESPNOW_RATE_ADAPT           1
+#endif
+
+#if CONFIG_ESPNOW_ENABLE_LONG_RANGE
+#define ESPNOW_RATE_LONG_RANGE      1
+#else
+#define ESPNOW_RATE_LONG_RANGE      0
+#endif
+
+// delivery ratio held at the rate, percent
+#ifdef CONFIG_ESPNOW_RATE_TARGET
+#define ESPNOW_RATE_TARGET          CONFIG_ESPNOW_RATE_TARGET
+#else
+#define ESPNOW_RATE_TARGET          90
+#endif
+
+// delivery EWMA in 1/65535, weight 1/16, increments rounded up so it gets back to all acked
+#define ESPNOW_RATE_DELIVERY_ALL    UINT16_MAX
+#define ESPNOW_RATE_DELIVERY_SHIFT  4
+#define ESPNOW_RATE_PROBE_AFTER     16
+#define ESPNOW_RATE_BACKOFF_MAX     4       // probes at least every 256 frames
+// rssi EWMA in 1/16 dB, weight 1/4: a 1 dB change still moves it
+#define ESPNOW_RATE_RSSI_SCALE      16
+#define ESPNOW_RATE_RSSI_SHIFT      2
+// under the floor of its rate by that much, the peer steps down
+#define ESPNOW_RATE_RSSI_HYST       3
+// mac header, vendor action header, fcs
+#define ESPNOW_RATE_OVERHEAD        43
+
+// one per peer, fits in RTC memory
+typedef struct {
+    uint8_t     rate;       // espnow_rate_id_t of the next frames
+    uint8_t     slowest;    // bottom of the ladder
+    uint8_t     probing;    // frame in flight one rate up
+    uint8_t     backoff;    // log2 of the wait to the next probe, in ESPNOW_RATE_PROBE_AFTER
+    uint16_t    delivery;   // EWMA at rate, ESPNOW_RATE_DELIVERY_ALL: all acked
+    int16_t     rssi;       // EWMA in 1/ESPNOW_RATE_RSSI_SCALE dBm, 0: not heard yet
+    uint16_t    streak;     // acks in a row at rate
+} espnow_rate_t;
+
+void        espnow_rate_init(espnow_rate_t* r, uint8_t long_range);
+// rate of the next unicast to the peer, one up when it is a probe
+uint8_t     espnow_rate_pick(espnow_rate_t* r);
+// mac layer status of the frame picked last, returns 1 moved up, -1 down, 0
+int8_t      espnow_rate_sent(espnow_rate_t* r, uint8_t ok);
+/* rssi of a frame from the peer, returns -1 when it stepped down, else 0.
+ * 0 is no rssi for the frame (relayed, replayed, no path model): the esp32
+ * reports dBm, never positive, the frame is left out. */
+int8_t      espnow_rate_heard(espnow_rate_t* r, int8_t rssi);
+
+uint8_t     espnow_rate_is_long_range(uint8_t rate);
+uint32_t    espnow_rate_airtime_us(uint8_t rate, size_t len);
+const char* espnow_rate_name(uint8_t rate);
+
+#endif // _ESPNOW_RATE_H_
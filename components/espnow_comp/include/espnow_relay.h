@@ -0,0 +1,146 @@
+#ifndef _ESPNOW_RELAY_H_
+#define _ESPNOW_RELAY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "espnow_proto.h"
+#include "espnow_transport.h"
+
+/*
+ * Relay role: a mains powered node forwards the frames of sensors out of
+ * reach of the master.
+ *
+ * To its children the relay is the master: it answers their discover with
+ * itself as master and the token of the real one, so their link runs
+ * unchanged. The reply is held back by a delay growing with the hops to
+ * the master, a weak signal and losses towards the parent: a node takes
+ * the first reply, the master (no delay) when it hears it, else the best
+ * relay. Children heard below ESPNOW_RELAY_MIN_RSSI get no reply at all.
+ *
+ * Data frames of the children are coalesced for ESPNOW_RELAY_WINDOW_MS
+ * into one ESPNOW_MSG_RELAY bundle to the parent. A child retry of a frame
+ * already on its way is dropped, the retry of a frame acked already gets
+ * the cached ack again. The master answers each child in a RELAY_DOWN
+ * frame, unwrapped by the relay in front of it. Acks stay end to end: a
+ * child only drops measures the master has.
+ *
+ * Bundles carry the hops they went through, past ESPNOW_RELAY_MAX_HOPS
+ * they are dropped so a loop does not keep frames on air. A relay only
+ * answers children while it has a parent, and drops its parent when more
+ * than ESPNOW_RELAY_MAX_LOSS of its frames to it fail, bundles dropped
+ * past the max hops included: inside a loop every send succeeds. Without
+ * a parent it drops its children, and its next join takes no relay as far
+ * from the master as it was (espnow_link_t max_hops): none of its own
+ * descendants.
+ *
+ * Portable, sends through an espnow_transport_t, not thread safe.
+ */
+
+// coalescing window, well within the ack timeout of the children
+#ifdef CONFIG_ESPNOW_RELAY_WINDOW_MS
+#define ESPNOW_RELAY_WINDOW_MS      CONFIG_ESPNOW_RELAY_WINDOW_MS
+#else
+#define ESPNOW_RELAY_WINDOW_MS      10
+#endif
+
+// sensors routed through the relay, the least recently heard one is recycled
+#ifdef CONFIG_ESPNOW_RELAY_MAX_CHILDREN
+#define ESPNOW_RELAY_MAX_CHILDREN   CONFIG_ESPNOW_RELAY_MAX_CHILDREN
+#else
+#define ESPNOW_RELAY_MAX_CHILDREN   16
+#endif
+
+#ifdef CONFIG_ESPNOW_RELAY_MIN_RSSI
+#define ESPNOW_RELAY_MIN_RSSI       CONFIG_ESPNOW_RELAY_MIN_RSSI
+#else
+#define ESPNOW_RELAY_MIN_RSSI       -88
+#endif
+
+#define ESPNOW_RELAY_MAX_HOPS       4
+/* Discover reply delay: ESPNOW_RELAY_HOP_DELAY_MS per hop, 1 ms per 4 dB
+ * under ESPNOW_RELAY_GOOD_RSSI, 2 ms per 10 % parent loss. Capped within
+ * the scan dwell of the nodes. */
+#define ESPNOW_RELAY_HOP_DELAY_MS   4
+#define ESPNOW_RELAY_GOOD_RSSI      -65
+#define ESPNOW_RELAY_REPLY_MAX_MS   24
+// a child retry this soon after its frame went up is dropped, a later one goes up again
+#define ESPNOW_RELAY_RETRY_MS       50
+// parent loss, EWMA over the frames sent to it in 1/1000
+#define ESPNOW_RELAY_LOSS_SHIFT     3
+#define ESPNOW_RELAY_MAX_LOSS       500
+#define ESPNOW_RELAY_MIN_SENT       8
+#define ESPNOW_RELAY_PENDING        4
+// acks cached for a retry, longer ones go through the master again
+#define ESPNOW_RELAY_ACK_MAX        128
+
+typedef enum {
+    ESPNOW_RELAY_CHILD_FREE = 0,
+    ESPNOW_RELAY_CHILD_FORWARDED,   // frame seq on its way to the master
+    ESPNOW_RELAY_CHILD_ACKED,       // ack of frame seq cached
+} espnow_relay_child_state_t;
+
+typedef struct {
+    uint8_t     addr[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t     via[ESPNOW_PROTO_ADDR_LEN];     // next hop, addr for a child in range
+    uint8_t     state;
+    uint16_t    seq;
+    uint8_t     ack_len;
+    uint8_t     ack[ESPNOW_RELAY_ACK_MAX];
+    uint32_t    sent_ms;        // frame seq went up
+    uint32_t    seen_ms;
+} espnow_relay_child_t;
+
+// discover reply waiting for its delay
+typedef struct {
+    uint8_t     addr[ESPNOW_PROTO_ADDR_LEN];
+    uint16_t    seq;
+    uint8_t     used;
+    uint32_t    due_ms;
+} espnow_relay_reply_t;
+
+typedef struct {
+    uint32_t    forwarded;      // frames of children sent up
+    uint32_t    bundles;
+    uint32_t    down;           // frames of the master handed to children
+    uint32_t    dup_dropped;    // child retries of a frame on its way
+    uint32_t    dup_acked;      // child retries answered from the cache
+    uint32_t    unroutable;     // master frames for unknown children, frames past the max hops
+    uint32_t    looped;         // bundles past the max hops
+    uint32_t    send_failed;    // to the parent
+    uint16_t    children;
+} espnow_relay_stats_t;
+
+typedef struct {
+    const espnow_transport_t*   transport;
+    uint8_t                     self[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t                     parent[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t                     channel;
+    uint32_t                    token;      // of the master
+    uint8_t                     hops;       // relays to the master, this one included, 0: no parent
+    uint16_t                    loss;
+    uint16_t                    sent;       // to the parent, saturated
+    uint16_t                    seq;
+    espnow_relay_child_t        child[ESPNOW_RELAY_MAX_CHILDREN];
+    espnow_relay_reply_t        reply[ESPNOW_RELAY_PENDING];
+    uint8_t                     bundle[ESPNOW_PROTO_MAX_LEN];
+    size_t                      bundle_len; // 0: empty
+    uint32_t                    bundle_ms;  // first entry
+    espnow_relay_stats_t        stats;
+} espnow_relay_t;
+
+void     espnow_relay_init(espnow_relay_t* r, const espnow_transport_t* transport, const uint8_t* self);
+/* Parent found by the link of the relay, parent_hops from its discover
+ * reply (ESPNOW_OPT_HOPS, 0 for the master). NULL: no parent, children
+ * get no reply until the next one. */
+void     espnow_relay_set_parent(espnow_relay_t* r, const uint8_t* parent, uint8_t channel, uint32_t token, uint8_t parent_hops);
+// 1 when the parent loss went over ESPNOW_RELAY_MAX_LOSS, the relay has to join again
+uint8_t  espnow_relay_parent_lost(const espnow_relay_t* r);
+// frame for the relay role rather than for the link of the node
+uint8_t  espnow_relay_wants(const uint8_t* data, size_t len);
+void     espnow_relay_on_frame(espnow_relay_t* r, const uint8_t* src, int8_t rssi, const uint8_t* data, size_t len, uint32_t now_ms);
+// sends the replies and the bundle due, returns the ms to the next one, UINT32_MAX if none
+uint32_t espnow_relay_poll(espnow_relay_t* r, uint32_t now_ms);
+void     espnow_relay_stats_get(const espnow_relay_t* r, espnow_relay_stats_t* stats);
+
+#endif // _ESPNOW_RELAY_H_
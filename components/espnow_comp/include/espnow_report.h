@@ -0,0 +1,45 @@
+#ifndef _ESPNOW_REPORT_H_
+#define _ESPNOW_REPORT_H_
+
+#include <stdint.h>
+#include "espnow_proto.h"
+#include "espnow_config.h"
+
+/*
+ * Change triggered reporting.
+ *
+ * A sample costs an i2c conversion, a report costs the radio. With
+ * deadbands set (ESPNOW_CFG_DEADBAND_*) the node samples on every wake but
+ * keeps for the master only the samples where a channel moved by its
+ * deadband or more from the last one kept: that one is acked by the master
+ * or waits in the backlog, the master has it either way. Skipped samples
+ * are dropped, the master knows the value stayed within the deadbands.
+ * A deadband of 0 leaves its channel out, all of them 0 keep every sample.
+ *
+ * A node that skips stays silent for ESPNOW_CFG_HEARTBEAT_S at most: once
+ * that long without an ack it goes to the master anyway, with the sample
+ * of that wake.
+ */
+
+// node side, fits in RTC memory
+typedef struct {
+    espnow_measure_t    last;       // last sample kept for the master
+    uint8_t             valid;
+    uint8_t             contact;    // an ack since power on
+    uint32_t            contact_ms; // node clock of the last one
+    uint32_t            samples;    // since power on
+    uint32_t            skipped;
+} espnow_report_t;
+
+void    espnow_report_reset(espnow_report_t* r);
+// any deadband set
+uint8_t espnow_report_enabled(const espnow_config_t* cfg);
+// the radio has to come up, the master did not hear from the node for the heartbeat
+uint8_t espnow_report_due(const espnow_report_t* r, const espnow_config_t* cfg, uint32_t now_ms);
+// counts the sample, returns 1 when it is to be kept for the master
+uint8_t espnow_report_sample(espnow_report_t* r, const espnow_config_t* cfg, const espnow_measure_t* m, uint32_t now_ms);
+// the master acked a data frame
+void    espnow_report_contact(espnow_report_t* r, uint32_t now_ms);
+void    espnow_report_info(const espnow_report_t* r, espnow_report_info_t* info);
+
+#endif // _ESPNOW_REPORT_H_
@@ -0,0 +1,35 @@
+#ifndef _ESPNOW_SYNC_H_
+#define _ESPNOW_SYNC_H_
+
+#include <stdint.h>
+#include "espnow_proto.h"
+
+/*
+ * Wake slots: the master hands out its clock and a slot in a shared wake
+ * cycle with every discover reply and ack. Nodes keep the offset to the
+ * master clock (and the drift of their own clock) across deep sleep and
+ * size the next sleep so the radio is up at the start of their slot.
+ */
+
+// at most this far off a 1 s clock, beyond that a sync is considered bogus
+#define ESPNOW_SYNC_MAX_DRIFT_PPM   50000
+
+typedef struct {
+    int64_t     offset_ms;      // master clock - local clock
+    uint32_t    period_ms;
+    uint32_t    slot_ms;
+    uint32_t    synced_ms;      // master clock of the last sync
+    int32_t     drift_ppm;      // local clock error, positive when it runs slow
+    uint32_t    lead_ms;        // wake to first frame, the node wakes that early
+    uint8_t     valid;
+} espnow_sync_t;
+
+// node side, local_ms is the local clock when the frame was received
+void     espnow_sync_update(espnow_sync_t* sync, const espnow_sync_info_t* info, int64_t local_ms);
+// sleep close to nominal_ms ending lead_ms before the node slot, nominal_ms without sync
+uint32_t espnow_sync_sleep_ms(const espnow_sync_t* sync, int64_t local_ms, uint32_t nominal_ms);
+
+// master side, slots are spread in the cycle in node order
+uint32_t espnow_sync_slot_ms(uint32_t index, uint32_t period_ms, uint32_t width_ms);
+
+#endif // _ESPNOW_SYNC_H_
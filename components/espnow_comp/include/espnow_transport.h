@@ -0,0 +1,27 @@
+#ifndef _ESPNOW_TRANSPORT_H_
+#define _ESPNOW_TRANSPORT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/*
+ * How frames get on air: esp-now on target, a simulated medium on the host
+ * (tools/espnow_sim). Code written against it runs unchanged on both.
+ */
+
+typedef esp_err_t (*espnow_transport_send_t)(void* ctx, const uint8_t* addr, const uint8_t* data, size_t len);
+
+typedef struct {
+    espnow_transport_send_t send;
+    void*                   ctx;
+} espnow_transport_t;
+
+static inline esp_err_t espnow_transport_send(const espnow_transport_t* transport, const uint8_t* addr, const uint8_t* data, size_t len) {
+    return transport->send(transport->ctx, addr, data, len);
+}
+
+// esp-now backend, unicast peers go through the peer cache (target only)
+extern const espnow_transport_t espnow_transport_esp;
+
+#endif // _ESPNOW_TRANSPORT_H_
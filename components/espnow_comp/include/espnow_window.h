@@ -0,0 +1,34 @@
+#ifndef _ESPNOW_WINDOW_H_
+#define _ESPNOW_WINDOW_H_
+
+#include <stdint.h>
+
+/*
+ * Sliding sequence window: the highest sequence seen and a bitmap of the
+ * 63 before it, as in IPsec anti-replay. Sequences compare with 16 bit
+ * wrap, anything 64 or more behind the highest one is stale.
+ */
+
+#define ESPNOW_WINDOW_SIZE  64
+
+typedef enum {
+    ESPNOW_WINDOW_NEW = 0,
+    ESPNOW_WINDOW_DUP,
+    ESPNOW_WINDOW_STALE,
+} espnow_window_result_t;
+
+typedef struct {
+    uint64_t    bits;       // bit n: top - n seen
+    uint16_t    top;
+    uint8_t     valid;
+} espnow_window_t;
+
+void                   espnow_window_reset(espnow_window_t* w);
+/* Sender restarted from a new seq: the window restarts there only if it
+ * cannot judge seq (stale), returns 1 when it did. A seq ahead or within
+ * the window goes through espnow_window_check() as any other. */
+uint8_t                espnow_window_restart(espnow_window_t* w, uint16_t seq);
+// O(1), marks seq as seen when new
+espnow_window_result_t espnow_window_check(espnow_window_t* w, uint16_t seq);
+
+#endif // _ESPNOW_WINDOW_H_
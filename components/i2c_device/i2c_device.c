@@ -1,9 +1,28 @@
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "i2c_device.h"
+#include "metrics.h"
 #include <string.h>
 
 static const char* TAG = "i2c_device";
 
+METRICS_COUNTER(i2c_transfers, "i2c.transfers");
+METRICS_COUNTER(i2c_errors, "i2c.errors");
+METRICS_COUNTER(i2c_timeouts, "i2c.timeouts");
+METRICS_HISTOGRAM(i2c_transfer_us, "i2c.transfer_us", 250, 500, 1000, 2000, 5000, 20000);
+
+static esp_err_t i2c_device_cmd(i2c_device_t* device, i2c_cmd_handle_t cmd) {
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = i2c_master_cmd_begin(device->port, cmd, 1000/portTICK_RATE_MS);
+
+    metrics_inc(&i2c_transfers);
+    metrics_observe(&i2c_transfer_us, (int32_t)( esp_timer_get_time() - start ));
+    if ( ret != ESP_OK ) {
+        metrics_inc(ret == ESP_ERR_TIMEOUT ? &i2c_timeouts : &i2c_errors);
+    }
+    return ret;
+}
+
 esp_err_t i2c_device_init(i2c_device_t* device, i2c_port_t port, uint8_t addr, uint8_t sda, uint8_t scl) {
     ESP_LOGV(TAG, "i2c_device_init(%d, %02x, %d, %d)", port, addr, sda, scl);
 
@@ -46,7 +65,7 @@ esp_err_t i2c_device_read(i2c_device_t* device, void* out_data, size_t out_size,
     i2c_master_read(cmd, in_data, in_size, I2C_MASTER_LAST_NACK);
     i2c_master_stop(cmd);
 
-    ret = i2c_master_cmd_begin(device->port, cmd, 1000/portTICK_RATE_MS);
+    ret = i2c_device_cmd(device, cmd);
     if ( ret != ESP_OK ) {
         ESP_LOGE(TAG, "Fail to read device ( port = %d, addr = %02x )", device->port, device->addr);
     }
@@ -72,7 +91,7 @@ esp_err_t i2c_device_write(i2c_device_t* device, void* reg_data, size_t reg_size
     }
     i2c_master_write(cmd, out_data, out_size, I2C_MASTER_LAST_NACK);
     i2c_master_stop(cmd);
-    ret = i2c_master_cmd_begin(device->port, cmd, 1000/portTICK_RATE_MS);
+    ret = i2c_device_cmd(device, cmd);
     if ( ret != ESP_OK ) {
         ESP_LOGE(TAG, "Fail to write decice ( port = %d, addr = %02x )", device->port, device->addr);
     }
@@ -0,0 +1,125 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Counters, gauges and fixed bucket histograms, one registry for every
+ * component and app.
+ *
+ * A metric is a static object defined with METRICS_COUNTER, METRICS_GAUGE
+ * or METRICS_HISTOGRAM; a constructor links it into the registry before
+ * app_main, nothing is allocated. Updates are single 32 bit atomic
+ * operations, relaxed, inlined at the caller: no lock, safe from an ISR
+ * and from the WiFi task (on chips without compare and swap the toolchain
+ * emulates them with interrupts masked).
+ *
+ * Readers walk the registry from any task. Each value is read atomically,
+ * a histogram as a whole is not: its buckets may be one update apart.
+ *
+ * Names are "component.metric", dumped in name order. A metric goes out as
+ * a record (metrics_encode()) the host tools decode with metrics_decode().
+ */
+
+typedef enum {
+    METRICS_COUNTER = 0,        // wraps at 2^32
+    METRICS_GAUGE,              // last value set, or highest seen
+    METRICS_HISTOGRAM,          // count per bucket, value is the sum of the samples, wraps
+} metrics_type_t;
+
+#define METRICS_NAME_MAX    31
+#define METRICS_BUCKETS_MAX 16
+
+typedef struct metrics_s {
+    const char*         name;
+    uint8_t             type;
+    uint8_t             buckets;    // histograms, bounds has one less
+    uint8_t             registered;
+    const int32_t*      bounds;     // upper bounds (excluded) of the buckets but the last one
+    uint32_t*           counts;
+    uint32_t            value;
+    struct metrics_s*   next;
+} metrics_t;
+
+#define METRICS_REGISTER(var) \
+    static void __attribute__((constructor)) metrics_register_##var(void) { metrics_register(&var); }
+
+#define METRICS_COUNTER(var, name_) \
+    static metrics_t var = { .name = name_, .type = METRICS_COUNTER }; \
+    METRICS_REGISTER(var)
+
+#define METRICS_GAUGE(var, name_) \
+    static metrics_t var = { .name = name_, .type = METRICS_GAUGE }; \
+    METRICS_REGISTER(var)
+
+// bucket bounds in increasing order, at most METRICS_BUCKETS_MAX - 1
+#define METRICS_HISTOGRAM(var, name_, ...) \
+    static const int32_t var##_bounds[] = { __VA_ARGS__ }; \
+    static uint32_t var##_counts[sizeof(var##_bounds) / sizeof(int32_t) + 1]; \
+    static metrics_t var = { .name = name_, .type = METRICS_HISTOGRAM, \
+        .buckets = sizeof(var##_bounds) / sizeof(int32_t) + 1, .bounds = var##_bounds, .counts = var##_counts }; \
+    METRICS_REGISTER(var)
+
+static inline void metrics_add(metrics_t* m, uint32_t n) {
+    __atomic_fetch_add(&m->value, n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_inc(metrics_t* m) {
+    metrics_add(m, 1);
+}
+
+static inline void metrics_set(metrics_t* m, int32_t v) {
+    __atomic_store_n(&m->value, (uint32_t)v, __ATOMIC_RELAXED);
+}
+
+// gauge keeps the highest value seen
+static inline void metrics_max(metrics_t* m, int32_t v) {
+    uint32_t old = __atomic_load_n(&m->value, __ATOMIC_RELAXED);
+
+    while ( (int32_t)old < v &&
+            !__atomic_compare_exchange_n(&m->value, &old, (uint32_t)v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+    }
+}
+
+static inline void metrics_observe(metrics_t* m, int32_t v) {
+    uint8_t b = 0;
+
+    while ( b < m->buckets - 1 && v >= m->bounds[b] ) {
+        b++;
+    }
+    __atomic_fetch_add(&m->counts[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->value, (uint32_t)v, __ATOMIC_RELAXED);
+}
+
+// a copy of a metric, or what a record decodes to
+typedef struct {
+    char        name[METRICS_NAME_MAX + 1];
+    uint8_t     type;
+    uint8_t     buckets;
+    int32_t     value;
+    int32_t     bounds[METRICS_BUCKETS_MAX - 1];
+    uint32_t    counts[METRICS_BUCKETS_MAX];
+} metrics_snapshot_t;
+
+/* Record: type (1) buckets (1) name length (1) name | value (4) | bounds
+ * (4 each) | counts (4 each), little endian. */
+#define METRICS_RECORD_MAX  ( 3 + METRICS_NAME_MAX + 4 + ( 2 * METRICS_BUCKETS_MAX - 1 ) * 4 )
+
+// done by the METRICS_ macros, or from one task before the readers start
+void        metrics_register(metrics_t* m);
+// NULL: first metric, returns NULL after the last one
+metrics_t*  metrics_next(const metrics_t* m);
+metrics_t*  metrics_find(const char* name);
+// counters and histograms back to 0, gauges keep their value
+void        metrics_reset(metrics_t* m);
+
+void        metrics_snapshot(const metrics_t* m, metrics_snapshot_t* s);
+// returns the record length, 0 if it does not fit in len
+size_t      metrics_encode(const metrics_t* m, uint8_t* out, size_t len);
+// returns 0 on a malformed record
+int         metrics_decode(const uint8_t* in, size_t len, metrics_snapshot_t* s);
+// one line, no newline, returns its length as snprintf
+int         metrics_format(const metrics_snapshot_t* s, char* out, size_t len);
+
+#endif // _METRICS_H_
@@ -0,0 +1,10 @@
+#ifndef _METRICS_CONSOLE_H_
+#define _METRICS_CONSOLE_H_
+
+#include "esp_err.h"
+
+/* "metrics [-r] [prefix]": prints every metric, or the ones whose name
+ * starts with prefix, -r resets them once printed. */
+esp_err_t metrics_console_register(void);
+
+#endif // _METRICS_CONSOLE_H_
@@ -0,0 +1,152 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+
+static metrics_t* metrics_head = NULL;
+
+static const char* const type_names[] = { "counter", "gauge", "histogram" };
+
+void metrics_register(metrics_t* m) {
+    metrics_t** at = &metrics_head;
+
+    if ( m->registered ) {
+        return;
+    }
+    // sorted by name, a dump reads the same from one build to the next
+    while ( *at != NULL && strcmp((*at)->name, m->name) < 0 ) {
+        at = &( *at )->next;
+    }
+    m->next = *at;
+    m->registered = 1;
+    *at = m;
+}
+
+metrics_t* metrics_next(const metrics_t* m) {
+    return m == NULL ? metrics_head : m->next;
+}
+
+metrics_t* metrics_find(const char* name) {
+    for ( metrics_t* m = metrics_head; m != NULL; m = m->next ) {
+        if ( strcmp(m->name, name) == 0 ) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+void metrics_reset(metrics_t* m) {
+    if ( m->type == METRICS_GAUGE ) {
+        return;
+    }
+    for ( uint8_t b = 0; b < m->buckets; b++ ) {
+        __atomic_store_n(&m->counts[b], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&m->value, 0, __ATOMIC_RELAXED);
+}
+
+void metrics_snapshot(const metrics_t* m, metrics_snapshot_t* s) {
+    memset(s, 0, sizeof(metrics_snapshot_t));
+    strncpy(s->name, m->name, METRICS_NAME_MAX);
+    s->type = m->type;
+    s->buckets = m->buckets < METRICS_BUCKETS_MAX ? m->buckets : METRICS_BUCKETS_MAX;
+    s->value = (int32_t)__atomic_load_n(&m->value, __ATOMIC_RELAXED);
+    for ( uint8_t b = 0; b < s->buckets; b++ ) {
+        if ( b < s->buckets - 1 ) {
+            s->bounds[b] = m->bounds[b];
+        }
+        s->counts[b] = __atomic_load_n(&m->counts[b], __ATOMIC_RELAXED);
+    }
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static const uint8_t* get32(const uint8_t* p, uint32_t* v) {
+    *v = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+    return p + 4;
+}
+
+size_t metrics_encode(const metrics_t* m, uint8_t* out, size_t len) {
+    metrics_snapshot_t s;
+    size_t name_len = strlen(m->name);
+
+    metrics_snapshot(m, &s);
+    if ( name_len > METRICS_NAME_MAX ) {
+        name_len = METRICS_NAME_MAX;
+    }
+    size_t need = 3 + name_len + 4 + ( s.buckets ? 2 * s.buckets - 1 : 0 ) * 4;
+    if ( need > len ) {
+        return 0;
+    }
+    uint8_t* p = out;
+    *p++ = s.type;
+    *p++ = s.buckets;
+    *p++ = (uint8_t)name_len;
+    memcpy(p, s.name, name_len);
+    p = put32(p + name_len, (uint32_t)s.value);
+    for ( uint8_t b = 0; b + 1 < s.buckets; b++ ) {
+        p = put32(p, (uint32_t)s.bounds[b]);
+    }
+    for ( uint8_t b = 0; b < s.buckets; b++ ) {
+        p = put32(p, s.counts[b]);
+    }
+    return p - out;
+}
+
+int metrics_decode(const uint8_t* in, size_t len, metrics_snapshot_t* s) {
+    uint32_t v;
+
+    if ( len < 3 ) {
+        return 0;
+    }
+    memset(s, 0, sizeof(metrics_snapshot_t));
+    s->type = in[0];
+    s->buckets = in[1];
+    size_t name_len = in[2];
+    if ( s->type > METRICS_HISTOGRAM || s->buckets > METRICS_BUCKETS_MAX || name_len > METRICS_NAME_MAX ||
+         len != 3 + name_len + 4 + ( s->buckets ? 2 * s->buckets - 1 : 0 ) * 4 ) {
+        return 0;
+    }
+    memcpy(s->name, in + 3, name_len);
+    const uint8_t* p = get32(in + 3 + name_len, &v);
+    s->value = (int32_t)v;
+    for ( uint8_t b = 0; b + 1 < s->buckets; b++ ) {
+        p = get32(p, &v);
+        s->bounds[b] = (int32_t)v;
+    }
+    for ( uint8_t b = 0; b < s->buckets; b++ ) {
+        p = get32(p, &s->counts[b]);
+    }
+    return 1;
+}
+
+int metrics_format(const metrics_snapshot_t* s, char* out, size_t len) {
+    int pos;
+
+    if ( s->type == METRICS_COUNTER ) {
+        return snprintf(out, len, "%-24s %-9s %u", s->name, type_names[s->type], (uint32_t)s->value);
+    }
+    if ( s->type == METRICS_GAUGE ) {
+        return snprintf(out, len, "%-24s %-9s %d", s->name, type_names[s->type], s->value);
+    }
+    uint32_t count = 0;
+    for ( uint8_t b = 0; b < s->buckets; b++ ) {
+        count += s->counts[b];
+    }
+    // the sum wraps, the host takes the mean of two dumps
+    pos = snprintf(out, len, "%-24s %-9s n %u", s->name, type_names[s->type], count);
+    for ( uint8_t b = 0; b < s->buckets && pos >= 0 && (size_t)pos < len; b++ ) {
+        if ( b + 1 < s->buckets ) {
+            pos += snprintf(out + pos, len - pos, " | <%d %u", s->bounds[b], s->counts[b]);
+        }
+        else {
+            pos += snprintf(out + pos, len - pos, " | >=%d %u", b ? s->bounds[b - 1] : 0, s->counts[b]);
+        }
+    }
+    return pos;
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_console.h"
+#include "metrics.h"
+#include "metrics_console.h"
+
+static int metrics_cmd(int argc, char** argv) {
+    const char* prefix = "";
+    uint8_t reset = 0;
+    char line[256];
+    metrics_snapshot_t s;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp(argv[i], "-r") == 0 ) {
+            reset = 1;
+        }
+        else {
+            prefix = argv[i];
+        }
+    }
+    for ( metrics_t* m = metrics_next(NULL); m != NULL; m = metrics_next(m) ) {
+        if ( strncmp(m->name, prefix, strlen(prefix)) != 0 ) {
+            continue;
+        }
+        metrics_snapshot(m, &s);
+        if ( reset ) {
+            metrics_reset(m);
+        }
+        metrics_format(&s, line, sizeof(line));
+        printf("%s\n", line);
+    }
+    return 0;
+}
+
+esp_err_t metrics_console_register(void) {
+    const esp_console_cmd_t cmd = {
+        .command = "metrics",
+        .help = "Print the metrics, the ones starting with prefix if given, -r resets them",
+        .hint = "[-r] [prefix]",
+        .func = metrics_cmd,
+    };
+    return esp_console_cmd_register(&cmd);
+}
@@ -0,0 +1,148 @@
+#ifndef _SEGLOG_H_
+#define _SEGLOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/*
+ * Append-only record log over a flash area.
+ *
+ * The area is split in segments of whole sectors, written round robin so
+ * that every sector wears the same. A segment starts with a header (its
+ * sequence number, the id of its first record, its erase count) and an
+ * index, the id of the first record of each chunk, then the chunks.
+ *
+ * Records are batched in RAM, one chunk (whole flash pages) at a time, and
+ * never straddle two chunks. seglog_flush() writes what the current chunk
+ * holds so far, the rest of the chunk is programmed later on the same
+ * erased bytes. Every record has an id, consecutive from the first one
+ * ever appended, and a crc so that a record torn by a reset is dropped on
+ * the next open: the writer goes on at the next chunk.
+ *
+ * One segment is always kept erased ahead of the writer. When the log is
+ * full the oldest segment expires, its records are gone.
+ *
+ * Reads go through a cursor, straight from the mapped area when the
+ * backend maps it, with a copy through read() otherwise. Records still in
+ * the RAM chunk are not visible until flushed.
+ *
+ * The log is not thread safe, one lock around it.
+ */
+
+#define SEGLOG_MAGIC        0x474c5345  // "ESLG"
+#define SEGLOG_PAGE_SIZE    256
+
+/* Flash backend: esp_partition on target (seglog_partition_open()), a RAM
+ * fake with the same NOR rules on the host. Writes only turn bits to 0,
+ * erases are whole sectors. */
+typedef struct {
+    esp_err_t       (*read)(void* ctx, size_t off, void* buf, size_t len);
+    esp_err_t       (*write)(void* ctx, size_t off, const void* buf, size_t len);
+    esp_err_t       (*erase)(void* ctx, size_t off, size_t len);
+    const uint8_t*  map;            // whole area, read only, NULL if not mapped
+    size_t          size;
+    size_t          sector_size;
+    void*           ctx;
+} seglog_flash_t;
+
+typedef struct {
+    size_t          segment_size;   // whole sectors
+    size_t          chunk_size;     // whole pages, the unit of a flash write
+} seglog_config_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t         len;            // payload bytes, 0xff: erased, 0: rest of the chunk unused
+    uint8_t         type;
+    uint16_t        crc;            // crc16 of len, type and payload
+} seglog_record_t;
+
+#define SEGLOG_MAX_RECORD           254
+
+#define SEGLOG_RECORD_ALIGN(len)    ( ( sizeof(seglog_record_t) + (len) + 3 ) & ~(size_t)3 )
+
+typedef struct {
+    uint32_t        seq;            // 0: not in use
+    uint32_t        first_id;
+    uint32_t        erases;
+} seglog_segment_t;
+
+typedef struct {
+    uint32_t        appended;
+    uint32_t        bytes;          // payload
+    uint32_t        chunk_writes;   // full chunks
+    uint32_t        flushes;        // partial ones
+    uint32_t        erases;         // segments
+    uint32_t        expired;        // records lost with expired segments
+    uint32_t        torn;           // records dropped on open
+    uint32_t        min_erases;     // over the segments
+    uint32_t        max_erases;
+} seglog_stats_t;
+
+typedef struct {
+    seglog_flash_t      flash;
+    seglog_config_t     config;
+    uint16_t            seg_count;
+    uint16_t            chunks;         // per segment
+    size_t              data_off;       // first chunk, in a segment
+    seglog_segment_t*   seg;
+    uint16_t            oldest;
+    uint16_t            head;           // segment written
+    uint16_t            chunk;          // chunk written in head
+    uint8_t             spare_erased;   // the segment after head
+    uint8_t*            buf;            // current chunk
+    uint8_t*            rbuf;           // record read, when not mapped
+    size_t              fill;
+    size_t              written;        // bytes of buf on flash
+    uint32_t            chunk_id;       // first record of the current chunk
+    uint32_t            next_id;
+    uint32_t            flushed_id;     // records below are on flash
+    seglog_stats_t      stats;
+} seglog_t;
+
+typedef struct {
+    uint32_t        id;             // next record
+    uint16_t        seg;
+    uint32_t        seg_seq;        // the segment expired if it changed
+    size_t          off;            // in the segment
+} seglog_cursor_t;
+
+typedef struct {
+    uint32_t        id;
+    uint8_t         type;
+    uint16_t        len;
+    const uint8_t*  data;           // valid until the next read or append
+} seglog_entry_t;
+
+void      seglog_config_default(seglog_config_t* config);
+
+// finds the head and the end of the log, formats an area without any segment
+esp_err_t seglog_open(seglog_t* log, const seglog_flash_t* flash, const seglog_config_t* config);
+esp_err_t seglog_close(seglog_t* log);
+
+// ESP_ERR_INVALID_SIZE over SEGLOG_MAX_RECORD or a chunk, may erase a segment
+esp_err_t seglog_append(seglog_t* log, uint8_t type, const void* data, uint16_t len);
+// write the records batched in RAM
+esp_err_t seglog_flush(seglog_t* log);
+// erase the spare segment ahead of time, call it when idle
+esp_err_t seglog_maintain(seglog_t* log);
+
+// oldest record still in the log, next one appended
+uint32_t  seglog_first_id(const seglog_t* log);
+uint32_t  seglog_next_id(const seglog_t* log);
+
+/* Cursor on record id, on the oldest one if that one expired, after the
+ * last flushed one if it is not on flash yet. */
+esp_err_t seglog_seek(seglog_t* log, seglog_cursor_t* cursor, uint32_t id);
+/* Next record, ESP_ERR_NOT_FOUND when there is none on flash yet. A cursor
+ * left on an expired segment goes on from the oldest record, entry->id
+ * shows the gap. */
+esp_err_t seglog_next(seglog_t* log, seglog_cursor_t* cursor, seglog_entry_t* entry);
+
+void      seglog_stats_get(const seglog_t* log, seglog_stats_t* stats);
+
+// esp_partition backend, the partition mapped for reads (target only)
+esp_err_t seglog_partition_open(const char* label, seglog_flash_t* flash);
+void      seglog_partition_close(seglog_flash_t* flash);
+
+#endif // _SEGLOG_H_
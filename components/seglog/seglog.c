@@ -0,0 +1,625 @@
+#include "seglog.h"
+#include "esp_log.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Segment layout:
+ *
+ *   header (16) | index, one entry per chunk | pad to a page | chunks
+ *
+ * An index entry is written before the first bytes of its chunk, so a
+ * chunk without one has never been written. Header and index entries are
+ * erased (0xff) until written.
+ */
+
+typedef struct __attribute__((packed)) {
+    uint32_t    magic;
+    uint32_t    seq;
+    uint32_t    first_id;
+    uint16_t    erases;     // saturated
+    uint16_t    crc;        // of the fields before
+} seglog_seg_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t    id;         // first record of the chunk
+    uint32_t    check;      // ~id, a torn entry does not match
+} seglog_index_t;
+
+#define SEGLOG_ERASED_ID    0xffffffffu
+#define SEGLOG_ERASED_LEN   0xff
+
+static const char *TAG = "seglog";
+
+static inline size_t seglog_seg_off(const seglog_t* log, uint16_t seg) {
+    return (size_t)seg * log->config.segment_size;
+}
+
+static inline size_t seglog_chunk_off(const seglog_t* log, uint16_t chunk) {
+    return log->data_off + (size_t)chunk * log->config.chunk_size;
+}
+
+static inline uint16_t seglog_after(const seglog_t* log, uint16_t seg) {
+    return (uint16_t)( ( seg + 1 ) % log->seg_count );
+}
+
+// crc-16/ccitt-false
+static uint16_t seglog_crc16(uint16_t crc, const uint8_t* data, size_t len) {
+    while ( len-- ) {
+        crc ^= (uint16_t)( *data++ ) << 8;
+        for ( int i = 0; i < 8; i++ ) {
+            crc = ( crc & 0x8000 ) ? (uint16_t)( ( crc << 1 ) ^ 0x1021 ) : (uint16_t)( crc << 1 );
+        }
+    }
+    return crc;
+}
+
+// over len, type and payload
+static inline uint16_t seglog_record_crc(const seglog_record_t* rec, const uint8_t* data) {
+    return seglog_crc16(seglog_crc16(0xffff, (const uint8_t*)rec, offsetof(seglog_record_t, crc)), data, rec->len);
+}
+
+static esp_err_t seglog_read(seglog_t* log, size_t off, void* buf, size_t len) {
+    if ( log->flash.map != NULL ) {
+        memcpy(buf, log->flash.map + off, len);
+        return ESP_OK;
+    }
+    return log->flash.read(log->flash.ctx, off, buf, len);
+}
+
+// 1 if the chunk has an index entry, 0 if it was never written, -1 if torn
+static int seglog_index_get(seglog_t* log, uint16_t seg, uint16_t chunk, uint32_t* id) {
+    seglog_index_t entry;
+
+    seglog_read(log, seglog_seg_off(log, seg) + sizeof(seglog_seg_hdr_t) + chunk * sizeof(seglog_index_t), &entry, sizeof(entry));
+    if ( entry.id == SEGLOG_ERASED_ID && entry.check == SEGLOG_ERASED_ID ) {
+        return 0;
+    }
+    if ( entry.check != ~entry.id ) {
+        return -1;
+    }
+    *id = entry.id;
+    return 1;
+}
+
+static void seglog_wear(seglog_t* log) {
+    log->stats.min_erases = UINT32_MAX;
+    log->stats.max_erases = 0;
+    for ( uint16_t i = 0; i < log->seg_count; i++ ) {
+        if ( log->seg[i].erases < log->stats.min_erases ) log->stats.min_erases = log->seg[i].erases;
+        if ( log->seg[i].erases > log->stats.max_erases ) log->stats.max_erases = log->seg[i].erases;
+    }
+}
+
+static esp_err_t seglog_erase(seglog_t* log, uint16_t seg) {
+    ESP_LOGD(TAG, "erase segment %u", seg);
+
+    esp_err_t ret = log->flash.erase(log->flash.ctx, seglog_seg_off(log, seg), log->config.segment_size);
+    if ( ret != ESP_OK ) {
+        ESP_LOGE(TAG, "erase of segment %u failed", seg);
+        return ret;
+    }
+    log->seg[seg].erases++;
+    log->stats.erases++;
+    seglog_wear(log);
+    return ESP_OK;
+}
+
+// the segment after head is erased, it becomes the head
+static esp_err_t seglog_start_segment(seglog_t* log, uint16_t seg, uint32_t seq) {
+    seglog_seg_hdr_t hdr = {
+        .magic = SEGLOG_MAGIC,
+        .seq = seq,
+        .first_id = log->next_id,
+        .erases = log->seg[seg].erases < 0xffff ? (uint16_t)log->seg[seg].erases : 0xffff,
+    };
+    hdr.crc = seglog_crc16(0xffff, (const uint8_t*)&hdr, offsetof(seglog_seg_hdr_t, crc));
+
+    esp_err_t ret = log->flash.write(log->flash.ctx, seglog_seg_off(log, seg), &hdr, sizeof(hdr));
+    if ( ret != ESP_OK ) {
+        return ret;
+    }
+    log->seg[seg].seq = seq;
+    log->seg[seg].first_id = log->next_id;
+    log->head = seg;
+    log->chunk = 0;
+    log->fill = 0;
+    log->written = 0;
+    log->chunk_id = log->next_id;
+
+    // the next one is kept free, the oldest segment expires when the log is full
+    uint16_t spare = seglog_after(log, seg);
+    if ( log->seg[spare].seq ) {
+        uint32_t lost = log->seg[seglog_after(log, spare)].first_id - log->seg[spare].first_id;
+        ESP_LOGW(TAG, "log full, segment %u expired with %u records", spare, lost);
+        log->stats.expired += lost;
+        log->seg[spare].seq = 0;
+        log->oldest = seglog_after(log, spare);
+    }
+    log->spare_erased = 0;
+    return ESP_OK;
+}
+
+static esp_err_t seglog_rotate(seglog_t* log) {
+    uint16_t seg = seglog_after(log, log->head);
+
+    if ( !log->spare_erased ) {
+        esp_err_t ret = seglog_erase(log, seg);
+        if ( ret != ESP_OK ) {
+            return ret;
+        }
+    }
+    return seglog_start_segment(log, seg, log->seg[log->head].seq + 1);
+}
+
+// bytes [written, fill) of the current chunk, its index entry first
+static esp_err_t seglog_write_chunk(seglog_t* log) {
+    size_t base = seglog_seg_off(log, log->head);
+    esp_err_t ret;
+
+    if ( log->fill == log->written ) {
+        return ESP_OK;
+    }
+    if ( log->written == 0 ) {
+        seglog_index_t entry = { .id = log->chunk_id, .check = ~log->chunk_id };
+        ret = log->flash.write(log->flash.ctx, base + sizeof(seglog_seg_hdr_t) + log->chunk * sizeof(seglog_index_t),
+                               &entry, sizeof(entry));
+        if ( ret != ESP_OK ) {
+            return ret;
+        }
+    }
+    ret = log->flash.write(log->flash.ctx, base + seglog_chunk_off(log, log->chunk) + log->written,
+                           log->buf + log->written, log->fill - log->written);
+    if ( ret != ESP_OK ) {
+        ESP_LOGE(TAG, "write failed in segment %u chunk %u", log->head, log->chunk);
+        return ret;
+    }
+    log->written = log->fill;
+    return ESP_OK;
+}
+
+static esp_err_t seglog_close_chunk(seglog_t* log) {
+    if ( log->fill + sizeof(seglog_record_t) <= log->config.chunk_size ) {
+        memset(log->buf + log->fill, 0, sizeof(seglog_record_t));
+        log->fill += sizeof(seglog_record_t);
+    }
+    esp_err_t ret = seglog_write_chunk(log);
+    if ( ret != ESP_OK ) {
+        return ret;
+    }
+    log->stats.chunk_writes++;
+    log->flushed_id = log->next_id;
+    log->chunk++;
+    log->fill = 0;
+    log->written = 0;
+    log->chunk_id = log->next_id;
+    return log->chunk < log->chunks ? ESP_OK : seglog_rotate(log);
+}
+
+void seglog_config_default(seglog_config_t* config) {
+    ESP_LOGV(TAG, "seglog_config_default");
+
+#ifdef CONFIG_SEGLOG_SEGMENT_KB
+    config->segment_size = CONFIG_SEGLOG_SEGMENT_KB * 1024;
+    config->chunk_size = CONFIG_SEGLOG_CHUNK_SIZE;
+#else
+    config->segment_size = 16 * 1024;
+    config->chunk_size = 1024;
+#endif
+}
+
+// walks the records of a chunk from off, returns the end of the last good one,
+// closed if nothing can be appended after it (padded or torn)
+static size_t seglog_walk(seglog_t* log, uint16_t seg, uint16_t chunk, size_t off, uint32_t* id, uint8_t* closed) {
+    size_t base = seglog_seg_off(log, seg) + seglog_chunk_off(log, chunk);
+    seglog_record_t rec;
+
+    *closed = 0;
+    while ( off + sizeof(seglog_record_t) <= log->config.chunk_size ) {
+        seglog_read(log, base + off, &rec, sizeof(rec));
+        if ( rec.len == SEGLOG_ERASED_LEN || rec.len == 0 ) {
+            *closed = rec.len == 0;
+            break;
+        }
+        size_t size = SEGLOG_RECORD_ALIGN(rec.len);
+        if ( off + size > log->config.chunk_size ) {
+            *closed = 1;
+            break;
+        }
+        seglog_read(log, base + off + sizeof(rec), log->buf, rec.len);
+        if ( seglog_record_crc(&rec, log->buf) != rec.crc ) {
+            *closed = 1;
+            break;
+        }
+        off += size;
+        (*id)++;
+    }
+    return off;
+}
+
+// the writer goes on at end of a chunk of the head segment, from next_id
+static esp_err_t seglog_resume(seglog_t* log, uint16_t chunk, size_t end) {
+    log->flushed_id = log->next_id;
+    log->chunk_id = log->next_id;
+    log->chunk = chunk;
+    log->fill = end;
+    log->written = end;
+    if ( end ) {
+        seglog_index_get(log, log->head, chunk, &log->chunk_id);
+        seglog_read(log, seglog_seg_off(log, log->head) + seglog_chunk_off(log, chunk), log->buf, end);
+    }
+    return chunk < log->chunks ? ESP_OK : seglog_rotate(log);
+}
+
+// end of the log in the head segment, after a reset
+static esp_err_t seglog_recover(seglog_t* log) {
+    uint16_t chunk = 0;
+    int indexed = 0;
+    uint32_t id;
+
+    // last chunk written
+    log->next_id = log->seg[log->head].first_id;
+    for ( uint16_t k = 0; k < log->chunks; k++ ) {
+        int state = seglog_index_get(log, log->head, k, &id);
+        if ( state == 0 ) {
+            break;
+        }
+        chunk = k;
+        indexed = state;
+        if ( state > 0 ) {
+            log->next_id = id;
+        }
+    }
+
+    uint8_t closed = 0;
+    if ( indexed < 0 ) {
+        // reset in the middle of an index entry, before any record of its chunk
+        ESP_LOGW(TAG, "torn index entry in segment %u chunk %u", log->head, chunk);
+        if ( chunk > 0 ) {
+            seglog_walk(log, log->head, chunk - 1, 0, &log->next_id, &closed);
+        }
+        return seglog_resume(log, chunk + 1, 0);
+    }
+
+    size_t end = indexed ? seglog_walk(log, log->head, chunk, 0, &log->next_id, &closed) : 0;
+    if ( closed ) {
+        // a torn record is forgotten, its chunk is not written again
+        seglog_record_t rec;
+        seglog_read(log, seglog_seg_off(log, log->head) + seglog_chunk_off(log, chunk) + end, &rec, sizeof(rec));
+        if ( rec.len != 0 ) {
+            ESP_LOGW(TAG, "torn record in segment %u chunk %u dropped", log->head, chunk);
+            log->stats.torn++;
+        }
+    }
+    if ( closed || end + sizeof(seglog_record_t) > log->config.chunk_size ) {
+        return seglog_resume(log, chunk + 1, 0);
+    }
+    return seglog_resume(log, chunk, end);
+}
+
+static uint8_t seglog_is_erased(seglog_t* log, uint16_t seg) {
+    uint32_t word[16];
+    size_t base = seglog_seg_off(log, seg);
+
+    for ( size_t off = 0; off < log->config.segment_size; off += sizeof(word) ) {
+        seglog_read(log, base + off, word, sizeof(word));
+        for ( int i = 0; i < 16; i++ ) {
+            if ( word[i] != 0xffffffffu ) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+esp_err_t seglog_open(seglog_t* log, const seglog_flash_t* flash, const seglog_config_t* config) {
+    ESP_LOGV(TAG, "seglog_open");
+
+    if ( log == NULL || flash == NULL || config == NULL || flash->sector_size == 0 ||
+         config->segment_size % flash->sector_size || config->chunk_size % SEGLOG_PAGE_SIZE ||
+         config->chunk_size == 0 || config->chunk_size > 0xffff || flash->size / config->segment_size < 3 ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memset(log, 0, sizeof(seglog_t));
+    log->flash = *flash;
+    log->config = *config;
+    log->seg_count = (uint16_t)( flash->size / config->segment_size );
+    // the index takes room from the chunks it indexes
+    size_t chunks = config->segment_size / config->chunk_size;
+    log->data_off = ( sizeof(seglog_seg_hdr_t) + chunks * sizeof(seglog_index_t) + SEGLOG_PAGE_SIZE - 1 ) & ~(size_t)( SEGLOG_PAGE_SIZE - 1 );
+    log->chunks = (uint16_t)( ( config->segment_size - log->data_off ) / config->chunk_size );
+    if ( log->chunks == 0 ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    log->seg = calloc(log->seg_count, sizeof(seglog_segment_t));
+    log->buf = malloc(config->chunk_size);
+    log->rbuf = flash->map == NULL ? malloc(config->chunk_size) : NULL;
+    if ( log->seg == NULL || log->buf == NULL || ( flash->map == NULL && log->rbuf == NULL ) ) {
+        seglog_close(log);
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint32_t max_seq = 0;
+    for ( uint16_t i = 0; i < log->seg_count; i++ ) {
+        seglog_seg_hdr_t hdr;
+        seglog_read(log, seglog_seg_off(log, i), &hdr, sizeof(hdr));
+        if ( hdr.magic != SEGLOG_MAGIC || hdr.seq == 0 ||
+             seglog_crc16(0xffff, (const uint8_t*)&hdr, offsetof(seglog_seg_hdr_t, crc)) != hdr.crc ) {
+            continue;
+        }
+        log->seg[i].seq = hdr.seq;
+        log->seg[i].first_id = hdr.first_id;
+        log->seg[i].erases = hdr.erases;
+        if ( hdr.seq > max_seq ) {
+            max_seq = hdr.seq;
+            log->head = i;
+        }
+    }
+    seglog_wear(log);
+
+    esp_err_t ret;
+    if ( max_seq == 0 ) {
+        ESP_LOGI(TAG, "no log found, formatting %u segments of %u bytes", log->seg_count, (unsigned)config->segment_size);
+        ret = seglog_erase(log, 0);
+        if ( ret == ESP_OK ) {
+            ret = seglog_start_segment(log, 0, 1);
+        }
+        log->oldest = 0;
+        if ( ret != ESP_OK ) {
+            seglog_close(log);
+        }
+        return ret;
+    }
+
+    // live segments run back from the head with consecutive seqs, one is always spare
+    log->oldest = log->head;
+    for ( uint16_t n = 1; n < log->seg_count - 1; n++ ) {
+        uint16_t prev = (uint16_t)( ( log->head + log->seg_count - n ) % log->seg_count );
+        if ( log->seg[prev].seq == 0 || log->seg[prev].seq != log->seg[log->head].seq - n ) {
+            break;
+        }
+        log->oldest = prev;
+    }
+    uint16_t live = (uint16_t)( ( log->head + log->seg_count - log->oldest ) % log->seg_count );
+    for ( uint16_t i = 0; i < log->seg_count; i++ ) {
+        if ( ( i + log->seg_count - log->oldest ) % log->seg_count > live ) {
+            log->seg[i].seq = 0;
+        }
+    }
+
+    ret = seglog_recover(log);
+    if ( ret == ESP_OK && !log->spare_erased ) {
+        log->spare_erased = seglog_is_erased(log, seglog_after(log, log->head));
+    }
+    if ( ret != ESP_OK ) {
+        seglog_close(log);
+        return ret;
+    }
+    ESP_LOGI(TAG, "log open: records %u to %u, segments %u to %u of %u",
+        seglog_first_id(log), log->next_id, log->oldest, log->head, log->seg_count);
+    return ESP_OK;
+}
+
+esp_err_t seglog_close(seglog_t* log) {
+    ESP_LOGV(TAG, "seglog_close");
+
+    if ( log == NULL ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t ret = log->seg != NULL && log->buf != NULL ? seglog_flush(log) : ESP_OK;
+    free(log->seg);
+    free(log->buf);
+    free(log->rbuf);
+    log->seg = NULL;
+    log->buf = NULL;
+    log->rbuf = NULL;
+    return ret;
+}
+
+esp_err_t seglog_append(seglog_t* log, uint8_t type, const void* data, uint16_t len) {
+    size_t size = SEGLOG_RECORD_ALIGN(len);
+    esp_err_t ret;
+
+    if ( log->buf == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ( len == 0 || len > SEGLOG_MAX_RECORD || size > log->config.chunk_size ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if ( log->fill + size > log->config.chunk_size && ( ret = seglog_close_chunk(log) ) != ESP_OK ) {
+        return ret;
+    }
+
+    seglog_record_t rec = { .len = (uint8_t)len, .type = type };
+    rec.crc = seglog_record_crc(&rec, data);
+    uint8_t* p = log->buf + log->fill;
+    memcpy(p, &rec, sizeof(rec));
+    memcpy(p + sizeof(rec), data, len);
+    // alignment pad, never read
+    memset(p + sizeof(rec) + len, 0xff, size - sizeof(rec) - len);
+    log->fill += size;
+    log->next_id++;
+    log->stats.appended++;
+    log->stats.bytes += len;
+    return ESP_OK;
+}
+
+esp_err_t seglog_flush(seglog_t* log) {
+    if ( log->buf == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ( log->fill == log->written ) {
+        return ESP_OK;
+    }
+
+    esp_err_t ret = seglog_write_chunk(log);
+    if ( ret == ESP_OK ) {
+        log->stats.flushes++;
+        log->flushed_id = log->next_id;
+    }
+    return ret;
+}
+
+esp_err_t seglog_maintain(seglog_t* log) {
+    if ( log->buf == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ( log->spare_erased ) {
+        return ESP_OK;
+    }
+
+    esp_err_t ret = seglog_erase(log, seglog_after(log, log->head));
+    if ( ret == ESP_OK ) {
+        log->spare_erased = 1;
+    }
+    return ret;
+}
+
+uint32_t seglog_first_id(const seglog_t* log) {
+    return log->seg[log->oldest].first_id;
+}
+
+uint32_t seglog_next_id(const seglog_t* log) {
+    return log->next_id;
+}
+
+// record header at the cursor, moves to the next chunk / segment over the unused ends
+static esp_err_t seglog_locate(seglog_t* log, seglog_cursor_t* cursor, seglog_record_t* rec) {
+    while ( 1 ) {
+        size_t in_data = cursor->off - log->data_off;
+        uint16_t chunk = (uint16_t)( in_data / log->config.chunk_size );
+        size_t chunk_end = seglog_chunk_off(log, chunk + 1);
+
+        if ( chunk >= log->chunks ) {
+            if ( cursor->seg == log->head ) {
+                return ESP_ERR_INVALID_STATE;
+            }
+            cursor->seg = seglog_after(log, cursor->seg);
+            cursor->seg_seq = log->seg[cursor->seg].seq;
+            cursor->off = log->data_off;
+            continue;
+        }
+        if ( cursor->off + sizeof(seglog_record_t) <= chunk_end ) {
+            seglog_read(log, seglog_seg_off(log, cursor->seg) + cursor->off, rec, sizeof(seglog_record_t));
+            if ( rec->len != SEGLOG_ERASED_LEN && rec->len != 0 &&
+                 cursor->off + SEGLOG_RECORD_ALIGN(rec->len) <= chunk_end ) {
+                return ESP_OK;
+            }
+        }
+        if ( cursor->seg == log->head && chunk >= log->chunk ) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        cursor->off = chunk_end;
+    }
+}
+
+// payload of the record at the cursor, NULL if torn
+static const uint8_t* seglog_payload(seglog_t* log, const seglog_cursor_t* cursor, const seglog_record_t* rec) {
+    size_t off = seglog_seg_off(log, cursor->seg) + cursor->off + sizeof(seglog_record_t);
+    const uint8_t* data;
+
+    if ( log->flash.map != NULL ) {
+        data = log->flash.map + off;
+    }
+    else if ( log->flash.read(log->flash.ctx, off, log->rbuf, rec->len) == ESP_OK ) {
+        data = log->rbuf;
+    }
+    else {
+        return NULL;
+    }
+    return seglog_record_crc(rec, data) == rec->crc ? data : NULL;
+}
+
+esp_err_t seglog_seek(seglog_t* log, seglog_cursor_t* cursor, uint32_t id) {
+    uint32_t first = seglog_first_id(log);
+
+    if ( log->buf == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ( (int32_t)( id - first ) < 0 ) {
+        id = first;
+    }
+    if ( (int32_t)( id - log->flushed_id ) > 0 ) {
+        id = log->flushed_id;
+    }
+
+    // segment holding it
+    uint16_t seg = log->oldest;
+    while ( seg != log->head && (int32_t)( id - log->seg[seglog_after(log, seg)].first_id ) >= 0 ) {
+        seg = seglog_after(log, seg);
+    }
+
+    // last chunk starting at or before it
+    uint16_t lo = 0, hi = log->chunks;
+    while ( hi - lo > 1 ) {
+        uint16_t mid = (uint16_t)( ( lo + hi ) / 2 );
+        uint32_t entry;
+        if ( seglog_index_get(log, seg, mid, &entry) > 0 && (int32_t)( id - entry ) >= 0 ) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    cursor->seg = seg;
+    cursor->seg_seq = log->seg[seg].seq;
+    cursor->off = seglog_chunk_off(log, lo);
+    if ( seglog_index_get(log, seg, lo, &cursor->id) <= 0 ) {
+        cursor->id = log->seg[seg].first_id;
+    }
+
+    // then record by record
+    seglog_record_t rec;
+    while ( cursor->id != id ) {
+        if ( seglog_locate(log, cursor, &rec) != ESP_OK ) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        cursor->off += SEGLOG_RECORD_ALIGN(rec.len);
+        cursor->id++;
+    }
+    return ESP_OK;
+}
+
+esp_err_t seglog_next(seglog_t* log, seglog_cursor_t* cursor, seglog_entry_t* entry) {
+    if ( log->buf == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ( log->seg[cursor->seg].seq != cursor->seg_seq || (int32_t)( cursor->id - seglog_first_id(log) ) < 0 ) {
+        ESP_LOGW(TAG, "cursor on an expired segment, moved to the oldest record");
+        esp_err_t ret = seglog_seek(log, cursor, seglog_first_id(log));
+        if ( ret != ESP_OK ) {
+            return ret;
+        }
+    }
+    if ( cursor->id == log->flushed_id ) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    seglog_record_t rec;
+    while ( 1 ) {
+        esp_err_t ret = seglog_locate(log, cursor, &rec);
+        if ( ret != ESP_OK ) {
+            return ret;
+        }
+        const uint8_t* data = seglog_payload(log, cursor, &rec);
+        if ( data != NULL ) {
+            entry->id = cursor->id;
+            entry->type = rec.type;
+            entry->len = rec.len;
+            entry->data = data;
+            cursor->off += SEGLOG_RECORD_ALIGN(rec.len);
+            cursor->id++;
+            return ESP_OK;
+        }
+        // torn before a reset and skipped on open as well
+        cursor->off = seglog_chunk_off(log, (uint16_t)( ( cursor->off - log->data_off ) / log->config.chunk_size ) + 1);
+    }
+}
+
+void seglog_stats_get(const seglog_t* log, seglog_stats_t* stats) {
+    if ( stats == NULL ) return;
+    memcpy(stats, &log->stats, sizeof(seglog_stats_t));
+}
@@ -0,0 +1,68 @@
+#include "seglog.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+
+/*
+ * esp_partition backend. The whole partition is mapped once in the data
+ * address space: reads are plain loads through the flash cache, and
+ * esp_partition_write / erase flush the cache over the range they touch,
+ * so the mapping never shows stale data.
+ */
+
+typedef struct {
+    const esp_partition_t*  part;
+    spi_flash_mmap_handle_t mmap;
+} seglog_partition_t;
+
+static const char *TAG = "seglog";
+
+static seglog_partition_t partition;
+
+static esp_err_t seglog_partition_read(void* ctx, size_t off, void* buf, size_t len) {
+    return esp_partition_read(((seglog_partition_t*)ctx)->part, off, buf, len);
+}
+
+static esp_err_t seglog_partition_write(void* ctx, size_t off, const void* buf, size_t len) {
+    return esp_partition_write(((seglog_partition_t*)ctx)->part, off, buf, len);
+}
+
+static esp_err_t seglog_partition_erase(void* ctx, size_t off, size_t len) {
+    return esp_partition_erase_range(((seglog_partition_t*)ctx)->part, off, len);
+}
+
+esp_err_t seglog_partition_open(const char* label, seglog_flash_t* flash) {
+    ESP_LOGV(TAG, "seglog_partition_open");
+
+    partition.part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if ( partition.part == NULL ) {
+        ESP_LOGE(TAG, "no data partition \"%s\"", label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const void* map = NULL;
+    esp_err_t ret = esp_partition_mmap(partition.part, 0, partition.part->size, SPI_FLASH_MMAP_DATA, &map, &partition.mmap);
+    if ( ret != ESP_OK ) {
+        // reads go through esp_partition_read then
+        ESP_LOGW(TAG, "partition \"%s\" not mapped (%d)", label, ret);
+        map = NULL;
+    }
+
+    flash->read = seglog_partition_read;
+    flash->write = seglog_partition_write;
+    flash->erase = seglog_partition_erase;
+    flash->map = map;
+    flash->size = partition.part->size;
+    flash->sector_size = SPI_FLASH_SEC_SIZE;
+    flash->ctx = &partition;
+    return ESP_OK;
+}
+
+void seglog_partition_close(seglog_flash_t* flash) {
+    ESP_LOGV(TAG, "seglog_partition_close");
+
+    if ( flash->map != NULL ) {
+        spi_flash_munmap(partition.mmap);
+        flash->map = NULL;
+    }
+}
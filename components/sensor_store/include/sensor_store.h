@@ -0,0 +1,70 @@
+#ifndef _SENSOR_STORE_H_
+#define _SENSOR_STORE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define SENSOR_STORE_ADDR_LEN       6
+#define SENSOR_STORE_MAX_WINDOWS    4
+// each window is split in buckets, the window resolution is window / buckets
+#define SENSOR_STORE_BUCKETS        4
+#define SENSOR_STORE_NONE           0xffff
+
+// fixed point channels
+typedef enum {
+    SENSOR_STORE_TEMP = 0,      // 0.01 C
+    SENSOR_STORE_HUMI,          // 0.01 %
+    SENSOR_STORE_PRES,          // 0.01 hPa
+    SENSOR_STORE_CHANNELS
+} sensor_store_channel_t;
+
+typedef struct {
+    uint32_t    ts;             // ms, master clock
+    int32_t     value[SENSOR_STORE_CHANNELS];
+} sensor_store_sample_t;
+
+typedef struct {
+    uint32_t    count;
+    int32_t     min[SENSOR_STORE_CHANNELS];
+    int32_t     max[SENSOR_STORE_CHANNELS];
+    int32_t     mean[SENSOR_STORE_CHANNELS];
+} sensor_store_agg_t;
+
+typedef struct {
+    uint16_t    max_nodes;
+    uint16_t    ring_size;
+    uint8_t     window_count;
+    uint32_t    window_ms[SENSOR_STORE_MAX_WINDOWS];
+} sensor_store_config_t;
+
+typedef struct {
+    sensor_store_config_t   config;
+    uint16_t                node_count;
+    uint16_t                index_mask;
+    size_t                  node_size;
+    uint16_t*               index;      // addr hash -> node
+    uint8_t*                nodes;      // node headers, rings and buckets
+    void*                   arena;
+    uint8_t                 arena_owned;
+} sensor_store_t;
+
+void      sensor_store_config_default(sensor_store_config_t* config);
+size_t    sensor_store_arena_size(const sensor_store_config_t* config);
+// arena may be NULL, it is then allocated once here
+esp_err_t sensor_store_init(sensor_store_t* store, const sensor_store_config_t* config, void* arena, size_t arena_size);
+esp_err_t sensor_store_done(sensor_store_t* store);
+
+// node index is stable for the store lifetime, SENSOR_STORE_NONE if unknown / full
+uint16_t  sensor_store_node_index(sensor_store_t* store, const uint8_t* addr, uint8_t create);
+const uint8_t* sensor_store_node_addr(sensor_store_t* store, uint16_t node);
+
+esp_err_t sensor_store_add(sensor_store_t* store, const uint8_t* addr, const sensor_store_sample_t* sample);
+esp_err_t sensor_store_add_node(sensor_store_t* store, uint16_t node, const sensor_store_sample_t* sample);
+
+esp_err_t sensor_store_latest(sensor_store_t* store, uint16_t node, sensor_store_sample_t* sample);
+esp_err_t sensor_store_window(sensor_store_t* store, uint16_t node, uint8_t window, uint32_t now, sensor_store_agg_t* agg);
+// copy up to max samples, newest first, returns the number of samples
+uint16_t  sensor_store_history(sensor_store_t* store, uint16_t node, sensor_store_sample_t* out, uint16_t max);
+
+#endif // _SENSOR_STORE_H_
@@ -0,0 +1,296 @@
+#include "sensor_store.h"
+#include "esp_log.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Per sensor time series store
+ *
+ * Every node owns a fixed slot in a single arena: a header, a ring of the
+ * last ring_size samples and, for each configured window, SENSOR_STORE_BUCKETS
+ * time buckets holding min / max / sum / count. A sample updates one bucket per
+ * window, a window query merges at most SENSOR_STORE_BUCKETS buckets, so both
+ * are O(1) and nothing is ever rescanned.
+ *
+ * The store is not thread safe, one store per task.
+ */
+
+typedef struct {
+    uint8_t     addr[SENSOR_STORE_ADDR_LEN];
+    uint16_t    head;       // next ring slot
+    uint16_t    count;      // samples in ring
+} sensor_store_node_t;
+
+typedef struct {
+    uint32_t    start;
+    uint32_t    count;
+    int32_t     min[SENSOR_STORE_CHANNELS];
+    int32_t     max[SENSOR_STORE_CHANNELS];
+    int64_t     sum[SENSOR_STORE_CHANNELS];
+} sensor_store_bucket_t;
+
+#define SENSOR_STORE_ALIGN(x)   (((x) + 7) & ~((size_t)7))
+
+static const char *TAG = "sensor_store";
+
+static inline uint16_t sensor_store_hash(const uint8_t* addr) {
+    uint32_t h = 2166136261u;
+    for ( int i = 0; i < SENSOR_STORE_ADDR_LEN; i++ ) {
+        h = ( h ^ addr[i] ) * 16777619u;
+    }
+    return (uint16_t)( h ^ ( h >> 16 ) );
+}
+
+static inline size_t sensor_store_index_size(const sensor_store_config_t* config) {
+    size_t size = 1;
+    while ( size < 2 * (size_t)config->max_nodes ) size <<= 1;
+    return size;
+}
+
+static inline sensor_store_node_t* sensor_store_node(sensor_store_t* store, uint16_t node) {
+    return (sensor_store_node_t*)( store->nodes + (size_t)node * store->node_size );
+}
+
+static inline sensor_store_sample_t* sensor_store_ring(sensor_store_t* store, uint16_t node) {
+    return (sensor_store_sample_t*)( (uint8_t*)sensor_store_node(store, node) + SENSOR_STORE_ALIGN(sizeof(sensor_store_node_t)) );
+}
+
+static inline sensor_store_bucket_t* sensor_store_buckets(sensor_store_t* store, uint16_t node, uint8_t window) {
+    uint8_t* ring = (uint8_t*)sensor_store_ring(store, node);
+    sensor_store_bucket_t* buckets = (sensor_store_bucket_t*)( ring + SENSOR_STORE_ALIGN(store->config.ring_size * sizeof(sensor_store_sample_t)) );
+    return buckets + window * SENSOR_STORE_BUCKETS;
+}
+
+void sensor_store_config_default(sensor_store_config_t* config) {
+    ESP_LOGV(TAG, "sensor_store_config_default");
+
+    memset(config, 0, sizeof(sensor_store_config_t));
+#ifdef CONFIG_SENSOR_STORE_MAX_NODES
+    config->max_nodes = CONFIG_SENSOR_STORE_MAX_NODES;
+    config->ring_size = CONFIG_SENSOR_STORE_RING_SIZE;
+    config->window_count = 2;
+    config->window_ms[0] = CONFIG_SENSOR_STORE_WINDOW1_SEC * 1000;
+    config->window_ms[1] = CONFIG_SENSOR_STORE_WINDOW2_SEC * 1000;
+#else
+    config->max_nodes = 128;
+    config->ring_size = 16;
+    config->window_count = 2;
+    config->window_ms[0] = 15 * 60 * 1000;
+    config->window_ms[1] = 24 * 3600 * 1000;
+#endif
+}
+
+size_t sensor_store_arena_size(const sensor_store_config_t* config) {
+    size_t node_size = SENSOR_STORE_ALIGN(sizeof(sensor_store_node_t))
+        + SENSOR_STORE_ALIGN(config->ring_size * sizeof(sensor_store_sample_t))
+        + config->window_count * SENSOR_STORE_BUCKETS * sizeof(sensor_store_bucket_t);
+
+    return SENSOR_STORE_ALIGN(sensor_store_index_size(config) * sizeof(uint16_t))
+        + config->max_nodes * SENSOR_STORE_ALIGN(node_size);
+}
+
+esp_err_t sensor_store_init(sensor_store_t* store, const sensor_store_config_t* config, void* arena, size_t arena_size) {
+    ESP_LOGV(TAG, "sensor_store_init");
+
+    if ( store == NULL || config == NULL || config->max_nodes == 0 || config->max_nodes >= SENSOR_STORE_NONE
+        || config->ring_size == 0 || config->window_count > SENSOR_STORE_MAX_WINDOWS ) {
+        ESP_LOGE(TAG, "bad args");
+        return ESP_ERR_INVALID_ARG;
+    }
+    for ( int i = 0; i < config->window_count; i++ ) {
+        if ( config->window_ms[i] < SENSOR_STORE_BUCKETS ) {
+            ESP_LOGE(TAG, "window %d too short", i);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    size_t size = sensor_store_arena_size(config);
+    memset(store, 0, sizeof(sensor_store_t));
+    if ( arena == NULL ) {
+        arena = malloc(size);
+        if ( arena == NULL ) {
+            ESP_LOGE(TAG, "malloc arena fail (%d bytes)", (int)size);
+            return ESP_ERR_NO_MEM;
+        }
+        store->arena_owned = 1;
+    }
+    else if ( arena_size < size ) {
+        ESP_LOGE(TAG, "arena too small (%d < %d)", (int)arena_size, (int)size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memset(arena, 0, size);
+
+    memcpy(&store->config, config, sizeof(sensor_store_config_t));
+    store->arena = arena;
+    store->index = (uint16_t*)arena;
+    store->index_mask = (uint16_t)( sensor_store_index_size(config) - 1 );
+    store->nodes = (uint8_t*)arena + SENSOR_STORE_ALIGN(sensor_store_index_size(config) * sizeof(uint16_t));
+    store->node_size = SENSOR_STORE_ALIGN(SENSOR_STORE_ALIGN(sizeof(sensor_store_node_t))
+        + SENSOR_STORE_ALIGN(config->ring_size * sizeof(sensor_store_sample_t))
+        + config->window_count * SENSOR_STORE_BUCKETS * sizeof(sensor_store_bucket_t));
+    for ( size_t i = 0; i <= store->index_mask; i++ ) {
+        store->index[i] = SENSOR_STORE_NONE;
+    }
+
+    ESP_LOGI(TAG, "store: %d nodes, %d samples / node, %d window(s), %d bytes",
+        config->max_nodes, config->ring_size, config->window_count, (int)size);
+    return ESP_OK;
+}
+
+esp_err_t sensor_store_done(sensor_store_t* store) {
+    ESP_LOGV(TAG, "sensor_store_done");
+
+    if ( store->arena_owned ) {
+        free(store->arena);
+    }
+    memset(store, 0, sizeof(sensor_store_t));
+    return ESP_OK;
+}
+
+uint16_t sensor_store_node_index(sensor_store_t* store, const uint8_t* addr, uint8_t create) {
+    uint16_t slot = sensor_store_hash(addr) & store->index_mask;
+
+    // linear probing, nodes are never removed
+    while ( store->index[slot] != SENSOR_STORE_NONE ) {
+        uint16_t node = store->index[slot];
+        if ( memcmp(sensor_store_node(store, node)->addr, addr, SENSOR_STORE_ADDR_LEN) == 0 ) {
+            return node;
+        }
+        slot = ( slot + 1 ) & store->index_mask;
+    }
+    if ( !create ) {
+        return SENSOR_STORE_NONE;
+    }
+    if ( store->node_count >= store->config.max_nodes ) {
+        ESP_LOGW(TAG, "store full, node dropped");
+        return SENSOR_STORE_NONE;
+    }
+
+    uint16_t node = store->node_count++;
+    memcpy(sensor_store_node(store, node)->addr, addr, SENSOR_STORE_ADDR_LEN);
+    store->index[slot] = node;
+    return node;
+}
+
+const uint8_t* sensor_store_node_addr(sensor_store_t* store, uint16_t node) {
+    if ( node >= store->node_count ) return NULL;
+    return sensor_store_node(store, node)->addr;
+}
+
+static void sensor_store_bucket_add(sensor_store_bucket_t* b, uint32_t width, const sensor_store_sample_t* sample) {
+    uint32_t start = sample->ts - sample->ts % width;
+
+    if ( b->count != 0 && b->start != start ) {
+        if ( (int32_t)( start - b->start ) < 0 ) {
+            // late sample, its bucket was already recycled
+            return;
+        }
+        b->count = 0;
+    }
+    if ( b->count == 0 ) {
+        b->start = start;
+        for ( int c = 0; c < SENSOR_STORE_CHANNELS; c++ ) {
+            b->min[c] = b->max[c] = sample->value[c];
+            b->sum[c] = 0;
+        }
+    }
+    for ( int c = 0; c < SENSOR_STORE_CHANNELS; c++ ) {
+        int32_t v = sample->value[c];
+        if ( v < b->min[c] ) b->min[c] = v;
+        if ( v > b->max[c] ) b->max[c] = v;
+        b->sum[c] += v;
+    }
+    b->count++;
+}
+
+esp_err_t sensor_store_add_node(sensor_store_t* store, uint16_t node, const sensor_store_sample_t* sample) {
+    ESP_LOGV(TAG, "sensor_store_add_node");
+
+    if ( node >= store->node_count || sample == NULL ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    sensor_store_node_t* n = sensor_store_node(store, node);
+    sensor_store_ring(store, node)[n->head] = *sample;
+    n->head = ( n->head + 1 ) % store->config.ring_size;
+    if ( n->count < store->config.ring_size ) n->count++;
+
+    for ( int w = 0; w < store->config.window_count; w++ ) {
+        uint32_t width = store->config.window_ms[w] / SENSOR_STORE_BUCKETS;
+        sensor_store_bucket_t* b = sensor_store_buckets(store, node, w) + ( sample->ts / width ) % SENSOR_STORE_BUCKETS;
+        sensor_store_bucket_add(b, width, sample);
+    }
+    return ESP_OK;
+}
+
+esp_err_t sensor_store_add(sensor_store_t* store, const uint8_t* addr, const sensor_store_sample_t* sample) {
+    ESP_LOGV(TAG, "sensor_store_add");
+
+    if ( store == NULL || addr == NULL ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint16_t node = sensor_store_node_index(store, addr, 1);
+    if ( node == SENSOR_STORE_NONE ) {
+        return ESP_ERR_NO_MEM;
+    }
+    return sensor_store_add_node(store, node, sample);
+}
+
+esp_err_t sensor_store_latest(sensor_store_t* store, uint16_t node, sensor_store_sample_t* sample) {
+    if ( node >= store->node_count || sample == NULL ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    sensor_store_node_t* n = sensor_store_node(store, node);
+    if ( n->count == 0 ) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint16_t last = ( n->head + store->config.ring_size - 1 ) % store->config.ring_size;
+    *sample = sensor_store_ring(store, node)[last];
+    return ESP_OK;
+}
+
+esp_err_t sensor_store_window(sensor_store_t* store, uint16_t node, uint8_t window, uint32_t now, sensor_store_agg_t* agg) {
+    if ( node >= store->node_count || window >= store->config.window_count || agg == NULL ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int64_t sum[SENSOR_STORE_CHANNELS] = { 0 };
+    sensor_store_bucket_t* buckets = sensor_store_buckets(store, node, window);
+
+    memset(agg, 0, sizeof(sensor_store_agg_t));
+    for ( int i = 0; i < SENSOR_STORE_BUCKETS; i++ ) {
+        sensor_store_bucket_t* b = &buckets[i];
+        if ( b->count == 0 || now - b->start >= store->config.window_ms[window] ) {
+            continue;
+        }
+        for ( int c = 0; c < SENSOR_STORE_CHANNELS; c++ ) {
+            if ( agg->count == 0 || b->min[c] < agg->min[c] ) agg->min[c] = b->min[c];
+            if ( agg->count == 0 || b->max[c] > agg->max[c] ) agg->max[c] = b->max[c];
+            sum[c] += b->sum[c];
+        }
+        agg->count += b->count;
+    }
+    if ( agg->count == 0 ) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    for ( int c = 0; c < SENSOR_STORE_CHANNELS; c++ ) {
+        agg->mean[c] = (int32_t)( sum[c] / (int64_t)agg->count );
+    }
+    return ESP_OK;
+}
+
+uint16_t sensor_store_history(sensor_store_t* store, uint16_t node, sensor_store_sample_t* out, uint16_t max) {
+    if ( node >= store->node_count || out == NULL ) {
+        return 0;
+    }
+    sensor_store_node_t* n = sensor_store_node(store, node);
+    sensor_store_sample_t* ring = sensor_store_ring(store, node);
+    uint16_t count = n->count < max ? n->count : max;
+    uint16_t pos = n->head;
+
+    for ( uint16_t i = 0; i < count; i++ ) {
+        pos = ( pos + store->config.ring_size - 1 ) % store->config.ring_size;
+        out[i] = ring[pos];
+    }
+    return count;
+}
@@ -0,0 +1,44 @@
+#ifndef _UPLINK_H_
+#define _UPLINK_H_
+
+#include "esp_err.h"
+#include "uplink_frame.h"
+
+#ifdef CONFIG_UPLINK_UART_PORT
+#define UPLINK_UART_PORT    CONFIG_UPLINK_UART_PORT
+#define UPLINK_BAUD_RATE    CONFIG_UPLINK_BAUD_RATE
+#define UPLINK_TX_BUFFER    CONFIG_UPLINK_TX_BUFFER
+#define UPLINK_BATCH_SIZE   CONFIG_UPLINK_BATCH_SIZE
+#define UPLINK_FLUSH_MS     CONFIG_UPLINK_FLUSH_MS
+#else
+#define UPLINK_UART_PORT    0
+#define UPLINK_BAUD_RATE    921600
+#define UPLINK_TX_BUFFER    8192
+#define UPLINK_BATCH_SIZE   512
+#define UPLINK_FLUSH_MS     50
+#endif
+
+// longest frame expected from the host, decoded
+#define UPLINK_RX_FRAME_MAX 64
+
+typedef struct {
+    uint32_t    records;
+    uint32_t    frames;
+    uint32_t    bytes;          // bytes handed to the uart driver
+    uint32_t    blocked_us;     // time spent waiting for room in the uart buffer
+} uplink_stats_t;
+
+esp_err_t uplink_init();
+esp_err_t uplink_done();
+
+// append a record to the current batch, the batch is sent when full
+esp_err_t uplink_write(uint8_t type, const void* data, uint16_t len);
+// send the current batch, if any
+esp_err_t uplink_flush();
+// last cursor the host sent back since the previous call, ESP_ERR_NOT_FOUND
+// if none, never waits; from one task only
+esp_err_t uplink_read_cursor(uint32_t* id);
+
+void      uplink_stats_get(uplink_stats_t* stats);
+
+#endif // _UPLINK_H_
@@ -0,0 +1,121 @@
+#ifndef _UPLINK_FRAME_H_
+#define _UPLINK_FRAME_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Binary uplink framing, shared by the master and the host tools.
+ *
+ * A frame is a batch of records:
+ *
+ *   header (4) | type (1) len (1) payload (len) | ... | crc16 (2, le)
+ *
+ * Record types with UPLINK_REC_EXT set have a 16 bit little endian length,
+ * for payloads over 255 bytes.
+ *
+ * The whole frame is COBS encoded and sent between two 0x00 delimiters, so
+ * a host can resync on any 0x00 byte (console output included).
+ */
+
+#define UPLINK_FRAME_VERSION    1
+#define UPLINK_FRAME_DELIM      0x00
+#define UPLINK_FRAME_HDR_LEN    4
+#define UPLINK_FRAME_CRC_LEN    2
+#define UPLINK_RECORD_HDR_LEN   2
+#define UPLINK_RECORD_EXT_HDR_LEN 3
+#define UPLINK_RECORD_MAX_LEN   255
+
+// worst case cobs overhead, one byte every 254 plus the leading code byte
+#define UPLINK_COBS_MAX_LEN(len) ((len) + (len) / 254 + 1)
+
+typedef enum {
+    UPLINK_REC_SAMPLE = 0x01,
+    UPLINK_REC_PROFILE = 0x02,  // uplink_profile_t
+    UPLINK_REC_CURSOR = 0x03,   // uplink_cursor_t, both ways
+    UPLINK_REC_LINK   = 0x04,   // uplink_link_t
+    UPLINK_REC_METRIC = 0x05,   // one metric, metrics_encode() (components/metrics)
+    UPLINK_REC_EXT    = 0x80,
+    UPLINK_REC_FRAME  = 0x81,   // uplink_capture_t followed by the esp-now payload
+} uplink_record_type_t;
+
+#define UPLINK_RECORD_HDR_SIZE(type) ( ( (type) & UPLINK_REC_EXT ) ? UPLINK_RECORD_EXT_HDR_LEN : UPLINK_RECORD_HDR_LEN )
+
+typedef struct __attribute__((packed)) {
+    uint8_t     version;
+    uint8_t     flags;
+    uint16_t    seq;
+} uplink_frame_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t     addr[6];
+    uint32_t    ts;             // ms, master clock
+    int32_t     temp;           // 0.01 C
+    int32_t     humi;           // 0.01 %
+    int32_t     pres;           // 0.01 hPa
+} uplink_sample_t;
+
+// wake profile reported by a sensor node, averaged over its last wakes
+#define UPLINK_PROFILE_PHASES   10
+
+typedef struct __attribute__((packed)) {
+    uint8_t     addr[6];
+    uint32_t    ts;             // ms, master clock
+    uint16_t    wakes;
+    uint16_t    phase[UPLINK_PROFILE_PHASES];   // 0.1 ms: boot nvs wifi espnow sensor convert join send ack sleep
+    uint32_t    energy_uj;      // estimated, one wake cycle
+} uplink_profile_t;
+
+/* Master flash log (CONFIG_MASTER_SEGLOG): after a batch of records from
+ * the log, the id of the next one. The host sends it back once it has
+ * them, the master goes on from the last one it got back after a reboot or
+ * a silent host. */
+typedef struct __attribute__((packed)) {
+    uint32_t    id;
+} uplink_cursor_t;
+
+/* Link quality of a sensor as the master sees it (espnow_linkstat_t):
+ * EWMA and histogram of rssi (dBm), gap, dup, interval and jitter (ms). */
+#define UPLINK_LINK_METRICS     5
+#define UPLINK_LINK_BUCKETS     6
+
+typedef struct __attribute__((packed)) {
+    int32_t     ewma;           // x16
+    uint16_t    hist[UPLINK_LINK_BUCKETS];
+} uplink_link_value_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t     addr[6];
+    uint32_t    ts;             // ms, master clock
+    uint32_t    age_ms;         // since the last frame
+    uint32_t    frames;
+    uint32_t    data;           // new data frames
+    uint32_t    lost;
+    uint32_t    duplicates;
+    uplink_link_value_t value[UPLINK_LINK_METRICS];
+} uplink_link_t;
+
+// one received esp-now frame, as captured by the master
+typedef struct __attribute__((packed)) {
+    uint32_t    ts;             // ms, master clock
+    uint8_t     addr[6];
+    int8_t      rssi;           // dBm
+    uint8_t     len;            // payload bytes that follow
+} uplink_capture_t;
+
+uint16_t uplink_crc16(const uint8_t* data, size_t len);
+
+size_t   uplink_cobs_encode(const uint8_t* in, size_t len, uint8_t* out);
+/* crc appended to the frame (2 bytes of room needed), then COBS encoded
+ * between two delimiters into out (UPLINK_COBS_MAX_LEN(len + 2) + 2 bytes),
+ * returns the bytes to send */
+size_t   uplink_frame_seal(uint8_t* frame, size_t len, uint8_t* out);
+// returns the decoded length, 0 on malformed input or more than out_len bytes
+size_t   uplink_cobs_decode(const uint8_t* in, size_t len, uint8_t* out, size_t out_len);
+
+// check a decoded frame, returns 1 if version and crc are good
+int      uplink_frame_check(const uint8_t* frame, size_t len);
+// iterate records of a checked frame, pos starts at 0, returns 0 when done
+int      uplink_frame_next(const uint8_t* frame, size_t len, size_t* pos, uint8_t* type, const uint8_t** payload, uint16_t* payload_len);
+
+#endif // _UPLINK_FRAME_H_
@@ -0,0 +1,187 @@
+#include "uplink.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <string.h>
+
+/*
+ * Records are batched in RAM and a whole batch is handed to the uart driver
+ * in one uart_write_bytes() call. The driver copies it into its tx ring
+ * buffer and the uart interrupt drains it, so the caller only waits when
+ * the ring buffer is full.
+ */
+
+static const char *TAG = "uplink";
+
+static uint8_t              batch[UPLINK_BATCH_SIZE];
+static size_t               batch_len = 0;
+static uint8_t              encoded[UPLINK_COBS_MAX_LEN(UPLINK_BATCH_SIZE) + 2];
+static uint16_t             seq = 0;
+static uplink_stats_t       stats;
+static SemaphoreHandle_t    uplink_lock = NULL;
+// frames from the host, cursor acks only
+static uint8_t              rx_acc[UPLINK_COBS_MAX_LEN(UPLINK_RX_FRAME_MAX)];
+static size_t               rx_len = 0;
+
+static esp_err_t uplink_flush_locked() {
+    if ( batch_len <= UPLINK_FRAME_HDR_LEN ) {
+        return ESP_OK;
+    }
+
+    size_t len = uplink_frame_seal(batch, batch_len, encoded);
+    batch_len = 0;
+
+    int64_t start = esp_timer_get_time();
+    int written = uart_write_bytes(UPLINK_UART_PORT, (const char*)encoded, len);
+    stats.blocked_us += (uint32_t)( esp_timer_get_time() - start );
+    if ( written != (int)len ) {
+        ESP_LOGE(TAG, "uart write failed (%d)", written);
+        return ESP_FAIL;
+    }
+    stats.frames++;
+    stats.bytes += len;
+    return ESP_OK;
+}
+
+esp_err_t uplink_init() {
+    ESP_LOGV(TAG, "uplink_init");
+
+    uart_config_t config = {
+        .baud_rate = UPLINK_BAUD_RATE,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+    };
+    esp_err_t ret = uart_param_config(UPLINK_UART_PORT, &config);
+    if ( ret != ESP_OK ) {
+        ESP_LOGE(TAG, "uart config failed");
+        return ret;
+    }
+    ret = uart_driver_install(UPLINK_UART_PORT, UART_FIFO_LEN * 2, UPLINK_TX_BUFFER, 0, NULL, 0);
+    if ( ret != ESP_OK ) {
+        ESP_LOGE(TAG, "uart driver install failed");
+        return ret;
+    }
+
+    uplink_lock = xSemaphoreCreateMutex();
+    if ( uplink_lock == NULL ) {
+        ESP_LOGE(TAG, "create mutex fail");
+        return ESP_ERR_NO_MEM;
+    }
+    memset(&stats, 0, sizeof(stats));
+    batch_len = 0;
+    rx_len = 0;
+    return ESP_OK;
+}
+
+esp_err_t uplink_done() {
+    ESP_LOGV(TAG, "uplink_done");
+
+    if ( uplink_lock != NULL ) {
+        uplink_flush();
+        vSemaphoreDelete(uplink_lock);
+        uplink_lock = NULL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t uplink_write(uint8_t type, const void* data, uint16_t len) {
+    size_t hdr_len = UPLINK_RECORD_HDR_SIZE(type);
+
+    if ( uplink_lock == NULL || ( data == NULL && len > 0 ) ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ( ( hdr_len == UPLINK_RECORD_HDR_LEN && len > UPLINK_RECORD_MAX_LEN ) ||
+         UPLINK_FRAME_HDR_LEN + hdr_len + len + UPLINK_FRAME_CRC_LEN > UPLINK_BATCH_SIZE ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(uplink_lock, portMAX_DELAY);
+    if ( batch_len + hdr_len + len + UPLINK_FRAME_CRC_LEN > UPLINK_BATCH_SIZE ) {
+        ret = uplink_flush_locked();
+    }
+    if ( batch_len == 0 ) {
+        uplink_frame_hdr_t hdr = { .version = UPLINK_FRAME_VERSION, .flags = 0, .seq = seq++ };
+        memcpy(batch, &hdr, UPLINK_FRAME_HDR_LEN);
+        batch_len = UPLINK_FRAME_HDR_LEN;
+    }
+    batch[batch_len++] = type;
+    batch[batch_len++] = (uint8_t)len;
+    if ( hdr_len == UPLINK_RECORD_EXT_HDR_LEN ) {
+        batch[batch_len++] = (uint8_t)( len >> 8 );
+    }
+    if ( len > 0 ) {
+        memcpy(&batch[batch_len], data, len);
+        batch_len += len;
+    }
+    stats.records++;
+    xSemaphoreGive(uplink_lock);
+    return ret;
+}
+
+esp_err_t uplink_flush() {
+    if ( uplink_lock == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(uplink_lock, portMAX_DELAY);
+    esp_err_t ret = uplink_flush_locked();
+    xSemaphoreGive(uplink_lock);
+    return ret;
+}
+
+// last cursor in a decoded frame from the host
+static esp_err_t uplink_rx_frame(uint32_t* id) {
+    uint8_t frame[UPLINK_RX_FRAME_MAX];
+    size_t len = uplink_cobs_decode(rx_acc, rx_len, frame, sizeof(frame));
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+
+    if ( len == 0 || !uplink_frame_check(frame, len) ) {
+        return ret;
+    }
+
+    size_t pos = 0;
+    uint8_t type;
+    uint16_t plen;
+    const uint8_t* payload;
+    while ( uplink_frame_next(frame, len, &pos, &type, &payload, &plen) ) {
+        if ( type == UPLINK_REC_CURSOR && plen == sizeof(uplink_cursor_t) ) {
+            memcpy(id, payload, sizeof(uint32_t));
+            ret = ESP_OK;
+        }
+    }
+    return ret;
+}
+
+esp_err_t uplink_read_cursor(uint32_t* id) {
+    uint8_t buf[32];
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    int n;
+
+    if ( uplink_lock == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    while ( ( n = uart_read_bytes(UPLINK_UART_PORT, buf, sizeof(buf), 0) ) > 0 ) {
+        for ( int i = 0; i < n; i++ ) {
+            if ( buf[i] == UPLINK_FRAME_DELIM ) {
+                if ( rx_len > 0 && uplink_rx_frame(id) == ESP_OK ) {
+                    ret = ESP_OK;
+                }
+                rx_len = 0;
+            }
+            else if ( rx_len < sizeof(rx_acc) ) {
+                rx_acc[rx_len++] = buf[i];
+            }
+        }
+    }
+    return ret;
+}
+
+void uplink_stats_get(uplink_stats_t* stats_out) {
+    if ( stats_out == NULL ) return;
+    memcpy(stats_out, &stats, sizeof(uplink_stats_t));
+}
@@ -0,0 +1,105 @@
+#include "uplink_frame.h"
+
+// crc-16/ccitt-false (poly 0x1021, init 0xffff)
+uint16_t uplink_crc16(const uint8_t* data, size_t len) {
+    uint16_t crc = 0xffff;
+
+    while ( len-- ) {
+        crc ^= (uint16_t)( *data++ ) << 8;
+        for ( int i = 0; i < 8; i++ ) {
+            crc = ( crc & 0x8000 ) ? (uint16_t)( ( crc << 1 ) ^ 0x1021 ) : (uint16_t)( crc << 1 );
+        }
+    }
+    return crc;
+}
+
+size_t uplink_cobs_encode(const uint8_t* in, size_t len, uint8_t* out) {
+    size_t  code_pos = 0;
+    size_t  out_pos = 1;
+    uint8_t code = 1;
+
+    for ( size_t i = 0; i < len; i++ ) {
+        if ( in[i] == 0 ) {
+            out[code_pos] = code;
+            code_pos = out_pos++;
+            code = 1;
+            continue;
+        }
+        out[out_pos++] = in[i];
+        if ( ++code == 0xff ) {
+            out[code_pos] = code;
+            code_pos = out_pos++;
+            code = 1;
+        }
+    }
+    out[code_pos] = code;
+    return out_pos;
+}
+
+size_t uplink_frame_seal(uint8_t* frame, size_t len, uint8_t* out) {
+    uint16_t crc = uplink_crc16(frame, len);
+
+    frame[len++] = (uint8_t)( crc & 0xff );
+    frame[len++] = (uint8_t)( crc >> 8 );
+    out[0] = UPLINK_FRAME_DELIM;
+    size_t out_len = uplink_cobs_encode(frame, len, &out[1]) + 1;
+    out[out_len++] = UPLINK_FRAME_DELIM;
+    return out_len;
+}
+
+size_t uplink_cobs_decode(const uint8_t* in, size_t len, uint8_t* out, size_t out_len) {
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+
+    while ( in_pos < len ) {
+        uint8_t code = in[in_pos++];
+        if ( code == 0 || in_pos + code - 1 > len || out_pos + code - 1 > out_len ) {
+            return 0;
+        }
+        for ( uint8_t i = 1; i < code; i++ ) {
+            out[out_pos++] = in[in_pos++];
+        }
+        if ( code != 0xff && in_pos < len ) {
+            if ( out_pos == out_len ) {
+                return 0;
+            }
+            out[out_pos++] = 0;
+        }
+    }
+    return out_pos;
+}
+
+int uplink_frame_check(const uint8_t* frame, size_t len) {
+    if ( len < UPLINK_FRAME_HDR_LEN + UPLINK_FRAME_CRC_LEN || frame[0] != UPLINK_FRAME_VERSION ) {
+        return 0;
+    }
+    uint16_t crc = (uint16_t)( frame[len - 2] | ( frame[len - 1] << 8 ) );
+    return uplink_crc16(frame, len - UPLINK_FRAME_CRC_LEN) == crc;
+}
+
+int uplink_frame_next(const uint8_t* frame, size_t len, size_t* pos, uint8_t* type, const uint8_t** payload, uint16_t* payload_len) {
+    size_t end = len - UPLINK_FRAME_CRC_LEN;
+
+    if ( *pos < UPLINK_FRAME_HDR_LEN ) {
+        *pos = UPLINK_FRAME_HDR_LEN;
+    }
+    if ( *pos + UPLINK_RECORD_HDR_LEN > end ) {
+        return 0;
+    }
+    *type = frame[*pos];
+
+    size_t hdr_len = UPLINK_RECORD_HDR_SIZE(*type);
+    if ( *pos + hdr_len > end ) {
+        return 0;
+    }
+    *payload_len = frame[*pos + 1];
+    if ( hdr_len == UPLINK_RECORD_EXT_HDR_LEN ) {
+        *payload_len |= (uint16_t)( frame[*pos + 2] << 8 );
+    }
+    if ( *pos + hdr_len + *payload_len > end ) {
+        return 0;
+    }
+    *payload = &frame[*pos + hdr_len];
+    *pos += hdr_len + *payload_len;
+    return 1;
+}
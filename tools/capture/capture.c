@@ -0,0 +1,34 @@
+#include <string.h>
+#include "capture.h"
+
+int capture_write_header(FILE* f) {
+    uint8_t version = CAPTURE_VERSION;
+
+    return fwrite(CAPTURE_MAGIC, 4, 1, f) == 1 && fwrite(&version, 1, 1, f) == 1;
+}
+
+int capture_write(FILE* f, const uplink_capture_t* rec, const uint8_t* payload) {
+    return fwrite(rec, sizeof(uplink_capture_t), 1, f) == 1 &&
+           ( rec->len == 0 || fwrite(payload, rec->len, 1, f) == 1 );
+}
+
+int capture_read_header(FILE* f) {
+    uint8_t hdr[5];
+
+    return fread(hdr, sizeof(hdr), 1, f) == 1 && memcmp(hdr, CAPTURE_MAGIC, 4) == 0 && hdr[4] == CAPTURE_VERSION;
+}
+
+int capture_read(FILE* f, uplink_capture_t* rec, uint8_t* payload) {
+    size_t n = fread(rec, 1, sizeof(uplink_capture_t), f);
+
+    if ( n == 0 ) {
+        return 0;
+    }
+    if ( n != sizeof(uplink_capture_t) ) {
+        return -1;
+    }
+    if ( rec->len && fread(payload, rec->len, 1, f) != 1 ) {
+        return -1;
+    }
+    return 1;
+}
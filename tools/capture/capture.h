@@ -0,0 +1,29 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+/*
+ * Capture files: received ESP-NOW frames as seen by the master.
+ *
+ *   magic "ENCP" (4) version (1) | uplink_capture_t payload (len) | ...
+ *
+ * Written by uplink_decode -w (from CONFIG_MASTER_CAPTURE records) and
+ * espnow_sim -o, read back by espnow_replay.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uplink_frame.h"
+
+#define CAPTURE_MAGIC       "ENCP"
+#define CAPTURE_VERSION     1
+#define CAPTURE_MAX_PAYLOAD 255
+
+int capture_write_header(FILE* f);
+int capture_write(FILE* f, const uplink_capture_t* rec, const uint8_t* payload);
+
+// 0 when the file is not a capture
+int capture_read_header(FILE* f);
+// 1: record read, 0: end of file, -1: truncated record
+int capture_read(FILE* f, uplink_capture_t* rec, uint8_t* payload);
+
+#endif // _CAPTURE_H_
@@ -0,0 +1,273 @@
+/*
+ * espnow_replay: feeds a capture file back into the master pipeline.
+ *
+ * Frames go through the same master_handle_frame() as on target, with
+ * their captured reception time, so a replay of a field capture reproduces
+ * the decode, store and reply decisions of the master exactly. Replies are
+ * not sent anywhere: their count and a digest over replies and decoded
+ * samples are printed, two runs of the same capture give the same digest.
+ *
+ * usage: espnow_replay [-s speed] [-n loops] [-t token] [-m max_nodes] [-k shards] [-v] capture
+ *
+ *   -s 0 replays as fast as possible (default), 1 at the captured pace,
+ *   2 twice as fast... -n replays the capture several times, each loop on a
+ *   fresh pipeline, and checks the digest does not change. The store is
+ *   sized for every sender of the capture unless -m says otherwise.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "espnow_transport.h"
+#include "master.h"
+#include "capture.h"
+
+#define REPLAY_FNV_OFFSET   0xcbf29ce484222325ULL
+#define REPLAY_FNV_PRIME    0x100000001b3ULL
+
+typedef struct {
+    uplink_capture_t    rec;
+    uint8_t*            payload;
+} replay_frame_t;
+
+typedef struct {
+    uint64_t    replies;
+    uint64_t    reply_bytes;
+    uint64_t    samples;
+    uint64_t    digest;
+} replay_stats_t;
+
+esp_log_level_t host_log_level = ESP_LOG_ERROR;
+
+static const uint8_t    master_addr[ESPNOW_PROTO_ADDR_LEN] = { 0x24, 0x6f, 0x28, 0x00, 0x00, 0x01 };
+
+static replay_frame_t*  frames = NULL;
+static size_t           frame_count = 0;
+static replay_stats_t   stats;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void digest(const void* data, size_t len) {
+    const uint8_t* p = data;
+
+    for ( size_t i = 0; i < len; i++ ) {
+        stats.digest = ( stats.digest ^ p[i] ) * REPLAY_FNV_PRIME;
+    }
+}
+
+static esp_err_t replay_send(void* ctx, const uint8_t* addr, const uint8_t* data, size_t len) {
+    stats.replies++;
+    stats.reply_bytes += len;
+    digest(addr, ESPNOW_PROTO_ADDR_LEN);
+    digest(data, len);
+    return ESP_OK;
+}
+
+static const espnow_transport_t replay_transport = {
+    .send = replay_send,
+    .ctx = NULL
+};
+
+static void replay_sample(const uint8_t* addr, const sensor_store_sample_t* sample) {
+    stats.samples++;
+    digest(addr, ESPNOW_PROTO_ADDR_LEN);
+    digest(sample, sizeof(sensor_store_sample_t));
+}
+
+static int load(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if ( f == NULL ) {
+        perror(path);
+        return 0;
+    }
+    if ( !capture_read_header(f) ) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        fclose(f);
+        return 0;
+    }
+
+    size_t size = 0;
+    uplink_capture_t rec;
+    uint8_t payload[CAPTURE_MAX_PAYLOAD];
+    int ret;
+
+    while ( ( ret = capture_read(f, &rec, payload) ) == 1 ) {
+        if ( frame_count == size ) {
+            size = size ? size * 2 : 1024;
+            replay_frame_t* grown = realloc(frames, size * sizeof(replay_frame_t));
+            if ( grown == NULL ) {
+                fprintf(stderr, "out of memory\n");
+                fclose(f);
+                return 0;
+            }
+            frames = grown;
+        }
+        replay_frame_t* fr = &frames[frame_count];
+        fr->rec = rec;
+        fr->payload = malloc(rec.len ? rec.len : 1);
+        if ( fr->payload == NULL ) {
+            fprintf(stderr, "out of memory\n");
+            fclose(f);
+            return 0;
+        }
+        memcpy(fr->payload, payload, rec.len);
+        frame_count++;
+    }
+    if ( ret < 0 ) {
+        fprintf(stderr, "%s: truncated record after %zu frames, ignored\n", path, frame_count);
+    }
+    fclose(f);
+    return 1;
+}
+
+static int addr_cmp(const void* a, const void* b) {
+    return memcmp(a, b, ESPNOW_PROTO_ADDR_LEN);
+}
+
+static uint32_t distinct_senders() {
+    uint8_t* addrs = malloc(frame_count * ESPNOW_PROTO_ADDR_LEN);
+    uint32_t count = 0;
+
+    if ( addrs == NULL ) {
+        return 0;
+    }
+    for ( size_t i = 0; i < frame_count; i++ ) {
+        memcpy(&addrs[i * ESPNOW_PROTO_ADDR_LEN], frames[i].rec.addr, ESPNOW_PROTO_ADDR_LEN);
+    }
+    qsort(addrs, frame_count, ESPNOW_PROTO_ADDR_LEN, addr_cmp);
+    for ( size_t i = 0; i < frame_count; i++ ) {
+        if ( i == 0 || addr_cmp(&addrs[i * ESPNOW_PROTO_ADDR_LEN], &addrs[( i - 1 ) * ESPNOW_PROTO_ADDR_LEN]) ) {
+            count++;
+        }
+    }
+    free(addrs);
+    return count;
+}
+
+// one pass over the capture on a fresh pipeline, returns the time spent in it
+static double replay(const master_config_t* config, double speed, master_stats_t* mstats) {
+    memset(&stats, 0, sizeof(replay_stats_t));
+    stats.digest = REPLAY_FNV_OFFSET;
+    if ( master_init(config) != ESP_OK ) {
+        fprintf(stderr, "master init failed\n");
+        exit(1);
+    }
+
+    double busy = 0;
+    double start = now_s();
+    uint32_t first_ts = frame_count ? frames[0].rec.ts : 0;
+
+    for ( size_t i = 0; i < frame_count; i++ ) {
+        const replay_frame_t* fr = &frames[i];
+        if ( speed > 0 ) {
+            double due = start + (uint32_t)( fr->rec.ts - first_ts ) / 1000.0 / speed;
+            double left = due - now_s();
+            if ( left > 0 ) {
+                usleep((useconds_t)( left * 1e6 ));
+            }
+        }
+        double t = now_s();
+        master_handle_frame(fr->rec.addr, fr->payload, fr->rec.len, fr->rec.rssi, fr->rec.ts);
+        busy += now_s() - t;
+    }
+    master_stats_get(mstats);
+    master_done();
+    return busy;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [-s speed] [-n loops] [-t token] [-m max_nodes] [-k shards] [-v] capture\n"
+        "  -s 0 replays as fast as possible, 1 at the captured pace\n", name);
+}
+
+int main(int argc, char** argv) {
+    double speed = 0;
+    uint32_t loops = 1;
+    uint32_t max_nodes = 0;
+    int opt;
+
+    master_config_t config;
+    master_config_default(&config);
+    config.transport = &replay_transport;
+    config.on_sample = replay_sample;
+    memcpy(config.mac, master_addr, ESPNOW_PROTO_ADDR_LEN);
+    config.channel = 1;
+    config.token = 1;
+
+    while ( ( opt = getopt(argc, argv, "s:n:t:m:k:vh") ) != -1 ) {
+        switch ( opt ) {
+            case 's': speed = atof(optarg); break;
+            case 'n': loops = strtoul(optarg, NULL, 0); break;
+            case 't': config.token = strtoul(optarg, NULL, 0); break;
+            case 'm': max_nodes = strtoul(optarg, NULL, 0); break;
+            case 'k': config.shards = strtoul(optarg, NULL, 0); break;
+            case 'v': host_log_level++; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if ( optind >= argc || loops == 0 || speed < 0 || config.shards == 0 ) {
+        usage(argv[0]);
+        return 1;
+    }
+    if ( !load(argv[optind]) ) {
+        return 1;
+    }
+    if ( frame_count == 0 ) {
+        fprintf(stderr, "empty capture\n");
+        return 1;
+    }
+    if ( max_nodes == 0 ) {
+        max_nodes = distinct_senders();
+        if ( max_nodes < config.store.max_nodes ) {
+            max_nodes = config.store.max_nodes;
+        }
+    }
+    config.store.max_nodes = max_nodes < SENSOR_STORE_NONE ? max_nodes : SENSOR_STORE_NONE - 1;
+
+    master_stats_t mstats;
+    uint64_t first_digest = 0;
+    double busy = 0;
+    double wall = now_s();
+
+    for ( uint32_t loop = 0; loop < loops; loop++ ) {
+        busy += replay(&config, speed, &mstats);
+        if ( loop == 0 ) {
+            first_digest = stats.digest;
+        }
+        else if ( stats.digest != first_digest ) {
+            fprintf(stderr, "loop %u: digest %016llx differs from %016llx\n",
+                loop, (unsigned long long)stats.digest, (unsigned long long)first_digest);
+            return 2;
+        }
+    }
+    wall = now_s() - wall;
+
+    uint64_t handled = (uint64_t)frame_count * loops;
+    printf("capture    : %zu frames over %.1f s\n",
+        frame_count, (uint32_t)( frames[frame_count - 1].rec.ts - frames[0].rec.ts ) / 1000.0);
+    printf("pipeline   : %u frames, %u discovers (%u rate limited), %u data (%u duplicates, %u stale), %u measures, %u resyncs, %u profiles, %u legacy, %u store errors\n",
+        mstats.frames, mstats.discovers, mstats.discover_limited, mstats.data, mstats.duplicates, mstats.stale, mstats.measures,
+        mstats.resyncs, mstats.profiles, mstats.legacy, mstats.store_errors);
+    printf("replies    : %llu (%llu bytes), %llu samples, digest %016llx\n",
+        (unsigned long long)stats.replies, (unsigned long long)stats.reply_bytes,
+        (unsigned long long)stats.samples, (unsigned long long)stats.digest);
+    printf("replay     : %u loop(s) in %.3f s wall, %.0f frames / s, %.2f us / frame in the pipeline\n",
+        loops, wall, busy > 0 ? handled / busy : 0.0, handled ? busy * 1e6 / handled : 0.0);
+
+    for ( size_t i = 0; i < frame_count; i++ ) {
+        free(frames[i].payload);
+    }
+    free(frames);
+    return 0;
+}
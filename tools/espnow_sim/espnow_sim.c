@@ -0,0 +1,1444 @@
+/*
+ * espnow_sim: host side ESP-NOW medium simulator.
+ *
+ * Thousands of virtual sensor nodes run the real node logic (espnow_link:
+ * channel scan, retries, backoff; espnow_sync: wake slots) against the real
+ * master pipeline (applications/espnow/main/master.c) over a simulated
+ * medium with airtime, carrier sense, collisions and random loss.
+ *
+ * usage: espnow_sim [-n nodes] [-t seconds] [-p period_s] [-l loss] [-c channel]
+ *                   [-s slot_period_ms] [-w slot_width_ms] [-q queue] [-u service_us]
+ *                   [-k workers] [-m measures] [-D] [-P profile_wakes] [-O start_s:len_s]
+ *                   [-C at_s:period_s] [-B t:h:p[:heartbeat_s]] [-R rssi_min:rssi_max [-F] [-L]]
+ *                   [-M] [-X relays:far_pct] [-a] [-r seed] [-o capture] [-v]
+ *
+ * -k splits the master in worker tasks, each with its queue and shard of
+ * the pipeline, as CONFIG_MASTER_WORKERS does on target. Nodes send -m
+ * measures per frame, delta coded unless -D asks for raw data frames, and
+ * their wake profile (boot, join, send, ack) every -P wakes. Measures not
+ * acked wait in the node backlog and are drained on the next contact, -O
+ * takes the master down from start_s for len_s then reboots it, to see
+ * the drain. -C changes the sample period the master pushes to the nodes
+ * in its acks at at_s, to see the fleet retuned. -B sets report deadbands
+ * (0.01 units, as espnow_config_t) from the start: nodes sample every wake
+ * but only bring the radio up for a measure past them, or on heartbeat,
+ * and report their skip ratio. -R places the nodes at a path rssi drawn
+ * between rssi_min and rssi_max (dBm, a few dB of fading per frame) where
+ * frames under the sensitivity of their rate are lost, and lets nodes and
+ * master adapt their rates (espnow_rate): -F keeps them at 1 Mbps to
+ * compare, -L opens the long range rates. -M adds a backup master the
+ * master advertises to its nodes (ESPNOW_OPT_MASTERS): during -O only the
+ * master goes silent, nodes fail over to the backup on a missed ack. Both
+ * answer through the one pipeline, which keeps running. -X makes the
+ * first nodes relays (espnow_relay, always on, heard by every node) and
+ * puts far_pct % of the others out of reach of the master, they only get
+ * through the relays. The relays send their bundles with no mac feedback,
+ * like inside a loop: with -O they lose their master and join again while
+ * their children still claim a way to it. -o writes the frames handed to
+ * the master pipeline to a capture file for espnow_replay.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "espnow_proto.h"
+#include "espnow_link.h"
+#include "espnow_sync.h"
+#include "espnow_delta.h"
+#include "espnow_profile.h"
+#include "espnow_backlog.h"
+#include "espnow_config.h"
+#include "espnow_report.h"
+#include "espnow_transport.h"
+#include "espnow_rate.h"
+#include "espnow_relay.h"
+#include "master.h"
+#include "capture.h"
+
+#define SIM_FADING_DB       4           // per frame, uniform either way
+#define SIM_CCA_US          25          // a transmission is sensed after that
+#define SIM_DIFS_US         34
+#define SIM_SLOT_US         9
+#define SIM_CW              15
+#define SIM_BOOT_MIN_US     200000      // deep sleep wake to radio up
+#define SIM_BOOT_MAX_US     300000
+#define SIM_GUARD_MS        30
+#define SIM_MAX_DRIFT_PPM   10000
+
+typedef enum {
+    EV_NODE_WAKE = 0,
+    EV_NODE_READY,
+    EV_NODE_TIMEOUT,
+    EV_TX_ATTEMPT,
+    EV_TX_END,
+    EV_MASTER_DONE,
+    EV_MASTER_REBOOT,
+    EV_MASTER_CONFIG,
+    EV_RELAY_POLL,
+} sim_event_type_t;
+
+typedef struct {
+    int         src;                    // node index, -1 for the master
+    int         via;                    // relay index of a frame out of a bundle, -1 heard directly
+    uint8_t     backup;                 // from or to the backup master
+    uint8_t     relayed;                // sent by the relay role of src, not by its link
+    uint8_t     dst[ESPNOW_PROTO_ADDR_LEN];
+    uint8_t     channel;
+    uint8_t     len;
+    uint8_t     rate;                   // espnow_rate_id_t
+    int8_t      rssi;                   // at the receiver, 0 without path model
+    uint8_t     collided;
+    uint8_t     lost;
+    uint64_t    start_us;
+    uint64_t    end_us;
+    uint8_t     data[ESPNOW_PROTO_MAX_LEN];
+} sim_frame_t;
+
+typedef struct {
+    uint64_t            t_us;
+    uint64_t            seq;
+    sim_event_type_t    type;
+    int                 node;
+    uint32_t            gen;
+    sim_frame_t*        frame;
+} sim_event_t;
+
+typedef struct {
+    uint8_t             addr[ESPNOW_PROTO_ADDR_LEN];
+    espnow_link_cache_t cache;
+    espnow_link_t       link;
+    espnow_sync_t       sync;
+    espnow_delta_tx_t   delta;
+    espnow_measure_t    value;          // random walk
+    uint8_t             resync;         // keyframe sent after a resync ack
+    uint8_t             first;          // no data frame acked since power on
+    espnow_profile_t    profile;        // times since wake_us
+    espnow_backlog_t    backlog;
+    uint8_t             batch;          // backlog samples in the data frame in flight
+    uint8_t             on_air;         // data frame sent once in this exchange
+    uint8_t             profile_sent;   // with the data frame in flight
+    espnow_config_t     config;         // pushed by the master
+    uint8_t             config_report;  // version not seen by the master yet
+    uint8_t             config_sent;    // with the data frame in flight
+    espnow_report_t     report;         // deadbands, skip counts
+    espnow_rate_t       rate;           // to the master
+    espnow_rate_t       master_rate;    // of the master to the node
+    int8_t              path_rssi;      // 0 without path model
+    espnow_relay_t*     relay;          // NULL for a sensor
+    espnow_transport_t  relay_transport;
+    uint32_t            relay_gen;      // stale polls are ignored
+    uint8_t             hops;           // of the parent, from its discover reply
+    uint8_t             far;            // out of reach of the master
+    int32_t             drift_ppm;      // local clock error, positive runs slow
+    uint8_t             channel;
+    uint32_t            gen;            // stale timeouts are ignored
+    uint64_t            wake_us;
+    uint64_t            start_us;       // current exchange
+    uint64_t            deadline_us;
+} sim_node_t;
+
+typedef struct {
+    sim_frame_t**       active;         // on air
+    int                 count;
+    int                 size;
+} sim_channel_t;
+
+// one master worker task, with its own queue and shard of the pipeline
+typedef struct {
+    sim_frame_t**       queue;
+    uint32_t            head;
+    uint32_t            count;
+    uint8_t             busy;
+    uint64_t            busy_us;
+    uint64_t            queue_max;
+} sim_worker_t;
+
+typedef struct {
+    uint64_t    frames;
+    uint64_t    collided;
+    uint64_t    lost;
+    uint64_t    off_channel;
+    uint64_t    deferred;
+    uint64_t    master_rx;
+    uint64_t    outage_drops;
+    uint64_t    queue_drops;
+    uint64_t    queue_max;
+    uint64_t    exchanges;
+    uint64_t    acked;
+    uint64_t    failed;
+    uint64_t    retransmits;
+    uint64_t    data_frames;
+    uint64_t    data_bytes;
+    uint64_t    resyncs;
+    uint64_t    samples;                // kept by the nodes for the master
+    uint64_t    skipped;                // within the deadbands
+    uint64_t    quiet_wakes;            // without radio
+    uint64_t    quiet_lost;             // of them, with no master cached
+    uint64_t    delivered;              // decoded by the master
+    uint64_t    backlog_frames;         // data frames with older measures
+    uint64_t    backlog_max;
+    uint64_t    joins;
+    uint64_t    join_failed;
+    uint64_t    join_us;
+    uint64_t    join_probes;
+    uint64_t    rate_frames[ESPNOW_RATE_MAX];   // unicasts
+    uint64_t    rate_up;
+    uint64_t    rate_down;
+    uint64_t    airtime_us;             // of the unicasts
+    uint64_t    base_airtime_us;        // the same at ESPNOW_RATE_BASE
+    uint64_t    failovers;
+    uint64_t    far_samples;
+    uint64_t    far_delivered;
+    uint64_t    events;
+} sim_stats_t;
+
+esp_log_level_t host_log_level = ESP_LOG_ERROR;
+
+static uint32_t     opt_nodes = 1000;
+static uint32_t     opt_seconds = 600;
+static uint32_t     opt_period_s = 30;
+static double       opt_loss = 0.01;
+static uint8_t      opt_channel = 6;
+static uint32_t     opt_slot_period_ms = MASTER_SLOT_PERIOD_MS;
+static uint32_t     opt_slot_width_ms = MASTER_SLOT_WIDTH_MS;
+static uint32_t     opt_queue = 20;
+static uint32_t     opt_service_us = 300;
+static uint32_t     opt_workers = 1;
+static uint8_t      opt_csma = 1;
+static uint32_t     opt_measures = 1;
+static uint8_t      opt_delta = 1;
+static uint32_t     opt_profile = ESPNOW_PROFILE_INTERVAL;
+static uint32_t     opt_outage_s = 0;
+static uint32_t     opt_outage_len_s = 0;
+static uint32_t     opt_config_s = 0;
+static uint32_t     opt_config_period_s = 0;
+static uint32_t     opt_deadband[3] = { 0, 0, 0 };
+static uint32_t     opt_heartbeat_s = 0;
+static int          opt_rssi_min = 0;
+static int          opt_rssi_max = 0;
+static uint8_t      opt_rate_adapt = 1;
+static uint8_t      opt_long_range = 0;
+static uint8_t      opt_backup = 0;
+static uint32_t     opt_relays = 0;
+static uint32_t     opt_far_pct = 0;
+static FILE*        capture = NULL;
+
+static uint64_t     rnd_state = 0x853c49e6748fea9bULL;
+
+static sim_event_t* heap = NULL;
+static size_t       heap_count = 0;
+static size_t       heap_size = 0;
+static uint64_t     heap_seq = 0;
+
+static uint64_t         now_us = 0;
+static sim_node_t*      nodes = NULL;
+static sim_channel_t    channels[ESPNOW_LINK_MAX_CHANNEL + 1];
+static sim_stats_t      stats;
+static uint8_t          master_addr[ESPNOW_PROTO_ADDR_LEN] = { 0x24, 0x6f, 0x28, 0x00, 0x00, 0x01 };
+static uint8_t          backup_addr[ESPNOW_PROTO_ADDR_LEN] = { 0x24, 0x6f, 0x28, 0x00, 0x00, 0x02 };
+static uint8_t          master_backup = 0;      // the pipeline answers for the backup
+
+static master_config_t  config;
+static master_stats_t   before_reboot;
+static sim_worker_t*    workers = NULL;
+static uint64_t         master_tx_free_us = 0;
+
+static uint32_t*        latency_ms = NULL;
+static size_t           latency_count = 0;
+static size_t           latency_size = 0;
+
+uint32_t esp_random(void) {
+    // xorshift64*
+    rnd_state ^= rnd_state >> 12;
+    rnd_state ^= rnd_state << 25;
+    rnd_state ^= rnd_state >> 27;
+    return (uint32_t)( ( rnd_state * 0x2545f4914f6cdd1dULL ) >> 32 );
+}
+
+static double rnd_unit() {
+    return esp_random() / 4294967296.0;
+}
+
+static uint64_t rnd_range(uint64_t lo, uint64_t hi) {
+    return lo + ( hi > lo ? esp_random() % ( hi - lo ) : 0 );
+}
+
+static void* xrealloc(void* ptr, size_t size) {
+    void* ret = realloc(ptr, size);
+    if ( ret == NULL ) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return ret;
+}
+
+/* -------- event queue, binary heap on (time, seq) -------- */
+
+static inline int ev_before(const sim_event_t* a, const sim_event_t* b) {
+    return a->t_us < b->t_us || ( a->t_us == b->t_us && a->seq < b->seq );
+}
+
+static void ev_push(uint64_t t_us, sim_event_type_t type, int node, uint32_t gen, sim_frame_t* frame) {
+    if ( heap_count == heap_size ) {
+        heap_size = heap_size ? heap_size * 2 : 1024;
+        heap = xrealloc(heap, heap_size * sizeof(sim_event_t));
+    }
+    sim_event_t ev = { .t_us = t_us, .seq = heap_seq++, .type = type, .node = node, .gen = gen, .frame = frame };
+    size_t i = heap_count++;
+    while ( i > 0 && ev_before(&ev, &heap[( i - 1 ) / 2]) ) {
+        heap[i] = heap[( i - 1 ) / 2];
+        i = ( i - 1 ) / 2;
+    }
+    heap[i] = ev;
+}
+
+static int ev_pop(sim_event_t* out) {
+    if ( heap_count == 0 ) {
+        return 0;
+    }
+    *out = heap[0];
+    sim_event_t last = heap[--heap_count];
+    size_t i = 0;
+    for ( ;; ) {
+        size_t c = 2 * i + 1;
+        if ( c >= heap_count ) {
+            break;
+        }
+        if ( c + 1 < heap_count && ev_before(&heap[c + 1], &heap[c]) ) {
+            c++;
+        }
+        if ( !ev_before(&heap[c], &last) ) {
+            break;
+        }
+        heap[i] = heap[c];
+        i = c;
+    }
+    if ( heap_count ) {
+        heap[i] = last;
+    }
+    return 1;
+}
+
+/* -------- medium -------- */
+
+static int node_find(const uint8_t* addr) {
+    if ( addr[0] != 0x02 ) {
+        return -1;
+    }
+    uint32_t i = ( (uint32_t)addr[2] << 24 ) | ( (uint32_t)addr[3] << 16 ) | ( (uint32_t)addr[4] << 8 ) | addr[5];
+    return i < opt_nodes ? (int)i : -1;
+}
+
+static inline uint8_t is_broadcast(const uint8_t* addr) {
+    return memcmp(addr, "\xff\xff\xff\xff\xff\xff", ESPNOW_PROTO_ADDR_LEN) == 0;
+}
+
+static inline uint8_t is_backup(const uint8_t* addr) {
+    return opt_backup && memcmp(addr, backup_addr, ESPNOW_PROTO_ADDR_LEN) == 0;
+}
+
+// broadcasts go to the master, the backup only answers what is sent to it
+static inline uint8_t to_masters(const uint8_t* addr) {
+    return is_broadcast(addr) || memcmp(addr, master_addr, ESPNOW_PROTO_ADDR_LEN) == 0 || is_backup(addr);
+}
+
+// sender address as the receiver sees it
+static const uint8_t* frame_from(const sim_frame_t* f) {
+    if ( f->src >= 0 ) {
+        return nodes[f->src].addr;
+    }
+    return f->backup ? backup_addr : master_addr;
+}
+
+static inline uint64_t airtime_us(uint8_t rate, uint8_t len) {
+    return espnow_rate_airtime_us(rate, len);
+}
+
+// esp32 sensitivity at each rate
+static const int8_t sim_sensitivity[ESPNOW_RATE_MAX] = {
+    [ESPNOW_RATE_24M]       = -84,
+    [ESPNOW_RATE_12M]       = -89,
+    [ESPNOW_RATE_6M]        = -94,
+    [ESPNOW_RATE_1M]        = -98,
+    [ESPNOW_RATE_LR_500K]   = -102,
+    [ESPNOW_RATE_LR_250K]   = -105,
+};
+
+// a frame below the sensitivity of its rate is lost, whatever the random loss
+static uint8_t path_lost(sim_frame_t* f) {
+    int node = f->src >= 0 ? f->src : node_find(f->dst);
+
+    if ( opt_rssi_min == 0 || node < 0 ) {
+        return 0;
+    }
+    f->rssi = (int8_t)( nodes[node].path_rssi + (int)rnd_range(0, 2 * SIM_FADING_DB + 1) - SIM_FADING_DB );
+    return f->rssi < sim_sensitivity[f->rate];
+}
+
+static uint8_t rate_pick(espnow_rate_t* r, uint8_t len) {
+    uint8_t rate = opt_rssi_min && opt_rate_adapt ? espnow_rate_pick(r) : ESPNOW_RATE_BASE;
+
+    stats.rate_frames[rate]++;
+    stats.airtime_us += airtime_us(rate, len);
+    stats.base_airtime_us += airtime_us(ESPNOW_RATE_BASE, len);
+    return rate;
+}
+
+static void rate_count(int8_t moved) {
+    if ( !opt_rate_adapt ) return;
+    if ( moved > 0 ) stats.rate_up++;
+    else if ( moved < 0 ) stats.rate_down++;
+}
+
+// a frame leaves the air when its transmission ends
+static void channel_remove(sim_frame_t* f) {
+    sim_channel_t* ch = &channels[f->channel];
+
+    for ( int i = 0; i < ch->count; i++ ) {
+        if ( ch->active[i] == f ) {
+            ch->active[i] = ch->active[--ch->count];
+            return;
+        }
+    }
+}
+
+// end of the transmissions sensed on the channel, 0 when idle
+static uint64_t channel_busy_until(sim_channel_t* ch) {
+    uint64_t until = 0;
+
+    for ( int i = 0; i < ch->count; i++ ) {
+        if ( ch->active[i]->start_us + SIM_CCA_US <= now_us && ch->active[i]->end_us > until ) {
+            until = ch->active[i]->end_us;
+        }
+    }
+    return until;
+}
+
+static void tx_start(sim_frame_t* f) {
+    sim_channel_t* ch = &channels[f->channel];
+
+    if ( opt_csma ) {
+        uint64_t until = channel_busy_until(ch);
+        if ( until ) {
+            stats.deferred++;
+            ev_push(until + SIM_DIFS_US + rnd_range(0, SIM_CW + 1) * SIM_SLOT_US, EV_TX_ATTEMPT, f->src, 0, f);
+            return;
+        }
+    }
+    f->start_us = now_us;
+    f->end_us = now_us + airtime_us(f->rate, f->len);
+    // anything still on air overlaps this one
+    for ( int i = 0; i < ch->count; i++ ) {
+        ch->active[i]->collided = 1;
+        f->collided = 1;
+    }
+    if ( ch->count == ch->size ) {
+        ch->size = ch->size ? ch->size * 2 : 16;
+        ch->active = xrealloc(ch->active, ch->size * sizeof(sim_frame_t*));
+    }
+    ch->active[ch->count++] = f;
+    f->lost = path_lost(f) || rnd_unit() < opt_loss;
+    stats.frames++;
+    if ( f->src < 0 ) {
+        master_tx_free_us = f->end_us;
+    }
+    ev_push(f->end_us, EV_TX_END, f->src, 0, f);
+}
+
+static sim_frame_t* tx_queue(int src, const uint8_t* dst, uint8_t channel, const uint8_t* data, size_t len, uint8_t rate) {
+    sim_frame_t* f = calloc(1, sizeof(sim_frame_t));
+    if ( f == NULL ) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    f->src = src;
+    f->via = -1;
+    f->backup = src < 0 && master_backup;
+    memcpy(f->dst, dst, ESPNOW_PROTO_ADDR_LEN);
+    f->channel = channel;
+    f->len = len;
+    f->rate = rate;
+    memcpy(f->data, data, len);
+
+    // the master radio sends its replies one after the other
+    uint64_t t = now_us;
+    if ( src < 0 && master_tx_free_us > t ) {
+        t = master_tx_free_us;
+    }
+    if ( src < 0 ) {
+        master_tx_free_us = t + airtime_us(rate, len);
+    }
+    ev_push(t, EV_TX_ATTEMPT, src, 0, f);
+    return f;
+}
+
+/* -------- master -------- */
+
+static esp_err_t sim_transport_send(void* ctx, const uint8_t* addr, const uint8_t* data, size_t len) {
+    int i = node_find(addr);
+
+    tx_queue(-1, addr, opt_channel, data, len, i >= 0 ? rate_pick(&nodes[i].master_rate, len) : ESPNOW_RATE_BASE);
+    return ESP_OK;
+}
+
+static const espnow_transport_t sim_transport = {
+    .send = sim_transport_send,
+    .ctx = NULL
+};
+
+static void master_next(uint32_t index) {
+    sim_worker_t* w = &workers[index];
+
+    if ( w->busy || w->count == 0 ) {
+        return;
+    }
+    w->busy = 1;
+    w->busy_us += opt_service_us;
+    ev_push(now_us + opt_service_us, EV_MASTER_DONE, index, 0, NULL);
+}
+
+static void master_queue(sim_frame_t* f) {
+    uint32_t index = master_shard(nodes[f->src].addr);
+    sim_worker_t* w = &workers[index];
+
+    if ( w->count >= opt_queue ) {
+        stats.queue_drops++;
+        free(f);
+        return;
+    }
+    w->queue[( w->head + w->count++ ) % opt_queue] = f;
+    if ( w->count > w->queue_max ) {
+        w->queue_max = w->count;
+    }
+    if ( w->count > stats.queue_max ) {
+        stats.queue_max = w->count;
+    }
+    master_next(index);
+}
+
+/* Like the receive callback on target: frames of a sensor go to its shard
+ * worker, a relay bundle is split over the shards of its frames. */
+static void master_rx(sim_frame_t* f) {
+    size_t         pos = 0;
+    const uint8_t* addr;
+    const uint8_t* frame;
+    uint8_t        flen;
+
+    if ( opt_outage_len_s && now_us >= (uint64_t)opt_outage_s * 1000000 &&
+         now_us < (uint64_t)( opt_outage_s + opt_outage_len_s ) * 1000000 && !f->backup ) {
+        stats.outage_drops++;
+        free(f);
+        return;
+    }
+    stats.master_rx++;
+    rate_count(espnow_rate_heard(&nodes[f->src].master_rate, f->rssi));
+    if ( espnow_proto_parse(f->data, f->len, NULL) != ESPNOW_MSG_RELAY ) {
+        master_queue(f);
+        return;
+    }
+    while ( ( frame = espnow_proto_relay_next(f->data, f->len, &pos, &addr, &flen) ) != NULL ) {
+        int i = node_find(addr);
+        if ( i < 0 ) {
+            continue;
+        }
+        sim_frame_t* g = calloc(1, sizeof(sim_frame_t));
+        if ( g == NULL ) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        g->src = i;
+        g->via = f->src;
+        g->backup = f->backup;
+        g->len = flen;
+        memcpy(g->data, frame, flen);
+        master_queue(g);
+    }
+    free(f);
+}
+
+static void master_done_event(uint32_t index) {
+    sim_worker_t* w = &workers[index];
+    sim_frame_t* f = w->queue[w->head];
+
+    w->head = ( w->head + 1 ) % opt_queue;
+    w->count--;
+    if ( capture != NULL ) {
+        // 0 without path model: unknown
+        uplink_capture_t rec = { .ts = (uint32_t)( now_us / 1000 ), .rssi = f->rssi, .len = f->len };
+        memcpy(rec.addr, nodes[f->src].addr, ESPNOW_PROTO_ADDR_LEN);
+        capture_write(capture, &rec, f->data);
+    }
+    // the replies leave from the master the frame went to
+    master_backup = f->backup;
+    if ( f->via >= 0 ) {
+        master_handle_frame_via(nodes[f->via].addr, nodes[f->src].addr, f->data, f->len, (uint32_t)( now_us / 1000 ));
+    }
+    else {
+        master_handle_frame(nodes[f->src].addr, f->data, f->len, f->rssi, (uint32_t)( now_us / 1000 ));
+    }
+    master_backup = 0;
+    free(f);
+    w->busy = 0;
+    master_next(index);
+}
+
+static void sim_sample(const uint8_t* addr, const sensor_store_sample_t* sample) {
+    int i = node_find(addr);
+
+    stats.delivered++;
+    if ( i >= 0 && nodes[i].far ) {
+        stats.far_delivered++;
+    }
+}
+
+// all master_stats_t fields are counters
+static void stats_add(master_stats_t* to, const master_stats_t* from) {
+    uint32_t* t = (uint32_t*)to;
+    const uint32_t* f = (const uint32_t*)from;
+
+    for ( size_t i = 0; i < sizeof(master_stats_t) / sizeof(uint32_t); i++ ) {
+        t[i] += f[i];
+    }
+}
+
+// end of the outage: a fresh pipeline with a new token, as after an update
+static void master_reboot() {
+    master_stats_t ms;
+
+    master_stats_get(&ms);
+    stats_add(&before_reboot, &ms);
+    master_done();
+    config.token++;
+    if ( master_init(&config) != ESP_OK ) {
+        fprintf(stderr, "master init failed\n");
+        exit(1);
+    }
+}
+
+// new settings for the fleet, pushed with the next ack of every node
+static void master_config_change() {
+    espnow_config_set(&config.node, ESPNOW_CFG_PERIOD_S, opt_config_period_s);
+    for ( uint32_t i = 0; i < opt_workers; i++ ) {
+        master_node_config_set(i, &config.node);
+    }
+}
+
+/* -------- relays -------- */
+
+// relay frames go at the base rate, with no mac feedback: always sent
+static esp_err_t sim_relay_send(void* ctx, const uint8_t* addr, const uint8_t* data, size_t len) {
+    int i = (int)(intptr_t)ctx;
+
+    tx_queue(i, addr, nodes[i].channel, data, len, ESPNOW_RATE_BASE)->relayed = 1;
+    return ESP_OK;
+}
+
+static void relay_poll(int i) {
+    sim_node_t* n = &nodes[i];
+    uint32_t wait_ms = espnow_relay_poll(n->relay, (uint32_t)( now_us / 1000 ));
+
+    if ( wait_ms != UINT32_MAX ) {
+        ev_push(now_us + (uint64_t)( wait_ms ? wait_ms : 1 ) * 1000, EV_RELAY_POLL, i, ++n->relay_gen, NULL);
+    }
+}
+
+static void relay_rx(int i, sim_frame_t* f) {
+    espnow_relay_on_frame(nodes[i].relay, frame_from(f), f->rssi, f->data, f->len, (uint32_t)( now_us / 1000 ));
+    relay_poll(i);
+}
+
+// as espnow_node_relay_parent() on target, after every exchange of the relay
+static void relay_parent(int i) {
+    sim_node_t* n = &nodes[i];
+    espnow_relay_t* r = n->relay;
+
+    if ( espnow_relay_parent_lost(r) ) {
+        espnow_link_invalidate(&n->link);
+    }
+    if ( !espnow_link_is_valid(&n->link) ) {
+        if ( r->hops ) {
+            n->link.max_hops = r->hops;
+        }
+        espnow_relay_set_parent(r, NULL, 0, 0, 0);
+        return;
+    }
+    if ( r->hops == 0 || memcmp(r->parent, espnow_link_master(&n->link), ESPNOW_PROTO_ADDR_LEN) != 0 ||
+         r->token != espnow_link_token(&n->link) ) {
+        espnow_relay_set_parent(r, espnow_link_master(&n->link), espnow_link_channel(&n->link),
+                                espnow_link_token(&n->link), n->hops);
+    }
+}
+
+/* -------- nodes -------- */
+
+static inline int64_t node_clock_ms(const sim_node_t* n) {
+    return (int64_t)( now_us - now_us / 1000000 * n->drift_ppm ) / 1000;
+}
+
+static void node_sleep(int i, uint32_t nominal_ms) {
+    sim_node_t* n = &nodes[i];
+    uint32_t sleep_ms = espnow_sync_sleep_ms(&n->sync, node_clock_ms(n), nominal_ms);
+
+    n->gen++;
+    if ( n->relay != NULL ) {
+        relay_parent(i);
+    }
+    espnow_profile_mark(&n->profile, ESPNOW_PHASE_SLEEP, now_us - n->wake_us);
+    espnow_profile_end(&n->profile);
+    // the sleep timer runs on the local clock
+    uint64_t sleep_us = (uint64_t)sleep_ms * 1000;
+    sleep_us += sleep_us / 1000000 * n->drift_ppm;
+    ev_push(now_us + sleep_us, EV_NODE_WAKE, i, n->gen, NULL);
+}
+
+static void node_apply(int i, espnow_link_action_t* act) {
+    sim_node_t* n = &nodes[i];
+
+    if ( act->channel ) {
+        n->channel = act->channel;
+    }
+    if ( act->wait_ms ) {
+        n->deadline_us = now_us + (uint64_t)act->wait_ms * 1000;
+        ev_push(n->deadline_us, EV_NODE_TIMEOUT, i, ++n->gen, NULL);
+    }
+    if ( act->len ) {
+        tx_queue(i, act->dest, n->channel, act->frame, act->len,
+                 is_broadcast(act->dest) ? ESPNOW_RATE_BASE : rate_pick(&n->rate, act->len));
+    }
+}
+
+static void node_start_data(int i) {
+    sim_node_t* n = &nodes[i];
+    espnow_link_action_t act;
+    espnow_backlog_sample_t sample[ESPNOW_BACKLOG_BATCH];
+    uint8_t buf[ESPNOW_PROTO_MAX_LEN];
+
+    // oldest measures first, as many as fit
+    uint16_t count = espnow_backlog_peek(&n->backlog, sample, ESPNOW_BACKLOG_BATCH);
+    size_t len = espnow_backlog_encode(&n->backlog, opt_delta ? &n->delta : NULL, buf, sample, count,
+                                       (uint32_t)node_clock_ms(n), &n->batch);
+    if ( espnow_proto_opt_find(buf, len, ESPNOW_OPT_AGES, NULL) != NULL ) {
+        stats.backlog_frames++;
+    }
+    if ( n->first ) {
+        ((espnow_data_t*)buf)->flags |= ESPNOW_DATA_FIRST;
+    }
+    espnow_profile_info_t info;
+    n->profile_sent = 0;
+    if ( opt_profile && n->profile.wakes >= opt_profile && espnow_profile_info(&n->profile, &info) ) {
+        size_t with = espnow_proto_opt_add(buf, len, ESPNOW_OPT_PROFILE, &info, sizeof(info));
+        if ( with ) {
+            len = with;
+            n->profile_sent = 1;
+        }
+    }
+    if ( espnow_report_enabled(&n->config) ) {
+        espnow_report_info_t skips;
+        espnow_report_info(&n->report, &skips);
+        size_t with = espnow_proto_opt_add(buf, len, ESPNOW_OPT_REPORT, &skips, sizeof(skips));
+        len = with ? with : len;
+    }
+    n->config_sent = 0;
+    if ( n->config_report ) {
+        size_t with = espnow_proto_opt_add(buf, len, ESPNOW_OPT_CONFIG_VER, &n->config.version, sizeof(uint16_t));
+        if ( with ) {
+            len = with;
+            n->config_sent = 1;
+        }
+    }
+    n->on_air = 0;
+    stats.data_frames++;
+    stats.data_bytes += len;
+
+    // the node wakes this early to be on air at the start of its slot
+    n->sync.lead_ms = (uint32_t)( ( now_us - n->wake_us ) / 1000 ) + SIM_GUARD_MS;
+    n->start_us = now_us;
+    stats.exchanges++;
+    // a frame left without answer goes again with its seq
+    espnow_link_state_t state = n->backlog.pending ? espnow_link_resend_start(&n->link, buf, len, n->backlog.pending_seq, &act)
+                                                   : espnow_link_send_start(&n->link, buf, len, &act);
+    if ( state == ESPNOW_LINK_FAILED ) {
+        espnow_backlog_sent(&n->backlog, n->link.seq, n->batch, 0);
+        n->resync = 0;
+        stats.failed++;
+        node_sleep(i, n->config.value[ESPNOW_CFG_PERIOD_S] * 1000);
+        return;
+    }
+    node_apply(i, &act);
+}
+
+/* The measures of a wake, into the backlog whether the master answers or
+ * not, unless within the deadbands. Returns how many were kept. */
+static uint32_t node_sample(int i) {
+    sim_node_t* n = &nodes[i];
+    uint32_t now_ms = (uint32_t)node_clock_ms(n);
+    uint32_t kept = 0;
+
+    for ( uint32_t k = 0; k < opt_measures; k++ ) {
+        n->value.temp += (int32_t)rnd_range(0, 21) - 10;
+        n->value.humi += (int32_t)rnd_range(0, 61) - 30;
+        n->value.pres += (int32_t)rnd_range(0, 41) - 20;
+        if ( espnow_report_sample(&n->report, &n->config, &n->value, now_ms) ) {
+            espnow_backlog_push(&n->backlog, &n->value, now_ms);
+            kept++;
+        }
+    }
+    stats.samples += kept;
+    stats.skipped += opt_measures - kept;
+    if ( n->far ) {
+        stats.far_samples += kept;
+    }
+    if ( n->backlog.count > stats.backlog_max ) {
+        stats.backlog_max = n->backlog.count;
+    }
+    return kept;
+}
+
+static uint8_t node_credit(sim_node_t* n) {
+    espnow_flow_info_t info;
+    uint8_t len = 0;
+    const uint8_t* opt = espnow_proto_opt_find(n->link.ack, n->link.ack_len, ESPNOW_OPT_FLOW, &len);
+
+    if ( opt == NULL || len < sizeof(espnow_flow_info_t) ) {
+        return 0;
+    }
+    memcpy(&info, opt, sizeof(espnow_flow_info_t));
+    return info.credit;
+}
+
+static void node_sync(sim_node_t* n) {
+    espnow_sync_info_t info;
+    uint8_t len = 0;
+    const uint8_t* opt = espnow_proto_opt_find(n->link.ack, n->link.ack_len, ESPNOW_OPT_SYNC, &len);
+
+    if ( opt != NULL && len >= sizeof(espnow_sync_info_t) ) {
+        memcpy(&info, opt, sizeof(espnow_sync_info_t));
+        espnow_sync_update(&n->sync, &info, node_clock_ms(n));
+    }
+}
+
+static void node_config(sim_node_t* n) {
+    espnow_config_t pushed;
+    uint8_t len = 0;
+    const uint8_t* opt = espnow_proto_opt_find(n->link.ack, n->link.ack_len, ESPNOW_OPT_CONFIG, &len);
+
+    if ( opt == NULL ) {
+        if ( n->config_sent && ((const espnow_ack_t*)n->link.ack)->status == ESPNOW_ACK_OK ) {
+            n->config_report = 0;
+        }
+        return;
+    }
+    if ( espnow_config_get(&pushed, opt, len) == ESP_OK ) {
+        memcpy(&n->config, &pushed, sizeof(espnow_config_t));
+        n->config_report = 1;
+    }
+}
+
+static void node_latency(uint32_t ms) {
+    if ( latency_count == latency_size ) {
+        latency_size = latency_size ? latency_size * 2 : 4096;
+        latency_ms = xrealloc(latency_ms, latency_size * sizeof(uint32_t));
+    }
+    latency_ms[latency_count++] = ms;
+}
+
+// an exchange moved to state, go on with the wake cycle
+static void node_state(int i, espnow_link_state_t prev, espnow_link_state_t state, espnow_link_action_t* act) {
+    sim_node_t* n = &nodes[i];
+
+    if ( state == ESPNOW_LINK_JOINING || state == ESPNOW_LINK_SENDING ) {
+        node_apply(i, act);
+        return;
+    }
+    n->gen++;
+    if ( act->channel ) {
+        n->channel = act->channel;
+    }
+    if ( prev == ESPNOW_LINK_JOINING ) {
+        espnow_profile_mark(&n->profile, ESPNOW_PHASE_JOIN, now_us - n->wake_us);
+        stats.joins++;
+        stats.join_us += now_us - n->start_us;
+        stats.join_probes += n->link.probes;
+        n->link.max_hops = 0;
+        if ( state == ESPNOW_LINK_DONE ) {
+            uint8_t vlen = 0;
+            const uint8_t* hops = espnow_proto_opt_find(n->link.ack, n->link.ack_len, ESPNOW_OPT_HOPS, &vlen);
+            n->hops = hops != NULL && vlen >= 1 ? hops[0] : 0;
+            if ( n->relay != NULL ) {
+                relay_parent(i);
+            }
+            node_sync(n);
+            node_start_data(i);
+        }
+        else {
+            stats.join_failed++;
+            node_sleep(i, n->config.value[ESPNOW_CFG_PERIOD_S] * 1000 * espnow_link_sleep_factor(&n->link));
+        }
+        return;
+    }
+
+    stats.retransmits += n->link.probes - 1;
+    stats.failovers += n->link.failovers;
+    espnow_profile_mark(&n->profile, ESPNOW_PHASE_ACK, now_us - n->wake_us);
+    espnow_backlog_sent(&n->backlog, n->link.seq, n->batch, state == ESPNOW_LINK_DONE);
+    if ( opt_delta ) {
+        const espnow_ack_t* ack = (const espnow_ack_t*)n->link.ack;
+        int status = state == ESPNOW_LINK_DONE ? ack->status : -1;
+        espnow_delta_tx_done(&n->delta, n->link.seq, status);
+        if ( status == ESPNOW_ACK_RESYNC && !n->resync ) {
+            stats.resyncs++;
+            n->resync = 1;
+            node_start_data(i);
+            return;
+        }
+        n->resync = 0;
+    }
+    if ( state == ESPNOW_LINK_DONE ) {
+        uint8_t more = 0;
+        if ( ((const espnow_ack_t*)n->link.ack)->status == ESPNOW_ACK_OK ) {
+            n->first = 0;
+            espnow_report_contact(&n->report, (uint32_t)node_clock_ms(n));
+            if ( n->profile_sent ) {
+                espnow_profile_reported(&n->profile);
+            }
+            espnow_backlog_pop(&n->backlog, n->batch);
+            more = n->backlog.count && node_credit(n);
+        }
+        stats.acked++;
+        node_latency((uint32_t)( ( now_us - n->start_us ) / 1000 ));
+        node_sync(n);
+        node_config(n);
+        if ( more ) {
+            node_start_data(i);
+            return;
+        }
+    }
+    else {
+        stats.failed++;
+    }
+    node_sleep(i, n->config.value[ESPNOW_CFG_PERIOD_S] * 1000);
+}
+
+static void node_ready(int i) {
+    sim_node_t* n = &nodes[i];
+    espnow_link_action_t act;
+
+    n->start_us = now_us;
+    // ram is lost in deep sleep: the link comes back from the rtc cache,
+    // radio or not, as espnow_node_prepare() does at boot
+    if ( n->relay == NULL ) {
+        espnow_link_init(&n->link, &n->cache);
+    }
+    uint32_t kept = node_sample(i);
+    espnow_profile_start(&n->profile, 0);
+    espnow_profile_mark(&n->profile, ESPNOW_PHASE_BOOT, now_us - n->wake_us);
+    // nothing past the deadbands and the master heard from the node lately
+    if ( kept == 0 && !espnow_report_due(&n->report, &n->config, (uint32_t)node_clock_ms(n)) ) {
+        stats.quiet_wakes++;
+        stats.quiet_lost += !espnow_link_is_valid(&n->link);
+        node_sleep(i, n->config.value[ESPNOW_CFG_PERIOD_S] * 1000);
+        return;
+    }
+    espnow_link_state_t state = espnow_link_join_start(&n->link, &act);
+    if ( state == ESPNOW_LINK_DONE ) {
+        espnow_profile_mark(&n->profile, ESPNOW_PHASE_JOIN, now_us - n->wake_us);
+        if ( act.channel ) {
+            n->channel = act.channel;
+        }
+        node_start_data(i);
+        return;
+    }
+    node_state(i, ESPNOW_LINK_IDLE, state, &act);
+}
+
+static void node_event(int i, espnow_link_state_t (*fn)(espnow_link_t*, espnow_link_action_t*)) {
+    sim_node_t* n = &nodes[i];
+    espnow_link_action_t act;
+    espnow_link_state_t prev = n->link.state;
+
+    if ( prev != ESPNOW_LINK_JOINING && prev != ESPNOW_LINK_SENDING ) {
+        return;
+    }
+    node_state(i, prev, fn(&n->link, &act), &act);
+}
+
+static void node_rx(int i, sim_frame_t* f) {
+    sim_node_t* n = &nodes[i];
+    espnow_link_action_t act;
+    espnow_link_state_t prev = n->link.state;
+
+    if ( prev != ESPNOW_LINK_JOINING && prev != ESPNOW_LINK_SENDING ) {
+        return;
+    }
+    espnow_link_state_t state = espnow_link_on_frame(&n->link, frame_from(f), f->data, f->len, &act);
+    rate_count(espnow_rate_heard(&n->rate, f->rssi));
+    if ( state == prev ) {
+        // not for this exchange, the deadline stands
+        return;
+    }
+    node_state(i, prev, state, &act);
+}
+
+static void node_send_status(int i, uint8_t ok) {
+    sim_node_t* n = &nodes[i];
+    espnow_link_action_t act;
+    espnow_link_state_t prev = n->link.state;
+
+    if ( prev != ESPNOW_LINK_SENDING ) {
+        return;
+    }
+    if ( !n->on_air ) {
+        espnow_profile_mark(&n->profile, ESPNOW_PHASE_SEND, now_us - n->wake_us);
+        n->on_air = 1;
+    }
+    espnow_link_state_t state = espnow_link_on_send_status(&n->link, ok, &act);
+    if ( state == prev && act.len == 0 ) {
+        return;
+    }
+    node_state(i, prev, state, &act);
+}
+
+// relays handle what their role wants, even between the exchanges of their link
+static void node_deliver(int i, sim_frame_t* f) {
+    if ( nodes[i].relay != NULL && espnow_relay_wants(f->data, f->len) ) {
+        relay_rx(i, f);
+    }
+    else {
+        node_rx(i, f);
+    }
+}
+
+static void tx_end(sim_frame_t* f) {
+    uint8_t delivered = !f->collided && !f->lost;
+
+    channel_remove(f);
+    if ( f->collided ) {
+        stats.collided++;
+    }
+    else if ( f->lost ) {
+        stats.lost++;
+    }
+
+    if ( f->src >= 0 ) {
+        uint8_t broadcast = is_broadcast(f->dst);
+        uint8_t to_master = f->channel == opt_channel && !nodes[f->src].far && to_masters(f->dst);
+        int     to = broadcast ? -1 : node_find(f->dst);
+        uint8_t to_node = to >= 0 && nodes[to].channel == f->channel;
+
+        if ( f->channel != opt_channel ) {
+            stats.off_channel++;
+        }
+        if ( !broadcast && !f->relayed ) {
+            // mac layer ack of a unicast frame
+            rate_count(espnow_rate_sent(&nodes[f->src].rate, delivered && ( to_master || to_node )));
+            node_send_status(f->src, delivered && ( to_master || to_node ));
+        }
+        if ( delivered && to_node ) {
+            node_deliver(to, f);
+        }
+        // discovers of the nodes in reach of the relays
+        for ( uint32_t r = 0; delivered && broadcast && r < opt_relays; r++ ) {
+            if ( (int)r != f->src && nodes[r].channel == f->channel ) {
+                relay_rx(r, f);
+            }
+        }
+        if ( delivered && to_master ) {
+            f->backup = is_backup(f->dst);
+            master_rx(f);
+            return;
+        }
+    }
+    else {
+        int i = node_find(f->dst);
+        uint8_t heard = i >= 0 && !nodes[i].far && nodes[i].channel == f->channel;
+        if ( i >= 0 ) {
+            rate_count(espnow_rate_sent(&nodes[i].master_rate, delivered && heard));
+        }
+        if ( delivered && heard ) {
+            node_deliver(i, f);
+        }
+    }
+    free(f);
+}
+
+/* -------- report -------- */
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(double p) {
+    if ( latency_count == 0 ) {
+        return 0;
+    }
+    size_t i = (size_t)( p * ( latency_count - 1 ) + 0.5 );
+    return latency_ms[i];
+}
+
+static double pct(uint64_t a, uint64_t b) {
+    return b ? 100.0 * a / b : 0.0;
+}
+
+static void report(double wall_s) {
+    master_stats_t ms;
+
+    master_stats_get(&ms);
+    stats_add(&ms, &before_reboot);
+    qsort(latency_ms, latency_count, sizeof(uint32_t), cmp_u32);
+
+    printf("espnow_sim: %u nodes, %u s, period %u s, loss %.1f%%, %s, slots %u / %u ms\n",
+        opt_nodes, opt_seconds, opt_period_s, opt_loss * 100.0, opt_csma ? "csma" : "aloha",
+        opt_slot_period_ms, opt_slot_width_ms);
+    printf("frames     : %llu sent, %llu collided (%.2f%%), %llu lost, %llu off channel, %llu deferred\n",
+        (unsigned long long)stats.frames, (unsigned long long)stats.collided, pct(stats.collided, stats.frames),
+        (unsigned long long)stats.lost, (unsigned long long)stats.off_channel, (unsigned long long)stats.deferred);
+    printf("master     : %llu received, %llu queue drops, max queue %llu / %u, %llu lost in outage\n",
+        (unsigned long long)stats.master_rx, (unsigned long long)stats.queue_drops,
+        (unsigned long long)stats.queue_max, opt_queue, (unsigned long long)stats.outage_drops);
+    for ( uint32_t i = 0; i < opt_workers; i++ ) {
+        master_stats_t ws;
+        master_shard_stats_get(i, &ws);
+        printf("worker %-4u: %u frames, max queue %llu, busy %.2f%%\n",
+            i, ws.frames, (unsigned long long)workers[i].queue_max, pct(workers[i].busy_us, now_us));
+    }
+    printf("pipeline   : %u frames, %u data (%u duplicates, %u stale dropped), %u measures, %u discovers (%u limited), %u store errors\n",
+        ms.frames, ms.data, ms.duplicates, ms.stale, ms.measures, ms.discovers, ms.discover_limited, ms.store_errors);
+    printf("joins      : %llu, %llu failed, %.1f ms and %.1f probes on average\n",
+        (unsigned long long)stats.joins, (unsigned long long)stats.join_failed,
+        stats.joins ? stats.join_us / 1000.0 / stats.joins : 0.0,
+        stats.joins ? (double)stats.join_probes / stats.joins : 0.0);
+    printf("exchanges  : %llu, %llu acked, %llu failed (drop rate %.3f%%), %llu retransmits (%.3f / exchange)\n",
+        (unsigned long long)stats.exchanges, (unsigned long long)stats.acked, (unsigned long long)stats.failed,
+        pct(stats.failed, stats.acked + stats.failed), (unsigned long long)stats.retransmits,
+        stats.exchanges ? (double)stats.retransmits / stats.exchanges : 0.0);
+    printf("throughput : %.1f acked frames / s\n", now_us ? stats.acked * 1e6 / now_us : 0.0);
+    printf("data       : %s, %u measure(s) per frame, %.1f bytes per frame, %llu resyncs\n",
+        opt_delta ? "delta" : "raw", opt_measures, stats.data_frames ? (double)stats.data_bytes / stats.data_frames : 0.0,
+        (unsigned long long)stats.resyncs);
+    uint64_t kept = 0, dropped = 0;
+    for ( uint32_t i = 0; i < opt_nodes; i++ ) {
+        kept += nodes[i].backlog.count;
+        dropped += nodes[i].backlog.dropped;
+    }
+    printf("backlog    : %llu samples, %llu delivered (%.2f%%), %llu still kept, %llu dropped, max %llu / %u, %llu frames (%u held)\n",
+        (unsigned long long)stats.samples, (unsigned long long)stats.delivered, pct(stats.delivered, stats.samples),
+        (unsigned long long)kept, (unsigned long long)dropped, (unsigned long long)stats.backlog_max, ESPNOW_BACKLOG_SIZE,
+        (unsigned long long)stats.backlog_frames, ms.backlog_held);
+    // the workers publish their shard totals, all of them done by now
+    for ( uint8_t i = 0; i < master_shards(); i++ ) {
+        master_shard_publish(i, (uint32_t)( now_us / 1000 ));
+    }
+    espnow_profile_info_t fleet;
+    uint32_t profiled = master_profile_fleet(&fleet);
+    printf("profiles   : %u reports from %u nodes, average wake: boot %.1f, join %.1f, send %.1f, ack %.1f ms, ~%u uJ per cycle\n",
+        ms.profiles, profiled, fleet.phase[ESPNOW_PHASE_BOOT] / 10.0, fleet.phase[ESPNOW_PHASE_JOIN] / 10.0,
+        fleet.phase[ESPNOW_PHASE_SEND] / 10.0, fleet.phase[ESPNOW_PHASE_ACK] / 10.0,
+        espnow_profile_energy_uj(&fleet, config.node.value[ESPNOW_CFG_PERIOD_S] * 1000));
+    uint32_t current = 0;
+    for ( uint32_t i = 0; i < opt_nodes; i++ ) {
+        current += nodes[i].config.version == config.node.version;
+    }
+    printf("reporting  : deadbands %u %u %u, %llu samples skipped (%.2f%%), %llu wakes without radio (%llu with no master cached), master saw %u of %u skipped\n",
+        config.node.value[ESPNOW_CFG_DEADBAND_T], config.node.value[ESPNOW_CFG_DEADBAND_H], config.node.value[ESPNOW_CFG_DEADBAND_P],
+        (unsigned long long)stats.skipped, pct(stats.skipped, stats.samples + stats.skipped),
+        (unsigned long long)stats.quiet_wakes, (unsigned long long)stats.quiet_lost, ms.skipped, ms.sampled);
+    printf("config     : version %04x, period %u s, pushed in %u acks, %u / %u nodes run it\n",
+        config.node.version, config.node.value[ESPNOW_CFG_PERIOD_S], ms.configs, current, opt_nodes);
+    if ( opt_rssi_min ) {
+        printf("rates      : rssi %d to %d dBm, %s%s, unicasts 24M %llu, 12M %llu, 6M %llu, 1M %llu, LR %llu, %llu up, %llu down, airtime %.1f%% of 1M\n",
+            opt_rssi_min, opt_rssi_max, opt_rate_adapt ? "adaptive" : "fixed", opt_long_range ? " with long range" : "",
+            (unsigned long long)stats.rate_frames[ESPNOW_RATE_24M], (unsigned long long)stats.rate_frames[ESPNOW_RATE_12M],
+            (unsigned long long)stats.rate_frames[ESPNOW_RATE_6M], (unsigned long long)stats.rate_frames[ESPNOW_RATE_1M],
+            (unsigned long long)( stats.rate_frames[ESPNOW_RATE_LR_500K] + stats.rate_frames[ESPNOW_RATE_LR_250K] ),
+            (unsigned long long)stats.rate_up, (unsigned long long)stats.rate_down, pct(stats.airtime_us, stats.base_airtime_us));
+    }
+    if ( opt_backup ) {
+        uint32_t on_backup = 0;
+        for ( uint32_t i = 0; i < opt_nodes; i++ ) {
+            on_backup += espnow_link_is_valid(&nodes[i].link) && is_backup(espnow_link_master(&nodes[i].link));
+        }
+        printf("failover   : %llu to another master, %u / %u nodes on the backup at the end, %u master lists sent\n",
+            (unsigned long long)stats.failovers, on_backup, opt_nodes, ms.peer_lists);
+    }
+    if ( opt_relays ) {
+        espnow_relay_stats_t rs;
+        uint32_t far = 0, far_linked = 0, parents = 0, max_hops = 0;
+        uint64_t up = 0, bundles = 0, down = 0, dups = 0, looped = 0, unroutable = 0;
+        for ( uint32_t i = 0; i < opt_nodes; i++ ) {
+            far += nodes[i].far;
+            far_linked += nodes[i].far && espnow_link_is_valid(&nodes[i].link);
+            if ( nodes[i].relay == NULL ) {
+                continue;
+            }
+            espnow_relay_stats_get(nodes[i].relay, &rs);
+            parents += nodes[i].relay->hops != 0;
+            max_hops = nodes[i].relay->hops > max_hops ? nodes[i].relay->hops : max_hops;
+            up += rs.forwarded;
+            bundles += rs.bundles;
+            down += rs.down;
+            dups += rs.dup_dropped + rs.dup_acked;
+            looped += rs.looped;
+            unroutable += rs.unroutable;
+        }
+        printf("relays     : %u, %u with a parent (max %u hops), %llu frames up in %llu bundles, %llu down, %llu retries handled, "
+               "%llu bundles looped, %llu frames unroutable, master got %u\n",
+            opt_relays, parents, max_hops, (unsigned long long)up, (unsigned long long)bundles, (unsigned long long)down,
+            (unsigned long long)dups, (unsigned long long)looped, (unsigned long long)unroutable, ms.relayed);
+        printf("far nodes  : %u out of reach of the master, %u linked at the end, %llu samples, %llu delivered (%.2f%%)\n",
+            far, far_linked, (unsigned long long)stats.far_samples, (unsigned long long)stats.far_delivered,
+            pct(stats.far_delivered, stats.far_samples));
+    }
+    master_link_summary_t links;
+    master_link_summary(&links);
+    printf("links      : %u nodes, %u weak, %u silent, %u.%u%% of the data frames lost, %u duplicates",
+        links.nodes, links.weak, links.silent, links.loss / 10, links.loss % 10, ms.duplicates);
+    if ( opt_rssi_min ) {
+        printf(", rssi %d dBm", links.rssi);
+    }
+    printf("\n");
+    printf("latency ms : p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+        percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), percentile(1.0));
+    printf("simulation : %llu events in %.2f s wall, %.0f x real time\n",
+        (unsigned long long)stats.events, wall_s, wall_s > 0 ? opt_seconds / wall_s : 0.0);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [-n nodes] [-t seconds] [-p period_s] [-l loss] [-c channel]\n"
+        "          [-s slot_period_ms] [-w slot_width_ms] [-q queue] [-u service_us] [-a] [-r seed]\n"
+        "          [-k workers] [-m measures] [-D] [-P profile_wakes] [-O start_s:len_s] [-C at_s:period_s]\n"
+        "          [-B t:h:p[:heartbeat_s]] [-R rssi_min:rssi_max [-F] [-L]] [-M] [-X relays:far_pct]\n"
+        "          [-o capture] [-v]\n"
+        "  -s 0 disables wake slots, -a disables carrier sense, -D sends raw data frames,\n"
+        "  -P 0 sends no wake profiles, -O takes the master down then reboots it,\n"
+        "  -C pushes a new sample period to the nodes, -B sets report deadbands in 0.01 units,\n"
+        "  -R places the nodes at a path rssi and adapts their rates, -F keeps 1 Mbps, -L adds long range,\n"
+        "  -M adds a backup master the nodes fail over to during -O, -X makes the first nodes relays\n"
+        "  and puts far_pct %% of the others out of reach of the master\n", name);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+
+    while ( ( opt = getopt(argc, argv, "n:t:p:l:c:s:w:q:u:k:m:DP:O:C:B:R:FLMX:ar:o:vh") ) != -1 ) {
+        switch ( opt ) {
+            case 'n': opt_nodes = strtoul(optarg, NULL, 0); break;
+            case 't': opt_seconds = strtoul(optarg, NULL, 0); break;
+            case 'p': opt_period_s = strtoul(optarg, NULL, 0); break;
+            case 'l': opt_loss = atof(optarg); break;
+            case 'c': opt_channel = strtoul(optarg, NULL, 0); break;
+            case 's': opt_slot_period_ms = strtoul(optarg, NULL, 0); break;
+            case 'w': opt_slot_width_ms = strtoul(optarg, NULL, 0); break;
+            case 'q': opt_queue = strtoul(optarg, NULL, 0); break;
+            case 'u': opt_service_us = strtoul(optarg, NULL, 0); break;
+            case 'k': opt_workers = strtoul(optarg, NULL, 0); break;
+            case 'm': opt_measures = strtoul(optarg, NULL, 0); break;
+            case 'D': opt_delta = 0; break;
+            case 'P': opt_profile = strtoul(optarg, NULL, 0); break;
+            case 'O':
+                if ( sscanf(optarg, "%u:%u", &opt_outage_s, &opt_outage_len_s) != 2 ) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'C':
+                if ( sscanf(optarg, "%u:%u", &opt_config_s, &opt_config_period_s) != 2 || opt_config_period_s == 0 ) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'B':
+                if ( sscanf(optarg, "%u:%u:%u:%u", &opt_deadband[0], &opt_deadband[1], &opt_deadband[2], &opt_heartbeat_s) < 3 ) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'R':
+                if ( sscanf(optarg, "%d:%d", &opt_rssi_min, &opt_rssi_max) != 2 ||
+                     opt_rssi_min >= opt_rssi_max || opt_rssi_max >= 0 || opt_rssi_min < -120 ) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'F': opt_rate_adapt = 0; break;
+            case 'L': opt_long_range = 1; break;
+            case 'M': opt_backup = 1; break;
+            case 'X':
+                if ( sscanf(optarg, "%u:%u", &opt_relays, &opt_far_pct) != 2 || opt_far_pct > 100 ) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'a': opt_csma = 0; break;
+            case 'r': rnd_state = strtoull(optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL + 1; break;
+            case 'o':
+                capture = fopen(optarg, "wb");
+                if ( capture == NULL || !capture_write_header(capture) ) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'v': host_log_level++; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if ( opt_measures == 0 || opt_measures > ( opt_delta ? ESPNOW_BACKLOG_BATCH : ESPNOW_DATA_MAX_MEASURES ) ||
+         opt_nodes == 0 || opt_queue == 0 || opt_period_s == 0 || opt_workers == 0 || opt_workers > 255 || opt_relays > opt_nodes ||
+         opt_channel < ESPNOW_LINK_MIN_CHANNEL || opt_channel > ESPNOW_LINK_MAX_CHANNEL ) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    master_config_default(&config);
+    config.transport = &sim_transport;
+    config.on_sample = sim_sample;
+    memcpy(config.mac, master_addr, ESPNOW_PROTO_ADDR_LEN);
+    config.channel = opt_channel;
+    config.token = esp_random() | 1;
+    config.slot_period_ms = opt_slot_period_ms;
+    config.slot_width_ms = opt_slot_width_ms;
+    config.store.max_nodes = opt_nodes;
+    config.shards = opt_workers;
+    if ( opt_backup ) {
+        memcpy(config.peers[0].addr, backup_addr, ESPNOW_PROTO_ADDR_LEN);
+        config.peers[0].channel = opt_channel;
+        config.peer_count = 1;
+    }
+    // the nodes start with it, as if kept in nvs
+    espnow_config_set(&config.node, ESPNOW_CFG_PERIOD_S, opt_period_s);
+    if ( espnow_config_set(&config.node, ESPNOW_CFG_DEADBAND_T, opt_deadband[0]) != ESP_OK ||
+         espnow_config_set(&config.node, ESPNOW_CFG_DEADBAND_H, opt_deadband[1]) != ESP_OK ||
+         espnow_config_set(&config.node, ESPNOW_CFG_DEADBAND_P, opt_deadband[2]) != ESP_OK ||
+         ( opt_heartbeat_s && espnow_config_set(&config.node, ESPNOW_CFG_HEARTBEAT_S, opt_heartbeat_s) != ESP_OK ) ) {
+        usage(argv[0]);
+        return 1;
+    }
+    if ( master_init(&config) != ESP_OK ) {
+        fprintf(stderr, "master init failed\n");
+        return 1;
+    }
+    workers = calloc(opt_workers, sizeof(sim_worker_t));
+    nodes = calloc(opt_nodes, sizeof(sim_node_t));
+    if ( workers == NULL || nodes == NULL ) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for ( uint32_t i = 0; i < opt_workers; i++ ) {
+        workers[i].queue = calloc(opt_queue, sizeof(sim_frame_t*));
+        if ( workers[i].queue == NULL ) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    // nodes power on at random times over one period, on the default channel
+    for ( uint32_t i = 0; i < opt_nodes; i++ ) {
+        sim_node_t* n = &nodes[i];
+        n->addr[0] = 0x02;
+        n->addr[2] = i >> 24;
+        n->addr[3] = i >> 16;
+        n->addr[4] = i >> 8;
+        n->addr[5] = i;
+        n->drift_ppm = (int32_t)rnd_range(0, 2 * SIM_MAX_DRIFT_PPM + 1) - SIM_MAX_DRIFT_PPM;
+        n->channel = ESPNOW_LINK_MIN_CHANNEL;
+        if ( opt_rssi_min ) {
+            n->path_rssi = (int8_t)( opt_rssi_min + (int)rnd_range(0, opt_rssi_max - opt_rssi_min + 1) );
+        }
+        espnow_rate_init(&n->rate, opt_long_range);
+        espnow_rate_init(&n->master_rate, opt_long_range);
+        if ( i < opt_relays ) {
+            n->relay = calloc(1, sizeof(espnow_relay_t));
+            if ( n->relay == NULL ) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+            n->relay_transport.send = sim_relay_send;
+            n->relay_transport.ctx = (void*)(intptr_t)i;
+            espnow_relay_init(n->relay, &n->relay_transport, n->addr);
+        }
+        else {
+            n->far = rnd_range(0, 100) < opt_far_pct;
+        }
+        espnow_link_init(&n->link, &n->cache);
+        n->cache.seq = (uint16_t)esp_random();
+        espnow_link_cache_seal(&n->cache);
+        n->first = 1;
+        memcpy(&n->config, &config.node, sizeof(espnow_config_t));
+        n->config_report = 1;
+        espnow_proto_measure_from_float(&n->value, 15.0f + rnd_unit() * 10.0f, 40.0f + rnd_unit() * 20.0f, 1000.0f + rnd_unit() * 30.0f);
+        ev_push(rnd_range(0, (uint64_t)opt_period_s * 1000000), EV_NODE_WAKE, i, 0, NULL);
+    }
+
+    if ( opt_config_period_s ) {
+        ev_push((uint64_t)opt_config_s * 1000000, EV_MASTER_CONFIG, -1, 0, NULL);
+    }
+    // with a backup the pipeline serves both, it keeps running
+    if ( opt_outage_len_s && !opt_backup ) {
+        ev_push((uint64_t)( opt_outage_s + opt_outage_len_s ) * 1000000, EV_MASTER_REBOOT, -1, 0, NULL);
+    }
+
+    clock_t wall = clock();
+    uint64_t end_us = (uint64_t)opt_seconds * 1000000;
+    sim_event_t ev;
+
+    while ( ev_pop(&ev) && ev.t_us <= end_us ) {
+        now_us = ev.t_us;
+        stats.events++;
+        switch ( ev.type ) {
+            case EV_NODE_WAKE:
+                if ( ev.gen == nodes[ev.node].gen ) {
+                    // relays light sleep, no boot
+                    uint64_t boot_us = nodes[ev.node].relay != NULL ? 0 : rnd_range(SIM_BOOT_MIN_US, SIM_BOOT_MAX_US);
+                    nodes[ev.node].wake_us = now_us;
+                    ev_push(now_us + boot_us, EV_NODE_READY, ev.node, nodes[ev.node].gen, NULL);
+                }
+                break;
+            case EV_NODE_READY:
+                if ( ev.gen == nodes[ev.node].gen ) {
+                    node_ready(ev.node);
+                }
+                break;
+            case EV_NODE_TIMEOUT:
+                if ( ev.gen == nodes[ev.node].gen ) {
+                    node_event(ev.node, espnow_link_on_timeout);
+                }
+                break;
+            case EV_TX_ATTEMPT:
+                tx_start(ev.frame);
+                break;
+            case EV_TX_END:
+                tx_end(ev.frame);
+                break;
+            case EV_MASTER_DONE:
+                master_done_event(ev.node);
+                break;
+            case EV_MASTER_REBOOT:
+                master_reboot();
+                break;
+            case EV_MASTER_CONFIG:
+                master_config_change();
+                break;
+            case EV_RELAY_POLL:
+                if ( ev.gen == nodes[ev.node].relay_gen ) {
+                    relay_poll(ev.node);
+                }
+                break;
+        }
+    }
+    now_us = end_us;
+
+    report((double)( clock() - wall ) / CLOCKS_PER_SEC);
+    master_done();
+    if ( capture != NULL ) {
+        fclose(capture);
+    }
+    return 0;
+}
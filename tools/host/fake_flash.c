@@ -0,0 +1,99 @@
+#include "fake_flash.h"
+#include <stdlib.h>
+#include <string.h>
+
+static esp_err_t fake_flash_read(void* ctx, size_t off, void* buf, size_t len) {
+    fake_flash_t* ff = ctx;
+
+    if ( ff->off || off + len > ff->size ) {
+        return ESP_FAIL;
+    }
+    memcpy(buf, ff->mem + off, len);
+    return ESP_OK;
+}
+
+static esp_err_t fake_flash_write(void* ctx, size_t off, const void* buf, size_t len) {
+    fake_flash_t* ff = ctx;
+    const uint8_t* src = buf;
+
+    if ( ff->off || off + len > ff->size ) {
+        return ESP_FAIL;
+    }
+    for ( size_t i = 0; i < len; i++ ) {
+        if ( ff->cut_after == 0 ) {
+            ff->off = 1;
+            return ESP_FAIL;
+        }
+        if ( src[i] & ~ff->mem[off + i] ) {
+            ff->violations++;
+        }
+        ff->mem[off + i] &= src[i];
+        if ( ff->cut_after > 0 ) {
+            ff->cut_after--;
+        }
+    }
+    ff->written += len;
+    ff->writes++;
+    return ESP_OK;
+}
+
+static esp_err_t fake_flash_erase(void* ctx, size_t off, size_t len) {
+    fake_flash_t* ff = ctx;
+
+    if ( ff->off || off % ff->sector_size || len % ff->sector_size || off + len > ff->size ) {
+        return ESP_FAIL;
+    }
+    for ( size_t s = off; s < off + len; s += ff->sector_size ) {
+        if ( ff->cut_after == 0 ) {
+            // half erased sector
+            memset(ff->mem + s, 0xff, ff->sector_size / 2);
+            ff->off = 1;
+            return ESP_FAIL;
+        }
+        memset(ff->mem + s, 0xff, ff->sector_size);
+        ff->erases[s / ff->sector_size]++;
+    }
+    return ESP_OK;
+}
+
+int fake_flash_init(fake_flash_t* ff, size_t size, size_t sector_size) {
+    memset(ff, 0, sizeof(fake_flash_t));
+    ff->mem = malloc(size);
+    ff->erases = calloc(size / sector_size, sizeof(uint32_t));
+    if ( ff->mem == NULL || ff->erases == NULL ) {
+        fake_flash_done(ff);
+        return 0;
+    }
+    // a new chip comes erased
+    memset(ff->mem, 0xff, size);
+    ff->size = size;
+    ff->sector_size = sector_size;
+    ff->cut_after = -1;
+    return 1;
+}
+
+void fake_flash_done(fake_flash_t* ff) {
+    free(ff->mem);
+    free(ff->erases);
+    ff->mem = NULL;
+    ff->erases = NULL;
+}
+
+void fake_flash_backend(fake_flash_t* ff, seglog_flash_t* flash, int mapped) {
+    flash->read = fake_flash_read;
+    flash->write = fake_flash_write;
+    flash->erase = fake_flash_erase;
+    flash->map = mapped ? ff->mem : NULL;
+    flash->size = ff->size;
+    flash->sector_size = ff->sector_size;
+    flash->ctx = ff;
+}
+
+void fake_flash_cut(fake_flash_t* ff, int64_t after_bytes) {
+    ff->cut_after = after_bytes;
+}
+
+void fake_flash_power_on(fake_flash_t* ff) {
+    ff->off = 0;
+    ff->cut_after = -1;
+}
@@ -0,0 +1,10 @@
+#ifndef _HOST_ESP_SYSTEM_H_
+#define _HOST_ESP_SYSTEM_H_
+
+/* Host build: esp_random() is provided by the tool, seeded for repeatable runs. */
+
+#include <stdint.h>
+
+uint32_t esp_random(void);
+
+#endif // _HOST_ESP_SYSTEM_H_
@@ -0,0 +1,38 @@
+#ifndef _HOST_FAKE_FLASH_H_
+#define _HOST_FAKE_FLASH_H_
+
+/*
+ * NOR flash in RAM for the host tools, behind a seglog_flash_t.
+ *
+ * Same rules as the real chip: erased bytes are 0xff, a write only clears
+ * bits (setting one back is an error, counted in violations), erases are
+ * whole sectors. Erases are counted per sector for wear. A power cut can
+ * be armed: the write or erase it lands in stops half way and every
+ * operation fails until fake_flash_power_on().
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "seglog.h"
+
+typedef struct {
+    uint8_t*    mem;
+    size_t      size;
+    size_t      sector_size;
+    uint32_t*   erases;         // per sector
+    uint64_t    written;        // bytes
+    uint32_t    writes;
+    uint32_t    violations;     // writes that would set a bit
+    int64_t     cut_after;      // bytes written before the power goes, -1: never
+    uint8_t     off;            // power cut, everything fails
+} fake_flash_t;
+
+int  fake_flash_init(fake_flash_t* ff, size_t size, size_t sector_size);
+void fake_flash_done(fake_flash_t* ff);
+// mapped: reads straight from memory, as through esp_partition_mmap()
+void fake_flash_backend(fake_flash_t* ff, seglog_flash_t* flash, int mapped);
+
+void fake_flash_cut(fake_flash_t* ff, int64_t after_bytes);
+void fake_flash_power_on(fake_flash_t* ff);
+
+#endif // _HOST_FAKE_FLASH_H_
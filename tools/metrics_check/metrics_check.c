@@ -0,0 +1,201 @@
+/*
+ * metrics_check: runs the metrics registry (components/metrics) on the host.
+ *
+ * Writer threads (-t) hammer the same counter, gauge and histograms at
+ * once, the way the WiFi task, the workers and an ISR do on target, while
+ * a reader dumps the whole registry through metrics_encode() and
+ * metrics_decode() over and over. Counters may never go back between two
+ * dumps, every record must decode to what was encoded, and once the
+ * writers are done every total must be exact: no update lost.
+ *
+ * usage: metrics_check [-t threads] [-n updates] [-v]
+ *
+ *   -n is per thread. -v prints the registry at the end as the console
+ *   command does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+#define CHECK_THREADS_MAX   64
+
+METRICS_COUNTER(check_updates, "check.updates");
+METRICS_GAUGE(check_highest, "check.highest");
+METRICS_GAUGE(check_last, "check.last");
+METRICS_HISTOGRAM(check_spread, "check.spread", 10, 100, 1000, 10000);
+METRICS_HISTOGRAM(check_signed, "check.signed", -50, 0, 50);
+
+typedef struct {
+    uint64_t    dumps;
+    uint64_t    records;
+    uint64_t    errors;
+} check_stats_t;
+
+static check_stats_t    stats;
+static uint32_t         updates = 1000000;
+static volatile int     writing = 1;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// sample i of thread t, spread over every bucket
+static int32_t sample(uint32_t t, uint32_t i) {
+    return (int32_t)( ( i * 2654435761u + t ) % 20000 );
+}
+
+static void* writer(void* arg) {
+    uint32_t t = (uint32_t)(uintptr_t)arg;
+
+    for ( uint32_t i = 0; i < updates; i++ ) {
+        int32_t v = sample(t, i);
+        metrics_inc(&check_updates);
+        metrics_max(&check_highest, (int32_t)( t * updates + i ));
+        metrics_set(&check_last, v);
+        metrics_observe(&check_spread, v);
+        metrics_observe(&check_signed, v % 200 - 100);
+    }
+    return NULL;
+}
+
+static void check_roundtrip(const metrics_t* m, const uint8_t* rec, size_t len) {
+    metrics_snapshot_t s;
+
+    if ( !metrics_decode(rec, len, &s) || strcmp(s.name, m->name) != 0 || s.type != m->type || s.buckets != m->buckets ) {
+        fprintf(stderr, "record of %s does not decode\n", m->name);
+        stats.errors++;
+        return;
+    }
+    for ( uint8_t b = 0; b + 1 < s.buckets; b++ ) {
+        if ( s.bounds[b] != m->bounds[b] ) {
+            fprintf(stderr, "%s: bound %u decodes to %d\n", m->name, b, s.bounds[b]);
+            stats.errors++;
+        }
+    }
+}
+
+static void* reader(void* arg) {
+    uint32_t last = 0;
+    uint8_t rec[METRICS_RECORD_MAX];
+
+    (void)arg;
+    while ( writing ) {
+        for ( metrics_t* m = metrics_next(NULL); m != NULL; m = metrics_next(m) ) {
+            size_t len = metrics_encode(m, rec, sizeof(rec));
+            if ( len == 0 ) {
+                fprintf(stderr, "%s does not fit in a record\n", m->name);
+                stats.errors++;
+                continue;
+            }
+            check_roundtrip(m, rec, len);
+            stats.records++;
+        }
+        uint32_t count = __atomic_load_n(&check_updates.value, __ATOMIC_RELAXED);
+        if ( count < last ) {
+            fprintf(stderr, "counter went back from %u to %u\n", last, count);
+            stats.errors++;
+        }
+        last = count;
+        stats.dumps++;
+    }
+    return NULL;
+}
+
+static void check_total(const char* what, uint64_t got, uint64_t expected) {
+    if ( got != expected ) {
+        fprintf(stderr, "%s: %llu, expected %llu\n", what, (unsigned long long)got, (unsigned long long)expected);
+        stats.errors++;
+    }
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-t threads] [-n updates] [-v]\n", name);
+}
+
+int main(int argc, char** argv) {
+    uint32_t threads = 4;
+    int verbose = 0;
+    int opt;
+
+    while ( ( opt = getopt(argc, argv, "t:n:vh") ) != -1 ) {
+        switch ( opt ) {
+            case 't': threads = strtoul(optarg, NULL, 0); break;
+            case 'n': updates = strtoul(optarg, NULL, 0); break;
+            case 'v': verbose = 1; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if ( threads == 0 || threads > CHECK_THREADS_MAX || updates == 0 ) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    pthread_t w[CHECK_THREADS_MAX];
+    pthread_t r;
+    double start = now_s();
+    pthread_create(&r, NULL, reader, NULL);
+    for ( uint32_t t = 0; t < threads; t++ ) {
+        pthread_create(&w[t], NULL, writer, (void*)(uintptr_t)t);
+    }
+    for ( uint32_t t = 0; t < threads; t++ ) {
+        pthread_join(w[t], NULL);
+    }
+    double wall = now_s() - start;
+    writing = 0;
+    pthread_join(r, NULL);
+
+    // what the writers did, computed again
+    uint64_t total = (uint64_t)threads * updates;
+    uint64_t spread[5] = { 0 }, sig[4] = { 0 };
+    uint32_t spread_sum = 0, signed_sum = 0;
+    for ( uint32_t t = 0; t < threads; t++ ) {
+        for ( uint32_t i = 0; i < updates; i++ ) {
+            int32_t v = sample(t, i);
+            int32_t s = v % 200 - 100;
+            spread[v < 10 ? 0 : v < 100 ? 1 : v < 1000 ? 2 : v < 10000 ? 3 : 4]++;
+            sig[s < -50 ? 0 : s < 0 ? 1 : s < 50 ? 2 : 3]++;
+            spread_sum += (uint32_t)v;
+            signed_sum += (uint32_t)s;
+        }
+    }
+    check_total("counter", check_updates.value, (uint32_t)total);
+    check_total("gauge max", check_highest.value, threads * updates - 1);
+    check_total("histogram sum", check_spread.value, spread_sum);
+    check_total("signed histogram sum", check_signed.value, signed_sum);
+    for ( int b = 0; b < 5; b++ ) {
+        check_total("histogram bucket", check_spread.counts[b], spread[b]);
+    }
+    for ( int b = 0; b < 4; b++ ) {
+        check_total("signed histogram bucket", check_signed.counts[b], sig[b]);
+    }
+    metrics_reset(&check_updates);
+    metrics_reset(&check_highest);
+    check_total("counter reset", check_updates.value, 0);
+    check_total("gauge kept", check_highest.value, threads * updates - 1);
+
+    if ( verbose ) {
+        char line[256];
+        metrics_snapshot_t s;
+        for ( metrics_t* m = metrics_next(NULL); m != NULL; m = metrics_next(m) ) {
+            metrics_snapshot(m, &s);
+            metrics_format(&s, line, sizeof(line));
+            printf("%s\n", line);
+        }
+    }
+    printf("updates    : %u threads x %u, 5 metrics each, %.1f ns per update\n",
+        threads, updates, wall * 1e9 / ( total * 5 ));
+    printf("reader     : %llu dumps, %llu records decoded while the writers ran\n",
+        (unsigned long long)stats.dumps, (unsigned long long)stats.records);
+    printf("run        : %.2f s wall, %llu errors\n", wall, (unsigned long long)stats.errors);
+    return stats.errors ? 2 : 0;
+}
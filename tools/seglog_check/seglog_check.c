@@ -0,0 +1,310 @@
+/*
+ * seglog_check: runs the master flash log on a fake NOR flash.
+ *
+ * Appends records of varying size, with contents derived from their id,
+ * flushes every few records and cuts the power at random points (-r):
+ * after each cut the log is opened again from the flash as left, and every
+ * record still in it is read back and checked. Everything flushed before
+ * a cut must be there, nothing may come back wrong.
+ *
+ * A consumer reads behind the writer like the uplink does, and goes away
+ * now and then (-D records long): it catches up on its return at full
+ * speed, from the id it had acked. A consumer away longer than the log
+ * holds sees the expired records as a gap.
+ *
+ * usage: seglog_check [-s size_kb] [-g segment_kb] [-c chunk] [-n records] [-f flush]
+ *                     [-r cuts] [-D down] [-R rate] [-u] [-S seed] [-v]
+ *
+ *   -u reads through the backend read() instead of the mapping. -R is the
+ *   record rate (records / s) the capacity is given for.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "seglog.h"
+#include "fake_flash.h"
+
+// typical spi nor timings, for an estimate of the time the flash is busy
+#define CHECK_PAGE_PROGRAM_MS   0.7
+#define CHECK_SECTOR_ERASE_MS   45.0
+
+typedef struct {
+    uint64_t    cuts;
+    uint64_t    reopened_ms;    // summed over the reopens, wall
+    uint64_t    lost_unflushed; // records appended but not flushed at a cut
+    uint64_t    read;           // by the consumer
+    uint64_t    gaps;           // records the consumer missed, expired
+    uint64_t    downs;
+    uint64_t    catchup;        // records read while catching up
+    double      catchup_s;
+    uint64_t    errors;
+} check_stats_t;
+
+esp_log_level_t host_log_level = ESP_LOG_NONE;
+
+static fake_flash_t     ff;
+static seglog_flash_t   flash;
+static seglog_config_t  config;
+static seglog_t         log_;
+static check_stats_t    stats;
+static uint64_t         rng_state = 88172645463325252ULL;
+
+static uint32_t rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// record of an id, the same every time it is built
+static uint16_t record(uint32_t id, uint8_t* type, uint8_t* buf) {
+    uint16_t len = (uint16_t)( 16 + id % 48 );
+    uint32_t h = id * 2654435761u;
+
+    *type = (uint8_t)( 1 + id % 3 );
+    for ( uint16_t i = 0; i < len; i++ ) {
+        h = h * 1103515245u + 12345u;
+        buf[i] = (uint8_t)( h >> 16 );
+    }
+    return len;
+}
+
+static int check_entry(const seglog_entry_t* e) {
+    uint8_t buf[64];
+    uint8_t type;
+    uint16_t len = record(e->id, &type, buf);
+
+    if ( e->type != type || e->len != len || memcmp(e->data, buf, len) ) {
+        if ( stats.errors++ < 10 ) {
+            fprintf(stderr, "record %u reads back wrong (type %u len %u)\n", e->id, e->type, e->len);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// every record in the log, in order
+static void check_all() {
+    seglog_cursor_t c;
+    seglog_entry_t e;
+    uint32_t expect = seglog_first_id(&log_);
+
+    if ( seglog_seek(&log_, &c, expect) != ESP_OK ) {
+        fprintf(stderr, "seek to the oldest record %u failed\n", expect);
+        stats.errors++;
+        return;
+    }
+    while ( seglog_next(&log_, &c, &e) == ESP_OK ) {
+        if ( e.id != expect ) {
+            fprintf(stderr, "record %u read where %u was expected\n", e.id, expect);
+            stats.errors++;
+            return;
+        }
+        check_entry(&e);
+        expect++;
+    }
+    if ( expect != log_.flushed_id ) {
+        fprintf(stderr, "log reads up to %u, %u flushed\n", expect, log_.flushed_id);
+        stats.errors++;
+    }
+}
+
+static int reopen() {
+    double t = now_s();
+    esp_err_t ret = seglog_open(&log_, &flash, &config);
+
+    stats.reopened_ms += (uint64_t)( ( now_s() - t ) * 1000 );
+    if ( ret != ESP_OK ) {
+        fprintf(stderr, "log open failed (%d)\n", ret);
+        return 0;
+    }
+    return 1;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [-s size_kb] [-g segment_kb] [-c chunk] [-n records] [-f flush]\n"
+        "          [-r cuts] [-D down] [-R rate] [-u] [-S seed] [-v]\n", name);
+}
+
+int main(int argc, char** argv) {
+    size_t size_kb = 1024;
+    uint32_t records = 1000000;
+    uint32_t flush_every = 20;
+    uint32_t cuts = 50;
+    uint32_t down = 0;
+    double rate = 10;
+    int mapped = 1;
+    int opt;
+
+    seglog_config_default(&config);
+    while ( ( opt = getopt(argc, argv, "s:g:c:n:f:r:D:R:uS:vh") ) != -1 ) {
+        switch ( opt ) {
+            case 's': size_kb = strtoul(optarg, NULL, 0); break;
+            case 'g': config.segment_size = strtoul(optarg, NULL, 0) * 1024; break;
+            case 'c': config.chunk_size = strtoul(optarg, NULL, 0); break;
+            case 'n': records = strtoul(optarg, NULL, 0); break;
+            case 'f': flush_every = strtoul(optarg, NULL, 0); break;
+            case 'r': cuts = strtoul(optarg, NULL, 0); break;
+            case 'D': down = strtoul(optarg, NULL, 0); break;
+            case 'R': rate = atof(optarg); break;
+            case 'u': mapped = 0; break;
+            case 'S': rng_state ^= strtoull(optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL; break;
+            case 'v': host_log_level++; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if ( records == 0 || flush_every == 0 || rate <= 0 ) {
+        usage(argv[0]);
+        return 1;
+    }
+    if ( !fake_flash_init(&ff, size_kb * 1024, 4096) ) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    fake_flash_backend(&ff, &flash, mapped);
+    if ( !reopen() ) {
+        return 1;
+    }
+
+    // power cuts spread over the run
+    uint32_t cut_every = cuts ? records / ( cuts + 1 ) : 0;
+    uint32_t next_cut = cut_every ? cut_every + rnd() % cut_every : UINT32_MAX;
+    uint32_t next_down = down ? down + rnd() % ( 4 * down ) : UINT32_MAX;
+    uint32_t up_at = 0;
+    uint32_t acked = 0;     // consumer, kept across cuts as in nvs
+    seglog_cursor_t c;
+    seglog_seek(&log_, &c, 0);
+
+    double start = now_s();
+    uint32_t appended = 0;
+    while ( appended < records ) {
+        uint32_t id = seglog_next_id(&log_);
+        uint8_t buf[64];
+        uint8_t type;
+        uint16_t len = record(id, &type, buf);
+
+        if ( appended == next_cut ) {
+            // the power goes somewhere in the next few chunks
+            fake_flash_cut(&ff, rnd() % ( 4 * config.chunk_size ));
+            next_cut += cut_every;
+        }
+        esp_err_t ret = seglog_append(&log_, type, buf, len);
+        if ( ret == ESP_OK && ( ++appended % flush_every ) == 0 ) {
+            ret = seglog_flush(&log_);
+        }
+        if ( ret == ESP_OK && ( appended % ( 8 * flush_every ) ) == 0 ) {
+            // idle time on the master
+            ret = seglog_maintain(&log_);
+        }
+        if ( ret != ESP_OK ) {
+            if ( !ff.off ) {
+                fprintf(stderr, "append of record %u failed (%d)\n", id, ret);
+                return 2;
+            }
+            uint32_t durable = log_.flushed_id;
+            uint32_t next = seglog_next_id(&log_);
+            seglog_close(&log_);
+            fake_flash_power_on(&ff);
+            stats.cuts++;
+            if ( !reopen() ) {
+                return 2;
+            }
+            if ( (int32_t)( seglog_next_id(&log_) - durable ) < 0 || (int32_t)( seglog_next_id(&log_) - next ) > 0 ) {
+                fprintf(stderr, "reopened at record %u, %u were flushed, %u appended\n", seglog_next_id(&log_), durable, next);
+                stats.errors++;
+            }
+            stats.lost_unflushed += next - seglog_next_id(&log_);
+            check_all();
+            seglog_seek(&log_, &c, acked);
+            continue;
+        }
+
+        // consumer
+        if ( appended == next_down ) {
+            up_at = appended + down;
+            next_down = up_at + down + rnd() % ( 4 * down );
+            stats.downs++;
+        }
+        if ( appended < up_at ) {
+            continue;
+        }
+        uint8_t catching_up = appended == up_at && up_at;
+        double t = now_s();
+        uint64_t before = stats.read;
+        seglog_entry_t e;
+        while ( seglog_next(&log_, &c, &e) == ESP_OK ) {
+            if ( (int32_t)( e.id - acked ) < 0 ) {
+                fprintf(stderr, "cursor read record %u after %u\n", e.id, acked);
+                stats.errors++;
+            }
+            if ( e.id != acked ) {
+                stats.gaps += e.id - acked;
+            }
+            check_entry(&e);
+            acked = e.id + 1;
+            stats.read++;
+        }
+        if ( catching_up ) {
+            stats.catchup += stats.read - before;
+            stats.catchup_s += now_s() - t;
+        }
+    }
+    seglog_flush(&log_);
+    double wall = now_s() - start;
+
+    // and once more from a cold open
+    seglog_close(&log_);
+    if ( !reopen() ) {
+        return 2;
+    }
+    check_all();
+
+    seglog_stats_t ls;
+    seglog_stats_get(&log_, &ls);
+    uint32_t sectors = (uint32_t)( ff.size / ff.sector_size );
+    uint32_t min_erases = UINT32_MAX, max_erases = 0;
+    uint64_t erases = 0;
+    for ( uint32_t i = 0; i < sectors; i++ ) {
+        erases += ff.erases[i];
+        if ( ff.erases[i] < min_erases ) min_erases = ff.erases[i];
+        if ( ff.erases[i] > max_erases ) max_erases = ff.erases[i];
+    }
+    double avg_record = appended ? (double)ff.written / appended : 0;
+    double held = ( log_.seg_count - 1 ) * (double)log_.chunks * config.chunk_size / ( avg_record > 0 ? avg_record : 1 );
+
+    printf("flash      : %zu kB, %u segments of %zu kB, %u chunks of %zu bytes each\n",
+        size_kb, log_.seg_count, config.segment_size / 1024, log_.chunks, config.chunk_size);
+    printf("log        : %u records appended, %.1f flash bytes per record, records %u to %u kept\n",
+        appended, avg_record, seglog_first_id(&log_), seglog_next_id(&log_));
+    printf("writes     : %u writes, %llu bytes, est. %.1f s of program and erase\n",
+        ff.writes, (unsigned long long)ff.written,
+        ( ff.written / 256.0 * CHECK_PAGE_PROGRAM_MS + erases * CHECK_SECTOR_ERASE_MS ) / 1000);
+    printf("wear       : %llu sector erases, %u to %u per sector, %u write violations\n",
+        (unsigned long long)erases, min_erases, max_erases, ff.violations);
+    printf("cuts       : %llu power cuts, %llu unflushed records lost, %.1f ms per reopen\n",
+        (unsigned long long)stats.cuts, (unsigned long long)stats.lost_unflushed,
+        stats.cuts ? (double)stats.reopened_ms / ( stats.cuts + 1 ) : 0.0);
+    printf("consumer   : %llu records read, %llu down times, %llu expired unread, %.0f records / s catching up\n",
+        (unsigned long long)stats.read, (unsigned long long)stats.downs, (unsigned long long)stats.gaps,
+        stats.catchup_s > 0 ? stats.catchup / stats.catchup_s : 0.0);
+    printf("capacity   : ~%.0f records, %.1f h at %.0f records / s\n", held, held / rate / 3600, rate);
+    printf("run        : %.2f s wall, %llu errors\n", wall, (unsigned long long)stats.errors);
+
+    seglog_close(&log_);
+    fake_flash_done(&ff);
+    return stats.errors ? 2 : 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * Host side decoder for the master binary uplink.
+ *
+ *   uplink_decode [-b baud] [-q] [-i seconds] [-w capture] [-N] <tty | capture file | ->
+ *
+ * Prints every record, or with -q only the sustained rates (records/s,
+ * frames/s, bytes/s, crc errors and lost frames) every -i seconds.
+ * -w saves the received esp-now frames (CONFIG_MASTER_CAPTURE) to a
+ * capture file for espnow_replay.
+ *
+ * On a tty every cursor record (CONFIG_MASTER_SEGLOG) is sent back to the
+ * master once the records before it are handled, the master replays its
+ * flash log from the last one it got. -N does not ack: the master takes
+ * the host as down and keeps everything for the next run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include "uplink_frame.h"
+#include "capture.h"
+#include "metrics.h"
+
+#define FRAME_MAX   8192
+
+typedef struct {
+    uint64_t    records;
+    uint64_t    frames;
+    uint64_t    bytes;
+    uint64_t    crc_errors;
+    uint64_t    lost_frames;
+} decode_stats_t;
+
+static decode_stats_t   total;
+static decode_stats_t   last;
+static int              quiet = 0;
+static int              have_seq = 0;
+static uint16_t         last_seq;
+static FILE*            capture = NULL;
+static int              ack_fd = -1;
+static uint64_t         acks = 0;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static speed_t baud_to_speed(int baud) {
+    switch ( baud ) {
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 921600:  return B921600;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+        default:      return B921600;
+    }
+}
+
+static int open_input(const char* path, int baud) {
+    if ( strcmp(path, "-") == 0 ) {
+        return STDIN_FILENO;
+    }
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if ( fd < 0 ) {
+        fd = open(path, O_RDONLY | O_NOCTTY);
+    }
+    if ( fd < 0 ) {
+        perror(path);
+        return -1;
+    }
+    if ( isatty(fd) ) {
+        struct termios tio;
+        tcgetattr(fd, &tio);
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, baud_to_speed(baud));
+        cfsetospeed(&tio, baud_to_speed(baud));
+        tio.c_cc[VMIN] = 1;
+        tio.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    return fd;
+}
+
+// cursor record back to the master, in a frame of its own
+static void send_ack(const uint8_t* payload) {
+    static uint16_t seq = 0;
+    uint8_t frame[UPLINK_FRAME_HDR_LEN + UPLINK_RECORD_HDR_LEN + sizeof(uplink_cursor_t) + UPLINK_FRAME_CRC_LEN];
+    uint8_t out[UPLINK_COBS_MAX_LEN(sizeof(frame)) + 2];
+    uplink_frame_hdr_t hdr = { .version = UPLINK_FRAME_VERSION, .flags = 0, .seq = seq++ };
+    size_t len = 0;
+
+    memcpy(frame, &hdr, UPLINK_FRAME_HDR_LEN);
+    len += UPLINK_FRAME_HDR_LEN;
+    frame[len++] = UPLINK_REC_CURSOR;
+    frame[len++] = sizeof(uplink_cursor_t);
+    memcpy(&frame[len], payload, sizeof(uplink_cursor_t));
+    len += sizeof(uplink_cursor_t);
+    len = uplink_frame_seal(frame, len, out);
+    if ( write(ack_fd, out, len) == (ssize_t)len ) {
+        acks++;
+    }
+}
+
+static int capture_record(const uint8_t* payload, uint16_t len, uplink_capture_t* rec) {
+    if ( len < sizeof(uplink_capture_t) ) {
+        return 0;
+    }
+    memcpy(rec, payload, sizeof(uplink_capture_t));
+    return rec->len == len - sizeof(uplink_capture_t);
+}
+
+static void print_record(uint8_t type, const uint8_t* payload, uint16_t len) {
+    uplink_capture_t rec;
+    metrics_snapshot_t metric;
+
+    if ( type == UPLINK_REC_SAMPLE && len == sizeof(uplink_sample_t) ) {
+        uplink_sample_t s;
+        memcpy(&s, payload, sizeof(s));
+        printf("sample %02x:%02x:%02x:%02x:%02x:%02x ts=%u temp=%.2f humi=%.2f pres=%.2f\n",
+            s.addr[0], s.addr[1], s.addr[2], s.addr[3], s.addr[4], s.addr[5],
+            s.ts, s.temp / 100.0, s.humi / 100.0, s.pres / 100.0);
+    }
+    else if ( type == UPLINK_REC_PROFILE && len == sizeof(uplink_profile_t) ) {
+        static const char* const names[UPLINK_PROFILE_PHASES] = {
+            "boot", "nvs", "wifi", "espnow", "sensor", "convert", "join", "send", "ack", "sleep"
+        };
+        uplink_profile_t p;
+        memcpy(&p, payload, sizeof(p));
+        printf("profile %02x:%02x:%02x:%02x:%02x:%02x ts=%u wakes=%u",
+            p.addr[0], p.addr[1], p.addr[2], p.addr[3], p.addr[4], p.addr[5], p.ts, p.wakes);
+        for ( int i = 0; i < UPLINK_PROFILE_PHASES; i++ ) {
+            printf(" %s=%.1f", names[i], p.phase[i] / 10.0);
+        }
+        printf(" energy=%uuJ\n", p.energy_uj);
+    }
+    else if ( type == UPLINK_REC_LINK && len == sizeof(uplink_link_t) ) {
+        static const char* const names[UPLINK_LINK_METRICS] = { "rssi", "gap", "dup", "interval", "jitter" };
+        uplink_link_t l;
+        memcpy(&l, payload, sizeof(l));
+        printf("link %02x:%02x:%02x:%02x:%02x:%02x ts=%u age=%u frames=%u data=%u lost=%u dup=%u",
+            l.addr[0], l.addr[1], l.addr[2], l.addr[3], l.addr[4], l.addr[5],
+            l.ts, l.age_ms, l.frames, l.data, l.lost, l.duplicates);
+        for ( int i = 0; i < UPLINK_LINK_METRICS; i++ ) {
+            printf(" %s=%.1f[", names[i], l.value[i].ewma / 16.0);
+            for ( int b = 0; b < UPLINK_LINK_BUCKETS; b++ ) {
+                printf("%s%u", b ? " " : "", l.value[i].hist[b]);
+            }
+            printf("]");
+        }
+        printf("\n");
+    }
+    else if ( type == UPLINK_REC_METRIC && metrics_decode(payload, len, &metric) ) {
+        char line[256];
+        metrics_format(&metric, line, sizeof(line));
+        printf("metric %s\n", line);
+    }
+    else if ( type == UPLINK_REC_CURSOR && len == sizeof(uplink_cursor_t) ) {
+        uplink_cursor_t c;
+        memcpy(&c, payload, sizeof(c));
+        printf("cursor %u\n", c.id);
+    }
+    else if ( type == UPLINK_REC_FRAME && capture_record(payload, len, &rec) ) {
+        printf("frame  %02x:%02x:%02x:%02x:%02x:%02x ts=%u rssi=%d len=%u\n",
+            rec.addr[0], rec.addr[1], rec.addr[2], rec.addr[3], rec.addr[4], rec.addr[5],
+            rec.ts, rec.rssi, rec.len);
+    }
+    else {
+        printf("record type=0x%02x len=%u\n", type, len);
+    }
+}
+
+static void handle_frame(const uint8_t* encoded, size_t len) {
+    static uint8_t frame[FRAME_MAX];
+
+    size_t frame_len = uplink_cobs_decode(encoded, len, frame, sizeof(frame));
+    if ( frame_len == 0 || !uplink_frame_check(frame, frame_len) ) {
+        // console output between two frames ends up here too
+        total.crc_errors++;
+        return;
+    }
+
+    uplink_frame_hdr_t hdr;
+    memcpy(&hdr, frame, sizeof(hdr));
+    if ( have_seq && hdr.seq != (uint16_t)( last_seq + 1 ) ) {
+        total.lost_frames += (uint16_t)( hdr.seq - last_seq - 1 );
+    }
+    have_seq = 1;
+    last_seq = hdr.seq;
+    total.frames++;
+
+    size_t pos = 0;
+    uint8_t type;
+    uint16_t plen;
+    const uint8_t* payload;
+    uplink_capture_t rec;
+    while ( uplink_frame_next(frame, frame_len, &pos, &type, &payload, &plen) ) {
+        total.records++;
+        if ( !quiet ) {
+            print_record(type, payload, plen);
+        }
+        if ( capture != NULL && type == UPLINK_REC_FRAME && capture_record(payload, plen, &rec) ) {
+            capture_write(capture, &rec, payload + sizeof(uplink_capture_t));
+        }
+        if ( ack_fd >= 0 && type == UPLINK_REC_CURSOR && plen == sizeof(uplink_cursor_t) ) {
+            send_ack(payload);
+        }
+    }
+}
+
+static void print_rates(double elapsed, const decode_stats_t* cur, const decode_stats_t* prev) {
+    fprintf(stderr, "%.0f rec/s  %.0f frames/s  %.0f B/s  crc errors %llu  lost frames %llu\n",
+        ( cur->records - prev->records ) / elapsed,
+        ( cur->frames - prev->frames ) / elapsed,
+        ( cur->bytes - prev->bytes ) / elapsed,
+        (unsigned long long)cur->crc_errors,
+        (unsigned long long)cur->lost_frames);
+}
+
+int main(int argc, char** argv) {
+    int baud = 921600;
+    double interval = 1.0;
+    int no_ack = 0;
+    int opt;
+
+    while ( ( opt = getopt(argc, argv, "b:qi:w:N") ) != -1 ) {
+        switch ( opt ) {
+            case 'b': baud = atoi(optarg); break;
+            case 'q': quiet = 1; break;
+            case 'i': interval = atof(optarg); break;
+            case 'N': no_ack = 1; break;
+            case 'w':
+                capture = fopen(optarg, "wb");
+                if ( capture == NULL || !capture_write_header(capture) ) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b baud] [-q] [-i seconds] [-w capture] [-N] <tty|file|->\n", argv[0]);
+                return 1;
+        }
+    }
+    if ( optind >= argc ) {
+        fprintf(stderr, "usage: %s [-b baud] [-q] [-i seconds] [-w capture] [-N] <tty|file|->\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open_input(argv[optind], baud);
+    if ( fd < 0 ) {
+        return 1;
+    }
+    if ( !no_ack && isatty(fd) ) {
+        ack_fd = fd;
+    }
+
+    static uint8_t acc[UPLINK_COBS_MAX_LEN(FRAME_MAX)];
+    size_t acc_len = 0;
+    uint8_t buf[4096];
+    double start = now_s();
+    double tick = start;
+    ssize_t n;
+
+    while ( ( n = read(fd, buf, sizeof(buf)) ) > 0 ) {
+        total.bytes += n;
+        for ( ssize_t i = 0; i < n; i++ ) {
+            if ( buf[i] == UPLINK_FRAME_DELIM ) {
+                if ( acc_len > 0 ) {
+                    handle_frame(acc, acc_len);
+                }
+                acc_len = 0;
+            }
+            else if ( acc_len < sizeof(acc) ) {
+                acc[acc_len++] = buf[i];
+            }
+        }
+        double t = now_s();
+        if ( quiet && t - tick >= interval ) {
+            print_rates(t - tick, &total, &last);
+            last = total;
+            tick = t;
+        }
+    }
+
+    double elapsed = now_s() - start;
+    decode_stats_t zero = { 0 };
+    fprintf(stderr, "total: %llu records, %llu frames, %llu bytes in %.3f s\n",
+        (unsigned long long)total.records, (unsigned long long)total.frames,
+        (unsigned long long)total.bytes, elapsed);
+    if ( acks ) {
+        fprintf(stderr, "acked %llu cursors\n", (unsigned long long)acks);
+    }
+    if ( elapsed > 0 ) {
+        print_rates(elapsed, &total, &zero);
+    }
+    if ( capture != NULL ) {
+        fclose(capture);
+    }
+    return 0;
+}